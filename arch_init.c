@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -41,6 +42,13 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "main-loop.h"
+#include "qemu_socket.h"
+#include "bitmap.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -93,6 +101,11 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+
+#define ENCODING_FLAG_XBZRLE   0x1
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -109,269 +122,1529 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
-static RAMBlock *last_block;
+/* struct contains XBZRLE cache and a static page
+   used by the compression */
+static struct {
+    /* buffer used for XBZRLE encoding */
+    uint8_t *encoded_buf;
+    /* buffer for storing page content */
+    uint8_t *current_buf;
+    /* Cache for XBZRLE */
+    PageCache *cache;
+    /* Protects the cache against resizing from the monitor */
+    QemuMutex lock;
+} XBZRLE;
+
+static struct {
+    uint64_t bytes;
+    uint64_t pages;
+    uint64_t cache_hit;
+    uint64_t cache_miss;
+    uint64_t overflow;
+    uint64_t skipped;
+    uint64_t saved;
+} xbzrle_acct;
+
+static void XBZRLE_cache_lock(void)
+{
+    if (migrate_use_xbzrle()) {
+        qemu_mutex_lock(&XBZRLE.lock);
+    }
+}
+
+static void XBZRLE_cache_unlock(void)
+{
+    if (migrate_use_xbzrle()) {
+        qemu_mutex_unlock(&XBZRLE.lock);
+    }
+}
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    if (XBZRLE.cache != NULL) {
+        qemu_mutex_lock(&XBZRLE.lock);
+        new_size = cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
+            TARGET_PAGE_SIZE;
+        qemu_mutex_unlock(&XBZRLE.lock);
+    }
+    return new_size;
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return xbzrle_acct.bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return xbzrle_acct.pages;
+}
+
+uint64_t xbzrle_mig_cache_hit(void)
+{
+    return xbzrle_acct.cache_hit;
+}
+
+uint64_t xbzrle_mig_cache_miss(void)
+{
+    return xbzrle_acct.cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return xbzrle_acct.overflow;
+}
+
+uint64_t xbzrle_mig_bytes_saved(void)
+{
+    return xbzrle_acct.saved;
+}
+
+static void xbzrle_cleanup(void)
+{
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        XBZRLE.cache = NULL;
+    }
+    g_free(XBZRLE.encoded_buf);
+    XBZRLE.encoded_buf = NULL;
+    g_free(XBZRLE.current_buf);
+    XBZRLE.current_buf = NULL;
+}
+
+/* Block of the last page written to the stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *last_sent_block;
+
+static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int flag)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    qemu_put_be64(f, offset | cont | flag);
+    if (!cont) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr,
+                        strlen(block->idstr));
+    }
+    last_sent_block = block;
+}
+
+/*
+ * Send a page as a delta against the copy the destination already has.
+ * Returns the number of bytes sent, 0 if the page did not change since it
+ * was last sent, or -1 if the page must be sent in full.  In the latter
+ * case *pdata is updated to point to a stable copy of the page that has
+ * been inserted in the cache, so that the destination and the cache agree
+ * even if the guest keeps writing to the page.
+ */
+static int save_xbzrle_page(QEMUFile *f, uint8_t **pdata,
+                            ram_addr_t current_addr, RAMBlock *block,
+                            ram_addr_t offset, bool last_stage)
+{
+    int encoded_len, bytes_sent;
+    uint8_t *prev_cached_page;
+
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (!prev_cached_page) {
+        xbzrle_acct.cache_miss++;
+        if (!last_stage) {
+            *pdata = cache_insert(XBZRLE.cache, current_addr, *pdata);
+        }
+        return -1;
+    }
+    xbzrle_acct.cache_hit++;
+
+    /* the guest may still be writing to the page; work on a snapshot */
+    memcpy(XBZRLE.current_buf, *pdata, TARGET_PAGE_SIZE);
+
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+                                       TARGET_PAGE_SIZE);
+    if (encoded_len == 0) {
+        xbzrle_acct.skipped++;
+        xbzrle_acct.saved += TARGET_PAGE_SIZE;
+        return 0;
+    }
+
+    /* both a full page and a delta leave the destination with the snapshot */
+    memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+
+    if (encoded_len < 0) {
+        xbzrle_acct.overflow++;
+        *pdata = prev_cached_page;
+        return -1;
+    }
+
+    save_block_hdr(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, encoded_len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+    bytes_sent = encoded_len + 1 + 2;
+
+    xbzrle_acct.pages++;
+    xbzrle_acct.bytes += bytes_sent;
+    xbzrle_acct.saved += TARGET_PAGE_SIZE - bytes_sent;
+
+    return bytes_sent;
+}
+
+/***********************************************************/
+/* multi-threaded page compression */
+
+/* Worst case size of a page compressed by zlib */
+#define COMPRESS_BUF_SIZE compressBound(TARGET_PAGE_SIZE)
+
+enum {
+    COMPRESS_IDLE,
+    COMPRESS_PENDING,   /* owned by the worker thread */
+    COMPRESS_DONE,      /* result waits to be collected by the I/O thread */
+};
+
+typedef struct CompressPool CompressPool;
+
+typedef struct CompressParam {
+    CompressPool *pool;
+    QemuThread thread;
+    QemuCond cond;
+    int state;
+
+    /* source: page to be sent; destination: page to be filled */
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *page;
+    int level;
+
+    /* compressed data */
+    uint8_t *buf;
+    unsigned long len;
+    int ret;
+
+    CompressThreadStats stats;
+} CompressParam;
+
+struct CompressPool {
+    QemuMutex lock;
+    QemuCond done_cond;
+    void (*fn)(CompressParam *param);
+    int nr_threads;             /* threads in use */
+    int max_threads;            /* threads created so far */
+    CompressParam **params;
+};
+
+static void *compress_pool_worker(void *opaque)
+{
+    CompressParam *param = opaque;
+    CompressPool *pool = param->pool;
+    int64_t start;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (param->state != COMPRESS_PENDING) {
+            qemu_cond_wait(&param->cond, &pool->lock);
+        }
+        qemu_mutex_unlock(&pool->lock);
+
+        start = get_clock();
+        pool->fn(param);
+
+        qemu_mutex_lock(&pool->lock);
+        param->stats.busy_ns += get_clock() - start;
+        param->state = COMPRESS_DONE;
+        qemu_cond_signal(&pool->done_cond);
+    }
+
+    return NULL;
+}
+
+/*
+ * Worker threads are created on first use and are kept around, idle, for
+ * later migrations.  Only the first @nr_threads of them are handed work.
+ */
+static void compress_pool_start(CompressPool *pool,
+                                void (*fn)(CompressParam *param),
+                                int nr_threads)
+{
+    int i;
+
+    if (!pool->fn) {
+        qemu_mutex_init(&pool->lock);
+        qemu_cond_init(&pool->done_cond);
+        pool->fn = fn;
+    }
+
+    if (nr_threads > pool->max_threads) {
+        pool->params = g_realloc(pool->params,
+                                 nr_threads * sizeof(*pool->params));
+        for (i = pool->max_threads; i < nr_threads; i++) {
+            CompressParam *param = g_malloc0(sizeof(*param));
+
+            param->pool = pool;
+            param->state = COMPRESS_IDLE;
+            param->buf = g_malloc(COMPRESS_BUF_SIZE);
+            qemu_cond_init(&param->cond);
+            pool->params[i] = param;
+            qemu_thread_create(&param->thread, compress_pool_worker, param);
+        }
+        pool->max_threads = nr_threads;
+    }
+
+    for (i = 0; i < nr_threads; i++) {
+        memset(&pool->params[i]->stats, 0, sizeof(pool->params[i]->stats));
+    }
+    pool->nr_threads = nr_threads;
+}
+
+/* Called with pool->lock held */
+static void compress_pool_submit(CompressParam *param)
+{
+    param->state = COMPRESS_PENDING;
+    qemu_cond_signal(&param->cond);
+}
+
+static CompressPool compress_pool;
+static bool compress_active;
+
+static void do_compress_page(CompressParam *param)
+{
+    uLongf len = COMPRESS_BUF_SIZE;
+
+    param->ret = compress2(param->buf, &len, param->page, TARGET_PAGE_SIZE,
+                           param->level);
+    param->len = len;
+    param->stats.pages++;
+    param->stats.bytes += TARGET_PAGE_SIZE;
+    param->stats.compressed_bytes += len;
+}
+
+/* Write a compressed page to the stream and make its slot idle again */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent;
+
+    if (param->ret != Z_OK) {
+        save_block_hdr(f, param->block, param->offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+    } else {
+        save_block_hdr(f, param->block, param->offset,
+                       RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent = param->len + 4;
+    }
+
+    qemu_mutex_lock(&compress_pool.lock);
+    param->state = COMPRESS_IDLE;
+    qemu_mutex_unlock(&compress_pool.lock);
+
+    return bytes_sent;
+}
+
+/*
+ * Collect the compressed pages that are ready.  If @wait is true, also
+ * wait for the pages that are still being compressed.  If @block is not
+ * NULL, only the page at @block/@offset is considered.  Returns the number
+ * of bytes written to the stream.
+ */
+static int flush_compressed_data(QEMUFile *f, bool wait,
+                                 RAMBlock *block, ram_addr_t offset)
+{
+    int i, bytes_sent = 0;
+
+    for (i = 0; i < compress_pool.nr_threads; i++) {
+        CompressParam *param = compress_pool.params[i];
+        int state;
+
+        qemu_mutex_lock(&compress_pool.lock);
+        if (block && (param->state == COMPRESS_IDLE ||
+                      param->block != block || param->offset != offset)) {
+            qemu_mutex_unlock(&compress_pool.lock);
+            continue;
+        }
+        while (wait && param->state == COMPRESS_PENDING) {
+            qemu_cond_wait(&compress_pool.done_cond, &compress_pool.lock);
+        }
+        state = param->state;
+        qemu_mutex_unlock(&compress_pool.lock);
+
+        if (state == COMPRESS_DONE) {
+            bytes_sent += flush_compressed_page(f, param);
+        }
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * Hand a page to an idle compression thread, first collecting the pages
+ * that are ready.  The page is copied, so the guest may keep writing to it.
+ * Returns the number of bytes written to the stream.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset, uint8_t *p)
+{
+    int i, bytes_sent = 0;
+    bool done;
+
+    for (;;) {
+        bytes_sent += flush_compressed_data(f, false, NULL, 0);
+
+        qemu_mutex_lock(&compress_pool.lock);
+        done = false;
+        for (i = 0; i < compress_pool.nr_threads; i++) {
+            CompressParam *param = compress_pool.params[i];
+
+            done |= param->state == COMPRESS_DONE;
+            if (param->state == COMPRESS_IDLE) {
+                param->block = block;
+                param->offset = offset;
+                param->level = migrate_compress_level();
+                memcpy(param->page, p, TARGET_PAGE_SIZE);
+                compress_pool_submit(param);
+                qemu_mutex_unlock(&compress_pool.lock);
+                return bytes_sent;
+            }
+        }
+        if (!done) {
+            qemu_cond_wait(&compress_pool.done_cond, &compress_pool.lock);
+        }
+        qemu_mutex_unlock(&compress_pool.lock);
+    }
+}
+
+/* Drop the pages that were not collected, e.g. after an error */
+static void compress_threads_save_cleanup(void)
+{
+    int i;
+
+    if (!compress_active) {
+        return;
+    }
+
+    qemu_mutex_lock(&compress_pool.lock);
+    for (i = 0; i < compress_pool.nr_threads; i++) {
+        CompressParam *param = compress_pool.params[i];
+
+        while (param->state == COMPRESS_PENDING) {
+            qemu_cond_wait(&compress_pool.done_cond, &compress_pool.lock);
+        }
+        param->state = COMPRESS_IDLE;
+    }
+    qemu_mutex_unlock(&compress_pool.lock);
+    compress_active = false;
+}
+
+static void compress_threads_save_setup(void)
+{
+    int i;
+
+    compress_active = migrate_use_compression();
+    if (!compress_active) {
+        return;
+    }
+
+    compress_pool_start(&compress_pool, do_compress_page,
+                        migrate_compress_threads());
+    for (i = 0; i < compress_pool.nr_threads; i++) {
+        if (!compress_pool.params[i]->page) {
+            compress_pool.params[i]->page = g_malloc(TARGET_PAGE_SIZE);
+        }
+    }
+}
+
+int compress_mig_thread_stats(CompressThreadStats *stats, int max)
+{
+    int i, n;
+
+    if (!compress_pool.fn) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&compress_pool.lock);
+    n = MIN(max, compress_pool.nr_threads);
+    for (i = 0; i < n; i++) {
+        stats[i] = compress_pool.params[i]->stats;
+    }
+    qemu_mutex_unlock(&compress_pool.lock);
+
+    return compress_pool.nr_threads;
+}
+
+/*
+ * RAM is sent by the migration thread without the global lock.  It walks
+ * a snapshot of the RAM block list, because the list itself is reordered
+ * by qemu_get_ram_ptr(), and a private bitmap of the pages that are still
+ * to be sent, indexed by ram_addr_t >> TARGET_PAGE_BITS.  Only
+ * migration_bitmap_sync() looks at the global dirty map, and it must be
+ * called with the global lock held.
+ */
+static RAMBlock **ram_blocks;
+static int nr_ram_blocks;
+static unsigned long *migration_bitmap;
+static uint64_t migration_dirty_pages;
+
+static int last_block_index;
 static ram_addr_t last_offset;
+static uint64_t bytes_transferred;
+
+/* Number of complete passes over guest memory in this migration */
+static int ram_passes;
+
+/* The remaining pages are sent after the guest starts on the destination */
+static bool postcopy_active;
+
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+static QemuMutex page_requests_lock;
+
+static void ram_save_init_locks(void)
+{
+    static bool initialized;
+
+    if (!initialized) {
+        qemu_mutex_init(&XBZRLE.lock);
+        qemu_mutex_init(&page_requests_lock);
+        initialized = true;
+    }
+}
+
+static void migration_bitmap_init(void)
+{
+    RAMBlock *block;
+    ram_addr_t end = 0;
+    int i = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        nr_ram_blocks++;
+        end = MAX(end, block->offset + block->length);
+    }
+    ram_blocks = g_malloc(nr_ram_blocks * sizeof(*ram_blocks));
+    migration_bitmap = bitmap_new(end >> TARGET_PAGE_BITS);
+    migration_dirty_pages = 0;
+
+    /* Everything is sent once, then only what the guest dirtied since */
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_blocks[i++] = block;
+        bitmap_set(migration_bitmap, block->offset >> TARGET_PAGE_BITS,
+                   block->length >> TARGET_PAGE_BITS);
+        migration_dirty_pages += block->length >> TARGET_PAGE_BITS;
+        cpu_physical_memory_reset_dirty(block->offset,
+                                        block->offset + block->length,
+                                        MIGRATION_DIRTY_FLAG);
+    }
+}
+
+static void migration_bitmap_free(void)
+{
+    g_free(ram_blocks);
+    ram_blocks = NULL;
+    nr_ram_blocks = 0;
+    g_free(migration_bitmap);
+    migration_bitmap = NULL;
+    migration_dirty_pages = 0;
+}
+
+/* Move newly dirtied pages from the global dirty map to migration_bitmap */
+static int migration_bitmap_sync(void)
+{
+    int i;
 
-static int ram_save_block(QEMUFile *f)
+    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr_ram_blocks; i++) {
+        RAMBlock *block = ram_blocks[i];
+        ram_addr_t addr;
+        bool dirty = false;
+
+        for (addr = block->offset; addr < block->offset + block->length;
+             addr += TARGET_PAGE_SIZE) {
+            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
+                dirty = true;
+                if (!test_and_set_bit(addr >> TARGET_PAGE_BITS,
+                                      migration_bitmap)) {
+                    migration_dirty_pages++;
+                }
+            }
+        }
+        /* Nobody dirties pages while we hold the lock */
+        if (dirty) {
+            cpu_physical_memory_reset_dirty(block->offset,
+                                            block->offset + block->length,
+                                            MIGRATION_DIRTY_FLAG);
+        }
+    }
+    return 0;
+}
+
+static bool migration_bitmap_test_and_reset_dirty(ram_addr_t addr)
+{
+    if (test_and_clear_bit(addr >> TARGET_PAGE_BITS, migration_bitmap)) {
+        migration_dirty_pages--;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Send the next dirty page.  Returns 0 if no dirty page was found, 1
+ * otherwise.  Bytes written are accounted in bytes_transferred.
+ */
+static int ram_save_block(QEMUFile *f, bool last_stage)
 {
-    RAMBlock *block = last_block;
+    int index = last_block_index;
+    RAMBlock *block = ram_blocks[index];
     ram_addr_t offset = last_offset;
     ram_addr_t current_addr;
     int bytes_sent = 0;
+    int pages = 0;
 
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
+    if (!migration_dirty_pages) {
+        return 0;
+    }
 
     current_addr = block->offset + offset;
 
     do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+        if (migration_bitmap_test_and_reset_dirty(current_addr)) {
+            uint8_t *p = block->host + offset;
 
-            p = block->host + offset;
+            /* an older copy of the page must reach the stream first */
+            if (compress_active) {
+                bytes_transferred += flush_compressed_data(f, true,
+                                                           block, offset);
+            }
 
             if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
+                uint8_t ch = *p;
+
+                save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+                qemu_put_byte(f, ch);
                 bytes_sent = 1;
+                pages = 1;
+
+                /* keep the cache in sync with the destination */
+                XBZRLE_cache_lock();
+                if (XBZRLE.cache) {
+                    uint8_t *cached = get_cached_data(XBZRLE.cache,
+                                                      current_addr);
+                    if (cached) {
+                        memset(cached, ch, TARGET_PAGE_SIZE);
+                    }
+                }
+                XBZRLE_cache_unlock();
             } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
+                /* p may point into the cache until the page is sent */
+                XBZRLE_cache_lock();
+                if (XBZRLE.cache) {
+                    bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
+                                                  offset, last_stage);
+                } else {
+                    bytes_sent = -1;
+                }
+
+                /* XBZRLE overflow, cache miss or normal page */
+                if (bytes_sent == -1) {
+                    if (compress_active) {
+                        bytes_sent = compress_page_with_multi_thread(f, block,
+                                                                     offset, p);
+                    } else {
+                        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+                        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                        bytes_sent = TARGET_PAGE_SIZE;
+                    }
+                    pages = 1;
+                } else if (bytes_sent > 0) {
+                    pages = 1;
                 }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
+                XBZRLE_cache_unlock();
             }
 
-            break;
+            /* if the page is unmodified, continue to the next one */
+            if (pages) {
+                break;
+            }
         }
 
         offset += TARGET_PAGE_SIZE;
         if (offset >= block->length) {
             offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+            index = (index + 1) % nr_ram_blocks;
+            block = ram_blocks[index];
         }
 
-        current_addr = block->offset + offset;
+        current_addr = block->offset + offset;
+
+    } while (index != last_block_index || offset != last_offset);
+
+    last_block_index = index;
+    last_offset = offset;
+
+    bytes_transferred += MAX(bytes_sent, 0);
+    return pages;
+}
+
+
+/* Send a page in full, or as a fill byte */
+static void ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+
+    if (is_dup_page(p, *p)) {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+    } else {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+    }
+}
+
+/* Tell the destination which pages it does not have yet */
+static void ram_save_postcopy_bitmap(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t i, npages = block->length >> TARGET_PAGE_BITS;
+        size_t len = DIV_ROUND_UP(npages, 8);
+        uint8_t *bitmap = g_malloc0(len);
+
+        for (i = 0; i < npages; i++) {
+            if (test_bit((block->offset >> TARGET_PAGE_BITS) + i,
+                         migration_bitmap)) {
+                bitmap[i / 8] |= 1 << (i % 8);
+            }
+        }
+
+        save_block_hdr(f, block, 0, RAM_SAVE_FLAG_POSTCOPY);
+        qemu_put_be64(f, len);
+        qemu_put_buffer(f, bitmap, len);
+        g_free(bitmap);
+    }
+}
+
+static void ram_postcopy_cleanup(void)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_requests_lock);
+    while ((req = QSIMPLEQ_FIRST(&page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
+    }
+    qemu_mutex_unlock(&page_requests_lock);
+    postcopy_active = false;
+}
+
+bool ram_postcopy_pending(void)
+{
+    return postcopy_active;
+}
+
+void ram_postcopy_request(const char *idstr, uint64_t offset)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, idstr)) {
+            break;
+        }
+    }
+    if (!block || offset >= block->length) {
+        fprintf(stderr, "post-copy: bad page request %s:0x%" PRIx64 "\n",
+                idstr, offset);
+        return;
+    }
+
+    req = g_malloc(sizeof(*req));
+    req->block = block;
+    req->offset = offset & TARGET_PAGE_MASK;
+    qemu_mutex_lock(&page_requests_lock);
+    QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+    qemu_mutex_unlock(&page_requests_lock);
+}
+
+static RAMPageRequest *ram_postcopy_next_request(void)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_requests_lock);
+    req = QSIMPLEQ_FIRST(&page_requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+    }
+    qemu_mutex_unlock(&page_requests_lock);
+    return req;
+}
+
+/*
+ * Send the pages that the destination asked for, then continue with the
+ * background transfer until the rate limit is hit.  Returns 1 once every
+ * page has been sent, 0 if there is more to do, or a negative errno.
+ * Called from the migration thread without the global lock.
+ */
+int ram_postcopy_push(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    int ret;
+
+    while ((req = ram_postcopy_next_request()) != NULL) {
+        ram_addr_t addr = req->block->offset + req->offset;
+
+        if (migration_bitmap_test_and_reset_dirty(addr)) {
+            ram_save_page(f, req->block, req->offset);
+        }
+        g_free(req);
+    }
+
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        if (ram_save_block(f, true) == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            ram_postcopy_cleanup();
+            migration_bitmap_free();
+            return 1;
+        }
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+    return qemu_file_get_error(f);
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static int block_compar(const void *a, const void *b)
+{
+    RAMBlock * const *ablock = a;
+    RAMBlock * const *bblock = b;
+    if ((*ablock)->offset < (*bblock)->offset) {
+        return -1;
+    } else if ((*ablock)->offset > (*bblock)->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+static void sort_ram_list(void)
+{
+    RAMBlock *block, *nblock, **blocks;
+    int n;
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ++n;
+    }
+    blocks = g_malloc(n * sizeof *blocks);
+    n = 0;
+    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
+        blocks[n++] = block;
+        QLIST_REMOVE(block, next);
+    }
+    qsort(blocks, n, sizeof *blocks, block_compar);
+    while (--n >= 0) {
+        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+    }
+    g_free(blocks);
+}
+
+int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+{
+    uint64_t bytes_transferred_last;
+    double bwidth = 0;
+    uint64_t expected_time = 0;
+    int ret;
+
+    ram_save_init_locks();
+
+    if (stage < 0) {
+        cpu_physical_memory_set_dirty_tracking(0);
+        xbzrle_cleanup();
+        compress_threads_save_cleanup();
+        ram_postcopy_cleanup();
+        migration_bitmap_free();
+        return 0;
+    }
+
+    if (stage == 1) {
+        RAMBlock *block;
+        bytes_transferred = 0;
+        last_block_index = 0;
+        last_offset = 0;
+        last_sent_block = NULL;
+        ram_passes = 0;
+        ram_postcopy_cleanup();
+        sort_ram_list();
+
+        memset(&xbzrle_acct, 0, sizeof(xbzrle_acct));
+        if (migrate_use_xbzrle()) {
+            XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                      TARGET_PAGE_SIZE,
+                                      TARGET_PAGE_SIZE);
+            if (!XBZRLE.cache) {
+                monitor_printf(mon, "Error creating XBZRLE cache\n");
+                return -ENOMEM;
+            }
+            XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+            XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+        }
+        compress_threads_save_setup();
+        migration_bitmap_init();
+
+        /* Enable dirty memory tracking */
+        cpu_physical_memory_set_dirty_tracking(1);
+
+        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, block->length);
+        }
+    }
+
+    /* Stage 2 runs in the migration thread, without the global lock */
+    if (stage == 2) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = migration_bitmap_sync();
+    if (stage == 2) {
+        qemu_mutex_unlock_iothread();
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    bytes_transferred_last = bytes_transferred;
+    bwidth = qemu_get_clock_ns(rt_clock);
+
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        if (ram_save_block(f, false) == 0) { /* no more blocks */
+            ram_passes++;
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        compress_threads_save_cleanup();
+        return ret;
+    }
+
+    if (compress_active) {
+        bytes_transferred += flush_compressed_data(f, true, NULL, 0);
+    }
+
+    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+
+    /* if we haven't transferred anything this round, force expected_time to a
+     * a very high value, but without crashing */
+    if (bwidth == 0) {
+        bwidth = 0.000001;
+    }
+
+    /* try transferring iterative blocks of memory */
+    if (stage == 3) {
+        if (postcopy_active) {
+            /* the rest is sent after the guest has started elsewhere */
+            ram_save_postcopy_bitmap(f);
+        } else {
+            /* flush all remaining blocks regardless of rate limiting */
+            while (ram_save_block(f, true) != 0) {
+            }
+        }
+        if (compress_active) {
+            bytes_transferred += flush_compressed_data(f, true, NULL, 0);
+        }
+        cpu_physical_memory_set_dirty_tracking(0);
+        xbzrle_cleanup();
+        compress_threads_save_cleanup();
+        if (!postcopy_active) {
+            migration_bitmap_free();
+        }
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+
+    if (stage == 2 && expected_time > migrate_max_downtime() &&
+        migrate_use_postcopy() &&
+        ram_passes >= migrate_postcopy_iterations()) {
+        postcopy_active = true;
+        return 1;
+    }
+
+    return (stage == 2) && (expected_time <= migrate_max_downtime());
+}
+
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    static RAMBlock *block = NULL;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return block->host + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id)))
+            return block->host + offset;
+    }
+
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+static int load_xbzrle(QEMUFile *f, void *host)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+    unsigned int xh_len;
+    int xh_flags;
+
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
+
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -EINVAL;
+    }
+
+    if (xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, buf, xh_len);
+
+    if (xbzrle_decode_buffer(buf, xh_len, host, TARGET_PAGE_SIZE) < 0) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static CompressPool decompress_pool;
+static bool decompress_error;
+
+static void do_decompress_page(CompressParam *param)
+{
+    uLongf len = TARGET_PAGE_SIZE;
+
+    param->ret = uncompress(param->page, &len, param->buf, param->len);
+    if (param->ret == Z_OK && len != TARGET_PAGE_SIZE) {
+        param->ret = Z_DATA_ERROR;
+    }
+    param->stats.pages++;
+    param->stats.bytes += TARGET_PAGE_SIZE;
+    param->stats.compressed_bytes += param->len;
+}
+
+/* Called with decompress_pool.lock held */
+static void decompress_collect(CompressParam *param)
+{
+    if (param->state == COMPRESS_DONE) {
+        if (param->ret != Z_OK) {
+            decompress_error = true;
+        }
+        param->state = COMPRESS_IDLE;
+    }
+}
+
+/*
+ * Wait for the decompression threads to finish writing guest memory.  If
+ * @host is not NULL, only wait for the page at @host.  Returns -EINVAL if
+ * a page failed to decompress.
+ */
+static int wait_for_decompress_done(void *host)
+{
+    int i;
+
+    if (!decompress_pool.fn) {
+        return 0;
+    }
 
-    } while (current_addr != last_block->offset + last_offset);
+    qemu_mutex_lock(&decompress_pool.lock);
+    for (i = 0; i < decompress_pool.nr_threads; i++) {
+        CompressParam *param = decompress_pool.params[i];
 
-    last_block = block;
-    last_offset = offset;
+        if (host && param->page != host) {
+            continue;
+        }
+        while (param->state == COMPRESS_PENDING) {
+            qemu_cond_wait(&decompress_pool.done_cond, &decompress_pool.lock);
+        }
+        decompress_collect(param);
+    }
+    qemu_mutex_unlock(&decompress_pool.lock);
 
-    return bytes_sent;
+    return decompress_error ? -EINVAL : 0;
 }
 
-static uint64_t bytes_transferred;
-
-static ram_addr_t ram_save_remaining(void)
+static int decompress_data_with_multi_thread(QEMUFile *f, void *host, int len)
 {
-    RAMBlock *block;
-    ram_addr_t count = 0;
+    CompressParam *param = NULL;
+    int i;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
+    if (!decompress_pool.fn) {
+        compress_pool_start(&decompress_pool, do_decompress_page,
+                            migrate_decompress_threads());
+    }
+
+    /* a previous copy of the page must land first */
+    if (wait_for_decompress_done(host) < 0) {
+        return -EINVAL;
+    }
+
+    qemu_mutex_lock(&decompress_pool.lock);
+    while (!param) {
+        for (i = 0; i < decompress_pool.nr_threads; i++) {
+            decompress_collect(decompress_pool.params[i]);
+            if (decompress_pool.params[i]->state == COMPRESS_IDLE) {
+                param = decompress_pool.params[i];
+                break;
             }
         }
+        if (!param) {
+            qemu_cond_wait(&decompress_pool.done_cond, &decompress_pool.lock);
+        }
     }
+    qemu_mutex_unlock(&decompress_pool.lock);
 
-    return count;
-}
+    /* the slot is idle, so the worker does not look at it */
+    qemu_get_buffer(f, param->buf, len);
+    param->page = host;
+    param->len = len;
 
-uint64_t ram_bytes_remaining(void)
-{
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    qemu_mutex_lock(&decompress_pool.lock);
+    compress_pool_submit(param);
+    qemu_mutex_unlock(&decompress_pool.lock);
+
+    return decompress_error ? -EINVAL : 0;
 }
 
-uint64_t ram_bytes_transferred(void)
+#ifdef __linux__
+/*
+ * Post-copy destination.  Pages that the source has not sent yet are
+ * mapped PROT_NONE; a SIGSEGV on one of them sends a request for the page
+ * back to the source and waits until the receive thread has filled it.
+ * Pages are written through /proc/self/mem so that they become visible
+ * atomically with the mprotect() that makes them accessible.
+ */
+typedef struct PostcopyBlock {
+    char idstr[256];
+    uint8_t *host;
+    ram_addr_t length;
+    unsigned long *missing;
+} PostcopyBlock;
+
+static struct {
+    PostcopyBlock *blocks;
+    int nr_blocks;
+    long nr_missing;
+    int mem_fd;
+    int sock_fd;
+    int req_pipe[2];
+    QEMUFile *file;
+    QemuThread rx_thread;
+    QemuThread req_thread;
+    struct sigaction old_segv;
+    bool setup;
+    bool active;
+} postcopy_in;
+
+static PostcopyBlock *postcopy_find_block(uint8_t *addr)
 {
-    return bytes_transferred;
+    int i;
+
+    for (i = 0; i < postcopy_in.nr_blocks; i++) {
+        PostcopyBlock *pb = &postcopy_in.blocks[i];
+        if (addr >= pb->host && addr < pb->host + pb->length) {
+            return pb;
+        }
+    }
+    return NULL;
 }
 
-uint64_t ram_bytes_total(void)
+static void postcopy_segv_handler(int sig, siginfo_t *info, void *ctx)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
+    static const struct timespec delay = { 0, 50000 };
+    uint8_t *addr = info->si_addr;
+    PostcopyBlock *pb = postcopy_find_block(addr);
+    int saved_errno = errno;
+    uint8_t req[1 + 255 + 8];
+    uint64_t offset;
+    long page;
+    int len, i;
+
+    if (!pb) {
+        /* Not ours: fault again with the previous disposition */
+        sigaction(SIGSEGV, &postcopy_in.old_segv, NULL);
+        return;
+    }
 
-    QLIST_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    page = (addr - pb->host) >> TARGET_PAGE_BITS;
+    if (!test_bit(page, pb->missing)) {
+        /* Raced with the receive thread, just retry the access */
+        errno = saved_errno;
+        return;
+    }
 
-    return total;
-}
+    len = strlen(pb->idstr);
+    offset = (uint64_t)page << TARGET_PAGE_BITS;
+    req[0] = len;
+    memcpy(req + 1, pb->idstr, len);
+    for (i = 0; i < 8; i++) {
+        req[1 + len + i] = offset >> (56 - i * 8);
+    }
+    /* Shorter than PIPE_BUF, so concurrent requests do not interleave */
+    if (write(postcopy_in.req_pipe[1], req, 1 + len + 8) < 0) {
+        abort();
+    }
 
-static int block_compar(const void *a, const void *b)
-{
-    RAMBlock * const *ablock = a;
-    RAMBlock * const *bblock = b;
-    if ((*ablock)->offset < (*bblock)->offset) {
-        return -1;
-    } else if ((*ablock)->offset > (*bblock)->offset) {
-        return 1;
+    while (test_bit(page, pb->missing)) {
+        nanosleep(&delay, NULL);
     }
-    return 0;
+    errno = saved_errno;
 }
 
-static void sort_ram_list(void)
+static int postcopy_incoming_setup(QEMUFile *f)
 {
-    RAMBlock *block, *nblock, **blocks;
-    int n;
-    n = 0;
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ++n;
+    struct sigaction act;
+    RAMBlock *block;
+    int i;
+
+    if (kvm_enabled()) {
+        fprintf(stderr, "post-copy: not supported with KVM\n");
+        return -ENOTSUP;
     }
-    blocks = g_malloc(n * sizeof *blocks);
-    n = 0;
-    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
-        blocks[n++] = block;
-        QLIST_REMOVE(block, next);
+    if (mem_path) {
+        fprintf(stderr, "post-copy: not supported with -mem-path\n");
+        return -ENOTSUP;
     }
-    qsort(blocks, n, sizeof *blocks, block_compar);
-    while (--n >= 0) {
-        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+    if (TARGET_PAGE_SIZE != qemu_real_host_page_size) {
+        fprintf(stderr, "post-copy: target and host page size differ\n");
+        return -ENOTSUP;
     }
-    g_free(blocks);
+    postcopy_in.sock_fd = qemu_socket_fd(f);
+    if (postcopy_in.sock_fd < 0) {
+        fprintf(stderr, "post-copy: needs a tcp or unix transport\n");
+        return -ENOTSUP;
+    }
+
+    postcopy_in.mem_fd = open("/proc/self/mem", O_RDWR);
+    if (postcopy_in.mem_fd < 0) {
+        perror("post-copy: open /proc/self/mem");
+        return -errno;
+    }
+    if (pipe(postcopy_in.req_pipe) < 0) {
+        perror("post-copy: pipe");
+        close(postcopy_in.mem_fd);
+        return -errno;
+    }
+
+    postcopy_in.nr_blocks = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        postcopy_in.nr_blocks++;
+    }
+    postcopy_in.blocks = g_malloc0(postcopy_in.nr_blocks *
+                                   sizeof(PostcopyBlock));
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        PostcopyBlock *pb = &postcopy_in.blocks[i++];
+        pstrcpy(pb->idstr, sizeof(pb->idstr), block->idstr);
+        pb->host = block->host;
+        pb->length = block->length;
+        pb->missing = bitmap_new(block->length >> TARGET_PAGE_BITS);
+    }
+    postcopy_in.nr_missing = 0;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = postcopy_segv_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGSEGV, &act, &postcopy_in.old_segv);
+
+    postcopy_in.setup = true;
+    return 0;
 }
 
-int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+static int ram_load_postcopy_bitmap(QEMUFile *f, uint8_t *host)
 {
-    ram_addr_t addr;
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    uint64_t expected_time = 0;
+    PostcopyBlock *pb;
+    ram_addr_t i, npages, start;
+    uint64_t len;
+    uint8_t *bitmap;
     int ret;
 
-    if (stage < 0) {
-        cpu_physical_memory_set_dirty_tracking(0);
-        return 0;
+    if (!postcopy_in.setup) {
+        ret = postcopy_incoming_setup(f);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
-    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
-        qemu_file_set_error(f, -EINVAL);
+    pb = postcopy_find_block(host);
+    len = qemu_get_be64(f);
+    if (!pb || host != pb->host) {
+        return -EINVAL;
+    }
+    npages = pb->length >> TARGET_PAGE_BITS;
+    if (len != DIV_ROUND_UP(npages, 8)) {
+        fprintf(stderr, "post-copy: bad bitmap size for %s\n", pb->idstr);
         return -EINVAL;
     }
 
-    if (stage == 1) {
-        RAMBlock *block;
-        bytes_transferred = 0;
-        last_block = NULL;
-        last_offset = 0;
-        sort_ram_list();
+    bitmap = g_malloc(len);
+    qemu_get_buffer(f, bitmap, len);
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
-            }
+    /* A decompression thread that is still writing an older copy of a
+     * missing page would fault on it once it is protected, and overwrite
+     * the copy that the fault brings in.
+     */
+    ret = wait_for_decompress_done(NULL);
+    if (ret < 0) {
+        g_free(bitmap);
+        return ret;
+    }
+
+    for (i = 0; i < npages; i = start) {
+        for (start = i; start < npages &&
+             (bitmap[start / 8] & (1 << (start % 8))); start++) {
+            set_bit(start, pb->missing);
+            postcopy_in.nr_missing++;
+        }
+        if (start > i) {
+            mprotect(pb->host + (i << TARGET_PAGE_BITS),
+                     (start - i) << TARGET_PAGE_BITS, PROT_NONE);
+        } else {
+            start++;
         }
+    }
 
-        /* Enable dirty memory tracking */
-        cpu_physical_memory_set_dirty_tracking(1);
+    g_free(bitmap);
+    return 0;
+}
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+/* Forward page requests from the fault handler to the source */
+static void *postcopy_req_thread(void *opaque)
+{
+    uint8_t buf[512];
+    ssize_t len;
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->length);
+    while ((len = read(postcopy_in.req_pipe[0], buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (send_all(postcopy_in.sock_fd, buf, len) < 0) {
+            fprintf(stderr, "post-copy: failed to request pages\n");
+            abort();
         }
     }
 
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
+    close(postcopy_in.req_pipe[0]);
+    close(postcopy_in.sock_fd);
+    return NULL;
+}
 
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+static void postcopy_place_page(PostcopyBlock *pb, ram_addr_t offset,
+                                uint8_t *buf)
+{
+    long page = offset >> TARGET_PAGE_BITS;
+    uint8_t *host = pb->host + offset;
 
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
-            break;
-        }
+    if (!test_bit(page, pb->missing)) {
+        return;
     }
 
-    if (ret < 0) {
-        return ret;
+    if (pwrite(postcopy_in.mem_fd, buf, TARGET_PAGE_SIZE,
+               (off_t)(uintptr_t)host) != TARGET_PAGE_SIZE ||
+        mprotect(host, TARGET_PAGE_SIZE, PROT_READ | PROT_WRITE) < 0) {
+        perror("post-copy: failed to place page");
+        abort();
     }
+    __sync_fetch_and_and(&pb->missing[BIT_WORD(page)], ~BIT_MASK(page));
+    postcopy_in.nr_missing--;
+}
 
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+static void *postcopy_rx_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_in.file;
+    PostcopyBlock *pb = NULL;
+    uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+    int i;
 
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
-    }
+    for (;;) {
+        uint64_t addr = qemu_get_be64(f);
+        int flags = addr & ~TARGET_PAGE_MASK;
 
-    /* try transferring iterative blocks of memory */
-    if (stage == 3) {
-        int bytes_sent;
+        addr &= TARGET_PAGE_MASK;
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+
+        if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+            char id[256];
+            uint8_t len = qemu_get_byte(f);
 
-        /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+            qemu_get_buffer(f, (uint8_t *)id, len);
+            id[len] = 0;
+            pb = NULL;
+            for (i = 0; i < postcopy_in.nr_blocks; i++) {
+                if (!strcmp(id, postcopy_in.blocks[i].idstr)) {
+                    pb = &postcopy_in.blocks[i];
+                    break;
+                }
+            }
         }
-        cpu_physical_memory_set_dirty_tracking(0);
+        if (!pb || addr >= pb->length) {
+            fprintf(stderr, "post-copy: bad page in migration stream\n");
+            abort();
+        }
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            memset(buf, qemu_get_byte(f), TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+        } else {
+            fprintf(stderr, "post-copy: unexpected flags 0x%x\n", flags);
+            abort();
+        }
+        if (qemu_file_get_error(f)) {
+            fprintf(stderr, "post-copy: lost connection to the source\n");
+            abort();
+        }
+
+        postcopy_place_page(pb, addr, buf);
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    if (postcopy_in.nr_missing) {
+        fprintf(stderr, "post-copy: %ld pages never arrived\n",
+                postcopy_in.nr_missing);
+        abort();
+    }
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    sigaction(SIGSEGV, &postcopy_in.old_segv, NULL);
+    postcopy_in.active = false;
+    postcopy_in.setup = false;
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    /* the request thread closes the socket once it sees EOF */
+    close(postcopy_in.req_pipe[1]);
+    close(postcopy_in.mem_fd);
+    qemu_fclose(f);
+
+    g_free(buf);
+    for (i = 0; i < postcopy_in.nr_blocks; i++) {
+        g_free(postcopy_in.blocks[i].missing);
+    }
+    g_free(postcopy_in.blocks);
+    postcopy_in.blocks = NULL;
+    postcopy_in.nr_blocks = 0;
+    return NULL;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+int ram_postcopy_incoming_start(QEMUFile *f)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
-
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
-        }
-
-        return block->host + offset;
+    if (!postcopy_in.setup) {
+        return -EINVAL;
     }
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+    postcopy_in.file = f;
+    postcopy_in.active = true;
+    qemu_thread_create(&postcopy_in.req_thread, postcopy_req_thread, NULL);
+    qemu_thread_create(&postcopy_in.rx_thread, postcopy_rx_thread, NULL);
+    return 0;
+}
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return block->host + offset;
+/*
+ * Touch guest pages before something that cannot take the fault, like a
+ * system call, accesses them.
+ */
+void ram_postcopy_prefault(void *host, size_t len)
+{
+    volatile uint8_t *p = host;
+    size_t i;
+
+    if (!postcopy_in.active) {
+        return;
+    }
+    for (i = 0; i < len; i += TARGET_PAGE_SIZE) {
+        (void)p[i];
     }
+    if (len) {
+        (void)p[len - 1];
+    }
+}
+#else
+static int ram_load_postcopy_bitmap(QEMUFile *f, uint8_t *host)
+{
+    fprintf(stderr, "post-copy migration is not supported on this host\n");
+    return -ENOTSUP;
+}
 
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    return -ENOTSUP;
 }
 
+void ram_postcopy_prefault(void *host, size_t len)
+{
+}
+#endif
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -439,6 +1712,10 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
+            if (wait_for_decompress_done(host) < 0) {
+                return -EINVAL;
+            }
+
             ch = qemu_get_byte(f);
             memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
@@ -454,8 +1731,67 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = qemu_get_ram_ptr(addr);
             else
                 host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (wait_for_decompress_done(host) < 0) {
+                return -EINVAL;
+            }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host;
+
+            if (version_id == 3) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (wait_for_decompress_done(host) < 0 ||
+                load_xbzrle(f, host) < 0) {
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+            int len;
+
+            if (version_id == 3) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > COMPRESS_BUF_SIZE) {
+                fprintf(stderr, "Invalid compressed data length: %d\n", len);
+                return -EINVAL;
+            }
+            if (decompress_data_with_multi_thread(f, host, len) < 0) {
+                fprintf(stderr, "Failed to decompress page\n");
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            void *host;
+            int ret;
+
+            if (version_id == 3) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            ret = ram_load_postcopy_bitmap(f, host);
+            if (ret < 0) {
+                return ret;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -463,7 +1799,7 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
-    return 0;
+    return wait_for_decompress_done(NULL);
 }
 
 #ifdef HAS_AUDIO
@@ -0,0 +1,183 @@
+/*
+ * VNC dirty region detection micro-benchmark
+ *
+ * Runs vnc_refresh_row() over a 32bpp framebuffer (1920x1200 unless a
+ * width and height are given on the command line) and reports the host
+ * ticks (cycles on x86) and nanoseconds spent per frame, next to the
+ * per-chunk memcmp/memcpy loop it replaced.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "bitops.h"
+#include "bitmap.h"
+#include "ui/vnc-dirty.h"
+
+#define MAX_WIDTH   2560
+#define MAX_HEIGHT  2048
+#define BPP         4
+#define FRAMES      200
+#define CHUNKS      (MAX_WIDTH / 16)
+
+static int width = 1920;
+static int height = 1200;
+
+static DECLARE_BITMAP(dirty[MAX_HEIGHT], CHUNKS);
+static DECLARE_BITMAP(changed[MAX_HEIGHT], CHUNKS);
+static DECLARE_BITMAP(ref_changed[MAX_HEIGHT], CHUNKS);
+
+static int refresh_row_memcmp(uint8_t *server_row, const uint8_t *guest_row,
+                              unsigned long *dirty, unsigned long *changed,
+                              int width, int bpp)
+{
+    int cmp_bytes = 16 * bpp;
+    int count = 0;
+    int x, len;
+
+    for (x = 0; x < width;
+         x += 16, server_row += cmp_bytes, guest_row += cmp_bytes) {
+        if (!test_and_clear_bit(x / 16, dirty)) {
+            continue;
+        }
+        len = MIN(cmp_bytes, (width - x) * bpp);
+        if (memcmp(server_row, guest_row, len) == 0) {
+            continue;
+        }
+        memcpy(server_row, guest_row, len);
+        set_bit(x / 16, changed);
+        count++;
+    }
+    return count;
+}
+
+typedef int (*refresh_fn)(uint8_t *, const uint8_t *, unsigned long *,
+                          unsigned long *, int, int);
+
+static int refresh_frame(refresh_fn fn, uint8_t *server, const uint8_t *guest)
+{
+    int count = 0;
+    int y;
+
+    for (y = 0; y < height; y++) {
+        if (!bitmap_empty(dirty[y], CHUNKS)) {
+            count += fn(server + y * width * BPP, guest + y * width * BPP,
+                        dirty[y], changed[y], width, BPP);
+        }
+    }
+    return count;
+}
+
+/*
+ * Alternate between the two guest images @a and @b, marking every
+ * @stride-th chunk of each scanline dirty (none if @stride is 0), and
+ * time the refresh.
+ */
+static void bench(const char *name, refresh_fn fn, uint8_t *server,
+                  const uint8_t *a, const uint8_t *b, int stride)
+{
+    int64_t ticks = 0, ns = 0, t0, c0;
+    long copied = 0;
+    int i, x, y;
+
+    memcpy(server, a, width * height * BPP);
+    for (i = 0; i < FRAMES; i++) {
+        for (y = 0; y < height; y++) {
+            for (x = 0; stride && x < DIV_ROUND_UP(width, 16); x += stride) {
+                set_bit(x, dirty[y]);
+            }
+            bitmap_zero(changed[y], CHUNKS);
+        }
+        t0 = get_clock();
+        c0 = cpu_get_real_ticks();
+        copied += refresh_frame(fn, server, (i & 1) ? a : b);
+        ticks += cpu_get_real_ticks() - c0;
+        ns += get_clock() - t0;
+    }
+    printf("%-10s %-6s %12" PRId64 " ticks/frame %10" PRId64 " ns/frame"
+           " %8ld chunks/frame\n", name, fn == vnc_refresh_row ? "kernel" :
+           "memcmp", ticks / FRAMES, ns / FRAMES, copied / FRAMES);
+}
+
+int main(int argc, char **argv)
+{
+    refresh_fn fns[] = { refresh_row_memcmp, vnc_refresh_row };
+    uint8_t *server, *a, *b, *s2;
+    size_t size, i;
+    int y;
+
+    if (argc == 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (width <= 0 || width > MAX_WIDTH || height <= 0 ||
+        height > MAX_HEIGHT) {
+        fprintf(stderr, "usage: %s [width height]\n", argv[0]);
+        return 1;
+    }
+    printf("%dx%dx%d\n", width, height, BPP * 8);
+
+    size = width * height * BPP;
+    server = g_malloc(size);
+    a = g_malloc(size);
+    b = g_malloc(size);
+    s2 = g_malloc(size);
+
+    for (i = 0; i < size; i++) {
+        a[i] = i * 7 + (i >> 12);
+    }
+
+    /* Every chunk of the frame is dirty and unchanged. */
+    for (i = 0; i < ARRAY_SIZE(fns); i++) {
+        bench("unchanged", fns[i], server, a, a, 1);
+    }
+
+    /* One chunk in sixteen really changed. */
+    memcpy(b, a, size);
+    for (i = 0; i < size; i += 16 * 16 * BPP) {
+        b[i + 5] ^= 0xff;
+    }
+    for (i = 0; i < ARRAY_SIZE(fns); i++) {
+        bench("sparse", fns[i], server, a, b, 1);
+    }
+
+    /* Every chunk changed. */
+    for (i = 0; i < size; i += 16 * BPP) {
+        b[i + 17] ^= 0xff;
+    }
+    for (i = 0; i < ARRAY_SIZE(fns); i++) {
+        bench("full", fns[i], server, a, b, 1);
+    }
+
+    /* Nothing dirty: only the bitmaps are scanned. */
+    for (i = 0; i < ARRAY_SIZE(fns); i++) {
+        bench("clean", fns[i], server, a, b, 0);
+    }
+
+    /* One dirty chunk per scanline, as when a cursor moves. */
+    for (i = 0; i < ARRAY_SIZE(fns); i++) {
+        bench("scattered", fns[i], server, a, b, CHUNKS);
+    }
+
+    /* Both implementations must produce the same surface and bitmap. */
+    memcpy(server, a, size);
+    memcpy(s2, a, size);
+    for (y = 0; y < height; y++) {
+        bitmap_fill(dirty[y], CHUNKS);
+        bitmap_zero(changed[y], CHUNKS);
+    }
+    refresh_frame(refresh_row_memcmp, server, b);
+    memcpy(ref_changed, changed, sizeof(changed));
+    for (y = 0; y < height; y++) {
+        bitmap_fill(dirty[y], CHUNKS);
+        bitmap_zero(changed[y], CHUNKS);
+    }
+    refresh_frame(vnc_refresh_row, s2, b);
+    if (memcmp(server, s2, size) || memcmp(ref_changed, changed, sizeof(changed))) {
+        fprintf(stderr, "vnc_refresh_row does not match the reference\n");
+        return 1;
+    }
+    return 0;
+}
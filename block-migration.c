@@ -20,6 +20,7 @@
 #include "block-migration.h"
 #include "migration.h"
 #include "blockdev.h"
+#include "main-loop.h"
 #include <assert.h>
 
 #define BLOCK_SIZE (BDRV_SECTORS_PER_DIRTY_CHUNK << BDRV_SECTOR_BITS)
@@ -315,8 +316,28 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
     }
 }
 
-static void init_blk_migration(Monitor *mon, QEMUFile *f)
+static void blk_mig_check_in_use_it(void *opaque, BlockDriverState *bs)
 {
+    BlockDriverState **busy = opaque;
+
+    if (!*busy && !bdrv_is_read_only(bs) && bdrv_in_use(bs)) {
+        *busy = bs;
+    }
+}
+
+static int init_blk_migration(Monitor *mon, QEMUFile *f)
+{
+    BlockDriverState *busy = NULL;
+
+    /* Devices owned by someone else, e.g. a block job, cannot be
+       migrated; fail before touching any of them.  */
+    bdrv_iterate(blk_mig_check_in_use_it, &busy);
+    if (busy) {
+        monitor_printf(mon, "Block device %s is in use, cannot migrate "
+                            "its storage\n", bdrv_get_device_name(busy));
+        return -EBUSY;
+    }
+
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
@@ -327,6 +348,7 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
     block_mig_state.reads = 0;
 
     bdrv_iterate(init_blk_migration_it, mon);
+    return 0;
 }
 
 static int blk_mig_save_bulked_block(Monitor *mon, QEMUFile *f)
@@ -555,7 +577,7 @@ static void blk_mig_cleanup(Monitor *mon)
     monitor_printf(mon, "\n");
 }
 
-static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+static int do_block_save_live(Monitor *mon, QEMUFile *f, int stage)
 {
     int ret;
 
@@ -574,7 +596,10 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     }
 
     if (stage == 1) {
-        init_blk_migration(mon, f);
+        ret = init_blk_migration(mon, f);
+        if (ret < 0) {
+            return ret;
+        }
 
         /* start track dirty blocks */
         set_dirty_tracking(1);
@@ -642,6 +667,21 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     return ((stage == 2) && is_stage2_completed());
 }
 
+static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+{
+    int ret;
+
+    /* Stage 2 runs in the migration thread, without the global lock */
+    if (stage == 2) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = do_block_save_live(mon, f, stage);
+    if (stage == 2) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
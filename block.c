@@ -46,6 +46,10 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+typedef enum {
+    BDRV_REQ_COPY_ON_READ = 0x1,
+} BdrvRequestFlags;
+
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
@@ -65,9 +69,12 @@ static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
                                          QEMUIOVector *iov);
 static int coroutine_fn bdrv_co_flush_em(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
 static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
+        bool is_write, int64_t *wait);
 static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
@@ -209,6 +216,109 @@ void bdrv_register(BlockDriver *bdrv)
     QLIST_INSERT_HEAD(&bdrv_drivers, bdrv, list);
 }
 
+/* throttling disk I/O limits */
+void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    /* Let the queued requests through, they will not be throttled again */
+    qemu_co_queue_restart_all(&bs->throttled_reqs);
+
+    if (bs->block_timer) {
+        qemu_del_timer(bs->block_timer);
+        qemu_free_timer(bs->block_timer);
+        bs->block_timer = NULL;
+    }
+
+    bs->slice_start = 0;
+    bs->slice_end   = 0;
+}
+
+static void bdrv_block_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    qemu_co_queue_init(&bs->throttled_reqs);
+    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
+    bs->slice_start = qemu_get_clock_ns(vm_clock);
+    bs->slice_end   = bs->slice_start + BLOCK_IO_SLICE_TIME;
+    bs->io_base     = bs->io_disp;
+    bs->io_limits_enabled = true;
+}
+
+bool bdrv_io_limits_enabled(BlockDriverState *bs)
+{
+    BlockIOLimit *io_limits = &bs->io_limits;
+    return io_limits->bps[BLOCK_IO_LIMIT_READ]
+         || io_limits->bps[BLOCK_IO_LIMIT_WRITE]
+         || io_limits->bps[BLOCK_IO_LIMIT_TOTAL]
+         || io_limits->iops[BLOCK_IO_LIMIT_READ]
+         || io_limits->iops[BLOCK_IO_LIMIT_WRITE]
+         || io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
+}
+
+/*
+ * Requests are serviced in FIFO order.  A request that is woken up but still
+ * exceeds the limits goes back to the head of the queue, so that the requests
+ * behind it keep waiting until it has been dispatched.
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+    bool is_write, int nb_sectors)
+{
+    int type = is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ;
+    int64_t wait_time = -1;
+    int64_t start = 0;
+
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        start = qemu_get_clock_ns(vm_clock);
+        qemu_co_queue_wait(&bs->throttled_reqs);
+    }
+
+    while (bs->io_limits_enabled &&
+           bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
+        if (!start) {
+            start = qemu_get_clock_ns(vm_clock);
+        }
+        qemu_mod_timer(bs->block_timer,
+                       wait_time + qemu_get_clock_ns(vm_clock));
+        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    }
+
+    bs->io_disp.bytes[is_write] += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+    bs->io_disp.ios[is_write]++;
+
+    if (start) {
+        bs->nr_throttled_ops[type]++;
+        bs->throttled_time_ns[type] += qemu_get_clock_ns(vm_clock) - start;
+    }
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+/**
+ * Enable copy-on-read
+ *
+ * Reads of unallocated sectors are copied from the backing file chain into
+ * the image so that later reads are served locally.  Calls nest, so that
+ * users such as block jobs can enable copy-on-read temporarily without
+ * clobbering the drive option.
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    bs->copy_on_read++;
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
 /* create a new block device (by default it is empty) */
 BlockDriverState *bdrv_new(const char *device_name)
 {
@@ -495,11 +605,17 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     if (flags & BDRV_O_CACHE_WB)
         bs->enable_write_cache = 1;
 
+    assert(bs->copy_on_read == 0); /* bdrv_close() resets it */
+    if ((flags & BDRV_O_RDWR) && (flags & BDRV_O_COPY_ON_READ)) {
+        bdrv_enable_copy_on_read(bs);
+    }
+
     /*
      * Clear flags that are internal to the block layer before opening the
      * image.
      */
-    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                           BDRV_O_COPY_ON_READ);
 
     /*
      * Snapshots should be writable.
@@ -544,6 +660,7 @@ free_and_fail:
     g_free(bs->opaque);
     bs->opaque = NULL;
     bs->drv = NULL;
+    bs->copy_on_read = 0;
     return ret;
 }
 
@@ -673,7 +790,8 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
 
         /* backing files always opened read-only */
         back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                      BDRV_O_COPY_ON_READ);
 
         ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
         if (ret < 0) {
@@ -703,6 +821,11 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    /* Worker threads may still be using the image */
+    while (bs->thread_pool_reqs) {
+        qemu_aio_wait();
+    }
+
     if (bs->drv) {
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
@@ -720,6 +843,7 @@ void bdrv_close(BlockDriverState *bs)
 #endif
         bs->opaque = NULL;
         bs->drv = NULL;
+        bs->copy_on_read = 0;
 
         if (bs->file != NULL) {
             bdrv_close(bs->file);
@@ -751,10 +875,15 @@ void bdrv_make_anon(BlockDriverState *bs)
 void bdrv_delete(BlockDriverState *bs)
 {
     assert(!bs->dev);
+    assert(!bs->job);
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
+
     bdrv_close(bs);
     if (bs->file != NULL) {
         bdrv_delete(bs->file);
@@ -1047,7 +1176,7 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
 
     if (!rwco->is_write) {
         rwco->ret = bdrv_co_do_readv(rwco->bs, rwco->sector_num,
-                                     rwco->nb_sectors, rwco->qiov);
+                                     rwco->nb_sectors, rwco->qiov, 0);
     } else {
         rwco->ret = bdrv_co_do_writev(rwco->bs, rwco->sector_num,
                                       rwco->nb_sectors, rwco->qiov);
@@ -1077,6 +1206,16 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
+    /*
+     * In sync call context the throttling timer cannot fire while we wait
+     * for the request, so the I/O throttling function has to be disabled.
+     */
+    if (bs->io_limits_enabled && !qemu_in_coroutine()) {
+        fprintf(stderr, "Disabling I/O throttling on '%s' due "
+                        "to synchronous I/O.\n", bdrv_get_device_name(bs));
+        bdrv_io_limits_disable(bs);
+    }
+
     if (qemu_in_coroutine()) {
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
@@ -1255,13 +1394,173 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
+/*
+ * Round a region to cluster boundaries
+ */
+static void round_to_clusters(BlockDriverState *bs,
+                              int64_t sector_num, int nb_sectors,
+                              int64_t *cluster_sector_num,
+                              int *cluster_nb_sectors)
+{
+    BlockDriverInfo bdi;
+
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size == 0) {
+        *cluster_sector_num = sector_num;
+        *cluster_nb_sectors = nb_sectors;
+    } else {
+        int64_t c = bdi.cluster_size / BDRV_SECTOR_SIZE;
+        *cluster_sector_num = (sector_num / c) * c;
+        *cluster_nb_sectors = ((sector_num - *cluster_sector_num +
+                                nb_sectors + c - 1) / c) * c;
+    }
+
+    /* The last cluster of the image may be incomplete */
+    if (!bs->growable &&
+        *cluster_sector_num + *cluster_nb_sectors > bs->total_sectors) {
+        *cluster_nb_sectors = bs->total_sectors - *cluster_sector_num;
+    }
+}
+
+static void tracked_request_begin(BdrvTrackedRequest *req,
+                                  BlockDriverState *bs,
+                                  int64_t sector_num,
+                                  int nb_sectors, bool is_write)
+{
+    *req = (BdrvTrackedRequest){
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .is_write = is_write,
+        .co = qemu_coroutine_self(),
+    };
+
+    qemu_co_queue_init(&req->wait_queue);
+
+    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+}
+
+static void tracked_request_end(BdrvTrackedRequest *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+static bool tracked_request_overlaps(BdrvTrackedRequest *req,
+                                     int64_t sector_num, int nb_sectors)
+{
+    /*        aaaa   bbbb */
+    if (sector_num >= req->sector_num + req->nb_sectors) {
+        return false;
+    }
+    /* bbbb   aaaa        */
+    if (req->sector_num >= sector_num + nb_sectors) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Wait until no in-flight request touches the clusters of a region
+ *
+ * Touching the same cluster counts as an overlap.  This makes the read and
+ * write halves of a copy-on-read operation atomic with respect to guest
+ * writes, which therefore cannot interleave between them.
+ */
+static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    bool retry;
+
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+            if (tracked_request_overlaps(req, cluster_sector_num,
+                                         cluster_nb_sectors)) {
+                /* Hitting this means there was a reentrant request, for
+                 * example, a block driver issuing nested requests.  This must
+                 * never happen since it means deadlock.
+                 */
+                assert(qemu_coroutine_self() != req->co);
+
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    /* Perform I/O through a temporary buffer so that users who scribble over
+     * their read buffer while the operation is in progress do not end up
+     * modifying the image file.  This is critical for zero-copy guest I/O
+     * where anything might happen inside guest memory.
+     */
+    void *bounce_buffer;
+
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    size_t skip_bytes;
+    int ret;
+
+    /* Cover entire cluster so no additional backing file I/O is required when
+     * allocating cluster in the image file.
+     */
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    trace_bdrv_co_copy_on_readv(bs, sector_num, nb_sectors,
+                                cluster_sector_num, cluster_nb_sectors);
+
+    iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = bounce_buffer = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = bs->drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
+                                 &bounce_qiov);
+    if (ret < 0) {
+        goto err;
+    }
+
+    ret = bs->drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
+                                  &bounce_qiov);
+    if (ret < 0) {
+        /* It might be okay to ignore write errors for guest requests.  If this
+         * is a deliberate copy-on-read then we don't want to ignore the error.
+         * Simply report it in all cases.
+         */
+        goto err;
+    }
+
+    skip_bytes = (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE;
+    qemu_iovec_from_buffer(qiov, bounce_buffer + skip_bytes,
+                           nb_sectors * BDRV_SECTOR_SIZE);
+
+err:
+    qemu_vfree(bounce_buffer);
+    return ret;
+}
+
 /*
  * Handle a read request in coroutine context
  */
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
@@ -1270,7 +1569,49 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         return -EIO;
     }
 
-    return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    /* throttling disk read I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, false, nb_sectors);
+    }
+
+    /* Images without a backing file have nothing to copy */
+    if (bs->copy_on_read && bs->backing_hd) {
+        flags |= BDRV_REQ_COPY_ON_READ;
+    }
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        bs->copy_on_read_in_flight++;
+    }
+
+    if (bs->copy_on_read_in_flight) {
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    }
+
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        int pnum;
+
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, &pnum);
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (!ret || pnum != nb_sectors) {
+            ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
+            goto out;
+        }
+    }
+
+    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+
+out:
+    tracked_request_end(&req);
+
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        bs->copy_on_read_in_flight--;
+    }
+
+    return ret;
 }
 
 int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -1278,7 +1619,18 @@ int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_co_readv(bs, sector_num, nb_sectors);
 
-    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov);
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov, 0);
+}
+
+/*
+ * Read a region and write the data that came from backing files into the
+ * image, so that later reads no longer need to go to the backing file
+ */
+int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_COPY_ON_READ);
 }
 
 /*
@@ -1288,6 +1640,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
     int ret;
 
     if (!bs->drv) {
@@ -1300,6 +1653,17 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         return -EIO;
     }
 
+    /* throttling disk write I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, true, nb_sectors);
+    }
+
+    if (bs->copy_on_read_in_flight) {
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    }
+
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+
     ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
 
     if (bs->dirty_bitmap) {
@@ -1310,6 +1674,8 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 
+    tracked_request_end(&req);
+
     return ret;
 }
 
@@ -1797,6 +2163,28 @@ void bdrv_flush_all(void)
     }
 }
 
+/*
+ * Wait for pending requests to complete across all BlockDriverStates
+ *
+ * Throttled requests are not visible to qemu_aio_flush(), so they are
+ * released regardless of the configured limits and waited for as well.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+
+    qemu_aio_flush();
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->io_limits_enabled &&
+            !qemu_co_queue_empty(&bs->throttled_reqs)) {
+            bdrv_io_limits_disable(bs);
+            qemu_aio_flush();
+            bdrv_io_limits_enable(bs);
+        }
+    }
+}
+
 int bdrv_has_zero_init(BlockDriverState *bs)
 {
     assert(bs->drv);
@@ -1846,6 +2234,23 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Coroutine version of bdrv_is_allocated().  Errors from the image driver are
+ * returned as -errno; drivers without a coroutine implementation fall back to
+ * the synchronous callback.
+ */
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
+{
+    trace_bdrv_co_is_allocated(bs, sector_num, nb_sectors);
+
+    if (bs->drv->bdrv_co_is_allocated) {
+        return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors,
+                                             pnum);
+    }
+    return bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
@@ -1909,6 +2314,16 @@ static void bdrv_print_dict(QObject *obj, void *opaque)
                             qdict_get_bool(qdict, "ro"),
                             qdict_get_str(qdict, "drv"),
                             qdict_get_bool(qdict, "encrypted"));
+
+        monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
+                            " bps_wr=%" PRId64 " iops=%" PRId64
+                            " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                            qdict_get_int(qdict, "bps"),
+                            qdict_get_int(qdict, "bps_rd"),
+                            qdict_get_int(qdict, "bps_wr"),
+                            qdict_get_int(qdict, "iops"),
+                            qdict_get_int(qdict, "iops_rd"),
+                            qdict_get_int(qdict, "iops_wr"));
     } else {
         monitor_printf(mon, " [not inserted]");
     }
@@ -1959,10 +2374,22 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
             QObject *obj;
 
             obj = qobject_from_jsonf("{ 'file': %s, 'ro': %i, 'drv': %s, "
-                                     "'encrypted': %i }",
+                                     "'encrypted': %i, "
+                                     "'bps': %" PRId64 ","
+                                     "'bps_rd': %" PRId64 ","
+                                     "'bps_wr': %" PRId64 ","
+                                     "'iops': %" PRId64 ","
+                                     "'iops_rd': %" PRId64 ","
+                                     "'iops_wr': %" PRId64 "}",
                                      bs->filename, bs->read_only,
                                      bs->drv->format_name,
-                                     bdrv_is_encrypted(bs));
+                                     bdrv_is_encrypted(bs),
+                                     bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL],
+                                     bs->io_limits.bps[BLOCK_IO_LIMIT_READ],
+                                     bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE],
+                                     bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL],
+                                     bs->io_limits.iops[BLOCK_IO_LIMIT_READ],
+                                     bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE]);
             if (bs->backing_file[0] != '\0') {
                 QDict *qdict = qobject_to_qdict(obj);
                 qdict_put(qdict, "backing_file",
@@ -1994,6 +2421,10 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         " wr_total_time_ns=%" PRId64
                         " rd_total_time_ns=%" PRId64
                         " flush_total_time_ns=%" PRId64
+                        " rd_throttled_operations=%" PRId64
+                        " wr_throttled_operations=%" PRId64
+                        " rd_throttled_time_ns=%" PRId64
+                        " wr_throttled_time_ns=%" PRId64
                         "\n",
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
@@ -2002,7 +2433,11 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         qdict_get_int(qdict, "flush_operations"),
                         qdict_get_int(qdict, "wr_total_time_ns"),
                         qdict_get_int(qdict, "rd_total_time_ns"),
-                        qdict_get_int(qdict, "flush_total_time_ns"));
+                        qdict_get_int(qdict, "flush_total_time_ns"),
+                        qdict_get_int(qdict, "rd_throttled_operations"),
+                        qdict_get_int(qdict, "wr_throttled_operations"),
+                        qdict_get_int(qdict, "rd_throttled_time_ns"),
+                        qdict_get_int(qdict, "wr_throttled_time_ns"));
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -2024,7 +2459,11 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              "'flush_operations': %" PRId64 ","
                              "'wr_total_time_ns': %" PRId64 ","
                              "'rd_total_time_ns': %" PRId64 ","
-                             "'flush_total_time_ns': %" PRId64
+                             "'flush_total_time_ns': %" PRId64 ","
+                             "'rd_throttled_operations': %" PRId64 ","
+                             "'wr_throttled_operations': %" PRId64 ","
+                             "'rd_throttled_time_ns': %" PRId64 ","
+                             "'wr_throttled_time_ns': %" PRId64
                              "} }",
                              bs->nr_bytes[BDRV_ACCT_READ],
                              bs->nr_bytes[BDRV_ACCT_WRITE],
@@ -2035,7 +2474,11 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              bs->nr_ops[BDRV_ACCT_FLUSH],
                              bs->total_time_ns[BDRV_ACCT_WRITE],
                              bs->total_time_ns[BDRV_ACCT_READ],
-                             bs->total_time_ns[BDRV_ACCT_FLUSH]);
+                             bs->total_time_ns[BDRV_ACCT_FLUSH],
+                             bs->nr_throttled_ops[BDRV_ACCT_READ],
+                             bs->nr_throttled_ops[BDRV_ACCT_WRITE],
+                             bs->throttled_time_ns[BDRV_ACCT_READ],
+                             bs->throttled_time_ns[BDRV_ACCT_WRITE]);
     dict  = qobject_to_qdict(res);
 
     if (*bs->device_name) {
@@ -2066,6 +2509,61 @@ void bdrv_info_stats(Monitor *mon, QObject **ret_data)
     *ret_data = QOBJECT(devices);
 }
 
+QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+static void bdrv_block_jobs_iter(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *qdict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "Type %s, device %s: Completed %" PRId64
+                   " of %" PRId64 " bytes, speed limit %" PRId64 " bytes/s\n",
+                   qdict_get_str(qdict, "type"),
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_int(qdict, "offset"),
+                   qdict_get_int(qdict, "len"),
+                   qdict_get_int(qdict, "speed"));
+}
+
+void bdrv_block_jobs_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+    qlist_iter(list, bdrv_block_jobs_iter, mon);
+}
+
+void bdrv_info_block_jobs(Monitor *mon, QObject **ret_data)
+{
+    QList *jobs;
+    BlockDriverState *bs;
+
+    jobs = qlist_new();
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->job) {
+            qlist_append_obj(jobs, qobject_from_block_job(bs->job));
+        }
+    }
+
+    *ret_data = QOBJECT(jobs);
+}
+
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs)
 {
     if (bs->backing_hd && bs->backing_hd->encrypted)
@@ -2752,7 +3250,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov);
+            acb->req.nb_sectors, acb->req.qiov, 0);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
             acb->req.nb_sectors, acb->req.qiov);
@@ -3136,6 +3634,96 @@ bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
     bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
 }
 
+void bdrv_set_io_limits(BlockDriverState *bs,
+                        BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+
+    if (bdrv_io_limits_enabled(bs)) {
+        if (!bs->io_limits_enabled) {
+            bdrv_io_limits_enable(bs);
+        } else {
+            /* Give the head of the queue a chance to run with the new limits */
+            qemu_co_queue_next(&bs->throttled_reqs);
+        }
+    } else if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
+}
+
+/*
+ * Returns the time in seconds that has to pass before 'done + req' units fit
+ * into the budget of 'limit' units per second, or 0 if they fit right now.
+ * One slice worth of budget is granted up front so that an idle device can
+ * absorb a small burst.
+ */
+static double bdrv_io_limit_wait(int64_t limit, double done, double req,
+                                 double elapsed_time)
+{
+    double slice_time = BLOCK_IO_SLICE_TIME / NANOSECONDS_PER_SECOND;
+
+    if (!limit) {
+        return 0;
+    }
+
+    if (done + req <= limit * (elapsed_time + slice_time)) {
+        return 0;
+    }
+
+    return (done + req) / limit - elapsed_time - slice_time;
+}
+
+static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
+                                  bool is_write, int64_t *wait)
+{
+    BlockIOLimit *limits = &bs->io_limits;
+    BlockIOBaseValue *base = &bs->io_base;
+    BlockIOBaseValue *disp = &bs->io_disp;
+    double elapsed_time, bytes_res, wait_time;
+    uint64_t bytes_done, bytes_total, ios_done, ios_total;
+    int64_t now;
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (bs->slice_start < now && now < bs->slice_end) {
+        bs->slice_end = now + BLOCK_IO_SLICE_TIME;
+    } else {
+        /* The device was idle for a whole slice, start accounting anew */
+        bs->slice_start = now;
+        bs->slice_end   = now + BLOCK_IO_SLICE_TIME;
+        *base = *disp;
+    }
+
+    elapsed_time = (now - bs->slice_start) / NANOSECONDS_PER_SECOND;
+    bytes_res    = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+
+    bytes_done  = disp->bytes[is_write] - base->bytes[is_write];
+    bytes_total = bytes_done + disp->bytes[!is_write] - base->bytes[!is_write];
+    ios_done    = disp->ios[is_write] - base->ios[is_write];
+    ios_total   = ios_done + disp->ios[!is_write] - base->ios[!is_write];
+
+    wait_time = MAX(bdrv_io_limit_wait(limits->bps[is_write], bytes_done,
+                                       bytes_res, elapsed_time),
+                    bdrv_io_limit_wait(limits->bps[BLOCK_IO_LIMIT_TOTAL],
+                                       bytes_total, bytes_res, elapsed_time));
+    wait_time = MAX(wait_time,
+                    bdrv_io_limit_wait(limits->iops[is_write], ios_done, 1,
+                                       elapsed_time));
+    wait_time = MAX(wait_time,
+                    bdrv_io_limit_wait(limits->iops[BLOCK_IO_LIMIT_TOTAL],
+                                       ios_total, 1, elapsed_time));
+
+    if (wait_time <= 0) {
+        *wait = 0;
+        return false;
+    }
+
+    *wait = wait_time * NANOSECONDS_PER_SECOND;
+    if (bs->slice_end < now + *wait + BLOCK_IO_SLICE_TIME) {
+        bs->slice_end = now + *wait + BLOCK_IO_SLICE_TIME;
+    }
+    return true;
+}
+
 int bdrv_img_create(const char *filename, const char *fmt,
                     const char *base_filename, const char *base_fmt,
                     char *options, uint64_t img_size, int flags)
@@ -3278,3 +3866,51 @@ out:
 
     return ret;
 }
+
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockJob *job;
+
+    if (bs->job || bdrv_in_use(bs)) {
+        return NULL;
+    }
+    bdrv_set_in_use(bs, 1);
+
+    job = g_malloc0(job_type->instance_size);
+    job->job_type      = job_type;
+    job->bs            = bs;
+    job->cb            = cb;
+    job->opaque        = opaque;
+    bs->job = job;
+    return job;
+}
+
+void block_job_complete(BlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    job->cb(job->opaque, ret);
+    bs->job = NULL;
+    g_free(job);
+    bdrv_set_in_use(bs, 0);
+}
+
+int block_job_set_speed(BlockJob *job, int64_t value)
+{
+    if (!job->job_type->set_speed) {
+        return -ENOTSUP;
+    }
+    return job->job_type->set_speed(job, value);
+}
+
+void block_job_cancel(BlockJob *job)
+{
+    job->cancelled = true;
+}
+
+bool block_job_is_cancelled(BlockJob *job)
+{
+    return job->cancelled;
+}
@@ -199,6 +199,37 @@ void drive_get_ref(DriveInfo *dinfo)
     dinfo->refcount++;
 }
 
+typedef struct {
+    QEMUBH *bh;
+    DriveInfo *dinfo;
+} DrivePutRefBH;
+
+static void drive_put_ref_bh(void *opaque)
+{
+    DrivePutRefBH *s = opaque;
+
+    drive_put_ref(s->dinfo);
+    qemu_bh_delete(s->bh);
+    g_free(s);
+}
+
+/*
+ * Release a drive reference in a BH
+ *
+ * It is not possible to use drive_put_ref() from a callback function when the
+ * callers still need the drive.  In such cases we schedule a BH to release the
+ * reference.
+ */
+static void drive_put_ref_bh_schedule(DriveInfo *dinfo)
+{
+    DrivePutRefBH *s;
+
+    s = g_new(DrivePutRefBH, 1);
+    s->bh = qemu_bh_new(drive_put_ref_bh, s);
+    s->dinfo = dinfo;
+    qemu_bh_schedule(s->bh);
+}
+
 static int parse_block_error_action(const char *buf, int is_read)
 {
     if (!strcmp(buf, "ignore")) {
@@ -216,6 +247,19 @@ static int parse_block_error_action(const char *buf, int is_read)
     }
 }
 
+static bool do_check_io_limits(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -235,7 +279,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     int on_read_error, on_write_error;
     const char *devaddr;
     DriveInfo *dinfo;
+    BlockIOLimit io_limits;
     int snapshot = 0;
+    bool copy_on_read;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -252,6 +298,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -386,6 +433,25 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    /* disk I/O throttling */
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr", 0);
+
+    if (!do_check_io_limits(&io_limits)) {
+        error_report("bps and iops values must be 0 or greater");
+        return NULL;
+    }
+
     /* compute bus and unit according index */
 
     if (index != -1) {
@@ -460,6 +526,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
 
+    /* disk I/O throttling */
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -512,6 +581,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    if (copy_on_read) {
+        if (ro) {
+            error_report("copy-on-read requires a writable image");
+            goto err;
+        }
+        bdrv_flags |= BDRV_O_COPY_ON_READ;
+    }
+
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
@@ -603,7 +680,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     bdrv_close(bs);
@@ -631,6 +708,10 @@ out:
 
 static int eject_device(Monitor *mon, BlockDriverState *bs, int force)
 {
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return -1;
+    }
     if (!bdrv_dev_has_removable_media(bs)) {
         qerror_report(QERR_DEVICE_NOT_REMOVABLE, bdrv_get_device_name(bs));
         return -1;
@@ -729,7 +810,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -776,3 +857,169 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+int do_block_set_io_throttle(Monitor *mon,
+                             const QDict *qdict, QObject **ret_data)
+{
+    BlockIOLimit io_limits;
+    const char *devname = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL]
+                        = qdict_get_int(qdict, "bps");
+    io_limits.bps[BLOCK_IO_LIMIT_READ]
+                        = qdict_get_int(qdict, "bps_rd");
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE]
+                        = qdict_get_int(qdict, "bps_wr");
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL]
+                        = qdict_get_int(qdict, "iops");
+    io_limits.iops[BLOCK_IO_LIMIT_READ]
+                        = qdict_get_int(qdict, "iops_rd");
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE]
+                        = qdict_get_int(qdict, "iops_wr");
+
+    bs = bdrv_find(devname);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, devname);
+        return -1;
+    }
+
+    if (!do_check_io_limits(&io_limits)) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "bps/iops",
+                      "a value of 0 or greater");
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+
+    return 0;
+}
+
+static void block_stream_cb(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    DriveInfo *dinfo;
+    QObject *obj;
+    QDict *dict;
+
+    obj = qobject_from_block_job(bs->job);
+    dict = qobject_to_qdict(obj);
+    if (ret < 0) {
+        qdict_put(dict, "error", qstring_from_str(strerror(-ret)));
+    }
+
+    if (block_job_is_cancelled(bs->job)) {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_CANCELLED, obj);
+    } else {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_COMPLETED, obj);
+    }
+    qobject_decref(obj);
+
+    dinfo = drive_get_by_blockdev(bs);
+    if (dinfo) {
+        drive_put_ref_bh_schedule(dinfo);
+    }
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs;
+    DriveInfo *dinfo;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (speed < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "speed",
+                      "a value of 0 or greater");
+        return -1;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.  It is dropped by the completion callback.
+     */
+    dinfo = drive_get_by_blockdev(bs);
+    if (dinfo) {
+        drive_get_ref(dinfo);
+    }
+
+    ret = stream_start(bs, block_stream_cb, bs);
+    if (ret < 0 && dinfo) {
+        drive_put_ref(dinfo);
+    }
+    switch (ret) {
+    case 0:
+        break;
+    case -EBUSY:
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    case -ENOTSUP:
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    default:
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+
+    /* The job may already have completed synchronously */
+    if (speed && bs->job) {
+        block_job_set_speed(bs->job, speed);
+    }
+
+    return 0;
+}
+
+static BlockJob *find_block_job(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs || !bs->job) {
+        return NULL;
+    }
+    return bs->job;
+}
+
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "value");
+    BlockJob *job = find_block_job(device);
+    int ret;
+
+    if (!job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    ret = block_job_set_speed(job, value);
+    if (ret == -ENOTSUP) {
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a value of 0 or greater");
+        return -1;
+    }
+    return 0;
+}
+
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    block_job_cancel(job);
+    return 0;
+}
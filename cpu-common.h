@@ -83,6 +83,11 @@ int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            void *opaque, enum device_endian endian);
 void cpu_unregister_io_memory(int table_address);
 
+/* Take the global mutex around a device access made from a vCPU thread
+   with multi-threaded TCG.  Returns true if it has to be released.  */
+bool io_mem_lock(void);
+void io_mem_unlock(bool locked);
+
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
 static inline void cpu_physical_memory_read(target_phys_addr_t addr,
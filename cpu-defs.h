@@ -66,6 +66,7 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define EXCP_HLT        0x10001 /* hlt instruction reached */
 #define EXCP_DEBUG      0x10002 /* cpu stopped after a breakpoint or singlestep */
 #define EXCP_HALTED     0x10003 /* cpu is halted (waiting for external event) */
+#define EXCP_ATOMIC     0x10004 /* atomic instruction needs the other cpus stopped */
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -79,8 +80,20 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* initial and minimum size of the TLB */
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* The TLB grows up to CPU_TLB_MAX_SIZE entries with the TCG backends
+   that load the index mask from env->tlb_mask.  Others use the constant
+   (CPU_TLB_SIZE - 1) mask, so the size must not change.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_TLB_MAX_BITS 10
+#else
+#define CPU_TLB_MAX_BITS CPU_TLB_BITS
+#endif
+#define CPU_TLB_MAX_SIZE (1 << CPU_TLB_MAX_BITS)
+/* fully associative TLB of the entries recently replaced in tlb_table */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -112,14 +125,34 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
 
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_MAX_SIZE];              \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_MAX_SIZE];           \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index; /* next victim TLB entry to replace */     \
+    int tlb_empty; /* no fill since the tables were last cleared */     \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;
 
+/* Preserved by CPU reset.  The TLB size is only changed by tlb_flush(),
+   depending on the fills since the previous flush.  */
+#define CPU_COMMON_TLB_SIZE \
+    /* (number of tlb_table entries used - 1) << CPU_TLB_ENTRY_BITS */  \
+    unsigned long tlb_mask;                                             \
+    unsigned int tlb_nb_fills; /* since the last flush */               \
+    unsigned int tlb_nb_evictions; /* valid entries replaced by fills */ \
+    uint64_t tlb_fill_count;                                            \
+    uint64_t tlb_victim_hit_count;                                      \
+    unsigned int tlb_resize_count;
+
+/* index of addr in env->tlb_table[mmu_idx] */
+#define tlb_index(env, addr) \
+    (((addr) >> TARGET_PAGE_BITS) & ((env)->tlb_mask >> CPU_TLB_ENTRY_BITS))
+
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_SIZE
 
 #endif
 
@@ -202,7 +235,7 @@ typedef struct CPUWatchpoint {
     int numa_node; /* NUMA node this cpu is belonging to  */            \
     int nr_cores;  /* number of cores within this CPU package */        \
     int nr_threads;/* number of threads within this CPU */              \
-    int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    int running; /* Nonzero while running (usermode or threaded TCG) */ \
     int thread_id;                                                      \
     /* user data */                                                     \
     void *opaque;                                                       \
@@ -218,6 +251,11 @@ typedef struct CPUWatchpoint {
     struct KVMState *kvm_state;                                         \
     struct kvm_run *kvm_run;                                            \
     int kvm_fd;                                                         \
-    int kvm_vcpu_dirty;
+    int kvm_vcpu_dirty;                                                 \
+    /* statistics of the TB lookups in cpu_exec() */                    \
+    uint64_t tb_lookup_count;                                           \
+    uint64_t tb_jmp_cache_miss_count;                                   \
+    uint64_t tb_hash_probe_count;                                       \
+    CPU_COMMON_TLB_SIZE
 
 #endif
@@ -63,8 +63,10 @@ static void cpu_exec_nocache(CPUState *env, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock_acquire();
     tb = tb_gen_code(env, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles);
+    tb_lock_release();
     env->current_tb = tb;
     /* execute the generated code */
     next_tb = tcg_qemu_tb_exec(env, tb->tc_ptr);
@@ -75,60 +77,104 @@ static void cpu_exec_nocache(CPUState *env, int max_cycles,
            the TB starts executing.  */
         cpu_pc_from_tb(env, tb);
     }
+    tb_lock_acquire();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_lock_release();
 }
 
-static TranslationBlock *tb_find_slow(CPUState *env,
-                                      target_ulong pc,
-                                      target_ulong cs_base,
-                                      uint64_t flags)
+#if !defined(CONFIG_USER_ONLY)
+/* Execute the instruction at the current PC on its own, without
+   caching the code.  The other vCPUs are stopped, see EXCP_ATOMIC.  */
+static void cpu_exec_step_atomic(CPUState *env)
+{
+    unsigned long next_tb;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb_lock_acquire();
+    tb = tb_gen_code(env, pc, cs_base, flags, 1);
+    tb_lock_release();
+    env->current_tb = tb;
+    next_tb = tcg_qemu_tb_exec(env, tb->tc_ptr);
+    env->current_tb = NULL;
+
+    if ((next_tb & 3) == 2) {
+        /* kicked before the instruction ran, it will raise EXCP_ATOMIC
+           again */
+        cpu_pc_from_tb(env, tb);
+    }
+    tb_lock_acquire();
+    tb_phys_invalidate(tb, -1);
+    tb_free(tb);
+    tb_lock_release();
+}
+#endif
+
+/* Look up a TB in tb_hash.  This does not need tb_lock, but may miss a
+   TB that another vCPU is adding.  */
+static TranslationBlock *tb_lookup(CPUState *env, tb_page_addr_t phys_pc,
+                                   target_ulong pc, target_ulong cs_base,
+                                   uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
+    TBHashTable *t;
+    TranslationBlock *tb;
     unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
+    tb_page_addr_t phys_page1, phys_page2 = -1;
     target_ulong virt_page2;
 
-    tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
+    t = tb_hash;
+    smp_rmb();
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
+    for (h = tb_hash_func(phys_pc, pc, cs_base, flags); ; h++) {
+        env->tb_hash_probe_count++;
+        tb = t->entries[h & t->mask];
+        if (!tb) {
+            return NULL;
+        }
+        if (tb != TB_HASH_DELETED &&
+            tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
-            tb->flags == flags) {
+            tb->flags == flags &&
+            !tb->invalid) {
             /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
+            if (tb->page_addr[1] == -1) {
+                return tb;
+            }
+            if (phys_page2 == -1) {
+                virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
                 phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
+            }
+            if (tb->page_addr[1] == phys_page2) {
+                return tb;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+}
+
+static TranslationBlock *tb_find_slow(CPUState *env,
+                                      target_ulong pc,
+                                      target_ulong cs_base,
+                                      uint64_t flags)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+
+    /* find translated block using physical mappings */
+    phys_pc = get_page_addr_code(env, pc);
+    tb = tb_lookup(env, phys_pc, pc, cs_base, flags);
+    if (!tb) {
+        tb_lock_acquire();
+        tb_invalidated_flag = 0;
+        /* another vCPU may have just translated it */
+        tb = tb_lookup(env, phys_pc, pc, cs_base, flags);
+        if (!tb) {
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        }
+        tb_lock_release();
     }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
@@ -145,14 +191,89 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    /* tb_jmp_cache is private to the vCPU and only cleared by other
+       threads.  In system emulation TBs are not reused before tb_flush,
+       which waits for all vCPUs to leave cpu_exec(), so this lookup
+       needs no lock.  */
+    env->tb_lookup_count++;
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        env->tb_jmp_cache_miss_count++;
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
+    /* Chained TBs run without coming back here, but a hot loop is left
+       often enough (interrupts, exits to the main loop) to keep its
+       region marked.  */
+    tb_mark_used(tb);
     return tb;
 }
 
+#if defined(TARGET_HAS_TRACES)
+/* Backward jumps to a TB are counted in cpu_exec() instead of being
+   chained, until the TB turns hot.  The TBs that run after it are then
+   executed one at a time, without direct jumps between them, and their
+   pcs are recorded until execution gets back to the hot TB or leaves
+   its page.  The path is then retranslated as a single TB.  */
+typedef struct TraceRecorder {
+    TranslationBlock *head;
+    int len;
+    target_ulong pc[TB_TRACE_MAX];
+} TraceRecorder;
+
+static DEFINE_TLS(TraceRecorder, trace_recorder);
+#define trace_recorder tls_var(trace_recorder)
+
+/* Return true if the jump from 'last' to 'tb' goes back and must not be
+   chained yet.  The count is only approximate if several vCPUs run the
+   loop.  */
+static bool trace_count_jump(TranslationBlock *last, TranslationBlock *tb)
+{
+    TraceRecorder *r = &trace_recorder;
+
+    if (tb->pc > last->pc) {
+        return false;
+    }
+    if (--tb->hot_count == 0 && !r->head) {
+        r->head = tb;
+        r->len = 0;
+    }
+    return true;
+}
+
+/* Record 'tb', which is about to run, and return the TB to run instead;
+   it differs if a trace was just built.  */
+static TranslationBlock *trace_record(CPUState *env, TranslationBlock *tb)
+{
+    TraceRecorder *r = &trace_recorder;
+    TranslationBlock *head = r->head;
+
+    if (tb == head && r->len == 0 && tb->page_addr[1] == -1) {
+        tb_lock_acquire();
+        tb_unchain(tb);
+        tb_lock_release();
+        return tb;
+    }
+    if (tb != head && r->len < TB_TRACE_MAX && tb->trace_len == 0 &&
+        tb->cs_base == head->cs_base && tb->flags == head->flags &&
+        tb->pc >= head->pc && tb->page_addr[1] == -1 &&
+        (tb->pc & TARGET_PAGE_MASK) == (head->pc & TARGET_PAGE_MASK)) {
+        r->pc[r->len++] = tb->pc;
+        tb_lock_acquire();
+        tb_unchain(tb);
+        tb_lock_release();
+        return tb;
+    }
+
+    r->head = NULL;
+    if (r->len == 0) {
+        return tb;
+    }
+    tb_gen_trace(env, head, r->pc, r->len);
+    return tb_find_fast(env);
+}
+#endif
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -230,6 +351,9 @@ int cpu_exec(CPUState *env)
 #error unsupported target CPU
 #endif
     env->exception_index = -1;
+#if defined(TARGET_HAS_TRACES)
+    trace_recorder.head = NULL;
+#endif
 
     /* prepare setjmp context for exception handling */
     for(;;) {
@@ -261,9 +385,20 @@ int cpu_exec(CPUState *env)
             }
 
             next_tb = 0; /* force lookup of first TB */
+#if !defined(CONFIG_USER_ONLY)
+            if (unlikely(tcg_step_atomic)) {
+                cpu_exec_step_atomic(env);
+                env->exception_index = EXCP_INTERRUPT;
+                cpu_loop_exit(env);
+            }
+#endif
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt controllers are device models */
+                    bool iothread_locked = io_mem_lock();
+#endif
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -505,6 +640,9 @@ int cpu_exec(CPUState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    io_mem_unlock(iothread_locked);
+#endif
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -530,7 +668,10 @@ int cpu_exec(CPUState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
+#if defined(CONFIG_USER_ONLY)
+                /* tb_flush does not wait for the other threads here */
+                tb_lock_acquire();
+#endif
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -540,7 +681,21 @@ int cpu_exec(CPUState *env)
                        must recompute the hash index here */
                     next_tb = 0;
                     tb_invalidated_flag = 0;
+#if defined(TARGET_HAS_TRACES)
+                    trace_recorder.head = NULL;
+#endif
                 }
+#if defined(TARGET_HAS_TRACES)
+                if (next_tb != 0 && tb->hot_count > 0 &&
+                    trace_count_jump((TranslationBlock *)(next_tb & ~3),
+                                     tb)) {
+                    next_tb = 0;
+                }
+                if (unlikely(trace_recorder.head != NULL)) {
+                    tb = trace_record(env, tb);
+                    next_tb = 0;
+                }
+#endif
 #ifdef CONFIG_DEBUG_EXEC
                 qemu_log_mask(CPU_LOG_EXEC, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n",
                              (long)tb->tc_ptr, tb->pc,
@@ -550,9 +705,17 @@ int cpu_exec(CPUState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    tb_lock_acquire();
+                    /* another vCPU may have invalidated it meanwhile */
+                    if (!tb->invalid) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                    }
+                    tb_lock_release();
                 }
-                spin_unlock(&tb_lock);
+#if defined(CONFIG_USER_ONLY)
+                tb_lock_release();
+#endif
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -600,6 +763,10 @@ int cpu_exec(CPUState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            cpu_exec_release_locks();
+#if defined(TARGET_HAS_TRACES)
+            trace_recorder.head = NULL;
+#endif
         }
     } /* for(;;) */
 
@@ -334,6 +334,48 @@ void configure_icount(const char *option)
                    qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+void configure_tcg_threads(const char *option)
+{
+    if (!option || !strcmp(option, "single")) {
+        return;
+    }
+    if (strcmp(option, "multi") != 0) {
+        fprintf(stderr, "Invalid tcg_threads mode: %s\n", option);
+        exit(1);
+    }
+    if (!tcg_enabled()) {
+        fprintf(stderr, "tcg_threads=multi requires the tcg accelerator\n");
+        exit(1);
+    }
+    if (use_icount) {
+        fprintf(stderr, "tcg_threads=multi is not compatible with -icount\n");
+        exit(1);
+    }
+#if !QEMU_TLS_IS_REAL || !defined(TARGET_HAS_PARALLEL_TCG) || \
+    !(defined(__i386__) || defined(__x86_64__))
+    fprintf(stderr, "tcg_threads=multi is not supported on this host or "
+            "for this target\n");
+    exit(1);
+#else
+    parallel_cpus = true;
+#endif
+}
+
+void configure_tcg_traces(bool enable)
+{
+    if (!enable) {
+        return;
+    }
+    if (use_icount) {
+        fprintf(stderr, "tcg_traces is not compatible with -icount\n");
+        exit(1);
+    }
+    if (tb_traces_enable() < 0) {
+        fprintf(stderr, "tcg_traces is not supported for this target\n");
+        exit(1);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -395,7 +437,7 @@ static void do_vm_stop(RunState state)
         pause_all_vcpus();
         runstate_set(state);
         vm_state_notify(0, state);
-        qemu_aio_flush();
+        bdrv_drain_all();
         bdrv_flush_all();
         monitor_protocol_event(QEVENT_STOP, NULL);
     }
@@ -585,6 +627,8 @@ static void qemu_tcg_init_cpu_signals(void)
 
     sigemptyset(&set);
     sigaddset(&set, SIG_IPI);
+    /* for the sampling mode of tb_profile */
+    sigaddset(&set, SIGPROF);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 }
 
@@ -602,6 +646,8 @@ static void qemu_tcg_init_cpu_signals(void)
 QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static DEFINE_TLS(bool, iothread_locked);
+#define iothread_locked tls_var(iothread_locked)
 
 static QemuThread io_thread;
 
@@ -614,6 +660,14 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* multi-threaded TCG: number of vCPU threads currently inside cpu_exec()
+   and number of pending requests for exclusive access to the code cache.
+   Both are protected by the global mutex.  */
+static int tcg_running_cpus;
+static int tcg_exclusive_pending;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume_cond;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -621,11 +675,15 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+static void flush_queued_work(CPUState *env);
+
 void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -647,11 +705,21 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
     wi.done = false;
 
     qemu_cpu_kick(env);
+    if (parallel_cpus) {
+        /* env may be waiting for exclusive access to the vCPUs */
+        qemu_cond_broadcast(&tcg_exclusive_cond);
+        qemu_cond_broadcast(&tcg_exclusive_resume_cond);
+    }
     while (!wi.done) {
         CPUState *self_env = cpu_single_env;
 
         qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
         cpu_single_env = self_env;
+
+        /* Two vCPUs may be waiting for each other */
+        if (parallel_cpus && self_env) {
+            flush_queued_work(self_env);
+        }
     }
 }
 
@@ -778,6 +846,115 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Stop all vCPU threads that run translated code, so that the caller can
+   modify the code cache.  Must be called with the global mutex held and
+   from outside cpu_exec().  */
+void tcg_exclusive_start(void)
+{
+    CPUState *env, *self_env = NULL;
+
+    tcg_exclusive_pending++;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_exit(env);
+        if (env->created && qemu_cpu_is_self(env)) {
+            self_env = env;
+        }
+    }
+    while (tcg_running_cpus > 0) {
+        qemu_cond_wait(&tcg_exclusive_cond, &qemu_global_mutex);
+        /* a running vCPU may be waiting for us in run_on_cpu() */
+        if (self_env) {
+            flush_queued_work(self_env);
+        }
+    }
+}
+
+void tcg_exclusive_end(void)
+{
+    if (--tcg_exclusive_pending == 0) {
+        qemu_cond_broadcast(&tcg_exclusive_resume_cond);
+    }
+}
+
+static int tcg_cpu_exec(CPUState *env);
+
+/* Run the instruction that made 'env' leave cpu_exec() with EXCP_ATOMIC
+   while the other vCPUs are stopped.  Called with the global mutex.  */
+static int tcg_cpu_exec_atomic(CPUState *env)
+{
+    int r;
+
+    tcg_exclusive_start();
+    /* tcg_exclusive_start() kicked this vCPU as well */
+    env->exit_request = 0;
+    env->icount_decr.u16.high = 0;
+
+    /* Count the vCPU as running, so that other requests for exclusive
+       access wait for the instruction.  */
+    tcg_running_cpus++;
+    env->running = 1;
+    tcg_step_atomic = true;
+    qemu_mutex_unlock_iothread();
+    r = tcg_cpu_exec(env);
+    qemu_mutex_lock_iothread();
+    tcg_step_atomic = false;
+    env->running = 0;
+    if (--tcg_running_cpus == 0) {
+        qemu_cond_broadcast(&tcg_exclusive_cond);
+    }
+    tcg_exclusive_end();
+    return r;
+}
+
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *env = arg;
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(env->thread);
+    env->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    env->created = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(env)) {
+            while (tcg_exclusive_pending) {
+                qemu_cond_wait(&tcg_exclusive_resume_cond, &qemu_global_mutex);
+                flush_queued_work(env);
+            }
+            tcg_running_cpus++;
+            env->running = 1;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(env);
+            qemu_mutex_lock_iothread();
+            env->running = 0;
+            if (--tcg_running_cpus == 0) {
+                qemu_cond_broadcast(&tcg_exclusive_cond);
+            }
+            /* Clear a request to leave the TB made by cpu_exit().  */
+            env->icount_decr.u16.high = 0;
+            if (r == EXCP_ATOMIC) {
+                r = tcg_cpu_exec_atomic(env);
+                env->icount_decr.u16.high = 0;
+            }
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+            tb_flush_deferred(env);
+        }
+        while (cpu_thread_is_idle(env)) {
+            qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
+        }
+        qemu_wait_io_event_common(env);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *env)
 {
 #ifndef _WIN32
@@ -805,6 +982,8 @@ void qemu_cpu_kick(void *_env)
     if (kvm_enabled() && !env->thread_kicked) {
         qemu_cpu_kick_thread(env);
         env->thread_kicked = true;
+    } else if (parallel_cpus) {
+        cpu_exit(env);
     }
 }
 
@@ -831,7 +1010,7 @@ int qemu_cpu_is_self(void *_env)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (kvm_enabled()) {
+    if (kvm_enabled() || parallel_cpus) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -842,13 +1021,20 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *penv = first_cpu;
@@ -900,6 +1086,18 @@ static void qemu_tcg_init_vcpu(void *_env)
 {
     CPUState *env = _env;
 
+    /* one thread per cpu with multi-threaded TCG */
+    if (parallel_cpus) {
+        env->thread = g_malloc0(sizeof(QemuThread));
+        env->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(env->halt_cond);
+        qemu_thread_create(env->thread, qemu_tcg_mt_cpu_thread_fn, env);
+        while (env->created == 0) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         env->thread = g_malloc0(sizeof(QemuThread));
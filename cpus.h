@@ -6,6 +6,10 @@ void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+void configure_tcg_threads(const char *option);
+void configure_tcg_traces(bool enable);
+void tcg_exclusive_start(void);
+void tcg_exclusive_end(void);
 
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
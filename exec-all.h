@@ -102,6 +102,8 @@ void tlb_flush(CPUState *env, int flush_global);
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size);
+bool tlb_victim_hit(CPUState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page);
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -135,8 +137,6 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -157,6 +157,51 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* set by tb_phys_invalidate(); such a TB must not be chained to */
+    bool invalid;
+    /* the code increments exec_count; otherwise exec_count counts
+       SIGPROF samples if profiling is in sampling mode */
+    bool count_exec;
+    uint64_t exec_count;
+    /* backward jumps to this TB that cpu_exec() still has to count
+       before it records a trace from here, see tb_gen_trace() */
+    int hot_count;
+    /* for a trace, the pcs of the blocks translated after the first */
+    uint8_t trace_len;
+    target_ulong *trace;
+};
+
+/* Traces: a TB that was jumped back to tb_trace_threshold times is
+   retranslated together with the TBs that followed it, up to
+   TB_TRACE_MAX of them after its pc on the same page, so that direct
+   jumps to the trace can still be chained.  A TB has only two direct
+   jump slots for its exits, so at most TB_TRACE_MAX_EXITS conditional
+   branches are followed, and the frontend shortens trace_len when the
+   end of the trace would need one more slot.  0 disables traces.  */
+#define TB_TRACE_MAX            16
+#define TB_TRACE_MAX_EXITS      1
+#define TB_TRACE_THRESHOLD      1000
+
+extern int tb_trace_threshold;
+
+int tb_traces_enable(void);
+void tb_gen_trace(CPUState *env, TranslationBlock *head,
+                  const target_ulong *trace, int trace_len);
+void tb_unchain(TranslationBlock *tb);
+
+/* Return true if the translation of the trace 'tb' continues with the
+   block at 'pc' after 'idx' blocks.  */
+static inline bool tb_trace_continues(TranslationBlock *tb, int idx,
+                                      target_ulong pc)
+{
+    return idx < tb->trace_len && tb->trace[idx] == pc;
+}
+
+/* per-TB execution profiling modes */
+enum {
+    TB_PROFILE_OFF,
+    TB_PROFILE_COUNT,   /* count executions in the generated code */
+    TB_PROFILE_SAMPLE,  /* count SIGPROF samples */
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -179,13 +224,44 @@ static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
     return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
 }
 
+/* Open addressing hash table of the TBs, keyed on the physical pc, pc,
+   cs_base and flags.  It is read without tb_lock: an entry changes with
+   a single pointer store, and so does the table when it is replaced by
+   a larger one.  With multi-threaded TCG the replaced tables are only
+   freed by tb_flush(), otherwise right away.  A lookup may thus miss a
+   TB that is being added, but not find a TB that was never valid; the
+   caller retries with tb_lock held.  */
+typedef struct TBHashTable {
+    struct TBHashTable *next; /* replaced tables, to be freed */
+    unsigned int mask;        /* number of entries - 1 */
+    unsigned int nb_used;     /* TBs and deleted entries */
+    unsigned int nb_tbs;
+    TranslationBlock *entries[];
+} TBHashTable;
+
+/* a removed TB; unlike NULL it does not end a lookup */
+#define TB_HASH_DELETED ((TranslationBlock *)1)
+
+static inline unsigned int tb_hash_func(tb_page_addr_t phys_pc,
+                                        target_ulong pc,
+                                        target_ulong cs_base,
+                                        uint64_t flags)
+{
+    uint64_t h;
+
+    h = (uint64_t)phys_pc ^ ((uint64_t)pc << 21) ^
+        ((uint64_t)cs_base << 7) ^ flags;
+    return (h * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *env);
+void tb_mark_used(TranslationBlock *tb);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+extern TBHashTable *tb_hash;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -261,12 +337,46 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 
 TranslationBlock *tb_find_pc(unsigned long pc_ptr);
 
+/* True when more than one thread may be running translated code at the
+   same time.  In system emulation this is the multi-threaded TCG mode,
+   selected with -machine tcg_threads=multi.  */
+extern bool parallel_cpus;
+
 #include "qemu-lock.h"
 
 extern spinlock_t tb_lock;
 
+/* tb_lock protects code generation, the physical hash table, the page
+   lists and the jump lists.  These functions may be nested, and a vCPU
+   that leaves cpu_exec() with a longjmp drops the lock in
+   cpu_exec_release_locks().  */
+void tb_lock_acquire(void);
+void tb_lock_release(void);
+void tb_lock_reset(void);
+
+/* Serialize guest atomic sequences (x86 LOCK prefix, ARM STREX).  With
+   multi-threaded TCG, cpu_atomic_lock() leaves cpu_exec() with
+   EXCP_ATOMIC unless tcg_step_atomic is set; the vCPU thread then stops
+   the other vCPUs and runs the instruction again on its own.  The
+   translator must have saved the state of the instruction before.  */
+extern bool tcg_step_atomic;
+void cpu_atomic_lock(void);
+void cpu_atomic_unlock(void);
+
+void cpu_exec_release_locks(void);
+
 extern int tb_invalidated_flag;
 
+#if defined(CONFIG_LINUX_USER)
+/* Persistent translation cache (linux-user/tbcache.c).  tb_cache_lookup()
+   fills in the code of 'tb' from the cache if it has a copy of it.  */
+int tb_cache_init(const char *path, const char *cpu_model);
+bool tb_cache_lookup(CPUState *env, TranslationBlock *tb,
+                     int *gen_code_size_ptr);
+void tb_cache_add(CPUState *env, TranslationBlock *tb, int gen_code_size);
+void tb_cache_save(void);
+#endif
+
 /* The return address may point to the start of the next instruction.
    Subtracting one gets us the call instruction itself.  */
 #if defined(__s390__) && !defined(__s390x__)
@@ -285,6 +395,24 @@ extern CPUWriteMemoryFunc *io_mem_write[IO_MEM_NB_ENTRIES][4];
 extern CPUReadMemoryFunc *io_mem_read[IO_MEM_NB_ENTRIES][4];
 extern void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 
+/* Run a tb_flush() that a vCPU deferred because other vCPUs were
+   executing translated code.  Called with the global mutex held.  */
+void tb_flush_deferred(CPUState *env);
+
+typedef struct TBProfileEntry {
+    target_ulong pc;
+    uint64_t count;
+    int guest_size;
+    int host_size;
+    int exits;
+    int chained_exits;
+} TBProfileEntry;
+
+int tb_profile_get_mode(void);
+int tb_profile_set_mode(int mode);
+int tb_profile_collect(TBProfileEntry *entries, int max_entries,
+                       uint64_t *total, uint64_t *other);
+
 void tlb_fill(CPUState *env1, target_ulong addr, int is_write, int mmu_idx,
               void *retaddr);
 
@@ -326,7 +454,7 @@ static inline tb_page_addr_t get_page_addr_code(CPUState *env1, target_ulong add
     int mmu_idx, page_index, pd;
     void *p;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    page_index = tlb_index(env1, addr);
     mmu_idx = cpu_mmu_index(env1);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
@@ -30,11 +30,13 @@
 #include "hw/hw.h"
 #include "hw/qdev.h"
 #include "osdep.h"
+#include "bitops.h"
 #include "kvm.h"
 #include "hw/xen.h"
 #include "qemu-timer.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "qemu-barrier.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -55,6 +57,12 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "migration.h"
+#include "cpus.h"
+#ifdef __linux__
+#include <sys/time.h>
+#include <ucontext.h>
+#endif
 #endif
 
 //#define DEBUG_TB_INVALIDATE
@@ -76,12 +84,25 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
-static TranslationBlock *tbs;
-static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
+TBHashTable *tb_hash;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+/* nesting depth of tb_lock in the current thread */
+static DEFINE_TLS(int, tb_lock_depth);
+#define tb_lock_depth tls_var(tb_lock_depth)
+
+bool parallel_cpus;
+/* set while a vCPU runs the instruction that raised EXCP_ATOMIC */
+bool tcg_step_atomic;
+
+/* TB_PROFILE_* mode for the TBs translated from now on */
+static int tb_profile_mode;
+
+int tb_trace_threshold;
+
+static spinlock_t cpu_atomic_spinlock = SPIN_LOCK_UNLOCKED;
+static DEFINE_TLS(bool, cpu_atomic_held);
+#define cpu_atomic_held tls_var(cpu_atomic_held)
 
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
@@ -101,11 +122,46 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
+/* size reserved for the buffer; only code_gen_nb_regions are used */
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static unsigned long code_gen_buffer_max_size;
 static uint8_t *code_gen_ptr;
 
+/* The translation buffer is split into regions, each with its own
+   array of TBs.  They are filled in turn; when the current one is full,
+   the least recently used region is evicted, that is only its TBs are
+   invalidated.  The buffer grows by one region instead if many of the
+   TBs that were just translated had been evicted before.  */
+typedef struct CodeGenRegion {
+    TranslationBlock *tbs;
+    int nb_tbs;
+    /* end of the code; code_gen_ptr for the current region */
+    uint8_t *code_end;
+    /* code_gen_region_clock when a TB of the region was last used */
+    unsigned int last_use;
+    /* how many of its TBs had been evicted before */
+    int nb_retranslated;
+} CodeGenRegion;
+
+/* initial number of regions */
+#define CODE_GEN_REGIONS        8
+#define CODE_GEN_MAX_REGIONS    64
+/* the buffer can grow up to that many times its initial size */
+#define CODE_GEN_MAX_GROWTH     4
+/* grow when at least 1 / CODE_GEN_GROW_RATIO of the TBs of a region
+   were retranslations */
+#define CODE_GEN_GROW_RATIO     4
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+/* the region being filled */
+static CodeGenRegion *code_gen_region;
+static int code_gen_nb_regions;
+static int code_gen_max_regions;
+static int code_gen_region_bits;
+static int code_gen_region_max_blocks;
+static unsigned int code_gen_region_clock;
+/* hashed physical pcs of the evicted TBs */
+static unsigned long tb_evicted_map[BITS_TO_LONGS(CODE_GEN_PHYS_HASH_SIZE)];
+
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
 static int in_migration;
@@ -120,7 +176,7 @@ static MemoryRegion *system_io;
 CPUState *first_cpu;
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
-CPUState *cpu_single_env;
+DEFINE_TLS(CPUState *, cpu_single_env);
 /* 0 = Do not count executed instructions.
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
@@ -225,6 +281,11 @@ static int tlb_flush_count;
 #endif
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_hash_resize_count;
+static int tb_translate_count;
+static int tb_retranslate_count;
+static int code_gen_evict_count;
+static int tb_evict_count;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -459,12 +520,49 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
+static inline uint8_t *code_gen_region_start(CodeGenRegion *r)
+{
+    return code_gen_buffer +
+        ((unsigned long)(r - code_gen_regions) << code_gen_region_bits);
+}
+
+/* Use regions of a power of two size for the first SIZE bytes of the
+   buffer.  */
+static void code_gen_regions_init(unsigned long size)
+{
+    int i;
+
+    code_gen_region_bits = 20;
+    while ((2UL << code_gen_region_bits) <= size / CODE_GEN_REGIONS) {
+        code_gen_region_bits++;
+    }
+    code_gen_max_regions = code_gen_buffer_size >> code_gen_region_bits;
+    if (code_gen_max_regions > CODE_GEN_MAX_REGIONS) {
+        code_gen_max_regions = CODE_GEN_MAX_REGIONS;
+    }
+    code_gen_nb_regions = size >> code_gen_region_bits;
+    if (code_gen_nb_regions < 1) {
+        code_gen_nb_regions = 1;
+    }
+    code_gen_region_max_blocks =
+        (1UL << code_gen_region_bits) / CODE_GEN_AVG_BLOCK_SIZE;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].tbs =
+            g_malloc(code_gen_region_max_blocks * sizeof(TranslationBlock));
+    }
+    code_gen_region = &code_gen_regions[0];
+    code_gen_region->last_use = ++code_gen_region_clock;
+}
+
 static void code_gen_alloc(unsigned long tb_size)
 {
+    unsigned long size;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
     code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
     map_exec(code_gen_buffer, code_gen_buffer_size);
+    size = code_gen_buffer_size;
 #else
     code_gen_buffer_size = tb_size;
     if (code_gen_buffer_size == 0) {
@@ -478,6 +576,10 @@ static void code_gen_alloc(unsigned long tb_size)
     }
     if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
         code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
+    /* reserve room to grow; the pages are only used once code is
+       generated there */
+    size = code_gen_buffer_size;
+    code_gen_buffer_size *= CODE_GEN_MAX_GROWTH;
     /* The code gen buffer location may have constraints depending on
        the host cpu and OS */
 #if defined(__linux__) 
@@ -485,7 +587,7 @@ static void code_gen_alloc(unsigned long tb_size)
         int flags;
         void *start = NULL;
 
-        flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
 #if defined(__x86_64__)
         flags |= MAP_32BIT;
         /* Cannot map more than that */
@@ -551,15 +653,130 @@ static void code_gen_alloc(unsigned long tb_size)
         }
     }
 #else
+    /* the memory would be committed: do not grow */
+    code_gen_buffer_size = size;
     code_gen_buffer = g_malloc(code_gen_buffer_size);
     map_exec(code_gen_buffer, code_gen_buffer_size);
 #endif
+    if (size > code_gen_buffer_size) {
+        size = code_gen_buffer_size;
+    }
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_regions_init(size);
+}
+
+static TBHashTable *tb_hash_alloc(unsigned int size)
+{
+    TBHashTable *t;
+
+    t = g_malloc0(sizeof(*t) + size * sizeof(TranslationBlock *));
+    t->mask = size - 1;
+    return t;
+}
+
+static void tb_hash_init(void)
+{
+    tb_hash = tb_hash_alloc(CODE_GEN_PHYS_HASH_SIZE);
+}
+
+/* Only called when no other thread can look up TBs.  */
+static void tb_hash_reset(void)
+{
+    TBHashTable *t, *next;
+
+    for (t = tb_hash->next; t != NULL; t = next) {
+        next = t->next;
+        g_free(t);
+    }
+    tb_hash->next = NULL;
+    tb_hash->nb_used = 0;
+    tb_hash->nb_tbs = 0;
+    memset(tb_hash->entries, 0,
+           (tb_hash->mask + 1) * sizeof(TranslationBlock *));
+}
+
+static inline unsigned int tb_hash_func_tb(TranslationBlock *tb)
+{
+    return tb_hash_func(tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK),
+                        tb->pc, tb->cs_base, tb->flags);
+}
+
+static void tb_hash_add(TBHashTable *t, TranslationBlock *tb)
+{
+    unsigned int h;
+
+    for (h = tb_hash_func_tb(tb); ; h++) {
+        if (t->entries[h & t->mask] == NULL) {
+            t->nb_used++;
+            break;
+        }
+        if (t->entries[h & t->mask] == TB_HASH_DELETED) {
+            break;
+        }
+    }
+    t->entries[h & t->mask] = tb;
+    t->nb_tbs++;
+}
+
+/* In system emulation, other vCPU threads look up TBs without tb_lock;
+   in user mode the lookup is done with tb_lock held.  */
+static inline bool tb_hash_has_lockless_readers(void)
+{
+#if defined(CONFIG_USER_ONLY)
+    return false;
+#else
+    return parallel_cpus;
+#endif
+}
+
+/* Called with tb_lock held, once the TB is ready to run.  The table is
+   kept at most half full, counting the deleted entries; when it would
+   not be, the TBs are copied to a new table, twice as large if they
+   fill more than a quarter of it.  */
+static void tb_hash_insert(TranslationBlock *tb)
+{
+    TBHashTable *t = tb_hash, *new_t;
+    unsigned int i, size;
+
+    if ((t->nb_used + 1) * 2 > t->mask + 1) {
+        size = t->mask + 1;
+        if ((t->nb_tbs + 1) * 4 > size) {
+            size *= 2;
+        }
+        new_t = tb_hash_alloc(size);
+        for (i = 0; i <= t->mask; i++) {
+            if (t->entries[i] != NULL && t->entries[i] != TB_HASH_DELETED) {
+                tb_hash_add(new_t, t->entries[i]);
+            }
+        }
+        smp_wmb();
+        tb_hash = new_t;
+        tb_hash_resize_count++;
+        if (tb_hash_has_lockless_readers()) {
+            /* keep the old table until tb_flush, which waits for all
+               vCPUs to leave cpu_exec() */
+            new_t->next = t;
+        } else {
+            new_t->next = t->next;
+            g_free(t);
+        }
+        t = new_t;
+    }
+    smp_wmb();
+    tb_hash_add(t, tb);
+}
+
+static void tb_hash_remove(TranslationBlock *tb)
+{
+    TBHashTable *t = tb_hash;
+    unsigned int h;
+
+    for (h = tb_hash_func_tb(tb); t->entries[h & t->mask] != tb; h++) {
+        assert(t->entries[h & t->mask] != NULL);
+    }
+    t->entries[h & t->mask] = TB_HASH_DELETED;
+    t->nb_tbs--;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -570,6 +787,7 @@ void tcg_exec_init(unsigned long tb_size)
     cpu_gen_init();
     code_gen_alloc(tb_size);
     code_gen_ptr = code_gen_buffer;
+    tb_hash_init();
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
@@ -653,6 +871,7 @@ void cpu_exec_init(CPUState *env)
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
     env->thread_id = qemu_get_thread_id();
+    env->tlb_mask = (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS;
 #endif
     *penv = env;
 #if defined(CONFIG_USER_ONLY)
@@ -665,18 +884,169 @@ void cpu_exec_init(CPUState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+void tb_lock_acquire(void)
+{
+    if (tb_lock_depth++ == 0) {
+        spin_lock(&tb_lock);
+    }
+}
+
+void tb_lock_release(void)
+{
+    assert(tb_lock_depth > 0);
+    if (--tb_lock_depth == 0) {
+        spin_unlock(&tb_lock);
+    }
+}
+
+void tb_lock_reset(void)
+{
+    if (tb_lock_depth) {
+        tb_lock_depth = 0;
+        spin_unlock(&tb_lock);
+    }
+}
+
+void cpu_atomic_lock(void)
+{
+    if (parallel_cpus) {
+        /* A lock would not keep plain stores of the other vCPUs out of
+           the sequence.  Stop them instead.  */
+        if (!tcg_step_atomic) {
+            cpu_single_env->exception_index = EXCP_ATOMIC;
+            cpu_loop_exit(cpu_single_env);
+        }
+        return;
+    }
+    spin_lock(&cpu_atomic_spinlock);
+    cpu_atomic_held = true;
+}
+
+void cpu_atomic_unlock(void)
+{
+    if (!cpu_atomic_held) {
+        return;
+    }
+    cpu_atomic_held = false;
+    spin_unlock(&cpu_atomic_spinlock);
+}
+
+/* A guest exception raised from translated code, a helper or the
+   translator longjmps back to cpu_exec() and may leave locks behind.  */
+void cpu_exec_release_locks(void)
+{
+    tb_lock_reset();
+    if (cpu_atomic_held) {
+        cpu_atomic_unlock();
+    }
+#if !defined(CONFIG_USER_ONLY)
+    /* with a single TCG thread, cpu_exec() runs with the global mutex */
+    if (parallel_cpus && qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
+/* Invalidate all the TBs of a region.  Called with tb_lock held, and
+   like tb_flush() only where no other vCPU can run their code.  */
+static void code_gen_region_evict(CodeGenRegion *r)
+{
+    TranslationBlock *tb;
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &r->tbs[i];
+        if (!tb->invalid) {
+            set_bit(tb_phys_hash_func(tb->page_addr[0] +
+                                      (tb->pc & ~TARGET_PAGE_MASK)),
+                    tb_evicted_map);
+            tb_phys_invalidate(tb, -1);
+            tb_evict_count++;
+        }
+        g_free(tb->trace);
+    }
+    r->nb_tbs = 0;
+    code_gen_evict_count++;
+}
+
+/* Move to another region once the current one is full: a new one if
+   many of the TBs that were just translated had been evicted before,
+   else the least recently used one, which is evicted.  Return NULL if
+   the whole buffer must be flushed instead.  */
+static CodeGenRegion *code_gen_next_region(void)
+{
+    CodeGenRegion *r, *next;
+    int i;
+
+    r = code_gen_region;
+    r->code_end = code_gen_ptr;
+    next = NULL;
+    if (code_gen_nb_regions < code_gen_max_regions &&
+        r->nb_retranslated * CODE_GEN_GROW_RATIO >= r->nb_tbs) {
+        next = &code_gen_regions[code_gen_nb_regions++];
+        next->tbs =
+            g_malloc(code_gen_region_max_blocks * sizeof(TranslationBlock));
+    } else {
+        for (i = 0; i < code_gen_nb_regions; i++) {
+            if (&code_gen_regions[i] != r &&
+                (!next || code_gen_regions[i].last_use < next->last_use)) {
+                next = &code_gen_regions[i];
+            }
+        }
+        if (!next) {
+            next = r;
+        }
+        if (next->nb_tbs > 0) {
+#if !defined(CONFIG_USER_ONLY)
+            if (parallel_cpus) {
+                /* other vCPUs may be running its code */
+                return NULL;
+            }
+#endif
+            code_gen_region_evict(next);
+        }
+    }
+    next->nb_retranslated = 0;
+    next->last_use = ++code_gen_region_clock;
+    code_gen_region = next;
+    code_gen_ptr = code_gen_region_start(next);
+    return next;
+}
+
+/* Note that TB is about to run, so that its region is not evicted
+   soon.  This is a single store, cheap enough for every lookup.  */
+void tb_mark_used(TranslationBlock *tb)
+{
+    code_gen_regions[(tb->tc_ptr - code_gen_buffer) >>
+                     code_gen_region_bits].last_use = code_gen_region_clock;
+}
+
+/* Allocate a new translation block, in another region if the current
+   one has too many translation blocks or too much generated code.
+   Return NULL if the buffer must be flushed.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = code_gen_region;
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
-        return NULL;
-    tb = &tbs[nb_tbs++];
+    /* there must be room for the largest TB after code_gen_ptr */
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        code_gen_ptr - code_gen_region_start(r) >=
+        (1L << code_gen_region_bits) - TCG_MAX_OP_SIZE * OPC_BUF_SIZE) {
+        r = code_gen_next_region();
+        if (!r) {
+            return NULL;
+        }
+    }
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->count_exec = tb_profile_mode == TB_PROFILE_COUNT;
+    tb->exec_count = 0;
+    tb->hot_count = tb_trace_threshold;
+    tb->trace_len = 0;
+    tb->trace = NULL;
     return tb;
 }
 
@@ -685,9 +1055,11 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    CodeGenRegion *r = code_gen_region;
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+        r->nb_tbs--;
     }
 }
 
@@ -732,26 +1104,41 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *env1)
+static void do_tb_flush(CPUState *env1)
 {
     CPUState *env;
+    CodeGenRegion *r;
+    int i, j;
+
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush region=%d code_size=%ld nb_tbs=%d\n",
+           (int)(code_gen_region - code_gen_regions),
+           (unsigned long)(code_gen_ptr -
+                           code_gen_region_start(code_gen_region)),
+           code_gen_region->nb_tbs);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if ((unsigned long)(code_gen_ptr - code_gen_region_start(code_gen_region))
+        > (1UL << code_gen_region_bits))
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
-    nb_tbs = 0;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        r = &code_gen_regions[i];
+        for (j = 0; j < r->nb_tbs; j++) {
+            g_free(r->tbs[j].trace);
+        }
+        r->nb_tbs = 0;
+        r->nb_retranslated = 0;
+        r->last_use = 0;
+    }
+    code_gen_region = &code_gen_regions[0];
+    code_gen_region->last_use = ++code_gen_region_clock;
+    memset(tb_evicted_map, 0, sizeof(tb_evicted_map));
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    tb_hash_reset();
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
@@ -760,6 +1147,39 @@ void tb_flush(CPUState *env1)
     tb_flush_count++;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+static int tb_flush_requested;
+
+void tb_flush_deferred(CPUState *env)
+{
+    if (tb_flush_requested) {
+        tb_flush(env);
+    }
+}
+#endif
+
+void tb_flush(CPUState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (parallel_cpus) {
+        if (cpu_single_env) {
+            /* Other vCPUs may be executing code from the buffer.  Leave
+               cpu_exec() and let the vCPU thread flush once they are out
+               of it, too.  */
+            tb_flush_requested = 1;
+            cpu_exit(cpu_single_env);
+            return;
+        }
+        tcg_exclusive_start();
+        tb_flush_requested = 0;
+        do_tb_flush(env1);
+        tcg_exclusive_end();
+        return;
+    }
+#endif
+    do_tb_flush(env1);
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
@@ -767,8 +1187,9 @@ static void tb_invalidate_check(target_ulong address)
     TranslationBlock *tb;
     int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= tb_hash->mask; i++) {
+        tb = tb_hash->entries[i];
+        if (tb != NULL && tb != TB_HASH_DELETED) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -785,8 +1206,9 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= tb_hash->mask; i++) {
+        tb = tb_hash->entries[i];
+        if (tb != NULL && tb != TB_HASH_DELETED) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -799,21 +1221,6 @@ static void tb_page_check(void)
 
 #endif
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb,
-                             int next_offset)
-{
-    TranslationBlock *tb1;
-    for(;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -871,14 +1278,10 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *env;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
-              offsetof(TranslationBlock, phys_hash_next));
+    /* remove the TB from the hash table */
+    tb_hash_remove(tb);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -893,6 +1296,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 
     tb_invalidated_flag = 1;
+    tb->invalid = true;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -977,9 +1381,11 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
-TranslationBlock *tb_gen_code(CPUState *env,
-                              target_ulong pc, target_ulong cs_base,
-                              int flags, int cflags)
+static TranslationBlock *tb_gen_code_trace(CPUState *env, target_ulong pc,
+                                           target_ulong cs_base, int flags,
+                                           int cflags,
+                                           const target_ulong *trace,
+                                           int trace_len)
 {
     TranslationBlock *tb;
     uint8_t *tc_ptr;
@@ -990,6 +1396,15 @@ TranslationBlock *tb_gen_code(CPUState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
+#if !defined(CONFIG_USER_ONLY)
+        if (parallel_cpus) {
+            /* the flush is deferred until all vCPUs are out of
+               cpu_exec(); retry the translation afterwards */
+            tb_flush(env);
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
         /* flush must be done */
         tb_flush(env);
         /* cannot fail at this point */
@@ -997,12 +1412,35 @@ TranslationBlock *tb_gen_code(CPUState *env,
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
+    tb_translate_count++;
+    if (test_and_clear_bit(tb_phys_hash_func(phys_pc), tb_evicted_map)) {
+        code_gen_region->nb_retranslated++;
+        tb_retranslate_count++;
+    }
     tc_ptr = code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    if (trace_len) {
+        tb->trace = g_malloc(trace_len * sizeof(target_ulong));
+        memcpy(tb->trace, trace, trace_len * sizeof(target_ulong));
+        tb->trace_len = trace_len;
+        tb->hot_count = 0;
+        cpu_gen_code(env, tb, &code_gen_size);
+        if (tb->trace_len < trace_len) {
+            /* the frontend gave up the end of the trace */
+            cpu_gen_code(env, tb, &code_gen_size);
+        }
+#if defined(CONFIG_LINUX_USER)
+    } else if (!tb_cache_lookup(env, tb, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_add(env, tb, code_gen_size);
+#else
+    } else {
+        cpu_gen_code(env, tb, &code_gen_size);
+#endif
+    }
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1015,6 +1453,54 @@ TranslationBlock *tb_gen_code(CPUState *env,
     return tb;
 }
 
+TranslationBlock *tb_gen_code(CPUState *env,
+                              target_ulong pc, target_ulong cs_base,
+                              int flags, int cflags)
+{
+    return tb_gen_code_trace(env, pc, cs_base, flags, cflags, NULL, 0);
+}
+
+/* Replace the hot TB 'head' with a trace that also contains the blocks
+   at trace[0..trace_len-1], in this order.  The frontend follows direct
+   branches to these blocks and turns the other direction of each one
+   into a side exit; it stops at the first block that it cannot follow,
+   so the recorded path is only a hint.  */
+void tb_gen_trace(CPUState *env, TranslationBlock *head,
+                  const target_ulong *trace, int trace_len)
+{
+    tb_lock_acquire();
+    if (!head->invalid) {
+        tb_phys_invalidate(head, -1);
+        tb_gen_code_trace(env, head->pc, head->cs_base, head->flags,
+                          head->cflags, trace, trace_len);
+    }
+    tb_lock_release();
+}
+
+/* Undo the direct jumps out of 'tb', so that execution gets back to
+   cpu_exec() once it leaves the TB.  Called with tb_lock held. */
+void tb_unchain(TranslationBlock *tb)
+{
+    int n;
+
+    for (n = 0; n < 2; n++) {
+        if (tb->jmp_next[n]) {
+            tb_jmp_remove(tb, n);
+            tb_reset_jump(tb, n);
+        }
+    }
+}
+
+int tb_traces_enable(void)
+{
+#if defined(TARGET_HAS_TRACES)
+    tb_trace_threshold = TB_TRACE_THRESHOLD;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
@@ -1040,6 +1526,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_lock_acquire();
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1120,9 +1607,11 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
            itself */
         env->current_tb = NULL;
         tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
+        /* cpu_exec() drops tb_lock */
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_lock_release();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1141,6 +1630,7 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_lock_acquire();
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1150,6 +1640,7 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_lock_release();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1276,17 +1767,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1305,41 +1788,66 @@ void tb_link_page(TranslationBlock *tb,
     if (tb->tb_next_offset[1] != 0xffff)
         tb_reset_jump(tb, 1);
 
+    /* add in the hash table last, lookups may find it from now on */
+    tb_hash_insert(tb);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
     mmap_unlock();
 }
 
-/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
-   tb[1].tc_ptr. Return NULL if not found */
-TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+/* Same as tb_find_pc() without tb_lock; also used from a signal
+   handler, so it must cope with a concurrent tb_flush.  */
+static TranslationBlock *tb_find_pc_nolock(unsigned long tc_ptr)
 {
-    int m_min, m_max, m;
-    unsigned long v;
+    int m_min, m_max, m, n;
+    unsigned long v, i;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+    uint8_t *code_end;
 
-    if (nb_tbs <= 0)
+    if (tc_ptr < (unsigned long)code_gen_buffer)
         return NULL;
-    if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+    i = (tc_ptr - (unsigned long)code_gen_buffer) >> code_gen_region_bits;
+    if (i >= code_gen_nb_regions)
+        return NULL;
+    r = &code_gen_regions[i];
+    n = r->nb_tbs;
+    code_end = r == code_gen_region ? code_gen_ptr : r->code_end;
+    if (n <= 0 || tc_ptr >= (unsigned long)code_end)
         return NULL;
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = n - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
-            return tb;
+            break;
         else if (tc_ptr < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    if (m_min > m_max) {
+        tb = &r->tbs[m_max];
+    }
+    return tb;
+}
+
+/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
+   tb[1].tc_ptr. Return NULL if not found */
+TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+{
+    TranslationBlock *tb;
+
+    tb_lock_acquire();
+    tb = tb_find_pc_nolock(tc_ptr);
+    tb_lock_release();
+    return tb;
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1635,6 +2143,14 @@ static void cpu_unlink_tb(CPUState *env)
     TranslationBlock *tb;
     static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCKED;
 
+    if (parallel_cpus) {
+        /* Every TB checks icount_decr on entry in this mode (see
+           gen_icount_start), so the jump lists can be left alone.  This
+           may be called from another thread.  */
+        env->icount_decr.u16.high = 0xffff;
+        return;
+    }
+
     spin_lock(&interrupt_lock);
     tb = env->current_tb;
     /* if the cpu is currently executing code, we must unlink it and
@@ -1985,11 +2501,70 @@ static CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+static inline int tlb_size(CPUState *env)
+{
+    return (env->tlb_mask >> CPU_TLB_ENTRY_BITS) + 1;
+}
+
+/* Called when the TLB is flushed: double its size if many fills since
+   the previous flush had to replace a valid entry, halve it if few of
+   its entries were filled.  */
+static void tlb_resize(CPUState *env)
+{
+    int size = tlb_size(env);
+    int new_size = size;
+
+    if (env->tlb_nb_evictions >= size / 4 && size < CPU_TLB_MAX_SIZE) {
+        new_size = size * 2;
+    } else if (env->tlb_nb_fills < size / 8 && size > CPU_TLB_SIZE) {
+        new_size = size / 2;
+    }
+    if (new_size != size) {
+        env->tlb_mask = (unsigned long)(new_size - 1) << CPU_TLB_ENTRY_BITS;
+        env->tlb_resize_count++;
+    }
+    env->tlb_nb_fills = 0;
+    env->tlb_nb_evictions = 0;
+}
+
+static void tlb_flush_local(CPUState *env);
+
+static void tlb_flush_work(void *data)
+{
+    tlb_flush_local(data);
+}
+
 /* NOTE: if flush_global is true, also flush global entries (not
    implemented yet) */
 void tlb_flush(CPUState *env, int flush_global)
 {
-    int i;
+    if (parallel_cpus && env->created && !qemu_cpu_is_self(env)) {
+        bool locked = qemu_mutex_iothread_locked();
+
+        if (!locked) {
+            qemu_mutex_lock_iothread();
+        }
+        if (env->running) {
+            /* The vCPU may be using its TLB right now; have it do the
+               flush itself, and wait so that the caller never goes on
+               while the old mappings are still in use.  */
+            run_on_cpu(env, tlb_flush_work, env);
+        } else {
+            /* The vCPU needs the global mutex to enter cpu_exec() */
+            tlb_flush_local(env);
+        }
+        if (!locked) {
+            qemu_mutex_unlock_iothread();
+        }
+        return;
+    }
+
+    tlb_flush_local(env);
+}
+
+static void tlb_flush_local(CPUState *env)
+{
+    int i, mmu_idx, size;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -1998,11 +2573,20 @@ void tlb_flush(CPUState *env, int flush_global)
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for(i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
+    /* Mode switches flush repeatedly without touching memory in
+       between; clearing a large TLB each time is not free.  */
+    if (!env->tlb_empty || env->tlb_nb_fills != 0) {
+        tlb_resize(env);
+        size = tlb_size(env);
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+            for (i = 0; i < size; i++) {
+                env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+            }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+            }
         }
+        env->tlb_empty = 1;
     }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -2012,21 +2596,33 @@ void tlb_flush(CPUState *env, int flush_global)
     tlb_flush_count++;
 }
 
+static inline int tlb_entry_is_page(CPUTLBEntry *tlb_entry,
+                                    target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+static inline int tlb_entry_is_empty(CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == -1 && tlb_entry->addr_write == -1 &&
+           tlb_entry->addr_code == -1;
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_is_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
 
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
@@ -2047,9 +2643,13 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
     env->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    i = tlb_index(env, addr);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
 
     tlb_flush_jmp_cache(env, addr);
 }
@@ -2110,11 +2710,15 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        int mmu_idx;
+        int mmu_idx, size = tlb_size(env);
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            for(i = 0; i < CPU_TLB_SIZE; i++)
+            for(i = 0; i < size; i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -2190,10 +2794,13 @@ static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry)
 void cpu_tlb_update_dirty(CPUState *env)
 {
     int i;
-    int mmu_idx;
+    int mmu_idx, size = tlb_size(env);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        for(i = 0; i < CPU_TLB_SIZE; i++)
+        for(i = 0; i < size; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
+        }
     }
 }
 
@@ -2207,13 +2814,17 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    i = tlb_index(env, vaddr);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -2240,8 +2851,10 @@ static void tlb_add_large_page(CPUState *env, target_ulong vaddr,
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
-   is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
-   supplied size is only used by tlb_flush_page.  */
+   is permitted in tlb_table; the victim TLB may still hold an older one
+   with other access rights, but the same translation since
+   tlb_flush_page removes both. Only a single TARGET_PAGE_SIZE region is
+   mapped, the supplied size is only used by tlb_flush_page.  */
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size)
@@ -2249,6 +2862,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     PhysPageDesc *p;
     unsigned long pd;
     unsigned int index;
+    int k;
     target_ulong address;
     target_ulong code_address;
     unsigned long addend;
@@ -2314,9 +2928,18 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         }
     }
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    index = tlb_index(env, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+    env->tlb_nb_fills++;
+    env->tlb_fill_count++;
+    if (!tlb_entry_is_empty(te) && !tlb_entry_is_page(te, vaddr)) {
+        /* keep the entry that is replaced in the victim TLB */
+        k = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][k] = *te;
+        env->iotlb_v[mmu_idx][k] = env->iotlb[mmu_idx][index];
+        env->tlb_nb_evictions++;
+    }
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -2345,6 +2968,36 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 }
 
+/* Called when page misses in tlb_table[mmu_idx]: if the victim TLB has
+   an entry for it, swap that entry with the one at index and return
+   true.  elt_ofs is the offset of the address field for the access
+   (addr_read, addr_write or addr_code).  */
+bool tlb_victim_hit(CPUState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page)
+{
+    CPUTLBEntry *te, *vte, tmp;
+    target_phys_addr_t iotlb;
+    target_ulong cmp;
+    int k;
+
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        vte = &env->tlb_v_table[mmu_idx][k];
+        cmp = *(target_ulong *)((uint8_t *)vte + elt_ofs);
+        if (page == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            te = &env->tlb_table[mmu_idx][index];
+            tmp = *te;
+            *te = *vte;
+            *vte = tmp;
+            iotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][k];
+            env->iotlb_v[mmu_idx][k] = iotlb;
+            env->tlb_victim_hit_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
 #else
 
 void tlb_flush(CPUState *env, int flush_global)
@@ -2558,7 +3211,6 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
                 if (!page_unprotect(addr, 0, NULL))
                     return -1;
             }
-            return 0;
         }
     }
     return 0;
@@ -3421,6 +4073,8 @@ static void check_watchpoint(int offset, int len_mask, int flags)
                               "pc=%p", (void *)env->mem_io_pc);
                 }
                 cpu_restore_state(tb, env, env->mem_io_pc);
+                /* cpu_exec() drops tb_lock */
+                tb_lock_acquire();
                 tb_phys_invalidate(tb, -1);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     env->exception_index = EXCP_DEBUG;
@@ -3884,6 +4538,44 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 }
 
 #else
+/* With multi-threaded TCG, physical memory accesses may come from a vCPU
+   thread that does not hold the global mutex; device callbacks expect it. */
+bool io_mem_lock(void)
+{
+    if (parallel_cpus && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+void io_mem_unlock(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static uint32_t cpu_io_mem_read(int io_index, int size_idx,
+                                target_phys_addr_t addr)
+{
+    bool locked = io_mem_lock();
+    uint32_t val;
+
+    val = io_mem_read[io_index][size_idx](io_mem_opaque[io_index], addr);
+    io_mem_unlock(locked);
+    return val;
+}
+
+static void cpu_io_mem_write(int io_index, int size_idx,
+                             target_phys_addr_t addr, uint32_t val)
+{
+    bool locked = io_mem_lock();
+
+    io_mem_write[io_index][size_idx](io_mem_opaque[io_index], addr, val);
+    io_mem_unlock(locked);
+}
+
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write)
 {
@@ -3917,17 +4609,17 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit write access */
                     val = ldl_p(buf);
-                    io_mem_write[io_index][2](io_mem_opaque[io_index], addr1, val);
+                    cpu_io_mem_write(io_index, 2, addr1, val);
                     l = 4;
                 } else if (l >= 2 && ((addr1 & 1) == 0)) {
                     /* 16 bit write access */
                     val = lduw_p(buf);
-                    io_mem_write[io_index][1](io_mem_opaque[io_index], addr1, val);
+                    cpu_io_mem_write(io_index, 1, addr1, val);
                     l = 2;
                 } else {
                     /* 8 bit write access */
                     val = ldub_p(buf);
-                    io_mem_write[io_index][0](io_mem_opaque[io_index], addr1, val);
+                    cpu_io_mem_write(io_index, 0, addr1, val);
                     l = 1;
                 }
             } else {
@@ -3955,17 +4647,17 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     addr1 = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
                 if (l >= 4 && ((addr1 & 3) == 0)) {
                     /* 32 bit read access */
-                    val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr1);
+                    val = cpu_io_mem_read(io_index, 2, addr1);
                     stl_p(buf, val);
                     l = 4;
                 } else if (l >= 2 && ((addr1 & 1) == 0)) {
                     /* 16 bit read access */
-                    val = io_mem_read[io_index][1](io_mem_opaque[io_index], addr1);
+                    val = cpu_io_mem_read(io_index, 1, addr1);
                     stw_p(buf, val);
                     l = 2;
                 } else {
                     /* 8 bit read access */
-                    val = io_mem_read[io_index][0](io_mem_opaque[io_index], addr1);
+                    val = cpu_io_mem_read(io_index, 0, addr1);
                     stb_p(buf, val);
                     l = 1;
                 }
@@ -4125,6 +4817,8 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
     }
     rlen = todo;
     ret = qemu_ram_ptr_length(raddr, &rlen);
+    /* the caller may hand the buffer to the kernel */
+    ram_postcopy_prefault(ret, rlen);
     *plen = rlen;
     return ret;
 }
@@ -4191,7 +4885,7 @@ static inline uint32_t ldl_phys_internal(target_phys_addr_t addr,
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
-        val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
+        val = cpu_io_mem_read(io_index, 2, addr);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
             val = bswap32(val);
@@ -4262,11 +4956,11 @@ static inline uint64_t ldq_phys_internal(target_phys_addr_t addr,
         /* XXX This is broken when device endian != cpu endian.
                Fix and add "endian" variable check */
 #ifdef TARGET_WORDS_BIGENDIAN
-        val = (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr) << 32;
-        val |= io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4);
+        val = (uint64_t)cpu_io_mem_read(io_index, 2, addr) << 32;
+        val |= cpu_io_mem_read(io_index, 2, addr + 4);
 #else
-        val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
-        val |= (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4) << 32;
+        val = cpu_io_mem_read(io_index, 2, addr);
+        val |= (uint64_t)cpu_io_mem_read(io_index, 2, addr + 4) << 32;
 #endif
     } else {
         /* RAM case */
@@ -4333,7 +5027,7 @@ static inline uint32_t lduw_phys_internal(target_phys_addr_t addr,
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
-        val = io_mem_read[io_index][1](io_mem_opaque[io_index], addr);
+        val = cpu_io_mem_read(io_index, 1, addr);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
             val = bswap16(val);
@@ -4398,7 +5092,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
-        io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
+        cpu_io_mem_write(io_index, 2, addr, val);
     } else {
         unsigned long addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
         ptr = qemu_get_ram_ptr(addr1);
@@ -4435,11 +5129,11 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
         if (p)
             addr = (addr & ~TARGET_PAGE_MASK) + p->region_offset;
 #ifdef TARGET_WORDS_BIGENDIAN
-        io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val >> 32);
-        io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val);
+        cpu_io_mem_write(io_index, 2, addr, val >> 32);
+        cpu_io_mem_write(io_index, 2, addr + 4, val);
 #else
-        io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
-        io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val >> 32);
+        cpu_io_mem_write(io_index, 2, addr, val);
+        cpu_io_mem_write(io_index, 2, addr + 4, val >> 32);
 #endif
     } else {
         ptr = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
@@ -4477,7 +5171,7 @@ static inline void stl_phys_internal(target_phys_addr_t addr, uint32_t val,
             val = bswap32(val);
         }
 #endif
-        io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
+        cpu_io_mem_write(io_index, 2, addr, val);
     } else {
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -4555,7 +5249,7 @@ static inline void stw_phys_internal(target_phys_addr_t addr, uint32_t val,
             val = bswap16(val);
         }
 #endif
-        io_mem_write[io_index][1](io_mem_opaque[io_index], addr, val);
+        cpu_io_mem_write(io_index, 1, addr, val);
     } else {
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -4693,6 +5387,8 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
     pc = tb->pc;
     cs_base = tb->cs_base;
     flags = tb->flags;
+    /* cpu_exec() drops tb_lock */
+    tb_lock_acquire();
     tb_phys_invalidate(tb, -1);
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
@@ -4709,41 +5405,59 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
-    int direct_jmp_count, direct_jmp2_count, cross_page;
+    int i, j, target_code_size, max_target_code_size;
+    int direct_jmp_count, direct_jmp2_count, cross_page, nb_tbs;
+    unsigned long code_size;
     TranslationBlock *tb;
+    CodeGenRegion *r;
+    CPUState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    nb_tbs = 0;
+    code_size = 0;
+    for (j = 0; j < code_gen_nb_regions; j++) {
+        r = &code_gen_regions[j];
+        nb_tbs += r->nb_tbs;
+        if (r == code_gen_region) {
+            code_size += code_gen_ptr - code_gen_region_start(r);
+        } else if (r->nb_tbs) {
+            code_size += r->code_end - code_gen_region_start(r);
+        }
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
-    cpu_fprintf(f, "TB count            %d/%d\n", 
-                nb_tbs, code_gen_max_blocks);
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_size, (unsigned long)code_gen_nb_regions <<
+                code_gen_region_bits);
+    cpu_fprintf(f, "code regions        %d/%d of %lu KB\n",
+                code_gen_nb_regions, code_gen_max_regions,
+                (1UL << code_gen_region_bits) >> 10);
+    cpu_fprintf(f, "TB count            %d/%d\n",
+                nb_tbs, code_gen_nb_regions * code_gen_region_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4754,11 +5468,163 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "region evict count  %d (%d TBs)\n",
+                code_gen_evict_count, tb_evict_count);
+    cpu_fprintf(f, "TB retranslated     %d/%d (%d%%)\n",
+                tb_retranslate_count, tb_translate_count,
+                tb_translate_count ?
+                (int)((int64_t)tb_retranslate_count * 100 /
+                      tb_translate_count) : 0);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB hash table       %u/%u (%u deleted, resized %d times)\n",
+                tb_hash->nb_tbs, tb_hash->mask + 1,
+                tb_hash->nb_used - tb_hash->nb_tbs, tb_hash_resize_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "CPU #%d TLB size %d (resized %u times), "
+                    "fills %" PRIu64 ", victim hits %" PRIu64 "\n",
+                    env->cpu_index, tlb_size(env), env->tlb_resize_count,
+                    env->tlb_fill_count, env->tlb_victim_hit_count);
+        cpu_fprintf(f, "CPU #%d TB lookups %" PRIu64 ", jmp cache misses %"
+                    PRIu64 " (%d%%), avg hash probes %0.1f\n",
+                    env->cpu_index, env->tb_lookup_count,
+                    env->tb_jmp_cache_miss_count,
+                    env->tb_lookup_count ?
+                    (int)(env->tb_jmp_cache_miss_count * 100 /
+                          env->tb_lookup_count) : 0,
+                    env->tb_jmp_cache_miss_count ?
+                    (double)env->tb_hash_probe_count /
+                    env->tb_jmp_cache_miss_count : 0);
+    }
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* SIGPROF samples that did not hit translated code */
+static uint64_t tb_profile_other_samples;
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#define TB_PROFILE_SAMPLING
+#define TB_PROFILE_SAMPLE_USEC 1000
+
+static void tb_profile_sigprof(int sig, siginfo_t *info, void *puc)
+{
+    ucontext_t *uc = puc;
+    TranslationBlock *tb;
+    unsigned long pc;
+
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+#else
+    pc = uc->uc_mcontext.gregs[REG_EIP];
+#endif
+    tb = tb_find_pc_nolock(pc);
+    if (tb) {
+        tb->exec_count++;
+    } else {
+        tb_profile_other_samples++;
+    }
+}
+
+static void tb_profile_set_timer(int usec)
+{
+    struct itimerval itv;
+
+    itv.it_interval.tv_sec = 0;
+    itv.it_interval.tv_usec = usec;
+    itv.it_value = itv.it_interval;
+    setitimer(ITIMER_PROF, &itv, NULL);
+}
+#endif
+
+int tb_profile_get_mode(void)
+{
+    return tb_profile_mode;
+}
+
+/* Changing the mode discards the translated code, and with it the
+   counters.  Called with the global mutex held.  */
+int tb_profile_set_mode(int mode)
+{
+#ifdef TB_PROFILE_SAMPLING
+    struct sigaction act;
+
+    if (tb_profile_mode == TB_PROFILE_SAMPLE) {
+        tb_profile_set_timer(0);
+    }
+#else
+    if (mode == TB_PROFILE_SAMPLE) {
+        return -ENOTSUP;
+    }
+#endif
+
+    tb_profile_mode = mode;
+    tb_profile_other_samples = 0;
+    tb_flush(first_cpu);
+
+#ifdef TB_PROFILE_SAMPLING
+    if (mode == TB_PROFILE_SAMPLE) {
+        memset(&act, 0, sizeof(act));
+        act.sa_sigaction = tb_profile_sigprof;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigaction(SIGPROF, &act, NULL);
+        tb_profile_set_timer(TB_PROFILE_SAMPLE_USEC);
+    }
+#endif
+    return 0;
+}
+
+/* Fill ENTRIES with the MAX_ENTRIES TBs with the highest count, in
+   decreasing order, and return their number.  *TOTAL is set to the sum
+   of all counts and *OTHER to the samples outside of translated code.  */
+int tb_profile_collect(TBProfileEntry *entries, int max_entries,
+                       uint64_t *total, uint64_t *other)
+{
+    TBProfileEntry e;
+    TranslationBlock *tb;
+    CodeGenRegion *r;
+    uint8_t *code_end;
+    int i, j, k, n;
+
+    n = 0;
+    *total = 0;
+    *other = tb_profile_other_samples;
+    tb_lock_acquire();
+    for (k = 0; k < code_gen_nb_regions; k++) {
+        r = &code_gen_regions[k];
+        code_end = r == code_gen_region ? code_gen_ptr : r->code_end;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            if (tb->exec_count == 0) {
+                continue;
+            }
+            *total += tb->exec_count;
+            if (n == max_entries && tb->exec_count <= entries[n - 1].count) {
+                continue;
+            }
+
+            e.pc = tb->pc;
+            e.count = tb->exec_count;
+            e.guest_size = tb->size;
+            e.host_size = (i + 1 < r->nb_tbs ? r->tbs[i + 1].tc_ptr
+                           : code_end) - tb->tc_ptr;
+            e.exits = (tb->tb_next_offset[0] != 0xffff) +
+                      (tb->tb_next_offset[1] != 0xffff);
+            e.chained_exits = (tb->jmp_next[0] != NULL) +
+                              (tb->jmp_next[1] != NULL);
+
+            /* insertion into the sorted array */
+            j = n < max_entries ? n++ : n - 1;
+            while (j > 0 && entries[j - 1].count < e.count) {
+                entries[j] = entries[j - 1];
+                j--;
+            }
+            entries[j] = e;
+        }
+    }
+    tb_lock_release();
+    return n;
+}
+
 #define MMUSUFFIX _cmmu
 #undef GETPC
 #define GETPC() NULL
@@ -9,18 +9,26 @@ static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
-    if (!use_icount)
+    /* With multi-threaded TCG, other threads cannot safely unchain the
+       TBs a vCPU is running, so every TB checks for an exit request (the
+       high half of icount_decr, see cpu_unlink_tb) on entry instead.  */
+    if (!use_icount && !parallel_cpus)
         return;
 
     icount_label = gen_new_label();
     count = tcg_temp_local_new_i32();
     tcg_gen_ld_i32(count, cpu_env, offsetof(CPUState, icount_decr.u32));
-    /* This is a horrid hack to allow fixing up the value later.  */
-    icount_arg = gen_opparam_ptr + 1;
-    tcg_gen_subi_i32(count, count, 0xdeadbeef);
+    if (use_icount) {
+        /* This is a horrid hack to allow fixing up the value later.  */
+        icount_arg = gen_opparam_ptr + 1;
+        tcg_gen_subi_i32(count, count, 0xdeadbeef);
+    }
 
     tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
-    tcg_gen_st16_i32(count, cpu_env, offsetof(CPUState, icount_decr.u16.low));
+    if (use_icount) {
+        tcg_gen_st16_i32(count, cpu_env,
+                         offsetof(CPUState, icount_decr.u16.low));
+    }
     tcg_temp_free_i32(count);
 }
 
@@ -28,6 +36,8 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
     if (use_icount) {
         *icount_arg = num_insns;
+    }
+    if (use_icount || parallel_cpus) {
         gen_set_label(icount_label);
         tcg_gen_exit_tb((tcg_target_long)tb + 2);
     }
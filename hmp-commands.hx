@@ -70,6 +70,71 @@ but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@findex block_set_io_throttle
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}.
+A value of 0 removes the corresponding limit.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy data from the backing file chain into @var{device} while the guest is
+running, then drop the backing file.  @var{speed} optionally limits the
+streaming rate in bytes per second.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Set maximum speed for a background block operation.  A value of 0 disables
+rate limiting.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active block streaming operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop an active block streaming operation.  The job stops at the next
+iteration and emits a BLOCK_JOB_CANCELLED event.
+ETEXI
+
 
     {
         .name       = "eject",
@@ -283,6 +348,25 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "mode:s",
+        .params     = "off|count|sample",
+        .help       = "profile the execution of translated code",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_tb_profile,
+    },
+
+STEXI
+@item tb_profile off|count|sample
+@findex tb_profile
+Profile the translation blocks executed by TCG, see @code{info tb_profile}.
+With @code{count}, the generated code counts the executions of each block.
+With @code{sample}, the host code is sampled 1000 times per second of CPU
+time, which is much cheaper; it is only available on x86 Linux hosts.
+Changing the mode discards the translated code and resets the counters.
 ETEXI
 
     {
@@ -816,6 +900,74 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations. "
+	"The size is rounded down to the nearest power of 2",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set cache size to @var{value} (in bytes) for xbzrle migrations.  A high
+cache miss ratio in @code{info migrate} means the cache is too small.
+ETEXI
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "Enable/Disable the usage of a capability for migration",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable/Disable the usage of a capability @var{capability} for migration.
+Capabilities must be set before the migration starts:
+@table @option
+@item xbzrle
+send pages that were already sent once as a delta against the previous copy
+@item compress
+compress pages with zlib in several threads, see @code{migrate_set_parameter}
+@item postcopy
+start the guest on the destination before all of its memory has been sent,
+and send the rest on demand; needs a tcp or unix migration and TCG on a
+Linux destination
+@end table
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration to @var{value}:
+@table @option
+@item compress-level
+zlib compression level, from 0 to 9 (default 1)
+@item compress-threads
+number of compression threads on the source (default 8)
+@item decompress-threads
+number of decompression threads on the destination (default 2)
+@item postcopy-iterations
+passes over guest memory before switching to post-copy (default 5)
+@end table
 ETEXI
 
     {
@@ -1290,6 +1442,8 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-jobs
+show progress of ongoing block device operations
 @item info registers
 show the cpu registers
 @item info cpus
@@ -1307,7 +1461,10 @@ show virtual to physical memory mappings (i386, SH4, SPARC, and PPC only)
 @item info mem
 show the active virtual memory mappings (i386 only)
 @item info jit
-show dynamic compiler info
+show dynamic compiler info, including how often translated code was
+discarded and translated again
+@item info tb_profile
+show the most executed translation blocks
 @item info numa
 show NUMA information
 @item info kvm
@@ -1340,6 +1497,12 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info migrate_capabilities
+show current migration capabilities
+@item info migrate_cache_size
+show current migration XBZRLE cache size
+@item info migrate_parameters
+show current migration parameters
 @item info balloon
 show balloon information
 @item info qtree
@@ -16,83 +16,52 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu-thread.h"
 #include "qemu-coroutine.h"
+#include "thread-pool.h"
 #include "virtio-9p-coth.h"
 
-/* v9fs glib thread pool */
-static V9fsThPool v9fs_pool;
+/*
+ * Worker limits for the v9fs pool.  Requests may block on slow host file
+ * systems, so allow plenty of workers; idle ones exit after a while.
+ */
+#define V9FS_MIN_THREADS 0
+#define V9FS_MAX_THREADS 64
 
-void co_run_in_worker_bh(void *opaque)
+static ThreadPool *v9fs_pool;
+
+/* Runs in a worker thread until the coroutine yields again */
+static int v9fs_thread_routine(void *opaque)
 {
     Coroutine *co = opaque;
-    g_thread_pool_push(v9fs_pool.pool, co, NULL);
+
+    qemu_coroutine_enter(co, NULL);
+    return 0;
 }
 
-static void v9fs_qemu_process_req_done(void *arg)
+/* Runs in the QEMU thread once the worker is done */
+static void v9fs_qemu_process_req_done(void *opaque, int ret)
 {
-    char byte;
-    ssize_t len;
-    Coroutine *co;
-
-    do {
-        len = read(v9fs_pool.rfd, &byte, sizeof(byte));
-    } while (len == -1 &&  errno == EINTR);
+    Coroutine *co = opaque;
 
-    while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
-        qemu_coroutine_enter(co, NULL);
-    }
+    qemu_coroutine_enter(co, NULL);
 }
 
-static void v9fs_thread_routine(gpointer data, gpointer user_data)
+void co_run_in_worker_bh(void *opaque)
 {
-    ssize_t len;
-    char byte = 0;
-    Coroutine *co = data;
-
-    qemu_coroutine_enter(co, NULL);
+    Coroutine *co = opaque;
 
-    g_async_queue_push(v9fs_pool.completed, co);
-    do {
-        len = write(v9fs_pool.wfd, &byte, sizeof(byte));
-    } while (len == -1 && errno == EINTR);
+    thread_pool_submit_aio(v9fs_pool, NULL, v9fs_thread_routine, co, NULL,
+                           v9fs_qemu_process_req_done, co);
 }
 
 int v9fs_init_worker_threads(void)
 {
-    int ret = 0;
-    int notifier_fds[2];
-    V9fsThPool *p = &v9fs_pool;
-    sigset_t set, oldset;
-
-    sigfillset(&set);
-    /* Leave signal handling to the iothread.  */
-    pthread_sigmask(SIG_SETMASK, &set, &oldset);
-
-    if (qemu_pipe(notifier_fds) == -1) {
-        ret = -1;
-        goto err_out;
-    }
-    p->pool = g_thread_pool_new(v9fs_thread_routine, p, -1, FALSE, NULL);
-    if (!p->pool) {
-        ret = -1;
-        goto err_out;
-    }
-    p->completed = g_async_queue_new();
-    if (!p->completed) {
-        /*
-         * We are going to terminate.
-         * So don't worry about cleanup
-         */
-        ret = -1;
-        goto err_out;
+    if (v9fs_pool) {
+        return 0;
     }
-    p->rfd = notifier_fds[0];
-    p->wfd = notifier_fds[1];
 
-    fcntl(p->rfd, F_SETFL, O_NONBLOCK);
-    fcntl(p->wfd, F_SETFL, O_NONBLOCK);
-
-    qemu_set_fd_handler(p->rfd, v9fs_qemu_process_req_done, NULL, NULL);
-err_out:
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
-    return ret;
+    v9fs_pool = thread_pool_new("v9fs", V9FS_MIN_THREADS, V9FS_MAX_THREADS);
+    if (!v9fs_pool) {
+        return -1;
+    }
+    return 0;
 }
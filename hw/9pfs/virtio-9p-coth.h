@@ -20,13 +20,6 @@
 #include "virtio-9p.h"
 #include <glib.h>
 
-typedef struct V9fsThPool {
-    int rfd;
-    int wfd;
-    GThreadPool *pool;
-    GAsyncQueue *completed;
-} V9fsThPool;
-
 /*
  * we want to use bottom half because we want to make sure the below
  * sequence of events.
@@ -45,7 +38,7 @@ typedef struct V9fsThPool {
         qemu_bh_schedule(co_bh);                                        \
         /*                                                              \
          * yeild in qemu thread and re-enter back                       \
-         * in glib worker thread                                        \
+         * in a worker thread                                           \
          */                                                             \
         qemu_coroutine_yield();                                         \
         qemu_bh_delete(co_bh);                                          \
@@ -1302,6 +1302,10 @@ static void cirrus_vga_write_sr(CirrusVGAState * s, uint32_t val)
 	s->vga.sr[0x11] = val;
 	s->hw_cursor_y = (val << 3) | (s->vga.sr_index >> 5);
 	break;
+    case 0x12:			// Graphics Cursor Attribute
+	s->vga.sr[0x12] = val;
+	s->vga.force_shadow = !!(val & CIRRUS_CURSOR_SHOW);
+	break;
     case 0x07:			// Extended Sequencer Mode
     cirrus_update_memory_access(s);
     case 0x08:			// EEPROM Control
@@ -1312,7 +1316,6 @@ static void cirrus_vga_write_sr(CirrusVGAState * s, uint32_t val)
     case 0x0d:			// VCLK 2
     case 0x0e:			// VCLK 3
     case 0x0f:			// DRAM Control
-    case 0x12:			// Graphics Cursor Attribute
     case 0x13:			// Graphics Cursor Pattern Address
     case 0x14:			// Scratch Register 2
     case 0x15:			// Scratch Register 3
@@ -2696,6 +2699,7 @@ static int cirrus_post_load(void *opaque, int version_id)
     s->vga.gr[0x01] = s->cirrus_shadow_gr1 & 0x0f;
 
     cirrus_update_memory_access(s);
+    s->vga.force_shadow = !!(s->vga.sr[0x12] & CIRRUS_CURSOR_SHOW);
     /* force refresh */
     s->vga.graphic_mode = -1;
     cirrus_update_bank_ptr(s, 0);
@@ -0,0 +1,200 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hw/hw.h"
+#include "hostmem.h"
+
+static int hostmem_lookup_cmp(const void *phys_, const void *region_)
+{
+    uint64_t phys = *(const uint64_t *)phys_;
+    const HostMemRegion *region = region_;
+
+    if (phys < region->guest_addr) {
+        return -1;
+    } else if (phys >= region->guest_addr + region->size) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+void *hostmem_lookup(HostMem *hostmem, uint64_t phys_addr, uint64_t len)
+{
+    HostMemRegion *region;
+    void *host_addr = NULL;
+    uint64_t offset;
+
+    qemu_mutex_lock(&hostmem->mutex);
+    region = bsearch(&phys_addr, hostmem->regions, hostmem->num_regions,
+                     sizeof(hostmem->regions[0]), hostmem_lookup_cmp);
+    if (region) {
+        offset = phys_addr - region->guest_addr;
+        if (len <= region->size - offset) {
+            host_addr = (uint8_t *)region->host_addr + offset;
+        }
+    }
+    qemu_mutex_unlock(&hostmem->mutex);
+
+    return host_addr;
+}
+
+static void hostmem_delete_at(HostMem *hostmem, size_t i)
+{
+    memmove(&hostmem->regions[i], &hostmem->regions[i + 1],
+            (hostmem->num_regions - i - 1) * sizeof(hostmem->regions[0]));
+    hostmem->num_regions--;
+}
+
+static void hostmem_insert_at(HostMem *hostmem, size_t i,
+                              const HostMemRegion *region)
+{
+    hostmem->regions = g_realloc(hostmem->regions,
+                                 (hostmem->num_regions + 1) *
+                                 sizeof(hostmem->regions[0]));
+    memmove(&hostmem->regions[i + 1], &hostmem->regions[i],
+            (hostmem->num_regions - i) * sizeof(hostmem->regions[0]));
+    hostmem->regions[i] = *region;
+    hostmem->num_regions++;
+}
+
+/* Drop [start, start + size) from the table, trimming or splitting regions
+ * that only partially overlap it.
+ */
+static void hostmem_remove(HostMem *hostmem, uint64_t start, uint64_t size)
+{
+    uint64_t end = start + size;
+    size_t i = 0;
+
+    while (i < hostmem->num_regions) {
+        HostMemRegion *region = &hostmem->regions[i];
+        uint64_t region_end = region->guest_addr + region->size;
+
+        if (region_end <= start || region->guest_addr >= end) {
+            i++;
+        } else if (region->guest_addr < start && region_end > end) {
+            HostMemRegion tail = {
+                .guest_addr = end,
+                .size = region_end - end,
+                .host_addr = (uint8_t *)region->host_addr +
+                             (end - region->guest_addr),
+            };
+
+            region->size = start - region->guest_addr;
+            hostmem_insert_at(hostmem, i + 1, &tail);
+            return;
+        } else if (region->guest_addr < start) {
+            region->size = start - region->guest_addr;
+            i++;
+        } else if (region_end > end) {
+            region->host_addr = (uint8_t *)region->host_addr +
+                                (end - region->guest_addr);
+            region->size = region_end - end;
+            region->guest_addr = end;
+            i++;
+        } else {
+            hostmem_delete_at(hostmem, i);
+        }
+    }
+}
+
+static bool hostmem_can_merge(const HostMemRegion *a, const HostMemRegion *b)
+{
+    return a->guest_addr + a->size == b->guest_addr &&
+           (uint8_t *)a->host_addr + a->size == b->host_addr;
+}
+
+/* Add a region that does not overlap any existing one, merging it with
+ * its neighbours when they are contiguous in both address spaces so that
+ * buffers spanning several registrations can still be looked up.
+ */
+static void hostmem_add(HostMem *hostmem, const HostMemRegion *region)
+{
+    size_t i;
+
+    for (i = 0; i < hostmem->num_regions; i++) {
+        if (hostmem->regions[i].guest_addr > region->guest_addr) {
+            break;
+        }
+    }
+    hostmem_insert_at(hostmem, i, region);
+
+    if (i + 1 < hostmem->num_regions &&
+        hostmem_can_merge(&hostmem->regions[i], &hostmem->regions[i + 1])) {
+        hostmem->regions[i].size += hostmem->regions[i + 1].size;
+        hostmem_delete_at(hostmem, i + 1);
+    }
+    if (i > 0 &&
+        hostmem_can_merge(&hostmem->regions[i - 1], &hostmem->regions[i])) {
+        hostmem->regions[i - 1].size += hostmem->regions[i].size;
+        hostmem_delete_at(hostmem, i);
+    }
+}
+
+static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
+                                      target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset,
+                                      bool log_dirty)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    qemu_mutex_lock(&hostmem->mutex);
+    hostmem_remove(hostmem, start_addr, size);
+
+    /* Regions that log dirty pages (e.g. framebuffers) are left out because
+     * writes through the host pointer would not be seen by their users.
+     */
+    if (flags == IO_MEM_RAM && !log_dirty) {
+        HostMemRegion region = {
+            .guest_addr = start_addr,
+            .size = size,
+            .host_addr = qemu_get_ram_ptr(phys_offset),
+        };
+        hostmem_add(hostmem, &region);
+    }
+    qemu_mutex_unlock(&hostmem->mutex);
+}
+
+static int hostmem_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                            target_phys_addr_t start_addr,
+                                            target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int hostmem_client_migration_log(CPUPhysMemoryClient *client,
+                                        int enable)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+
+    if (hostmem->migration_log) {
+        hostmem->migration_log(hostmem, enable);
+    }
+    return 0;
+}
+
+void hostmem_init(HostMem *hostmem,
+                  void (*migration_log)(HostMem *hostmem, bool enable))
+{
+    memset(hostmem, 0, sizeof(*hostmem));
+    qemu_mutex_init(&hostmem->mutex);
+    hostmem->migration_log = migration_log;
+
+    hostmem->client.set_memory = hostmem_client_set_memory;
+    hostmem->client.sync_dirty_bitmap = hostmem_client_sync_dirty_bitmap;
+    hostmem->client.migration_log = hostmem_client_migration_log;
+    cpu_register_phys_memory_client(&hostmem->client);
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+    cpu_unregister_phys_memory_client(&hostmem->client);
+    qemu_mutex_destroy(&hostmem->mutex);
+    g_free(hostmem->regions);
+}
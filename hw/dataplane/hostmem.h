@@ -0,0 +1,51 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "cpu-common.h"
+#include "qemu-thread.h"
+
+typedef struct {
+    uint64_t guest_addr;
+    uint64_t size;
+    void *host_addr;
+} HostMemRegion;
+
+typedef struct HostMem HostMem;
+
+struct HostMem {
+    CPUPhysMemoryClient client;
+
+    /* Protects regions and num_regions, which are sorted by guest_addr */
+    QemuMutex mutex;
+    HostMemRegion *regions;
+    size_t num_regions;
+
+    /* Called in the I/O thread when dirty logging for migration is turned
+     * on or off.  Accesses through pointers returned by hostmem_lookup() are
+     * not logged, so users must stop touching guest memory while logging is
+     * enabled.
+     */
+    void (*migration_log)(HostMem *hostmem, bool enable);
+};
+
+void hostmem_init(HostMem *hostmem,
+                  void (*migration_log)(HostMem *hostmem, bool enable));
+void hostmem_finalize(HostMem *hostmem);
+
+/**
+ * Map a guest physical address to a pointer
+ *
+ * Returns NULL if [phys_addr, phys_addr + len) is not contained in guest RAM.
+ * This function is safe to call from any thread.
+ */
+void *hostmem_lookup(HostMem *hostmem, uint64_t phys_addr, uint64_t len);
+
+#endif /* HOSTMEM_H */
@@ -0,0 +1,160 @@
+/*
+ * Linux AIO request queue
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "ioq.h"
+
+/* Set up a queue for up to @max_reqs requests on @fd
+ *
+ * The queue starts out without iocbs, the caller provides them with
+ * ioq_put_iocb().
+ */
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
+{
+    int rc;
+
+    ioq->fd = fd;
+    ioq->max_reqs = max_reqs;
+
+    memset(&ioq->io_ctx, 0, sizeof(ioq->io_ctx));
+    rc = io_setup(max_reqs, &ioq->io_ctx);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = event_notifier_init(&ioq->io_notifier, 0);
+    if (rc != 0) {
+        io_destroy(ioq->io_ctx);
+        return rc;
+    }
+
+    ioq->freelist = g_malloc0(sizeof(ioq->freelist[0]) * max_reqs);
+    ioq->freelist_idx = 0;
+
+    ioq->queue = g_malloc0(sizeof(ioq->queue[0]) * max_reqs);
+    ioq->queue_idx = 0;
+    return 0;
+}
+
+void ioq_cleanup(IOQueue *ioq)
+{
+    g_free(ioq->freelist);
+    g_free(ioq->queue);
+
+    event_notifier_cleanup(&ioq->io_notifier);
+    io_destroy(ioq->io_ctx);
+}
+
+EventNotifier *ioq_get_notifier(IOQueue *ioq)
+{
+    return &ioq->io_notifier;
+}
+
+/* Take a free iocb and queue it for the next ioq_submit() */
+struct iocb *ioq_get_iocb(IOQueue *ioq)
+{
+    struct iocb *iocb;
+
+    /* Underflow cannot happen since ioq is sized for max_reqs */
+    assert(ioq->freelist_idx != 0);
+
+    iocb = ioq->freelist[--ioq->freelist_idx];
+    ioq->queue[ioq->queue_idx++] = iocb;
+    return iocb;
+}
+
+void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb)
+{
+    /* Overflow cannot happen since ioq is sized for max_reqs */
+    assert(ioq->freelist_idx != ioq->max_reqs);
+
+    ioq->freelist[ioq->freelist_idx++] = iocb;
+}
+
+void ioq_prep_rdwr(IOQueue *ioq, struct iocb *iocb, bool read,
+                   struct iovec *iov, unsigned int count, long long offset)
+{
+    if (read) {
+        io_prep_preadv(iocb, ioq->fd, iov, count, offset);
+    } else {
+        io_prep_pwritev(iocb, ioq->fd, iov, count, offset);
+    }
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+}
+
+/* Prepare @iocb to flush @ioq's file to disk like fdatasync() */
+void ioq_prep_fdsync(IOQueue *ioq, struct iocb *iocb)
+{
+    io_prep_fdsync(iocb, ioq->fd);
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+}
+
+/* Submit all queued requests
+ *
+ * Returns the number of requests submitted or a negative errno.  On error
+ * the requests that the kernel did not accept stay queued and can be
+ * failed with ioq_fail_queued().
+ */
+int ioq_submit(IOQueue *ioq)
+{
+    int submitted = 0;
+    int rc;
+
+    while (ioq->queue_idx > 0) {
+        rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
+        if (rc == -EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            return rc < 0 ? rc : -EIO;
+        }
+
+        memmove(&ioq->queue[0], &ioq->queue[rc],
+                (ioq->queue_idx - rc) * sizeof(ioq->queue[0]));
+        ioq->queue_idx -= rc;
+        submitted += rc;
+    }
+    return submitted;
+}
+
+/* Complete all queued requests with @ret without submitting them */
+void ioq_fail_queued(IOQueue *ioq, ssize_t ret,
+                     IOQueueCompletion *completion, void *opaque)
+{
+    while (ioq->queue_idx > 0) {
+        struct iocb *iocb = ioq->queue[--ioq->queue_idx];
+
+        completion(iocb, ret, opaque);
+        ioq_put_iocb(ioq, iocb);
+    }
+}
+
+/* Call @completion for each finished request
+ *
+ * Returns the number of requests completed or a negative errno.
+ */
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque)
+{
+    struct io_event events[ioq->max_reqs];
+    int nevents, i;
+
+    do {
+        nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs, events, NULL);
+    } while (nevents == -EINTR);
+    if (nevents < 0) {
+        return nevents;
+    }
+
+    for (i = 0; i < nevents; i++) {
+        ssize_t ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
+
+        completion(events[i].obj, ret, opaque);
+        ioq_put_iocb(ioq, events[i].obj);
+    }
+    return nevents;
+}
@@ -0,0 +1,650 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The data plane thread waits for the guest to kick the virtqueue through
+ * an ioeventfd, takes requests straight from the vring, submits them to
+ * Linux AIO and completes them, all without taking the global mutex.  Only
+ * raw images opened with cache=none are supported, and I/O errors are
+ * always reported to the guest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "iov.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-thread.h"
+#include "block_int.h"
+#include "kvm.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/event-poll.h"
+#include "hw/dataplane/hostmem.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
+                                     * is VRING_MAX / 2 with traditional and
+                                     * VRING_MAX with indirect descriptors */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    struct virtio_blk_inhdr *inhdr; /* status byte in guest memory */
+    unsigned int head;              /* vring descriptor index */
+    size_t len;                     /* number of data bytes */
+    void *bounce_buf;               /* used if guest buffers are unaligned */
+    struct iovec bounce_iov;
+    struct iovec *read_iov;         /* guest buffers of a bounced read */
+    unsigned int read_iov_cnt;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool unavailable;               /* failed to start, don't try again */
+    bool notify_pending;            /* used ring changed since last notify */
+    bool sync_flush;                /* no Linux AIO fsync, use fdatasync() */
+
+    VirtIODevice *vdev;
+    BlockDriverState *bs;
+    BlockConf *conf;
+    const char *serial;
+    int fd;                         /* image file descriptor */
+    int64_t size;                   /* image size in bytes */
+    unsigned short sector_mask;
+
+    HostMem hostmem;                /* guest memory mapper */
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    EventPoll event_poll;           /* event poller */
+    EventHandler io_handler;        /* Linux AIO completion handler */
+    EventHandler notify_handler;    /* virtqueue notify handler */
+
+    IOQueue ioqueue;                /* Linux AIO queue (should really be per
+                                       dataplane thread) */
+    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
+                                             queue */
+
+    unsigned int num_reqs;
+    QemuThread thread;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    s->notify_pending = false;
+    if (!vring_should_notify(s->vdev, &s->vring)) {
+        return;
+    }
+
+    event_notifier_set(s->guest_notifier);
+}
+
+static void complete_request_status(VirtIOBlockDataPlane *s,
+                                    struct virtio_blk_inhdr *inhdr,
+                                    unsigned int head, size_t len,
+                                    unsigned char status)
+{
+    inhdr->status = status;
+
+    /* Account for the status byte like virtio-blk.c does */
+    vring_push(&s->vring, head, len + sizeof(*inhdr));
+    s->notify_pending = true;
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status;
+
+    if (likely(ret >= 0 && ret == req->len)) {
+        status = VIRTIO_BLK_S_OK;
+    } else {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+
+    if (req->bounce_buf) {
+        if (req->read_iov && status == VIRTIO_BLK_S_OK) {
+            iov_from_buf(req->read_iov, req->read_iov_cnt,
+                         req->bounce_buf, 0, req->len);
+        }
+        qemu_vfree(req->bounce_buf);
+        g_free(req->read_iov);
+        req->bounce_buf = NULL;
+        req->read_iov = NULL;
+    }
+
+    complete_request_status(s, req->inhdr, req->head, req->len, status);
+    s->num_reqs--;
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+            (BDRV_SECTOR_SIZE - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+                        struct iovec *iov, unsigned int iov_cnt,
+                        uint64_t sector, unsigned int head,
+                        struct virtio_blk_inhdr *inhdr)
+{
+    struct iocb *iocb;
+    VirtIOBlockRequest *req;
+    size_t len = iov_size(iov, iov_cnt);
+    long long offset;
+
+    /* Like bdrv_check_request(), don't let the guest access the image file
+     * beyond its end: O_DIRECT writes there would grow it.
+     */
+    if (sector > s->size >> BDRV_SECTOR_BITS) {
+        complete_request_status(s, inhdr, head, len, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+    offset = sector << BDRV_SECTOR_BITS;
+
+    if (offset < 0 || len > s->size - offset ||
+        (sector & s->sector_mask) ||
+        len % s->conf->logical_block_size) {
+        complete_request_status(s, inhdr, head, len, VIRTIO_BLK_S_IOERR);
+        return;
+    }
+
+    iocb = ioq_get_iocb(&s->ioqueue);
+    req = container_of(iocb, VirtIOBlockRequest, iocb);
+    req->head = head;
+    req->inhdr = inhdr;
+    req->len = len;
+    req->bounce_buf = NULL;
+    req->read_iov = NULL;
+
+    /* O_DIRECT needs aligned buffers, fall back to a bounce buffer for the
+     * rare guest that does not provide them.
+     */
+    if (unlikely(!iov_is_aligned(iov, iov_cnt))) {
+        req->bounce_buf = qemu_blockalign(s->bs, len);
+        req->bounce_iov.iov_base = req->bounce_buf;
+        req->bounce_iov.iov_len = len;
+        if (read) {
+            req->read_iov = g_malloc(sizeof(iov[0]) * iov_cnt);
+            memcpy(req->read_iov, iov, sizeof(iov[0]) * iov_cnt);
+            req->read_iov_cnt = iov_cnt;
+        } else {
+            iov_to_buf(iov, iov_cnt, req->bounce_buf, 0, len);
+        }
+        iov = &req->bounce_iov;
+        iov_cnt = 1;
+    }
+
+    ioq_prep_rdwr(&s->ioqueue, iocb, read, iov, iov_cnt, offset);
+}
+
+static void submit_requests(VirtIOBlockDataPlane *s)
+{
+    int ret;
+
+    s->num_reqs += ioq_num_queued(&s->ioqueue);
+    ret = ioq_submit(&s->ioqueue);
+    if (ret < 0) {
+        ioq_fail_queued(&s->ioqueue, ret, complete_request, s);
+    }
+}
+
+/* Kernels without Linux AIO fsync reject the iocb, flush synchronously */
+static void complete_flush_fallback(struct iocb *iocb, ssize_t ret,
+                                    void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    if (ret == -EINVAL) {
+        s->sync_flush = true;
+        ret = qemu_fdatasync(s->fd) < 0 ? -errno : 0;
+    }
+    complete_request(iocb, ret, opaque);
+}
+
+static void do_flush_cmd(VirtIOBlockDataPlane *s, unsigned int head,
+                         struct virtio_blk_inhdr *inhdr)
+{
+    struct iocb *iocb;
+    VirtIOBlockRequest *req;
+    int ret;
+
+    /* Writes that were queued before the flush must reach the kernel first.
+     * Like virtio-blk.c, the flush does not wait for requests that are
+     * already in flight.
+     */
+    submit_requests(s);
+
+    if (unlikely(s->sync_flush)) {
+        ret = qemu_fdatasync(s->fd);
+        complete_request_status(s, inhdr, head, 0,
+                                ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+        return;
+    }
+
+    /* The flush completes through the Linux AIO eventfd like reads and
+     * writes, so the data plane thread keeps processing other requests.
+     */
+    iocb = ioq_get_iocb(&s->ioqueue);
+    req = container_of(iocb, VirtIOBlockRequest, iocb);
+    req->head = head;
+    req->inhdr = inhdr;
+    req->len = 0;
+    req->bounce_buf = NULL;
+    req->read_iov = NULL;
+    ioq_prep_fdsync(&s->ioqueue, iocb);
+
+    s->num_reqs++;
+    ret = ioq_submit(&s->ioqueue);
+    if (ret < 0) {
+        ioq_fail_queued(&s->ioqueue, ret, complete_flush_fallback, s);
+    }
+}
+
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr *outhdr;
+    struct virtio_blk_inhdr *inhdr;
+    uint32_t type;
+
+    if (unlikely(out_num < 1 || in_num < 1)) {
+        error_report("virtio-blk missing headers");
+        return -EFAULT;
+    }
+
+    if (unlikely(iov[0].iov_len < sizeof(*outhdr) ||
+                 in_iov[in_num - 1].iov_len < sizeof(*inhdr))) {
+        error_report("virtio-blk header not in correct element");
+        return -EFAULT;
+    }
+
+    outhdr = iov[0].iov_base;
+    inhdr = in_iov[in_num - 1].iov_base;
+    type = outhdr->type;
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        do_flush_cmd(s, head, inhdr);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request_status(s, inhdr, head, 0, VIRTIO_BLK_S_UNSUPP);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        /*
+         * NB: per existing s/n string convention the string is
+         * terminated by '\0' only when shorter than buffer.
+         */
+        strncpy(in_iov[0].iov_base, s->serial ? s->serial : "",
+                MIN(in_iov[0].iov_len, VIRTIO_BLK_ID_BYTES));
+        complete_request_status(s, inhdr, head, 0, VIRTIO_BLK_S_OK);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        do_rdwr_cmd(s, false, &iov[1], out_num - 1, outhdr->sector,
+                    head, inhdr);
+    } else {
+        do_rdwr_cmd(s, true, in_iov, in_num - 1, outhdr->sector,
+                    head, inhdr);
+    }
+    return 0;
+}
+
+static void handle_notify(EventHandler *handler)
+{
+    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
+                                           notify_handler);
+
+    /* There is one array of iovecs into which all new requests are parsed.
+     * Each request parsed from the vring uses one or more iovecs, which
+     * must stay valid until the requests are submitted below.
+     */
+    struct iovec iovec[VRING_MAX];
+    struct iovec *end = &iovec[VRING_MAX];
+    struct iovec *iov = iovec;
+
+    /* When a request is read from the vring, the index of the first
+     * descriptor (aka head) is returned so that the completed request can
+     * be pushed onto the vring later.
+     *
+     * The number of hypervisor read-only iovecs is out_num.  The number of
+     * hypervisor write-only iovecs is in_num.
+     */
+    int head;
+    unsigned int out_num = 0, in_num = 0;
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        for (;;) {
+            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+                                                        head);
+
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&s->vring);
+                break;
+            }
+            iov += out_num + in_num;
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(s->vdev, &s->vring)) {
+                break;
+            }
+        } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
+            /* A chain that does not fit even in an empty iovec array can
+             * never be processed.
+             */
+            if (head == -ENOBUFS && iov == iovec) {
+                error_report("virtio-blk request has too many descriptors");
+                vring_set_broken(&s->vring);
+            }
+
+            /* Since there are no iovecs[] left, stop processing for now.  Do
+             * not re-enable guest->host notifies since the I/O completion
+             * handler knows to check for more vring descriptors anyway.
+             */
+            break;
+        }
+    }
+
+    submit_requests(s);
+
+    if (s->notify_pending) {
+        notify_guest(s);
+    }
+}
+
+static void handle_io(EventHandler *handler)
+{
+    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
+                                           io_handler);
+
+    ioq_run_completion(&s->ioqueue, complete_request, s);
+    if (s->notify_pending) {
+        notify_guest(s);
+    }
+
+    /* If there were more requests than iovecs, the vring will not be empty
+     * yet so check again.  There should now be enough resources to process
+     * more requests.
+     */
+    if (unlikely(vring_more_avail(&s->vring))) {
+        handle_notify(&s->notify_handler);
+    }
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    do {
+        event_poll(&s->event_poll);
+    } while (!s->stopping || s->num_reqs > 0);
+    return NULL;
+}
+
+/* Guest memory must not be written behind the back of dirty logging, so
+ * fall back to the regular code path while a migration is running.
+ */
+static void data_plane_migration_log(HostMem *hostmem, bool enable)
+{
+    VirtIOBlockDataPlane *s = container_of(hostmem, VirtIOBlockDataPlane,
+                                           hostmem);
+
+    if (enable) {
+        virtio_blk_data_plane_stop(s);
+    }
+}
+
+/* Check whether the data plane can be used for @conf
+ *
+ * Returns NULL, after reporting an error, if it cannot.
+ */
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    BlockDriverState *bs = conf->bs;
+    char format[32];
+    int fd;
+
+    if (!kvm_enabled() || !kvm_has_many_ioeventfds()) {
+        error_report("x-data-plane requires KVM with ioeventfd support");
+        return NULL;
+    }
+
+    bdrv_get_format(bs, format, sizeof(format));
+    if (strcmp(format, "raw") != 0 || bs->backing_hd) {
+        error_report("x-data-plane only supports raw images");
+        return NULL;
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_report("x-data-plane cannot use drive %s, it is in use",
+                     bdrv_get_device_name(bs));
+        return NULL;
+    }
+
+    if (!(bs->open_flags & BDRV_O_NOCACHE)) {
+        error_report("x-data-plane requires cache=none");
+        return NULL;
+    }
+
+    if (bs->io_limits_enabled || bs->copy_on_read) {
+        error_report("x-data-plane does not support I/O throttling "
+                     "or copy-on-read");
+        return NULL;
+    }
+
+    fd = qemu_open(bs->filename,
+                   (bdrv_is_read_only(bs) ? O_RDONLY : O_RDWR) | O_DIRECT);
+    if (fd < 0) {
+        error_report("x-data-plane cannot open image %s: %s",
+                     bs->filename, strerror(errno));
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->vdev = vdev;
+    s->bs = bs;
+    s->conf = conf;
+    s->serial = serial;
+    s->fd = fd;
+    s->sector_mask = (conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
+    hostmem_init(&s->hostmem, data_plane_migration_log);
+
+    /* The image is accessed behind the back of the block layer, so keep
+     * block jobs away from it and make block migration fail.
+     */
+    bdrv_set_in_use(bs, 1);
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    bdrv_set_in_use(s->bs, 0);
+    hostmem_finalize(&s->hostmem);
+    close(s->fd);
+    g_free(s);
+}
+
+/* Hand virtqueue processing over to the data plane thread
+ *
+ * Called from the virtqueue handler in the I/O thread.  Returns false if
+ * the regular code path must process the virtqueue instead.
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *binding_opaque = s->vdev->binding_opaque;
+    VirtQueue *vq;
+    int i;
+
+    if (s->started || s->starting) {
+        /* Kicks that race with setting up the host notifier are picked up
+         * by the data plane thread.
+         */
+        return true;
+    }
+    if (s->stopping || s->unavailable ||
+        cpu_physical_memory_get_dirty_tracking()) {
+        return false;
+    }
+
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers) {
+        error_report("x-data-plane is not supported by this virtio binding");
+        s->unavailable = true;
+        return false;
+    }
+
+    if (virtio_queue_get_num(s->vdev, 0) > REQ_MAX) {
+        error_report("x-data-plane supports at most %d vring entries",
+                     REQ_MAX);
+        s->unavailable = true;
+        return false;
+    }
+
+    s->starting = true;
+
+    /* The regular code path must not have requests in flight that would
+     * complete into the vring behind our back.
+     */
+    bdrv_drain_all();
+
+    /* The image cannot be resized while it is in use */
+    s->size = bdrv_getlength(s->bs);
+    if (s->size < 0) {
+        error_report("x-data-plane cannot get the size of image %s",
+                     s->bs->filename);
+        s->unavailable = true;
+        goto fail;
+    }
+
+    if (!vring_setup(&s->vring, s->vdev, 0, &s->hostmem)) {
+        goto fail;
+    }
+
+    if (event_poll_init(&s->event_poll) < 0) {
+        error_report("x-data-plane failed to set up event loop");
+        goto fail;
+    }
+
+    if (ioq_init(&s->ioqueue, s->fd, REQ_MAX) < 0) {
+        error_report("x-data-plane failed to set up Linux AIO");
+        goto fail_ioq;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    }
+    event_poll_add(&s->event_poll, &s->io_handler,
+                   ioq_get_notifier(&s->ioqueue), handle_io);
+
+    /* Set up guest notifier (irq) */
+    if (binding->set_guest_notifiers(binding_opaque, true) != 0) {
+        error_report("x-data-plane failed to set up guest notifier");
+        goto fail_guest_notifiers;
+    }
+    vq = virtio_get_queue(s->vdev, 0);
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (binding->set_host_notifier(binding_opaque, 0, true) != 0) {
+        error_report("x-data-plane failed to set up host notifier");
+        s->unavailable = true;
+        goto fail_host_notifier;
+    }
+    event_poll_add(&s->event_poll, &s->notify_handler,
+                   virtio_queue_get_host_notifier(vq), handle_notify);
+
+    s->num_reqs = 0;
+    s->notify_pending = false;
+    s->started = true;
+    s->starting = false;
+    trace_virtio_blk_data_plane_start(s);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+    return true;
+
+fail_host_notifier:
+    binding->set_guest_notifiers(binding_opaque, false);
+fail_guest_notifiers:
+    ioq_cleanup(&s->ioqueue);
+fail_ioq:
+    event_poll_cleanup(&s->event_poll);
+fail:
+    s->starting = false;
+    return false;
+}
+
+/* Wait for in-flight requests and give the virtqueue back to virtio.c */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *binding_opaque = s->vdev->binding_opaque;
+    VirtQueue *vq = virtio_get_queue(s->vdev, 0);
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    /* Stop the thread once in-flight requests have completed */
+    event_poll_notify(&s->event_poll);
+    qemu_thread_join(&s->thread);
+
+    vring_teardown(&s->vring, s->vdev, 0);
+
+    /* Deliver an interrupt that the I/O thread has not picked up yet */
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(vq);
+    }
+    binding->set_guest_notifiers(binding_opaque, false);
+
+    ioq_cleanup(&s->ioqueue);
+    event_poll_cleanup(&s->event_poll);
+
+    /* A kick that arrived after the thread stopped is processed by the
+     * regular code path when the host notifier is removed.
+     */
+    s->started = false;
+    binding->set_host_notifier(binding_opaque, 0, false);
+
+    s->stopping = false;
+}
@@ -60,3 +60,20 @@ int event_notifier_test(EventNotifier *e)
     }
     return r == sizeof(value);
 }
+
+int event_notifier_set(EventNotifier *e)
+{
+    static const uint64_t value = 1;
+    ssize_t r;
+
+    do {
+        r = write(e->fd, &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+
+    /* EAGAIN means the counter is about to overflow, which still leaves the
+     * notifier readable, so the event is not lost. */
+    if (r < 0 && errno != EAGAIN) {
+        return -errno;
+    }
+    return 0;
+}
@@ -29,6 +29,11 @@
 #include "pixel_ops.h"
 #include "qemu-timer.h"
 
+#if defined(__SSE2__) && !defined(TARGET_WORDS_BIGENDIAN)
+#include <emmintrin.h>
+#define VGA_DRAW_SSE2
+#endif
+
 //#define DEBUG_VGA
 //#define DEBUG_VGA_MEM
 //#define DEBUG_VGA_REG
@@ -953,6 +958,28 @@ typedef void vga_draw_glyph9_func(uint8_t *d, int linesize,
 typedef void vga_draw_line_func(VGACommonState *s1, uint8_t *d,
                                 const uint8_t *s, int width);
 
+#ifdef VGA_DRAW_SSE2
+/* Expand the 15/16 bit pixels held in the low half of each 32-bit lane
+   to xRGB, with the same rounding as rgb_to_pixel32().  */
+static inline __m128i vga_rgb15_to_32_sse2(__m128i v)
+{
+    __m128i r = _mm_and_si128(_mm_slli_epi32(v, 9), _mm_set1_epi32(0xf80000));
+    __m128i g = _mm_and_si128(_mm_slli_epi32(v, 6), _mm_set1_epi32(0xf800));
+    __m128i b = _mm_and_si128(_mm_slli_epi32(v, 3), _mm_set1_epi32(0xf8));
+
+    return _mm_or_si128(r, _mm_or_si128(g, b));
+}
+
+static inline __m128i vga_rgb16_to_32_sse2(__m128i v)
+{
+    __m128i r = _mm_and_si128(_mm_slli_epi32(v, 8), _mm_set1_epi32(0xf80000));
+    __m128i g = _mm_and_si128(_mm_slli_epi32(v, 5), _mm_set1_epi32(0xfc00));
+    __m128i b = _mm_and_si128(_mm_slli_epi32(v, 3), _mm_set1_epi32(0xf8));
+
+    return _mm_or_si128(r, _mm_or_si128(g, b));
+}
+#endif
+
 #define DEPTH 8
 #include "vga_template.h"
 
@@ -1583,12 +1610,39 @@ void vga_dirty_log_stop(VGACommonState *s)
 /*
  * graphic modes
  */
+
+/* The display can scan out of VRAM directly when every displayed line
+   is a plain linear copy of guest memory in a host pixel format.  */
+static bool vga_can_share_surface(VGACommonState *s, int shift_control,
+                                  int multi_scan, int depth,
+                                  int width, int height)
+{
+#if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
+    if (depth != 16 && depth != 32) {
+        return false;
+    }
+#else
+    if (depth != 32) {
+        return false;
+    }
+#endif
+    if (s->force_shadow || shift_control < 2 || multi_scan ||
+        (s->cr[0x17] & 3) != 3 || height <= 0 ||
+        s->line_compare < height - 1) {
+        return false;
+    }
+    return (uint64_t)s->start_addr * 4 +
+           (uint64_t)s->line_offset * (height - 1) +
+           width * (depth / 8) <= s->vram_size;
+}
+
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
     int width, height, shift_control, line_offset, bwidth, bits;
     ram_addr_t page0, page1, page_min, page_max;
     int disp_width, multi_scan, multi_run;
+    bool share_surface;
     uint8_t *d;
     uint32_t v, addr1, addr;
     vga_draw_line_func *vga_draw_line;
@@ -1629,15 +1683,14 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
 
     depth = s->get_bpp(s);
+    share_surface = vga_can_share_surface(s, shift_control, multi_scan, depth,
+                                          disp_width, height);
     if (s->line_offset != s->last_line_offset ||
         disp_width != s->last_width ||
         height != s->last_height ||
-        s->last_depth != depth) {
-#if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
-        if (depth == 16 || depth == 32) {
-#else
-        if (depth == 32) {
-#endif
+        s->last_depth != depth ||
+        share_surface != is_buffer_shared(s->ds->surface)) {
+        if (share_surface) {
             qemu_free_displaysurface(s->ds);
             s->ds->surface = qemu_create_displaysurface_from(disp_width, height, depth,
                     s->line_offset,
@@ -1812,6 +1865,9 @@ static void vga_draw_blank(VGACommonState *s, int full_update)
         return;
     if (s->last_scr_width <= 0 || s->last_scr_height <= 0)
         return;
+    /* do not clear the guest video memory behind a shared surface */
+    if (is_buffer_shared(s->ds->surface))
+        qemu_console_resize(s->ds, s->last_scr_width, s->last_scr_height);
 
     s->rgb_to_pixel =
         rgb_to_pixel_dup_table[get_depth_index(s->ds)];
@@ -424,6 +424,22 @@ static void glue(vga_draw_line15_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t v, r, g, b;
 
     w = width;
+#if DEPTH == 32 && !defined(BGR_FORMAT) && defined(VGA_DRAW_SSE2)
+    for (; w >= 8; w -= 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)s);
+        __m128i zero = _mm_setzero_si128();
+
+        _mm_storeu_si128((__m128i *)d,
+                         vga_rgb15_to_32_sse2(_mm_unpacklo_epi16(p, zero)));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         vga_rgb15_to_32_sse2(_mm_unpackhi_epi16(p, zero)));
+        s += 16;
+        d += 32;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
         v = lduw_raw((void *)s);
         r = (v >> 7) & 0xf8;
@@ -449,6 +465,22 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t v, r, g, b;
 
     w = width;
+#if DEPTH == 32 && !defined(BGR_FORMAT) && defined(VGA_DRAW_SSE2)
+    for (; w >= 8; w -= 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)s);
+        __m128i zero = _mm_setzero_si128();
+
+        _mm_storeu_si128((__m128i *)d,
+                         vga_rgb16_to_32_sse2(_mm_unpacklo_epi16(p, zero)));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         vga_rgb16_to_32_sse2(_mm_unpackhi_epi16(p, zero)));
+        s += 16;
+        d += 32;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
         v = lduw_raw((void *)s);
         r = (v >> 8) & 0xf8;
@@ -471,6 +503,25 @@ static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t r, g, b;
 
     w = width;
+#if DEPTH == 32 && !defined(BGR_FORMAT) && \
+    !defined(HOST_WORDS_BIGENDIAN) && !defined(TARGET_WORDS_BIGENDIAN)
+    /* four pixels from every three words */
+    for (; w >= 4; w -= 4) {
+        uint32_t w0 = ldl_le_p(s);
+        uint32_t w1 = ldl_le_p(s + 4);
+        uint32_t w2 = ldl_le_p(s + 8);
+
+        ((PIXEL_TYPE *)d)[0] = w0 & 0xffffff;
+        ((PIXEL_TYPE *)d)[1] = ((w0 >> 24) | (w1 << 8)) & 0xffffff;
+        ((PIXEL_TYPE *)d)[2] = ((w1 >> 16) | (w2 << 16)) & 0xffffff;
+        ((PIXEL_TYPE *)d)[3] = w2 >> 8;
+        s += 12;
+        d += 4 * BPP;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
 #if defined(TARGET_WORDS_BIGENDIAN)
         r = s[0];
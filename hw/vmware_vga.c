@@ -319,16 +319,20 @@ static inline void vmsvga_update_rect(struct vmsvga_state_s *s,
     src = s->vga.vram_ptr + start;
     dst = ds_get_data(s->vga.ds) + start;
 
-    for (; line > 0; line --, src += bypl, dst += bypl)
-        memcpy(dst, src, width);
+    if (!is_buffer_shared(s->vga.ds->surface)) {
+        for (; line > 0; line --, src += bypl, dst += bypl)
+            memcpy(dst, src, width);
+    }
 
     dpy_update(s->vga.ds, x, y, w, h);
 }
 
 static inline void vmsvga_update_screen(struct vmsvga_state_s *s)
 {
-    memcpy(ds_get_data(s->vga.ds), s->vga.vram_ptr,
-           s->bypp * s->width * s->height);
+    if (!is_buffer_shared(s->vga.ds->surface)) {
+        memcpy(ds_get_data(s->vga.ds), s->vga.vram_ptr,
+               s->bypp * s->width * s->height);
+    }
     dpy_update(s->vga.ds, 0, 0, s->width, s->height);
 }
 
@@ -937,12 +941,31 @@ static void vmsvga_bios_write(void *opaque, uint32_t address, uint32_t data)
                     __FUNCTION__, data);
 }
 
+/* The framebuffer is laid out in the host surface format, so the display
+ * can read it in place as long as the whole mode fits in VRAM.  */
+static inline int vmsvga_can_share_surface(struct vmsvga_state_s *s)
+{
+    return s->new_width > 0 && s->new_height > 0 &&
+           (uint64_t) s->bypp * s->new_width * s->new_height <=
+           s->vga.vram_size;
+}
+
 static inline void vmsvga_size(struct vmsvga_state_s *s)
 {
-    if (s->new_width != s->width || s->new_height != s->height) {
+    int share = vmsvga_can_share_surface(s);
+
+    if (s->new_width != s->width || s->new_height != s->height ||
+        share != is_buffer_shared(s->vga.ds->surface)) {
         s->width = s->new_width;
         s->height = s->new_height;
-        qemu_console_resize(s->vga.ds, s->width, s->height);
+        if (share) {
+            qemu_free_displaysurface(s->vga.ds);
+            s->vga.ds->surface = qemu_create_displaysurface_from(s->width,
+                    s->height, s->depth, s->bypp * s->width, s->vga.vram_ptr);
+            dpy_resize(s->vga.ds);
+        } else {
+            qemu_console_resize(s->vga.ds, s->width, s->height);
+        }
         s->invalidated = 1;
     }
 }
@@ -1011,6 +1034,7 @@ static void vmsvga_screen_dump(void *opaque, const char *filename)
         return;
     }
 
+    vmsvga_size(s);
     if (s->depth == 32) {
         DisplaySurface *ds = qemu_create_displaysurface_from(s->width,
                 s->height, 32, ds_get_linesize(s->vga.ds), s->vga.vram_ptr);
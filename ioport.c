@@ -269,29 +269,45 @@ bool isa_is_ioport_assigned(pio_addr_t start)
 
 void cpu_outb(pio_addr_t addr, uint8_t val)
 {
+    bool locked;
+
     LOG_IOPORT("outb: %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
     trace_cpu_out(addr, val);
+    locked = io_mem_lock();
     ioport_write(0, addr, val);
+    io_mem_unlock(locked);
 }
 
 void cpu_outw(pio_addr_t addr, uint16_t val)
 {
+    bool locked;
+
     LOG_IOPORT("outw: %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
     trace_cpu_out(addr, val);
+    locked = io_mem_lock();
     ioport_write(1, addr, val);
+    io_mem_unlock(locked);
 }
 
 void cpu_outl(pio_addr_t addr, uint32_t val)
 {
+    bool locked;
+
     LOG_IOPORT("outl: %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
     trace_cpu_out(addr, val);
+    locked = io_mem_lock();
     ioport_write(2, addr, val);
+    io_mem_unlock(locked);
 }
 
 uint8_t cpu_inb(pio_addr_t addr)
 {
     uint8_t val;
+    bool locked;
+
+    locked = io_mem_lock();
     val = ioport_read(0, addr);
+    io_mem_unlock(locked);
     trace_cpu_in(addr, val);
     LOG_IOPORT("inb : %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
     return val;
@@ -300,7 +316,11 @@ uint8_t cpu_inb(pio_addr_t addr)
 uint16_t cpu_inw(pio_addr_t addr)
 {
     uint16_t val;
+    bool locked;
+
+    locked = io_mem_lock();
     val = ioport_read(1, addr);
+    io_mem_unlock(locked);
     trace_cpu_in(addr, val);
     LOG_IOPORT("inw : %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
     return val;
@@ -309,7 +329,11 @@ uint16_t cpu_inw(pio_addr_t addr)
 uint32_t cpu_inl(pio_addr_t addr)
 {
     uint32_t val;
+    bool locked;
+
+    locked = io_mem_lock();
     val = ioport_read(2, addr);
+    io_mem_unlock(locked);
     trace_cpu_in(addr, val);
     LOG_IOPORT("inl : %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
     return val;
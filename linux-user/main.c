@@ -54,6 +54,7 @@ unsigned long reserved_va;
 static void usage(void);
 
 static const char *interp_prefix = CONFIG_QEMU_INTERP_PREFIX;
+static const char *tb_cache_path;
 const char *qemu_uname_release = CONFIG_UNAME_RELEASE;
 
 /* XXX: on x86 MAP_GROWSDOWN only works if ESP <= address + 32, so
@@ -3080,6 +3081,19 @@ static void handle_arg_strace(const char *arg)
     do_strace = 1;
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_path = arg;
+}
+
+static void handle_arg_tb_traces(const char *arg)
+{
+    if (tb_traces_enable() < 0) {
+        fprintf(stderr, "qemu: -tb-traces is not supported for this "
+                "target, ignored\n");
+    }
+}
+
 static void handle_arg_version(const char *arg)
 {
     printf("qemu-" TARGET_ARCH " version " QEMU_VERSION QEMU_PKGVERSION
@@ -3129,6 +3143,10 @@ struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "file",       "keep translated code in 'file' across runs"},
+    {"tb-traces",  "QEMU_TB_TRACES",   false, handle_arg_tb_traces,
+     "",           "translate hot code paths as traces"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3516,6 +3534,11 @@ int main(int argc, char **argv, char **envp)
     tcg_prologue_init(&tcg_ctx);
 #endif
 
+    if (tb_cache_path && tb_cache_init(tb_cache_path, cpu_model) < 0) {
+        fprintf(stderr, "Warning: translation cache not supported "
+                "on this host\n");
+    }
+
 #if defined(TARGET_I386)
     cpu_x86_set_cpl(env, 3);
 
@@ -430,6 +430,26 @@ static inline void unlock_user(void *host_ptr, abi_ulong guest_addr,
 #endif
 }
 
+/* Like lock_user, for a buffer that is only handed to a host syscall.
+   With reserved_va the whole guest address space is mapped in the host,
+   PROT_NONE where the guest has nothing.  A host syscall that reads the
+   buffer then fails with EFAULT by itself where the guest's would, and
+   the page walk of access_ok() can be skipped.  Buffers that the host
+   writes still go through lock_user(): pages that hold translated code
+   are read-only on the host though the guest may write them, and a
+   syscall that faults on them may already have consumed its input.  */
+static inline void *lock_user_direct(int type, abi_ulong guest_addr,
+                                     long len, int copy)
+{
+#ifndef DEBUG_REMAP
+    if (type == VERIFY_READ && RESERVED_VA && guest_addr <= RESERVED_VA &&
+        (unsigned long)len <= RESERVED_VA - guest_addr) {
+        return g2h(guest_addr);
+    }
+#endif
+    return lock_user(type, guest_addr, len, copy);
+}
+
 /* Return the length of a string in target memory or -TARGET_EFAULT if
    access error. */
 abi_long target_strlen(abi_ulong gaddr);
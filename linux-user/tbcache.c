@@ -0,0 +1,395 @@
+/*
+ *  Persistent translation cache for the user mode emulator
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "qemu.h"
+#include "tcg.h"
+
+//#define DEBUG_TB_CACHE
+
+/* The cache file holds the host code of translated blocks, so it is only
+   good for the QEMU binary and guest memory layout that wrote it.  All of
+   that goes into the fingerprint in the file header; a file with another
+   fingerprint is ignored and overwritten on exit.
+
+   A block is looked up by pc, cs_base, flags and cflags, and is only used
+   if the guest code it was translated from is unchanged.  The position
+   dependent parts of the host code are described by the relocations that
+   the TCG backend recorded while generating it.  */
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    1
+#define TB_CACHE_MAX_SIZE   (64 * 1024 * 1024)
+#define TB_CACHE_HASH_BITS  14
+#define TB_CACHE_HASH_SIZE  (1 << TB_CACHE_HASH_BITS)
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    uint64_t fingerprint;
+} TBCacheHeader;
+
+/* followed by nb_relocs TCGCodeReloc and code_size bytes of host code */
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t guest_hash;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t size;
+    uint32_t code_size;
+    uint32_t nb_relocs;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t pad;
+} TBCacheEntry;
+
+typedef struct TBCacheRecord {
+    struct TBCacheRecord *hash_next;
+    struct TBCacheRecord *next;
+    TBCacheEntry e;
+    uint8_t data[];
+} TBCacheRecord;
+
+#if defined(TCG_TARGET_HAS_CODE_RELOCS) && defined(USE_DIRECT_JUMP)
+
+static bool tb_cache_enabled;
+static bool tb_cache_dirty;
+static char *tb_cache_path;
+static uint64_t tb_cache_fingerprint;
+static TBCacheRecord *tb_cache_hash[TB_CACHE_HASH_SIZE];
+static TBCacheRecord *tb_cache_list;
+static uint32_t tb_cache_nb_entries;
+static size_t tb_cache_size;
+
+/* FNV-1a */
+static uint64_t tb_cache_hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define TB_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline unsigned int tb_cache_hash_func(target_ulong pc, uint32_t flags)
+{
+    return (pc ^ (pc >> TB_CACHE_HASH_BITS) ^ flags) &
+           (TB_CACHE_HASH_SIZE - 1);
+}
+
+static inline TCGCodeReloc *tb_cache_relocs(TBCacheRecord *rec)
+{
+    return (TCGCodeReloc *)rec->data;
+}
+
+static inline uint8_t *tb_cache_code(TBCacheRecord *rec)
+{
+    return rec->data + rec->e.nb_relocs * sizeof(TCGCodeReloc);
+}
+
+static inline size_t tb_cache_payload(const TBCacheEntry *e)
+{
+    return e->nb_relocs * sizeof(TCGCodeReloc) + e->code_size;
+}
+
+static uint64_t tb_cache_compute_fingerprint(const char *cpu_model)
+{
+    static const char version[] = QEMU_VERSION " " TARGET_ARCH;
+    struct stat st;
+    uint64_t v[8];
+    uint64_t h;
+
+    h = tb_cache_hash_bytes(TB_CACHE_HASH_INIT, version, sizeof(version));
+    if (cpu_model) {
+        h = tb_cache_hash_bytes(h, cpu_model, strlen(cpu_model) + 1);
+    }
+
+    memset(v, 0, sizeof(v));
+    if (stat("/proc/self/exe", &st) == 0) {
+        v[0] = st.st_dev;
+        v[1] = st.st_ino;
+        v[2] = st.st_size;
+        v[3] = st.st_mtime;
+    }
+    /* helpers are called by absolute address, so the cache is only good
+       if QEMU is loaded at the same address */
+    v[4] = (uintptr_t)code_gen_prologue;
+    v[5] = GUEST_BASE;
+    v[6] = singlestep;
+    v[7] = sizeof(TBCacheEntry) + sizeof(TCGCodeReloc);
+    return tb_cache_hash_bytes(h, v, sizeof(v));
+}
+
+static void tb_cache_insert(TBCacheRecord *rec)
+{
+    unsigned int h = tb_cache_hash_func(rec->e.pc, rec->e.flags);
+
+    rec->hash_next = tb_cache_hash[h];
+    tb_cache_hash[h] = rec;
+    rec->next = tb_cache_list;
+    tb_cache_list = rec;
+    tb_cache_nb_entries++;
+    tb_cache_size += sizeof(TBCacheEntry) + tb_cache_payload(&rec->e);
+}
+
+/* Reject records whose relocations would patch outside their code */
+static bool tb_cache_record_valid(TBCacheRecord *rec)
+{
+    TCGCodeReloc *relocs = tb_cache_relocs(rec);
+    uint32_t i;
+    int size;
+
+    for (i = 0; i < rec->e.nb_relocs; i++) {
+        size = tcg_code_reloc_size(&relocs[i]);
+        if (size < 0 || relocs[i].offset > rec->e.code_size ||
+            rec->e.code_size - relocs[i].offset < size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tb_cache_load(FILE *f)
+{
+    TBCacheHeader hdr;
+    TBCacheEntry e;
+    TBCacheRecord *rec;
+    uint32_t i;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TB_CACHE_VERSION ||
+        hdr.fingerprint != tb_cache_fingerprint) {
+        return;
+    }
+
+    for (i = 0; i < hdr.nb_entries; i++) {
+        if (fread(&e, sizeof(e), 1, f) != 1 ||
+            e.code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE ||
+            e.nb_relocs > TCG_MAX_CODE_RELOCS) {
+            break;
+        }
+        rec = g_malloc(sizeof(*rec) + tb_cache_payload(&e));
+        rec->e = e;
+        if (fread(rec->data, tb_cache_payload(&e), 1, f) != 1 ||
+            !tb_cache_record_valid(rec)) {
+            g_free(rec);
+            break;
+        }
+        tb_cache_insert(rec);
+    }
+#ifdef DEBUG_TB_CACHE
+    fprintf(stderr, "tb cache: loaded %u blocks from %s\n",
+            tb_cache_nb_entries, tb_cache_path);
+#endif
+}
+
+int tb_cache_init(const char *path, const char *cpu_model)
+{
+    FILE *f;
+
+    tb_cache_path = g_strdup(path);
+    tb_cache_fingerprint = tb_cache_compute_fingerprint(cpu_model);
+    f = fopen(path, "rb");
+    if (f) {
+        tb_cache_load(f);
+        fclose(f);
+    }
+    tcg_ctx.code_relocs_enabled = true;
+    tb_cache_enabled = true;
+    return 0;
+}
+
+/* The translation also depends on the debugger state, which is not part
+   of the key.  */
+static inline bool tb_cache_usable(CPUState *env)
+{
+    return tb_cache_enabled && !env->singlestep_enabled &&
+           QTAILQ_EMPTY(&env->breakpoints);
+}
+
+/* Copy the cached code to tb->tc_ptr.  This fails if the code uses an
+   encoding that the backend would not pick at the new address.  */
+static bool tb_cache_place(TBCacheRecord *rec, TranslationBlock *tb)
+{
+    TCGCodeReloc *relocs = tb_cache_relocs(rec);
+    uint32_t i;
+
+    memcpy(tb->tc_ptr, tb_cache_code(rec), rec->e.code_size);
+    for (i = 0; i < rec->e.nb_relocs; i++) {
+        if (!tcg_apply_code_reloc(&relocs[i], tb->tc_ptr,
+                                  (tcg_target_long)tb)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool tb_cache_lookup(CPUState *env, TranslationBlock *tb,
+                     int *gen_code_size_ptr)
+{
+    TBCacheRecord *rec;
+    TBCacheEntry *e;
+
+    if (!tb_cache_usable(env)) {
+        return false;
+    }
+    rec = tb_cache_hash[tb_cache_hash_func(tb->pc, tb->flags)];
+    for (; rec != NULL; rec = rec->hash_next) {
+        e = &rec->e;
+        if (e->pc != tb->pc || e->cs_base != tb->cs_base ||
+            e->flags != tb->flags || e->cflags != tb->cflags) {
+            continue;
+        }
+        if (page_check_range(tb->pc, e->size, PAGE_READ) != 0 ||
+            tb_cache_hash_bytes(TB_CACHE_HASH_INIT, g2h(tb->pc),
+                                e->size) != e->guest_hash) {
+            continue;
+        }
+        if (!tb_cache_place(rec, tb)) {
+            continue;
+        }
+        tb->size = e->size;
+        tb->tb_next_offset[0] = e->tb_next_offset[0];
+        tb->tb_next_offset[1] = e->tb_next_offset[1];
+        tb->tb_jmp_offset[0] = e->tb_jmp_offset[0];
+        tb->tb_jmp_offset[1] = e->tb_jmp_offset[1];
+        *gen_code_size_ptr = e->code_size;
+        return true;
+    }
+    return false;
+}
+
+void tb_cache_add(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheRecord *rec;
+    TBCacheEntry *e;
+
+    if (!tb_cache_usable(env) || s->code_relocs_failed || tb->size == 0 ||
+        tb_cache_size >= TB_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    rec = g_malloc(sizeof(*rec) + s->nb_code_relocs * sizeof(TCGCodeReloc) +
+                   gen_code_size);
+    e = &rec->e;
+    memset(e, 0, sizeof(*e));
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->cflags = tb->cflags;
+    e->size = tb->size;
+    e->guest_hash = tb_cache_hash_bytes(TB_CACHE_HASH_INIT, g2h(tb->pc),
+                                        tb->size);
+    e->code_size = gen_code_size;
+    e->nb_relocs = s->nb_code_relocs;
+    e->tb_next_offset[0] = tb->tb_next_offset[0];
+    e->tb_next_offset[1] = tb->tb_next_offset[1];
+    e->tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e->tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+    memcpy(tb_cache_relocs(rec), s->code_relocs,
+           s->nb_code_relocs * sizeof(TCGCodeReloc));
+    memcpy(tb_cache_code(rec), tb->tc_ptr, gen_code_size);
+
+    tb_cache_insert(rec);
+    tb_cache_dirty = true;
+}
+
+/* Write the cache back if new blocks were translated.  The file is
+   replaced atomically, so that concurrent runs never see a partial
+   file; the last one to exit wins.  */
+void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    TBCacheRecord *rec;
+    char *tmp;
+    FILE *f;
+    bool ok;
+
+    if (!tb_cache_enabled) {
+        return;
+    }
+    tb_lock_acquire();
+    if (!tb_cache_dirty) {
+        tb_lock_release();
+        return;
+    }
+
+    tmp = g_strdup_printf("%s.%d", tb_cache_path, (int)getpid());
+    f = fopen(tmp, "wb");
+    if (!f) {
+        goto out;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.nb_entries = tb_cache_nb_entries;
+    hdr.fingerprint = tb_cache_fingerprint;
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (rec = tb_cache_list; rec != NULL && ok; rec = rec->next) {
+        ok = fwrite(&rec->e, sizeof(rec->e), 1, f) == 1 &&
+             fwrite(rec->data, tb_cache_payload(&rec->e), 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, tb_cache_path) < 0) {
+        unlink(tmp);
+        goto out;
+    }
+    tb_cache_dirty = false;
+#ifdef DEBUG_TB_CACHE
+    fprintf(stderr, "tb cache: saved %u blocks to %s\n",
+            tb_cache_nb_entries, tb_cache_path);
+#endif
+out:
+    g_free(tmp);
+    tb_lock_release();
+}
+
+#else
+
+int tb_cache_init(const char *path, const char *cpu_model)
+{
+    return -ENOTSUP;
+}
+
+bool tb_cache_lookup(CPUState *env, TranslationBlock *tb,
+                     int *gen_code_size_ptr)
+{
+    return false;
+}
+
+void tb_cache_add(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+}
+
+void tb_cache_save(void)
+{
+}
+
+#endif
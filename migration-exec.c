@@ -15,9 +15,9 @@
 
 #include "qemu-common.h"
 #include "qemu_socket.h"
+#include "hw/hw.h"
 #include "migration.h"
 #include "qemu-char.h"
-#include "buffered_file.h"
 #include "block.h"
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -13,10 +13,10 @@
 
 #include "qemu-common.h"
 #include "qemu_socket.h"
+#include "hw/hw.h"
 #include "migration.h"
 #include "monitor.h"
 #include "qemu-char.h"
-#include "buffered_file.h"
 #include "block.h"
 #include "qemu_socket.h"
 
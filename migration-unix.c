@@ -13,9 +13,9 @@
 
 #include "qemu-common.h"
 #include "qemu_socket.h"
+#include "hw/hw.h"
 #include "migration.h"
 #include "qemu-char.h"
-#include "buffered_file.h"
 #include "block.h"
 
 //#define DEBUG_MIGRATION_UNIX
@@ -138,7 +138,10 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (process_incoming_migration(f)) {
+        /* the post-copy threads own the connection now */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
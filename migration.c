@@ -12,14 +12,16 @@
  */
 
 #include "qemu-common.h"
+#include "hw/hw.h"
 #include "migration.h"
 #include "monitor.h"
-#include "buffered_file.h"
 #include "sysemu.h"
 #include "block.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "qemu-timer.h"
+#include "main-loop.h"
 
 //#define DEBUG_MIGRATION
 
@@ -37,10 +39,34 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
+/* Time slice for rate limiting, in milliseconds */
+#define BUFFER_DELAY     100
+#define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
+
+/* Amount of guest memory cached for XBZRLE delta encoding */
+#define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
+
+/* Defaults for compressed migration */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* Pre-copy passes over guest memory before switching to post-copy */
+#define DEFAULT_MIGRATE_POSTCOPY_ITERATIONS 5
+#define MAX_MIGRATE_POSTCOPY_ITERATIONS 1000
+
+static const char *const migration_capability_names[MIGRATION_CAPABILITY_MAX] = {
+    [MIGRATION_CAPABILITY_XBZRLE] = "xbzrle",
+    [MIGRATION_CAPABILITY_COMPRESS] = "compress",
+    [MIGRATION_CAPABILITY_POSTCOPY] = "postcopy",
+};
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -53,6 +79,13 @@ static MigrationState *migrate_get_current(void)
     static MigrationState current_migration = {
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
+        .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .parameters = {
+            .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+            .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+            .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+            .postcopy_iterations = DEFAULT_MIGRATE_POSTCOPY_ITERATIONS,
+        },
     };
 
     return &current_migration;
@@ -80,9 +113,15 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * Returns true if post-copy has taken over @f; the caller must then leave
+ * the file and its socket open.
+ */
+bool process_incoming_migration(QEMUFile *f)
 {
-    if (qemu_loadvm_state(f) < 0) {
+    int ret = qemu_loadvm_state(f);
+
+    if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
@@ -94,6 +133,7 @@ void process_incoming_migration(QEMUFile *f)
     } else {
         runstate_set(RUN_STATE_PRELAUNCH);
     }
+    return ret > 0;
 }
 
 /* amount of nanoseconds we are willing to wait for migration to be down.
@@ -138,6 +178,45 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "xbzrle-cache")) {
+        QDict *cache;
+
+        cache = qobject_to_qdict(qdict_get(qdict, "xbzrle-cache"));
+        monitor_printf(mon, "cache size: %" PRId64 " bytes\n",
+                       qdict_get_int(cache, "cache-size"));
+        monitor_printf(mon, "xbzrle transferred: %" PRId64 " kbytes\n",
+                       qdict_get_int(cache, "bytes") >> 10);
+        monitor_printf(mon, "xbzrle pages: %" PRId64 " pages\n",
+                       qdict_get_int(cache, "pages"));
+        monitor_printf(mon, "xbzrle cache hit: %" PRId64 "\n",
+                       qdict_get_int(cache, "cache-hit"));
+        monitor_printf(mon, "xbzrle cache miss: %" PRId64 "\n",
+                       qdict_get_int(cache, "cache-miss"));
+        monitor_printf(mon, "xbzrle overflow: %" PRId64 "\n",
+                       qdict_get_int(cache, "overflow"));
+        monitor_printf(mon, "xbzrle saved: %" PRId64 " kbytes\n",
+                       qdict_get_int(cache, "bytes-saved") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "compress-threads")) {
+        QList *list = qobject_to_qlist(qdict_get(qdict, "compress-threads"));
+        const QListEntry *entry;
+        int i = 0;
+
+        QLIST_FOREACH_ENTRY(list, entry) {
+            QDict *thread = qobject_to_qdict(entry->value);
+            int64_t bytes = qdict_get_int(thread, "bytes");
+            int64_t busy = qdict_get_int(thread, "busy-time");
+
+            monitor_printf(mon, "compress thread %d: %" PRId64 " pages, "
+                           "%" PRId64 " kbytes -> %" PRId64 " kbytes, "
+                           "%" PRId64 " kbytes/s\n", i++,
+                           qdict_get_int(thread, "pages"), bytes >> 10,
+                           qdict_get_int(thread, "compressed-bytes") >> 10,
+                           busy ? (int64_t)(bytes * 1e9 / busy) >> 10 : 0);
+        }
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -151,6 +230,47 @@ static void migrate_put_status(QDict *qdict, const char *name,
     qdict_put_obj(qdict, name, obj);
 }
 
+static void migrate_put_xbzrle_status(QDict *qdict, MigrationState *s)
+{
+    QObject *obj;
+
+    obj = qobject_from_jsonf("{ 'cache-size': %" PRId64 ", "
+                               "'bytes': %" PRId64 ", "
+                               "'pages': %" PRId64 ", "
+                               "'cache-hit': %" PRId64 ", "
+                               "'cache-miss': %" PRId64 ", "
+                               "'overflow': %" PRId64 ", "
+                               "'bytes-saved': %" PRId64 " }",
+                             s->xbzrle_cache_size,
+                             xbzrle_mig_bytes_transferred(),
+                             xbzrle_mig_pages_transferred(),
+                             xbzrle_mig_cache_hit(),
+                             xbzrle_mig_cache_miss(),
+                             xbzrle_mig_pages_overflow(),
+                             xbzrle_mig_bytes_saved());
+    qdict_put_obj(qdict, "xbzrle-cache", obj);
+}
+
+static void migrate_put_compress_status(QDict *qdict)
+{
+    CompressThreadStats stats[MAX_MIGRATE_COMPRESS_THREADS];
+    QList *list = qlist_new();
+    int i, n;
+
+    n = compress_mig_thread_stats(stats, ARRAY_SIZE(stats));
+    for (i = 0; i < n; i++) {
+        qlist_append_obj(list,
+                         qobject_from_jsonf("{ 'pages': %" PRId64 ", "
+                                              "'bytes': %" PRId64 ", "
+                                              "'compressed-bytes': %" PRId64 ", "
+                                              "'busy-time': %" PRId64 " }",
+                                            stats[i].pages, stats[i].bytes,
+                                            stats[i].compressed_bytes,
+                                            stats[i].busy_ns));
+    }
+    qdict_put(qdict, "compress-threads", list);
+}
+
 void do_info_migrate(Monitor *mon, QObject **ret_data)
 {
     QDict *qdict;
@@ -173,10 +293,38 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
                                blk_mig_bytes_total());
         }
 
+        if (migrate_use_xbzrle()) {
+            migrate_put_xbzrle_status(qdict, s);
+        }
+
+        if (migrate_use_compression()) {
+            migrate_put_compress_status(qdict);
+        }
+
+        *ret_data = QOBJECT(qdict);
+        break;
+    case MIG_STATE_POSTCOPY:
+        qdict = qdict_new();
+        qdict_put(qdict, "status", qstring_from_str("postcopy-active"));
+
+        migrate_put_status(qdict, "ram", ram_bytes_transferred(),
+                           ram_bytes_remaining(), ram_bytes_total());
+
         *ret_data = QOBJECT(qdict);
         break;
     case MIG_STATE_COMPLETED:
-        *ret_data = qobject_from_jsonf("{ 'status': 'completed' }");
+        qdict = qdict_new();
+        qdict_put(qdict, "status", qstring_from_str("completed"));
+
+        if (migrate_use_xbzrle()) {
+            migrate_put_xbzrle_status(qdict, s);
+        }
+
+        if (migrate_use_compression()) {
+            migrate_put_compress_status(qdict);
+        }
+
+        *ret_data = QOBJECT(qdict);
         break;
     case MIG_STATE_ERROR:
         *ret_data = qobject_from_jsonf("{ 'status': 'failed' }");
@@ -200,16 +348,35 @@ static void migrate_fd_monitor_suspend(MigrationState *s, Monitor *mon)
     }
 }
 
-static int migrate_fd_cleanup(MigrationState *s)
+/*
+ * Runs in the I/O thread once the migration thread has exited, or directly
+ * if the migration failed before the thread was started.
+ */
+static void migrate_fd_cleanup(void *opaque)
 {
-    int ret = 0;
+    MigrationState *s = opaque;
+
+    if (s->cleanup_bh) {
+        qemu_bh_delete(s->cleanup_bh);
+        s->cleanup_bh = NULL;
+    }
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
     if (s->file) {
+#ifndef _WIN32
+        qemu_mutex_unlock_iothread();
+        qemu_thread_join(&s->thread);
+        qemu_mutex_lock_iothread();
+#endif
+
+        if (s->state != MIG_STATE_COMPLETED) {
+            qemu_savevm_state_cancel(s->mon, s->file);
+        }
+
         DPRINTF("closing file\n");
-        if (qemu_fclose(s->file) != 0) {
-            ret = -1;
+        if (qemu_fclose(s->file) != 0 && s->state == MIG_STATE_COMPLETED) {
+            s->state = MIG_STATE_ERROR;
         }
         s->file = NULL;
     } else {
@@ -223,143 +390,327 @@ static int migrate_fd_cleanup(MigrationState *s)
         s->fd = -1;
     }
 
-    return ret;
+    notifier_list_notify(&migration_state_notifiers, s);
 }
 
 void migrate_fd_error(MigrationState *s)
 {
     DPRINTF("setting error state\n");
+    assert(s->file == NULL);
     s->state = MIG_STATE_ERROR;
-    notifier_list_notify(&migration_state_notifiers, s);
     migrate_fd_cleanup(s);
 }
 
-static void migrate_fd_completed(MigrationState *s)
+static bool migrate_fd_is_running(MigrationState *s)
 {
-    DPRINTF("setting completed state\n");
-    if (migrate_fd_cleanup(s) < 0) {
-        s->state = MIG_STATE_ERROR;
-    } else {
-        s->state = MIG_STATE_COMPLETED;
-        runstate_set(RUN_STATE_POSTMIGRATE);
-    }
-    notifier_list_notify(&migration_state_notifiers, s);
+    return s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_POSTCOPY;
 }
 
-static void migrate_fd_put_notify(void *opaque)
+/* Move the state to @state unless the migration was stopped meanwhile */
+static void migrate_fd_set_state(MigrationState *s, int state)
 {
-    MigrationState *s = opaque;
-
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    qemu_file_put_notify(s->file);
-    if (qemu_file_get_error(s->file)) {
-        migrate_fd_error(s);
+    qemu_mutex_lock_iothread();
+    if (migrate_fd_is_running(s)) {
+        s->state = state;
     }
+    qemu_mutex_unlock_iothread();
 }
 
-static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
-                                     size_t size)
+static ssize_t migrate_fd_write(MigrationState *s, const void *data,
+                                size_t size)
 {
-    MigrationState *s = opaque;
     ssize_t ret;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        return -EIO;
-    }
-
     do {
         ret = s->write(s, data, size);
     } while (ret == -1 && ((s->get_error(s)) == EINTR));
 
-    if (ret == -1)
+    if (ret == -1) {
         ret = -(s->get_error(s));
-
-    if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
     }
 
     return ret;
 }
 
-static void migrate_fd_put_ready(void *opaque)
+/* Write out the buffered data; the file descriptor is in blocking mode */
+static int migrate_fd_flush(MigrationState *s)
+{
+    size_t offset = 0;
+    ssize_t ret = 0;
+
+    DPRINTF("flushing %zu byte(s) of data\n", s->buffer_size);
+
+    while (offset < s->buffer_size) {
+        ret = migrate_fd_write(s, s->buffer + offset,
+                               s->buffer_size - offset);
+        if (ret <= 0) {
+            DPRINTF("error flushing data, %zd\n", ret);
+            ret = ret ? ret : -EIO;
+            qemu_file_set_error(s->file, ret);
+            break;
+        }
+        offset += ret;
+    }
+
+    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
+    s->buffer_size -= offset;
+
+    return ret < 0 ? ret : 0;
+}
+
+static int migrate_fd_put_buffer(void *opaque, const uint8_t *buf,
+                                 int64_t pos, int size)
 {
     MigrationState *s = opaque;
-    int ret;
+    int error;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        DPRINTF("put_ready returning because of non-active state\n");
-        return;
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("put when error, bailing: %s\n", strerror(-error));
+        return error;
     }
 
-    DPRINTF("iterate\n");
-    ret = qemu_savevm_state_iterate(s->mon, s->file);
-    if (ret < 0) {
-        migrate_fd_error(s);
-    } else if (ret == 1) {
-        int old_vm_running = runstate_is_running();
+    if (size > s->buffer_capacity - s->buffer_size) {
+        s->buffer_capacity = s->buffer_size + size + 1024;
+        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+    }
 
-        DPRINTF("done iterating\n");
-        vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    memcpy(s->buffer + s->buffer_size, buf, size);
+    s->buffer_size += size;
+    s->bytes_xfer += size;
 
-        if (qemu_savevm_state_complete(s->mon, s->file) < 0) {
-            migrate_fd_error(s);
-        } else {
-            migrate_fd_completed(s);
-        }
-        if (s->state != MIG_STATE_COMPLETED) {
-            if (old_vm_running) {
-                vm_start();
-            }
-        }
+    return size;
+}
+
+/*
+ * The meaning of the return values is:
+ *   0: We can continue sending
+ *   1: Time to stop
+ *   negative: There has been an error
+ */
+static int migrate_fd_rate_limit(void *opaque)
+{
+    MigrationState *s = opaque;
+    int ret;
+
+    ret = qemu_file_get_error(s->file);
+    if (ret) {
+        return ret;
+    }
+
+    if (s->bytes_xfer >= s->xfer_limit) {
+        return 1;
     }
+
+    return 0;
 }
 
-static void migrate_fd_cancel(MigrationState *s)
+static int64_t migrate_fd_set_rate_limit(void *opaque, int64_t new_rate)
 {
-    if (s->state != MIG_STATE_ACTIVE)
-        return;
+    MigrationState *s = opaque;
 
-    DPRINTF("cancelling migration\n");
+    if (new_rate > SIZE_MAX) {
+        new_rate = SIZE_MAX;
+    }
+    s->xfer_limit = new_rate / XFER_LIMIT_RATIO;
 
-    s->state = MIG_STATE_CANCELLED;
-    notifier_list_notify(&migration_state_notifiers, s);
-    qemu_savevm_state_cancel(s->mon, s->file);
+    return s->xfer_limit;
+}
 
-    migrate_fd_cleanup(s);
+static int64_t migrate_fd_get_rate_limit(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    return s->xfer_limit;
 }
 
-static void migrate_fd_wait_for_unfreeze(void *opaque)
+static int migrate_fd_close(void *opaque)
 {
     MigrationState *s = opaque;
     int ret;
 
-    DPRINTF("wait for unfreeze\n");
-    if (s->state != MIG_STATE_ACTIVE)
-        return;
+    ret = migrate_fd_flush(s);
+    g_free(s->buffer);
+    s->buffer = NULL;
+    s->buffer_size = s->buffer_capacity = 0;
+
+    if (s->mon) {
+        monitor_resume(s->mon);
+    }
+    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    if (s->close(s) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+    return ret;
+}
+
+/*
+ * Page requests from the destination: a length byte, the RAM block name
+ * and the big endian offset of the page within the block.  They are
+ * queued here and sent by the migration thread.
+ */
+static void migrate_fd_postcopy_read(void *opaque)
+{
+    MigrationState *s = opaque;
+    uint8_t *buf = s->postcopy_req;
+    ssize_t len;
 
     do {
-        fd_set wfds;
+        len = qemu_recv(s->fd, buf + s->postcopy_req_len,
+                        sizeof(s->postcopy_req) - s->postcopy_req_len, 0);
+    } while (len == -1 && socket_error() == EINTR);
 
-        FD_ZERO(&wfds);
-        FD_SET(s->fd, &wfds);
+    if (len == -1 && socket_error() == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        DPRINTF("lost connection to destination in post-copy\n");
+        qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+        if (s->state == MIG_STATE_POSTCOPY) {
+            s->state = MIG_STATE_ERROR;
+        }
+        return;
+    }
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
-    } while (ret == -1 && (s->get_error(s)) == EINTR);
+    s->postcopy_req_len += len;
+    while (s->postcopy_req_len > 0 &&
+           s->postcopy_req_len >= 1 + buf[0] + 8) {
+        char idstr[256];
+        int idlen = buf[0];
 
-    if (ret == -1) {
-        qemu_file_set_error(s->file, -s->get_error(s));
+        memcpy(idstr, buf + 1, idlen);
+        idstr[idlen] = 0;
+        ram_postcopy_request(idstr, ldq_be_p(buf + 1 + idlen));
+
+        s->postcopy_req_len -= 1 + idlen + 8;
+        memmove(buf, buf + 1 + idlen + 8, s->postcopy_req_len);
     }
 }
 
-static int migrate_fd_close(void *opaque)
+/* Stop the guest and send what is left.  Called with the global lock held. */
+static void migrate_fd_complete(MigrationState *s)
+{
+    DPRINTF("done iterating\n");
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+
+    if (ram_postcopy_pending()) {
+        if (qemu_savevm_state_complete_postcopy(s->mon, s->file) < 0) {
+            s->state = MIG_STATE_ERROR;
+        } else {
+            /* the guest now runs on the destination */
+            DPRINTF("starting post-copy\n");
+            s->state = MIG_STATE_POSTCOPY;
+            s->postcopy_req_len = 0;
+            notifier_list_notify(&migration_state_notifiers, s);
+            qemu_set_fd_handler2(s->fd, NULL, migrate_fd_postcopy_read,
+                                 NULL, s);
+            qemu_notify_event();
+        }
+    } else if (qemu_savevm_state_complete(s->mon, s->file) < 0) {
+        s->state = MIG_STATE_ERROR;
+    } else {
+        s->state = MIG_STATE_COMPLETED;
+    }
+}
+
+/*
+ * The migration thread sends guest RAM without holding the global lock,
+ * which it only takes to set up, to synchronize the dirty bitmap and to
+ * save the device state at the end.  Output is limited to xfer_limit
+ * bytes every BUFFER_DELAY milliseconds.
+ */
+static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
+    int64_t expire_time = qemu_get_clock_ms(rt_clock) + BUFFER_DELAY;
+    bool old_vm_running = false;
+    bool postcopy = false;
+    int ret;
 
-    if (s->mon) {
-        monitor_resume(s->mon);
+    qemu_mutex_lock_iothread();
+    DPRINTF("beginning savevm\n");
+    if (s->state == MIG_STATE_ACTIVE &&
+        qemu_savevm_state_begin(s->mon, s->file, s->blk, s->shared) < 0) {
+        DPRINTF("failed to begin savevm\n");
+        s->state = MIG_STATE_ERROR;
     }
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    return s->close(s);
+    qemu_mutex_unlock_iothread();
+
+    while (migrate_fd_is_running(s)) {
+        int64_t current_time = qemu_get_clock_ms(rt_clock);
+
+        if (current_time >= expire_time) {
+            s->bytes_xfer = 0;
+            expire_time = current_time + BUFFER_DELAY;
+        }
+
+        if (s->state == MIG_STATE_POSTCOPY) {
+            /* page requests are served even when over the limit */
+            ret = ram_postcopy_push(s->file);
+            if (ret < 0) {
+                migrate_fd_set_state(s, MIG_STATE_ERROR);
+            } else if (ret == 1) {
+                DPRINTF("post-copy done\n");
+                migrate_fd_set_state(s, MIG_STATE_COMPLETED);
+            }
+        } else if (s->bytes_xfer < s->xfer_limit) {
+            DPRINTF("iterate\n");
+            ret = qemu_savevm_state_iterate(s->mon, s->file);
+            if (ret < 0) {
+                migrate_fd_set_state(s, MIG_STATE_ERROR);
+            } else if (ret == 1) {
+                qemu_mutex_lock_iothread();
+                if (s->state == MIG_STATE_ACTIVE) {
+                    old_vm_running = runstate_is_running();
+                    migrate_fd_complete(s);
+                    postcopy = s->state == MIG_STATE_POSTCOPY;
+                }
+                qemu_mutex_unlock_iothread();
+            }
+        }
+
+        if (migrate_fd_flush(s) < 0) {
+            migrate_fd_set_state(s, MIG_STATE_ERROR);
+            qemu_mutex_lock_iothread();
+            if (s->state == MIG_STATE_COMPLETED) {
+                s->state = MIG_STATE_ERROR;
+            }
+            qemu_mutex_unlock_iothread();
+            break;
+        }
+
+        if (s->bytes_xfer >= s->xfer_limit && migrate_fd_is_running(s)) {
+            current_time = qemu_get_clock_ms(rt_clock);
+            if (s->state == MIG_STATE_POSTCOPY) {
+                /* do not leave page requests waiting for the next slice */
+                g_usleep(1000);
+            } else if (current_time < expire_time) {
+                g_usleep((expire_time - current_time) * 1000);
+            }
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    if (s->state == MIG_STATE_COMPLETED) {
+        runstate_set(RUN_STATE_POSTMIGRATE);
+    } else if (old_vm_running && !postcopy) {
+        vm_start();
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+static void migrate_fd_cancel(MigrationState *s)
+{
+    if (s->state != MIG_STATE_ACTIVE)
+        return;
+
+    DPRINTF("cancelling migration\n");
+
+    /* the migration thread notices and exits, then cleans up */
+    s->state = MIG_STATE_CANCELLED;
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -379,33 +730,40 @@ bool migration_has_finished(MigrationState *s)
 
 void migrate_fd_connect(MigrationState *s)
 {
-    int ret;
-
     s->state = MIG_STATE_ACTIVE;
-    s->file = qemu_fopen_ops_buffered(s,
-                                      s->bandwidth_limit,
-                                      migrate_fd_put_buffer,
-                                      migrate_fd_put_ready,
-                                      migrate_fd_wait_for_unfreeze,
-                                      migrate_fd_close);
-
-    DPRINTF("beginning savevm\n");
-    ret = qemu_savevm_state_begin(s->mon, s->file, s->blk, s->shared);
-    if (ret < 0) {
-        DPRINTF("failed, %d\n", ret);
-        migrate_fd_error(s);
-        return;
-    }
-    migrate_fd_put_ready(s);
+    s->bytes_xfer = 0;
+    s->xfer_limit = s->bandwidth_limit / XFER_LIMIT_RATIO;
+    s->buffer = NULL;
+    s->buffer_size = s->buffer_capacity = 0;
+    s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
+    s->file = qemu_fopen_ops(s, migrate_fd_put_buffer, NULL,
+                             migrate_fd_close, migrate_fd_rate_limit,
+                             migrate_fd_set_rate_limit,
+                             migrate_fd_get_rate_limit);
+
+    /* the migration thread simply blocks when the socket is full */
+    socket_set_block(s->fd);
+
+    qemu_thread_create(&s->thread, migration_thread, s);
 }
 
 static MigrationState *migrate_init(Monitor *mon, int detach, int blk, int inc)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    MigrationParameters parameters = s->parameters;
+
+    memcpy(enabled_capabilities, s->enabled_capabilities,
+           sizeof(enabled_capabilities));
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
+    memcpy(s->enabled_capabilities, enabled_capabilities,
+           sizeof(enabled_capabilities));
+    s->xbzrle_cache_size = xbzrle_cache_size;
+    s->parameters = parameters;
     s->blk = blk;
     s->shared = inc;
     s->mon = NULL;
@@ -429,11 +787,18 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     const char *uri = qdict_get_str(qdict, "uri");
     int ret;
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    /* a pending cleanup_bh means the last migration is still winding down */
+    if (migrate_fd_is_running(s) || s->cleanup_bh) {
         monitor_printf(mon, "migration already in progress\n");
         return -1;
     }
 
+    if (migrate_use_postcopy() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        monitor_printf(mon, "post-copy needs a tcp: or unix: migration\n");
+        return -1;
+    }
+
     if (qemu_savevm_state_blocked(mon)) {
         return -1;
     }
@@ -487,6 +852,235 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data)
     return 0;
 }
 
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t value = qdict_get_int(qdict, "value");
+    int64_t new_size;
+
+    /* Check for truncation */
+    if (value != (size_t)value) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "cache size",
+                      "exceeding address space");
+        return -1;
+    }
+
+    /* Cache should not be larger than guest ram size */
+    if (value > ram_bytes_total()) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "cache size",
+                      "exceeds guest ram size");
+        return -1;
+    }
+
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "cache size",
+                      "is smaller than page size");
+        return -1;
+    }
+
+    s->xbzrle_cache_size = new_size;
+
+    return 0;
+}
+
+int do_migrate_set_capability(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    MigrationState *s = migrate_get_current();
+    const char *name = qdict_get_str(qdict, "capability");
+    int state = qdict_get_bool(qdict, "state");
+    int i;
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_POSTCOPY) {
+        qerror_report(QERR_MIGRATION_ACTIVE);
+        return -1;
+    }
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        if (!strcmp(name, migration_capability_names[i])) {
+            s->enabled_capabilities[i] = state;
+            return 0;
+        }
+    }
+
+    qerror_report(QERR_INVALID_PARAMETER_VALUE, "capability",
+                  "a migration capability");
+    return -1;
+}
+
+void do_info_migrate_capabilities_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    const QDictEntry *ent;
+
+    monitor_printf(mon, "capabilities:");
+    for (ent = qdict_first(qdict); ent; ent = qdict_next(qdict, ent)) {
+        monitor_printf(mon, " %s: %s", qdict_entry_key(ent),
+                       qbool_get_int(qobject_to_qbool(qdict_entry_value(ent)))
+                       ? "on" : "off");
+    }
+    monitor_printf(mon, "\n");
+}
+
+void do_info_migrate_capabilities(Monitor *mon, QObject **ret_data)
+{
+    MigrationState *s = migrate_get_current();
+    QDict *qdict = qdict_new();
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        qdict_put(qdict, migration_capability_names[i],
+                  qbool_from_int(s->enabled_capabilities[i]));
+    }
+
+    *ret_data = QOBJECT(qdict);
+}
+
+void do_info_migrate_cache_size_print(Monitor *mon, const QObject *data)
+{
+    monitor_printf(mon, "xbzrle cache size: %" PRId64 " kbytes\n",
+                   qint_get_int(qobject_to_qint(data)) >> 10);
+}
+
+void do_info_migrate_cache_size(Monitor *mon, QObject **ret_data)
+{
+    *ret_data = QOBJECT(qint_from_int(migrate_xbzrle_cache_size()));
+}
+
+int do_migrate_set_parameter(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data)
+{
+    MigrationState *s = migrate_get_current();
+    const char *name = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_POSTCOPY) {
+        qerror_report(QERR_MIGRATION_ACTIVE);
+        return -1;
+    }
+
+    if (!strcmp(name, "compress-level")) {
+        if (value < 0 || value > 9) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                          "an integer in the range of 0 to 9");
+            return -1;
+        }
+        s->parameters.compress_level = value;
+    } else if (!strcmp(name, "compress-threads")) {
+        if (value < 1 || value > MAX_MIGRATE_COMPRESS_THREADS) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                          "an integer in the range of 1 to 255");
+            return -1;
+        }
+        s->parameters.compress_threads = value;
+    } else if (!strcmp(name, "decompress-threads")) {
+        if (value < 1 || value > MAX_MIGRATE_COMPRESS_THREADS) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                          "an integer in the range of 1 to 255");
+            return -1;
+        }
+        s->parameters.decompress_threads = value;
+    } else if (!strcmp(name, "postcopy-iterations")) {
+        if (value < 0 || value > MAX_MIGRATE_POSTCOPY_ITERATIONS) {
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "postcopy-iterations",
+                          "an integer in the range of 0 to 1000");
+            return -1;
+        }
+        s->parameters.postcopy_iterations = value;
+    } else {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "parameter",
+                      "a migration parameter");
+        return -1;
+    }
+
+    return 0;
+}
+
+void do_info_migrate_parameters_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    const QDictEntry *ent;
+
+    monitor_printf(mon, "parameters:");
+    for (ent = qdict_first(qdict); ent; ent = qdict_next(qdict, ent)) {
+        monitor_printf(mon, " %s: %" PRId64, qdict_entry_key(ent),
+                       qint_get_int(qobject_to_qint(qdict_entry_value(ent))));
+    }
+    monitor_printf(mon, "\n");
+}
+
+void do_info_migrate_parameters(Monitor *mon, QObject **ret_data)
+{
+    MigrationState *s = migrate_get_current();
+
+    *ret_data = qobject_from_jsonf("{ 'compress-level': %d, "
+                                     "'compress-threads': %d, "
+                                     "'decompress-threads': %d, "
+                                     "'postcopy-iterations': %d }",
+                                   s->parameters.compress_level,
+                                   s->parameters.compress_threads,
+                                   s->parameters.decompress_threads,
+                                   s->parameters.postcopy_iterations);
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.decompress_threads;
+}
+
+bool migrate_use_postcopy(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+int migrate_postcopy_iterations(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.postcopy_iterations;
+}
+
+bool migrate_use_xbzrle(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->xbzrle_cache_size;
+}
+
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data)
 {
@@ -17,9 +17,32 @@
 #include "qdict.h"
 #include "qemu-common.h"
 #include "notify.h"
+#include "qemu-thread.h"
+#include "main-loop.h"
 
 typedef struct MigrationState MigrationState;
 
+enum {
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_COMPRESS,
+    MIGRATION_CAPABILITY_POSTCOPY,
+    MIGRATION_CAPABILITY_MAX,
+};
+
+typedef struct MigrationParameters {
+    int compress_level;
+    int compress_threads;
+    int decompress_threads;
+    int postcopy_iterations;
+} MigrationParameters;
+
+typedef struct CompressThreadStats {
+    uint64_t pages;
+    uint64_t bytes;
+    uint64_t compressed_bytes;
+    uint64_t busy_ns;
+} CompressThreadStats;
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -33,9 +56,21 @@ struct MigrationState
     void *opaque;
     int blk;
     int shared;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t xbzrle_cache_size;
+    MigrationParameters parameters;
+    uint8_t postcopy_req[512];
+    int postcopy_req_len;
+    QemuThread thread;
+    QEMUBH *cleanup_bh;
+    size_t bytes_xfer;
+    size_t xfer_limit;
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
 };
 
-void process_incoming_migration(QEMUFile *f);
+bool process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -50,10 +85,31 @@ uint64_t migrate_max_downtime(void);
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
+int do_migrate_set_capability(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int do_migrate_set_parameter(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
 
+void do_info_migrate_capabilities_print(Monitor *mon, const QObject *data);
+
+void do_info_migrate_capabilities(Monitor *mon, QObject **ret_data);
+
+void do_info_migrate_cache_size_print(Monitor *mon, const QObject *data);
+
+void do_info_migrate_cache_size(Monitor *mon, QObject **ret_data);
+
+void do_info_migrate_parameters_print(Monitor *mon, const QObject *data);
+
+void do_info_migrate_parameters(Monitor *mon, QObject **ret_data);
+
 int exec_start_incoming_migration(const char *host_port);
 
 int exec_start_outgoing_migration(MigrationState *s, const char *host_port);
@@ -85,6 +141,35 @@ uint64_t ram_bytes_total(void);
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
 
+bool migrate_use_xbzrle(void);
+int64_t migrate_xbzrle_cache_size(void);
+
+int64_t xbzrle_cache_resize(int64_t new_size);
+
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_cache_hit(void);
+uint64_t xbzrle_mig_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_bytes_saved(void);
+
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+int compress_mig_thread_stats(CompressThreadStats *stats, int max);
+
+bool migrate_use_postcopy(void);
+int migrate_postcopy_iterations(void);
+
+bool ram_postcopy_pending(void);
+void ram_postcopy_request(const char *idstr, uint64_t offset);
+int ram_postcopy_push(QEMUFile *f);
+
+int ram_postcopy_incoming_start(QEMUFile *f);
+void ram_postcopy_prefault(void *host, size_t len);
+
 extern int incoming_expected;
 
 #endif
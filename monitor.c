@@ -482,6 +482,12 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
         default:
             abort();
             break;
@@ -914,6 +920,116 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static const char *const tb_profile_mode_names[] = {
+    [TB_PROFILE_OFF] = "off",
+    [TB_PROFILE_COUNT] = "count",
+    [TB_PROFILE_SAMPLE] = "sample",
+};
+
+/* number of TBs reported by info tb_profile */
+#define TB_PROFILE_MAX_ENTRIES 50
+
+static int do_tb_profile(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *mode = qdict_get_str(qdict, "mode");
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(tb_profile_mode_names); i++) {
+        if (!strcmp(mode, tb_profile_mode_names[i])) {
+            break;
+        }
+    }
+    if (i == ARRAY_SIZE(tb_profile_mode_names)) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "mode",
+                      "off, count or sample");
+        return -1;
+    }
+    if (!tcg_enabled() || tb_profile_set_mode(i) < 0) {
+        qerror_report(QERR_UNSUPPORTED);
+        return -1;
+    }
+    return 0;
+}
+
+static void do_info_tb_profile_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    const QListEntry *entry;
+    const char *mode;
+    int64_t total, count;
+
+    mode = qdict_get_str(qdict, "mode");
+    monitor_printf(mon, "mode: %s\n", mode);
+    if (!strcmp(mode, "off")) {
+        return;
+    }
+
+    total = qdict_get_int(qdict, "total");
+    if (!strcmp(mode, "sample")) {
+        monitor_printf(mon, "samples: %" PRId64 " in translated code, %"
+                       PRId64 " elsewhere\n",
+                       total, qdict_get_int(qdict, "other-samples"));
+    } else {
+        monitor_printf(mon, "executions: %" PRId64 "\n", total);
+    }
+
+    monitor_printf(mon, "%-18s %10s %9s %14s %6s %7s\n", "guest PC",
+                   "guest size", "host size", "count", "%", "chained");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "tbs"), entry) {
+        QDict *tb = qobject_to_qdict(qlist_entry_obj(entry));
+        char pc[20];
+
+        snprintf(pc, sizeof(pc), "0x" TARGET_FMT_lx,
+                 (target_ulong)qdict_get_int(tb, "pc"));
+        count = qdict_get_int(tb, "count");
+        monitor_printf(mon, "%-18s %10" PRId64 " %9" PRId64 " %14" PRId64
+                       " %5.1f%% %5" PRId64 "/%" PRId64 "\n", pc,
+                       qdict_get_int(tb, "guest-size"),
+                       qdict_get_int(tb, "host-size"), count,
+                       total ? count * 100.0 / total : 0.0,
+                       qdict_get_int(tb, "chained-exits"),
+                       qdict_get_int(tb, "exits"));
+    }
+}
+
+static void do_info_tb_profile(Monitor *mon, QObject **ret_data)
+{
+    TBProfileEntry *entries;
+    QDict *qdict, *tb;
+    QList *list;
+    uint64_t total, other;
+    int mode, i, n;
+
+    qdict = qdict_new();
+    mode = tb_profile_get_mode();
+    qdict_put(qdict, "mode", qstring_from_str(tb_profile_mode_names[mode]));
+    if (mode != TB_PROFILE_OFF) {
+        entries = g_new(TBProfileEntry, TB_PROFILE_MAX_ENTRIES);
+        n = tb_profile_collect(entries, TB_PROFILE_MAX_ENTRIES,
+                               &total, &other);
+        qdict_put(qdict, "total", qint_from_int(total));
+        if (mode == TB_PROFILE_SAMPLE) {
+            qdict_put(qdict, "other-samples", qint_from_int(other));
+        }
+
+        list = qlist_new();
+        for (i = 0; i < n; i++) {
+            tb = qdict_new();
+            qdict_put(tb, "pc", qint_from_int(entries[i].pc));
+            qdict_put(tb, "guest-size", qint_from_int(entries[i].guest_size));
+            qdict_put(tb, "host-size", qint_from_int(entries[i].host_size));
+            qdict_put(tb, "count", qint_from_int(entries[i].count));
+            qdict_put(tb, "exits", qint_from_int(entries[i].exits));
+            qdict_put(tb, "chained-exits",
+                      qint_from_int(entries[i].chained_exits));
+            qlist_append(list, tb);
+        }
+        qdict_put(qdict, "tbs", list);
+        g_free(entries);
+    }
+    *ret_data = QOBJECT(qdict);
+}
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -2782,6 +2898,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = bdrv_block_jobs_print,
+        .mhandler.info_new = bdrv_info_block_jobs,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -2874,6 +2998,14 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "tb_profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most executed translation blocks",
+        .user_print = do_info_tb_profile_print,
+        .mhandler.info_new = do_info_tb_profile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -3003,6 +3135,30 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_migrate_print,
         .mhandler.info_new = do_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .user_print = do_info_migrate_capabilities_print,
+        .mhandler.info_new = do_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_cache_size",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration xbzrle cache size",
+        .user_print = do_info_migrate_cache_size_print,
+        .mhandler.info_new = do_info_migrate_cache_size,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .user_print = do_info_migrate_parameters_print,
+        .mhandler.info_new = do_info_migrate_parameters,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -3076,6 +3232,14 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = bdrv_block_jobs_print,
+        .mhandler.info_new = bdrv_info_block_jobs,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
@@ -3126,6 +3290,38 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_info_migrate_print,
         .mhandler.info_new = do_info_migrate,
     },
+    {
+        .name       = "migrate-capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .user_print = do_info_migrate_capabilities_print,
+        .mhandler.info_new = do_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate-cache-size",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration xbzrle cache size",
+        .user_print = do_info_migrate_cache_size_print,
+        .mhandler.info_new = do_info_migrate_cache_size,
+    },
+    {
+        .name       = "migrate-parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .user_print = do_info_migrate_parameters_print,
+        .mhandler.info_new = do_info_migrate_parameters,
+    },
+    {
+        .name       = "tb-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most executed translation blocks",
+        .user_print = do_info_tb_profile_print,
+        .mhandler.info_new = do_info_tb_profile,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -245,6 +245,30 @@ NICState *qemu_new_nic(NetClientInfo *info,
     return nic;
 }
 
+/* Create an additional queue for @nic, connected to @peer.  All queues of a
+ * NIC share its model, name and configuration; only the first one is visited
+ * by qemu_foreach_nic().
+ */
+NICState *qemu_new_nic_queue(NICState *nic, VLANClientState *peer,
+                             unsigned queue_index, void *opaque)
+{
+    VLANClientState *nc;
+    NICState *queue;
+
+    assert(!nic->nc.vlan);
+    assert(queue_index > 0);
+
+    nc = qemu_new_net_client(nic->nc.info, NULL, peer, nic->nc.model,
+                             nic->nc.name);
+    nc->queue_index = queue_index;
+
+    queue = DO_UPCAST(NICState, nc, nc);
+    queue->conf = nic->conf;
+    queue->opaque = opaque;
+
+    return queue;
+}
+
 static void qemu_cleanup_vlan_client(VLANClientState *vc)
 {
     if (vc->vlan) {
@@ -335,7 +359,7 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     VLANState *vlan;
 
     QTAILQ_FOREACH(nc, &non_vlan_clients, next) {
-        if (nc->info->type == NET_CLIENT_TYPE_NIC) {
+        if (nc->info->type == NET_CLIENT_TYPE_NIC && !nc->queue_index) {
             func(DO_UPCAST(NICState, nc, nc), opaque);
         }
     }
@@ -668,6 +692,30 @@ VLANClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/* Collect the queues of netdev @id into @vcs, ordered by queue index.
+ * Returns the number of queues of the netdev; only the first @max of them
+ * are stored.
+ */
+int qemu_find_netdev_queues(const char *id, VLANClientState **vcs, int max)
+{
+    VLANClientState *vc;
+    int n = 0;
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (vc->info->type == NET_CLIENT_TYPE_NIC) {
+            continue;
+        }
+        if (!strcmp(vc->name, id)) {
+            if (vc->queue_index < max) {
+                vcs[vc->queue_index] = vc;
+            }
+            n = MAX(n, vc->queue_index + 1);
+        }
+    }
+
+    return n;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -975,6 +1023,10 @@ static const struct {
                 .name = "vhostforce",
                 .type = QEMU_OPT_BOOL,
                 .help = "force vhost on for non-MSIX virtio guests",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues the tap device is opened with",
         },
 #endif /* _WIN32 */
             { /* end of list */ }
@@ -1223,7 +1275,10 @@ int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
-    qemu_del_vlan_client(vc);
+    /* Multiqueue netdevs register one client per queue, all sharing the id */
+    do {
+        qemu_del_vlan_client(vc);
+    } while ((vc = qemu_find_netdev(id)) != NULL);
     qemu_opts_del(qemu_opts_find(qemu_find_opts("netdev"), id));
     return 0;
 }
@@ -1263,48 +1318,55 @@ void do_info_network(Monitor *mon)
     }
 }
 
+static void net_set_link(VLANClientState *vc, int up)
+{
+    vc->link_down = !up;
+
+    if (vc->info->link_status_changed) {
+        vc->info->link_status_changed(vc);
+    }
+
+    /* Notify peer. Don't update peer link status: this makes it possible to
+     * disconnect from host network without notifying the guest.
+     * FIXME: is disconnected link status change operation useful?
+     *
+     * Current behaviour is compatible with qemu vlans where there could be
+     * multiple clients that can still communicate with each other in
+     * disconnected mode. For now maintain this compatibility. */
+    if (vc->peer && vc->peer->info->link_status_changed) {
+        vc->peer->info->link_status_changed(vc->peer);
+    }
+}
+
 int do_set_link(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     VLANState *vlan;
     VLANClientState *vc = NULL;
     const char *name = qdict_get_str(qdict, "name");
     int up = qdict_get_bool(qdict, "up");
+    NetClientInfo *info = NULL;
 
     QTAILQ_FOREACH(vlan, &vlans, next) {
         QTAILQ_FOREACH(vc, &vlan->clients, next) {
             if (strcmp(vc->name, name) == 0) {
-                goto done;
+                net_set_link(vc, up);
+                return 0;
             }
         }
     }
+
+    /* Update all queues of a multiqueue netdev or NIC */
     QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
-        if (!strcmp(vc->name, name)) {
-            goto done;
+        if (!strcmp(vc->name, name) && (!info || vc->info == info)) {
+            info = vc->info;
+            net_set_link(vc, up);
         }
     }
-done:
 
-    if (!vc) {
+    if (!info) {
         qerror_report(QERR_DEVICE_NOT_FOUND, name);
         return -1;
     }
-
-    vc->link_down = !up;
-
-    if (vc->info->link_status_changed) {
-        vc->info->link_status_changed(vc);
-    }
-
-    /* Notify peer. Don't update peer link status: this makes it possible to
-     * disconnect from host network without notifying the guest.
-     * FIXME: is disconnected link status change operation useful?
-     *
-     * Current behaviour is compatible with qemu vlans where there could be
-     * multiple clients that can still communicate with each other in
-     * disconnected mode. For now maintain this compatibility. */
-    if (vc->peer && vc->peer->info->link_status_changed) {
-        vc->peer->info->link_status_changed(vc->peer);
-    }
     return 0;
 }
 
@@ -749,3 +749,13 @@ struct vhost_net *tap_get_vhost_net(VLANClientState *nc)
 {
     return NULL;
 }
+
+int tap_enable(VLANClientState *nc)
+{
+    return -1;
+}
+
+int tap_disable(VLANClientState *nc)
+{
+    return -1;
+}
@@ -48,6 +48,9 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Maximum number of queues of a multiqueue tap device */
+#define MAX_TAP_QUEUES 1024
+
 typedef struct TAPState {
     VLANClientState nc;
     int fd;
@@ -58,6 +61,7 @@ typedef struct TAPState {
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int enabled : 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -71,9 +75,9 @@ static void tap_writable(void *opaque);
 static void tap_update_fd_handler(TAPState *s)
 {
     qemu_set_fd_handler2(s->fd,
-                         s->read_poll  ? tap_can_send : NULL,
-                         s->read_poll  ? tap_send     : NULL,
-                         s->write_poll ? tap_writable : NULL,
+                         s->read_poll && s->enabled  ? tap_can_send : NULL,
+                         s->read_poll && s->enabled  ? tap_send     : NULL,
+                         s->write_poll && s->enabled ? tap_writable : NULL,
                          s);
 }
 
@@ -275,6 +279,49 @@ void tap_set_offload(VLANClientState *nc, int csum, int tso4,
     tap_fd_set_offload(s->fd, csum, tso4, tso6, ecn, ufo);
 }
 
+/* Attach a queue of a multiqueue tap device back to the interface. */
+int tap_enable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_enable(s->fd);
+    if (ret == 0) {
+        s->enabled = 1;
+        tap_update_fd_handler(s);
+    }
+    return ret;
+}
+
+/* Detach a queue of a multiqueue tap device.  The kernel stops steering
+ * packets to it until it is enabled again.
+ */
+int tap_disable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (!s->enabled) {
+        return 0;
+    }
+
+    ret = tap_fd_disable(s->fd);
+    if (ret == 0) {
+        qemu_purge_queued_packets(nc);
+        s->enabled = 0;
+        tap_update_fd_handler(s);
+    }
+    return ret;
+}
+
 static void tap_cleanup(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -338,6 +385,7 @@ static TAPState *net_tap_fd_init(VLANState *vlan,
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = 0;
     s->has_ufo = tap_probe_has_ufo(s->fd);
+    s->enabled = 1;
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
     s->vhost_net = NULL;
@@ -388,7 +436,8 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int mq_required,
+                        bool run_script)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -405,11 +454,16 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
 
+    if (!run_script) {
+        return fd;
+    }
+
     setup_script = qemu_opt_get(opts, "script");
     if (setup_script &&
         setup_script[0] != '\0' &&
@@ -424,51 +478,26 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
     return fd;
 }
 
-int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+/* Set up one queue on @fd
+ *
+ * Returns NULL on error, after closing @fd and deleting the queue again.
+ */
+static TAPState *net_init_tap_one(QemuOpts *opts, Monitor *mon,
+                                  const char *name, VLANState *vlan, int fd,
+                                  int vnet_hdr, unsigned queue_index,
+                                  int queues)
 {
     TAPState *s;
-    int fd, vnet_hdr = 0;
-
-    if (qemu_opt_get(opts, "fd")) {
-        if (qemu_opt_get(opts, "ifname") ||
-            qemu_opt_get(opts, "script") ||
-            qemu_opt_get(opts, "downscript") ||
-            qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
-            return -1;
-        }
-
-        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
-        if (fd == -1) {
-            return -1;
-        }
-
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-
-        vnet_hdr = tap_probe_vnet_hdr(fd);
-    } else {
-        if (!qemu_opt_get(opts, "script")) {
-            qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
-        }
-
-        if (!qemu_opt_get(opts, "downscript")) {
-            qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
-        }
-
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
-            return -1;
-        }
-    }
 
     s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
     if (!s) {
         close(fd);
-        return -1;
+        return NULL;
     }
+    s->nc.queue_index = queue_index;
 
     if (tap_set_sndbuf(s->fd, opts) < 0) {
-        return -1;
+        goto fail;
     }
 
     if (qemu_opt_get(opts, "fd")) {
@@ -480,11 +509,18 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         script     = qemu_opt_get(opts, "script");
         downscript = qemu_opt_get(opts, "downscript");
 
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-                 "ifname=%s,script=%s,downscript=%s",
-                 ifname, script, downscript);
+        if (queues > 1) {
+            snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                     "ifname=%s,script=%s,downscript=%s,queue=%u/%d",
+                     ifname, script, downscript, queue_index, queues);
+        } else {
+            snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                     "ifname=%s,script=%s,downscript=%s",
+                     ifname, script, downscript);
+        }
 
-        if (strcmp(downscript, "no") != 0) {
+        /* The interface goes away together with its first queue */
+        if (queue_index == 0 && strcmp(downscript, "no") != 0) {
             snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
             snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
         }
@@ -497,23 +533,107 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         if (qemu_opt_get(opts, "vhostfd")) {
             r = net_handle_fd_param(mon, qemu_opt_get(opts, "vhostfd"));
             if (r == -1) {
-                return -1;
+                goto fail;
             }
             vhostfd = r;
         } else {
             vhostfd = -1;
         }
+        /* Every queue gets its own vhost device, and thus its own worker */
         s->vhost_net = vhost_net_init(&s->nc, vhostfd, force);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
-            return -1;
+            goto fail;
         }
     } else if (qemu_opt_get(opts, "vhostfd")) {
         error_report("vhostfd= is not valid without vhost");
+        goto fail;
+    }
+
+    return s;
+
+fail:
+    qemu_del_vlan_client(&s->nc);
+    return NULL;
+}
+
+int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+{
+    TAPState *taps[MAX_TAP_QUEUES];
+    int fd, vnet_hdr = 0, i, queues;
+
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1 || queues > MAX_TAP_QUEUES) {
+        error_report("queues= must be between 1 and %d", MAX_TAP_QUEUES);
         return -1;
     }
+    if (queues > 1) {
+        if (vlan) {
+            error_report("queues= is only valid with -netdev");
+            return -1;
+        }
+        if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "vhostfd")) {
+            error_report("fd= and vhostfd= are invalid with queues=");
+            return -1;
+        }
+    }
+
+    if (qemu_opt_get(opts, "fd")) {
+        if (qemu_opt_get(opts, "ifname") ||
+            qemu_opt_get(opts, "script") ||
+            qemu_opt_get(opts, "downscript") ||
+            qemu_opt_get(opts, "vnet_hdr")) {
+            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
+            return -1;
+        }
+
+        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
+        if (fd == -1) {
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        vnet_hdr = tap_probe_vnet_hdr(fd);
+
+        if (!net_init_tap_one(opts, mon, name, vlan, fd, vnet_hdr, 0, 1)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!qemu_opt_get(opts, "script")) {
+        qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
+    }
+
+    if (!qemu_opt_get(opts, "downscript")) {
+        qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
+    }
+
+    /* The first queue creates the interface and records its name in
+     * ifname=, so that the remaining queues attach to the same device.
+     */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(opts, &vnet_hdr, queues > 1, i == 0);
+        if (fd == -1) {
+            goto fail;
+        }
+
+        taps[i] = net_init_tap_one(opts, mon, name, vlan, fd, vnet_hdr,
+                                   i, queues);
+        if (!taps[i]) {
+            goto fail;
+        }
+    }
 
     return 0;
+
+fail:
+    /* Delete the queues created so far; the first one runs the downscript */
+    while (--i >= 0) {
+        qemu_del_vlan_client(&taps[i]->nc);
+    }
+    return -1;
 }
 
 VHostNetState *tap_get_vhost_net(VLANClientState *nc)
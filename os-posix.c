@@ -39,6 +39,8 @@
 #include "sysemu.h"
 #include "net/slirp.h"
 #include "qemu-options.h"
+#include "qemu-config.h"
+#include "thread-pool.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/prctl.h>
@@ -167,6 +169,26 @@ void os_set_proc_name(const char *s)
  * Parse OS specific command line options.
  * return 0 if option handled, -1 otherwise
  */
+static void os_parse_thread_pool(const char *optarg)
+{
+    QemuOpts *opts;
+    const char *name;
+    uint64_t min, max;
+
+    opts = qemu_opts_parse(qemu_find_opts("thread-pool"), optarg, 1);
+    if (!opts) {
+        exit(1);
+    }
+    name = qemu_opt_get(opts, "name");
+    min = qemu_opt_get_number(opts, "min", 0);
+    max = qemu_opt_get_number(opts, "max", 64);
+    if (!name || max < 1 || max > INT_MAX || min > max) {
+        fprintf(stderr, "Invalid thread pool size: %s\n", optarg);
+        exit(1);
+    }
+    thread_pool_configure(name, min, max);
+}
+
 void os_parse_cmd_args(int index, const char *optarg)
 {
     switch (index) {
@@ -189,6 +211,9 @@ void os_parse_cmd_args(int index, const char *optarg)
     case QEMU_OPTION_daemonize:
         daemonize = 1;
         break;
+    case QEMU_OPTION_thread_pool:
+        os_parse_thread_pool(optarg);
+        break;
     }
     return;
 }
@@ -0,0 +1,188 @@
+/*
+ * Page cache for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "page_cache.h"
+
+typedef struct CacheItem {
+    uint64_t it_addr;
+    uint64_t it_age;
+    uint8_t *it_data;
+} CacheItem;
+
+struct PageCache {
+    CacheItem *page_cache;
+    unsigned int page_size;
+    int64_t max_num_items;
+    uint64_t max_item_age;
+    int64_t num_items;
+};
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    int64_t i;
+    PageCache *cache;
+
+    if (num_pages <= 0) {
+        return NULL;
+    }
+
+    cache = g_malloc(sizeof(*cache));
+
+    /* round down to the nearest power of 2 so that slot lookup is a mask */
+    if (num_pages & (num_pages - 1)) {
+        num_pages = 1LL << (63 - clz64(num_pages));
+    }
+    cache->page_size = page_size;
+    cache->num_items = 0;
+    cache->max_item_age = 0;
+    cache->max_num_items = num_pages;
+
+    cache->page_cache = g_malloc(cache->max_num_items *
+                                 sizeof(*cache->page_cache));
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_addr = -1;
+    }
+
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    int64_t i;
+
+    assert(cache);
+    assert(cache->page_cache);
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        g_free(cache->page_cache[i].it_data);
+    }
+
+    g_free(cache->page_cache);
+    g_free(cache);
+}
+
+static size_t cache_get_cache_pos(const PageCache *cache, uint64_t address)
+{
+    assert(cache->max_num_items);
+    return (address / cache->page_size) & (cache->max_num_items - 1);
+}
+
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    size_t pos;
+
+    assert(cache);
+    assert(cache->page_cache);
+
+    pos = cache_get_cache_pos(cache, addr);
+
+    return cache->page_cache[pos].it_addr == addr;
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    size_t pos;
+
+    assert(cache);
+    assert(cache->page_cache);
+
+    pos = cache_get_cache_pos(cache, addr);
+
+    return &cache->page_cache[pos];
+}
+
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it->it_addr == addr ? it->it_data : NULL;
+}
+
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it;
+
+    assert(pdata);
+
+    it = cache_get_by_addr(cache, addr);
+
+    if (!it->it_data) {
+        it->it_data = g_malloc(cache->page_size);
+        cache->num_items++;
+    }
+
+    memcpy(it->it_data, pdata, cache->page_size);
+    it->it_age = ++cache->max_item_age;
+    it->it_addr = addr;
+
+    return it->it_data;
+}
+
+int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    PageCache *new_cache;
+    int64_t i;
+    CacheItem *old_it, *new_it;
+
+    assert(cache);
+
+    /* cache was not inited */
+    if (cache->page_cache == NULL) {
+        return -1;
+    }
+
+    new_cache = cache_init(new_num_pages, cache->page_size);
+    if (!new_cache) {
+        return -1;
+    }
+
+    /* same size */
+    if (new_cache->max_num_items == cache->max_num_items) {
+        cache_fini(new_cache);
+        return cache->max_num_items;
+    }
+
+    /* move the existing pages into the new cache, keeping the most recently
+     * used page when two of them collide */
+    for (i = 0; i < cache->max_num_items; i++) {
+        old_it = &cache->page_cache[i];
+        if (old_it->it_addr == -1) {
+            continue;
+        }
+
+        new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+        if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            g_free(old_it->it_data);
+        } else {
+            if (new_it->it_data) {
+                g_free(new_it->it_data);
+            } else {
+                new_cache->num_items++;
+            }
+            *new_it = *old_it;
+        }
+        old_it->it_data = NULL;
+    }
+
+    new_cache->max_item_age = cache->max_item_age;
+
+    g_free(cache->page_cache);
+    cache->page_cache = new_cache->page_cache;
+    cache->max_num_items = new_cache->max_num_items;
+    cache->num_items = new_cache->num_items;
+    cache->max_item_age = new_cache->max_item_age;
+
+    g_free(new_cache);
+
+    return cache->max_num_items;
+}
@@ -13,6 +13,8 @@
  * load/stores from C code.
  */
 #define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+#define smp_mb()    __sync_synchronize()
 
 #elif defined(__powerpc__)
 
@@ -22,6 +24,8 @@
  * each other
  */
 #define smp_wmb()   asm volatile("eieio" ::: "memory")
+#define smp_rmb()   asm volatile("lwsync" ::: "memory")
+#define smp_mb()    asm volatile("sync" ::: "memory")
 
 #else
 
@@ -32,6 +36,8 @@
  * be overkill.
  */
 #define smp_wmb()   __sync_synchronize()
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
 
 #endif
 
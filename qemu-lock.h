@@ -29,21 +29,31 @@
 
 #else
 
-/* Empty implementations, on the theory that system mode emulation
- * is single-threaded. This means that these functions should only
- * be used from code run in the TCG cpu thread, and cannot protect
- * data structures which might also be accessed from the IO thread
- * or from signal handlers.
+/* System emulation runs all vCPUs on a single thread unless multi-threaded
+ * TCG is enabled, so the locks are only taken in that mode.  They are
+ * never held for long (TB lookup and code generation, guest atomic
+ * sequences), hence a plain test-and-set spin loop.  parallel_cpus is
+ * set before any vCPU thread starts and never changes afterwards.
  */
 typedef int spinlock_t;
 #define SPIN_LOCK_UNLOCKED 0
 
 static inline void spin_lock(spinlock_t *lock)
 {
+    if (parallel_cpus) {
+        while (__sync_lock_test_and_set(lock, 1)) {
+            while (*(volatile spinlock_t *)lock) {
+                /* spin */
+            }
+        }
+    }
 }
 
 static inline void spin_unlock(spinlock_t *lock)
 {
+    if (parallel_cpus) {
+        __sync_lock_release(lock);
+    }
 }
 
 #endif
@@ -31,7 +31,11 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "-machine [type=]name[,prop[=value][,...]]\n"
     "                selects emulated machine (-machine ? for list)\n"
     "                property accel=accel1[:accel2[:...]] selects accelerator\n"
-    "                supported accelerators are kvm, xen, tcg (default: tcg)\n",
+    "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
+    "                property tcg_threads=single|multi runs all TCG vCPUs on\n"
+    "                one host thread or each on its own (default: single)\n"
+    "                property tcg_traces=on|off retranslates frequently\n"
+    "                executed code paths as single blocks (default: off)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -44,6 +48,19 @@ This is used to enable an accelerator. Depending on the target architecture,
 kvm, xen, or tcg can be available. By default, tcg is used. If there is more
 than one accelerator specified, the next one is used if the previous one fails
 to initialize.
+@item tcg_threads=single|multi
+Select how TCG runs the virtual CPUs. With @code{single} (the default), all
+CPUs are emulated in turn by one host thread. With @code{multi}, each CPU
+gets its own host thread; this is only available for some host and target
+combinations and cannot be combined with @option{-icount}.  Atomic guest
+instructions, such as x86 LOCK-prefixed instructions or ARM store-exclusive,
+run while the other CPUs are stopped, so guests that use them heavily scale
+less well.
+@item tcg_traces=on|off
+Count how often each translated block is executed, and translate the
+paths taken through the hottest blocks again as one longer block.  This
+speeds up loops in CPU bound guests.  It is only available for some
+targets and cannot be combined with @option{-icount}.
 @end table
 ETEXI
 
@@ -135,7 +152,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,bps=b][,bps_rd=r][,bps_wr=w][,iops=i][,iops_rd=r][,iops_wr=w]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -183,6 +201,19 @@ host disk is full; report the error to the guest otherwise).
 The default setting is @option{werror=enospc} and @option{rerror=report}.
 @item readonly
 Open drive @option{file} as read-only. Guest write attempts will fail.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" and enables whether to copy read backing
+file sectors into the image file.  This avoids fetching the same data from a
+slow or remote backing file again.  Overlapping guest requests are serialized
+while a copy is in flight.  The image must be writable.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total,
+@var{r} bytes per second for reads and @var{w} bytes per second for writes.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to @var{i} I/O operations per second in total, @var{r} read
+and @var{w} write operations per second.
+Requests exceeding a limit are delayed, not failed. A value of 0 (the
+default) means no limit; total and per-direction limits can be combined.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -1037,6 +1068,15 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings allows to restore the original static behavior of encodings
 like Tight.
 
+@item threads=@var{n}
+
+Encode framebuffer updates in @var{n} threads (up to 16) when QEMU is built
+with @code{--enable-vnc-thread}.  The updates of each client are encoded in
+order by one thread at a time, but the threads of different clients run
+concurrently with any encoding, so this helps when several clients are
+connected.  Large raw and hextile updates are also split into tiles that
+idle threads encode in parallel.
+
 @end table
 ETEXI
 
@@ -1179,7 +1219,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1193,6 +1233,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open n queues of a multiqueue tap device\n"
+    "                    (-netdev only, requires IFF_MULTI_QUEUE support in the kernel)\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
@@ -1372,6 +1414,15 @@ qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
                -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of a
+multiqueue TAP interface.  A virtio-net device with @option{mq=on} that is
+connected to it gets one receive/transmit queue pair per TAP queue, and
+with @option{vhost=on} every queue is served by its own vhost-net device:
+@example
+qemu linux.img -netdev tap,id=hn0,queues=4,vhost=on \
+               -device virtio-net-pci,netdev=hn0,mq=on,vectors=10
+@end example
+
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
 Connect the VLAN @var{n} to a remote VLAN in another QEMU virtual
@@ -2372,7 +2423,26 @@ DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
 STEXI
 @item -tb-size @var{n}
 @findex -tb-size
-Set TB size.
+Set TB size, that is the initial size in megabytes of the buffer for
+translated code.  The buffer is split into regions; when it is full,
+the least recently used region is discarded, or the buffer grows up to
+four times its initial size if discarded code keeps being translated
+again.
+ETEXI
+
+#ifndef _WIN32
+DEF("thread-pool", HAS_ARG, QEMU_OPTION_thread_pool, \
+    "-thread-pool name=pool[,min=n][,max=n]\n"
+    "                set the number of worker threads of a thread pool\n",
+    QEMU_ARCH_ALL)
+#endif
+STEXI
+@item -thread-pool name=@var{pool}[,min=@var{n}][,max=@var{n}]
+@findex -thread-pool
+Keep at least @option{min} worker threads of @var{pool} alive while idle, and
+never run more than @option{max} of them.  The pools are @code{paio} for
+block device I/O and @code{v9fs} for the 9p file system.  Both default to
+@code{min=0,max=64}.
 ETEXI
 
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
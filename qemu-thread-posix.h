@@ -14,4 +14,9 @@ struct QemuThread {
     pthread_t thread;
 };
 
+/* Wait for a thread created with qemu_thread_create() to exit and return
+ * its exit value.  Only available on POSIX hosts.
+ */
+void *qemu_thread_join(QemuThread *thread);
+
 #endif
@@ -0,0 +1,32 @@
+/*
+ * Abstraction layer for defining and using TLS variables
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_TLS_H
+#define QEMU_TLS_H
+
+/* Per-thread variables.  They are only really thread-local on Linux; the
+ * dummy implementation defines plain global variables.
+ *
+ * This is fine for the per-vCPU variables that use it, because the only
+ * configurations with more than one thread running guest code are KVM,
+ * linux-user and multi-threaded TCG, and the latter is refused on hosts
+ * without a real implementation (QEMU_TLS_IS_REAL is 0 there).
+ */
+#if defined(__linux__)
+#define DECLARE_TLS(type, x) extern DEFINE_TLS(type, x)
+#define DEFINE_TLS(type, x)  __thread __typeof__(type) tls__##x
+#define tls_var(x)           tls__##x
+#define QEMU_TLS_IS_REAL     1
+#else
+#define DECLARE_TLS(type, x) extern DEFINE_TLS(type, x)
+#define DEFINE_TLS(type, x)  __typeof__(type) tls__##x
+#define tls_var(x)           tls__##x
+#define QEMU_TLS_IS_REAL     0
+#endif
+
+#endif
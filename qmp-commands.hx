@@ -561,6 +561,132 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-set-cache-size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+SQMP
+migrate-set-cache-size
+----------------------
+
+Set cache size to be used by XBZRLE migration, the cache size will be rounded
+down to the nearest power of 2
+
+Arguments:
+
+- "value": cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "enable/disable a migration capability",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_capability,
+    },
+
+SQMP
+migrate-set-capability
+----------------------
+
+Enable/Disable a migration capability.  Capabilities can only be changed
+while no migration is in progress.
+
+Arguments:
+
+- "capability": capability name (json-string)
+     - Possible values: "xbzrle", "compress", "postcopy"
+- "state": new state of the capability (json-bool)
+
+Example:
+
+-> { "execute": "migrate-set-capability",
+     "arguments": { "capability": "xbzrle", "state": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "set a migration parameter",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_parameter,
+    },
+
+SQMP
+migrate-set-parameter
+---------------------
+
+Set a migration parameter.  Parameters can only be changed while no
+migration is in progress.
+
+Arguments:
+
+- "parameter": parameter name (json-string)
+     - "compress-level": zlib compression level, 0 to 9
+     - "compress-threads": number of compression threads on the source
+     - "decompress-threads": number of decompression threads on the
+       destination
+     - "postcopy-iterations": passes over guest memory before switching
+       to post-copy
+- "value": new value of the parameter (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-parameter",
+     "arguments": { "parameter": "compress-threads", "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "mode:s",
+        .params     = "mode",
+        .help       = "profile the execution of translated code",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_tb_profile,
+    },
+
+SQMP
+tb-profile
+----------
+
+Set the TCG translation block profiling mode.  Changing the mode discards
+the translated code and resets the counters.
+
+Arguments:
+
+- "mode": profiling mode (json-string)
+     - "off": no profiling
+     - "count": count the executions of each block in the generated code
+     - "sample": sample the host program counter on SIGPROF (x86 Linux
+       hosts only)
+
+Returns QERR_UNSUPPORTED when TCG is not in use or the mode is not
+available on this host.
+
+Example:
+
+-> { "execute": "tb-profile", "arguments": { "mode": "count" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -682,6 +808,158 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change I/O throttle limits for a block drive.  Requests exceeding the limits
+are queued until they can be serviced.  A value of 0 disables the
+corresponding limit.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps":  total throughput limit in bytes per second (json-int)
+- "bps_rd":  read throughput limit in bytes per second (json-int)
+- "bps_wr":  write throughput limit in bytes per second (json-int)
+- "iops":  total I/O operations per second (json-int)
+- "iops_rd":  read I/O operations per second (json-int)
+- "iops_wr":  write I/O operations per second (json-int)
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                        "bps": 1000000,
+                                                        "bps_rd": 0,
+                                                        "bps_wr": 0,
+                                                        "iops": 0,
+                                                        "iops_rd": 0,
+                                                        "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Copy data from a backing file into a block device.
+
+The block streaming operation is performed in the background until the entire
+backing file has been copied.  This command returns immediately once streaming
+has started.  The status of ongoing block streaming operations can be checked
+with query-block-jobs.  The operation can be stopped before it has completed
+using the block_job_cancel command.
+
+On successful completion the image file is updated to drop the backing file
+and the BLOCK_JOB_COMPLETED event is emitted.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed": maximum speed in bytes per second (json-int, optional)
+
+Errors:
+
+- DeviceNotFound if the device does not exist
+- DeviceInUse if streaming is already active on this device
+- Unsupported if the image format cannot drop its backing file
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+SQMP
+block_job_set_speed
+-------------------
+
+Set maximum speed for a background block operation.
+
+This command can only be issued when there is an active block job.
+
+Throttling can be disabled by setting the speed to 0.
+
+Arguments:
+
+- "device": device name (json-string)
+- "value": maximum speed in bytes per second (json-int)
+
+Errors:
+
+- DeviceNotActive if there is no block job on the device
+- Unsupported if the job type does not support a speed limit
+
+Example:
+
+-> { "execute": "block_job_set_speed",
+     "arguments": { "device": "virtio0", "value": 1048576 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+SQMP
+block_job_cancel
+----------------
+
+Stop an active block streaming operation.
+
+This command returns immediately after marking the active block streaming
+operation for cancellation.  The BLOCK_JOB_CANCELLED event is emitted once
+the operation has actually stopped; until then the job is still reported by
+query-block-jobs.  The image file retains its backing file unless the
+streaming operation happens to complete just as it is being cancelled.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Errors:
+
+- DeviceNotActive if there is no block job on the device
+
+Example:
+
+-> { "execute": "block_job_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1154,6 +1432,12 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "bps": limit total bytes per second (json-int)
+         - "bps_rd": limit read bytes per second (json-int)
+         - "bps_wr": limit write bytes per second (json-int)
+         - "iops": limit total I/O operations per second (json-int)
+         - "iops_rd": limit read operations per second (json-int)
+         - "iops_wr": limit write operations per second (json-int)
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
                to "ok" when the "cont" command is issued (json_string, optional)
@@ -1173,7 +1457,13 @@ Example:
                "ro":false,
                "drv":"qcow2",
                "encrypted":false,
-               "file":"disks/test.img"
+               "file":"disks/test.img",
+               "bps":1000000,
+               "bps_rd":0,
+               "bps_wr":0,
+               "iops":1000000,
+               "iops_rd":0,
+               "iops_wr":0
             },
             "type":"unknown"
          },
@@ -1224,6 +1514,14 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_throttled_operations": read operations delayed by I/O throttling
+                                 (json-int)
+    - "wr_throttled_operations": write operations delayed by I/O throttling
+                                 (json-int)
+    - "rd_throttled_time_ns": total time reads spent throttled in
+                              nano-seconds (json-int)
+    - "wr_throttled_time_ns": total time writes spent throttled in
+                              nano-seconds (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1308,6 +1606,33 @@ Example:
 
 EQMP
 
+SQMP
+query-block-jobs
+----------------
+
+Show progress of ongoing block device operations.
+
+Return a json-array of all active block jobs.  Each job is a json-object with
+the following keys:
+
+- "type": job type, "stream" for image streaming (json-string)
+- "device": device name (json-string)
+- "len": maximum progress value (json-int)
+- "offset": current progress value (json-int)
+- "speed": rate limit, bytes per second (json-int)
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- { "return": [
+        { "type": "stream", "device": "virtio0",
+          "len": 10737418240, "offset": 709632,
+          "speed": 0 }
+     ]
+   }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -1697,6 +2022,15 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "updates": number of framebuffer updates sent (json-int)
+- "queued_updates": number of framebuffer updates being encoded (json-int)
+- "latency_avg": average time between the start of an update and the
+                 time it was ready to send, in microseconds (json-int)
+- "latency_max": maximum of the same time, in microseconds (json-int)
+- "rtt": estimated round-trip time to the client, in microseconds, 0 if
+         unknown (json-int)
+- "bandwidth": estimated bandwidth to the client, in KB/s, 0 if unknown
+               or not limiting (json-int)
 
 Example:
 
@@ -1712,7 +2046,13 @@ Example:
             {
                "host":"127.0.0.1",
                "service":"50401",
-               "family":"ipv4"
+               "family":"ipv4",
+               "updates":120,
+               "queued_updates":0,
+               "latency_avg":850,
+               "latency_max":4200,
+               "rtt":0,
+               "bandwidth":0
             }
          ]
       }
@@ -1849,9 +2189,10 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
-- "ram": only present if "status" is "active", it is a json-object with the
-  following RAM information (in bytes):
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
+- "ram": only present if "status" is "active" or "postcopy-active", it is a
+  json-object with the following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
@@ -1860,6 +2201,24 @@ The main json-object contains the following:
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "xbzrle-cache": only present if "status" is "active" or "completed" and
+  the xbzrle capability is enabled, it is a json-object with the following
+  XBZRLE information:
+         - "cache-size": XBZRLE cache size (json-int)
+         - "bytes": total XBZRLE bytes transferred (json-int)
+         - "pages": number of XBZRLE compressed pages (json-int)
+         - "cache-hit": number of pages found in the cache (json-int)
+         - "cache-miss": number of cache misses (json-int)
+         - "overflow": number of pages whose delta was larger than the
+           page itself (json-int)
+         - "bytes-saved": bytes not sent thanks to XBZRLE (json-int)
+- "compress-threads": only present if "status" is "active" or "completed"
+  and the compress capability is enabled, it is a json-array with one
+  json-object per compression thread:
+         - "pages": number of pages compressed (json-int)
+         - "bytes": amount of data compressed (json-int)
+         - "compressed-bytes": amount of compressed data (json-int)
+         - "busy-time": time spent compressing, in nanoseconds (json-int)
 
 Examples:
 
@@ -1911,6 +2270,106 @@ Examples:
       }
    }
 
+6. Migration is being performed and XBZRLE is active:
+
+-> { "execute": "query-migrate" }
+<- {
+      "return":{
+         "status":"active",
+         "ram":{
+            "total":1057024,
+            "remaining":1053304,
+            "transferred":3720
+         },
+         "xbzrle-cache":{
+            "cache-size":67108864,
+            "bytes":20971520,
+            "pages":2444343,
+            "cache-hit":2444356,
+            "cache-miss":2244,
+            "overflow":34434,
+            "bytes-saved":9987654321
+         }
+      }
+   }
+
+EQMP
+
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Query current migration capabilities.
+
+Return a json-object with one json-bool member per capability.
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": { "xbzrle": false, "compress": false, "postcopy": false } }
+
+EQMP
+
+SQMP
+query-migrate-cache-size
+------------------------
+
+Show the XBZRLE cache size in bytes (json-int).
+
+Example:
+
+-> { "execute": "query-migrate-cache-size" }
+<- { "return": 67108864 }
+
+EQMP
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters.
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1,
+                 "compress-threads": 8,
+                 "decompress-threads": 2,
+                 "postcopy-iterations": 5 } }
+
+EQMP
+
+SQMP
+query-tb-profile
+----------------
+
+Show the translation blocks with the highest counts, at most 50.
+
+Return a json-object with the following information:
+
+- "mode": profiling mode, see tb-profile (json-string)
+- "total": sum of the counts of all blocks (json-int, not present if
+  "mode" is "off")
+- "other-samples": samples outside of translated code (json-int, only
+  present if "mode" is "sample")
+- "tbs": json-array of json-objects, sorted by decreasing count (not
+  present if "mode" is "off"):
+     - "pc": guest program counter of the block (json-int)
+     - "guest-size": size of the guest code in bytes (json-int)
+     - "host-size": size of the host code in bytes (json-int)
+     - "count": executions or samples (json-int)
+     - "exits": direct jumps out of the block (json-int)
+     - "chained-exits": direct jumps already patched to another block
+       (json-int)
+
+Example:
+
+-> { "execute": "query-tb-profile" }
+<- { "return": { "mode": "count", "total": 1830291,
+                 "tbs": [ { "pc": 1048838, "guest-size": 12,
+                            "host-size": 86, "count": 250184,
+                            "exits": 2, "chained-exits": 2 } ] } }
+
 EQMP
 
 SQMP
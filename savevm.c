@@ -83,6 +83,7 @@
 #include "qemu-queue.h"
 #include "qemu-timer.h"
 #include "cpus.h"
+#include "main-loop.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -333,6 +334,80 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+int qemu_socket_fd(QEMUFile *f)
+{
+    QEMUFileSocket *s;
+
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+
+    s = f->opaque;
+    return s->fd;
+}
+
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t len;
+    QEMUFile *file;
+} QEMUFileBuffer;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (s->len + size > s->size) {
+        s->size = MAX(s->size * 2, s->len + size);
+        s->data = g_realloc(s->data, s->size);
+    }
+    memcpy(s->data + s->len, buf, size);
+    s->len += size;
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->len) {
+        return 0;
+    }
+    size = MIN(size, s->len - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buffer_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    g_free(s->data);
+    g_free(s);
+    return 0;
+}
+
+/* Open an in-memory file.  A file opened for reading takes ownership of
+ * @data, which must have been allocated with g_malloc.
+ */
+static QEMUFile *qemu_fopen_buffer(uint8_t *data, size_t len, int is_writable)
+{
+    QEMUFileBuffer *s = g_malloc0(sizeof(QEMUFileBuffer));
+
+    s->data = data;
+    s->size = s->len = len;
+    if (is_writable) {
+        s->file = qemu_fopen_ops(s, buffer_put_buffer, NULL, buffer_close,
+                                 NULL, NULL, NULL);
+    } else {
+        s->file = qemu_fopen_ops(s, NULL, buffer_get_buffer, buffer_close,
+                                 NULL, NULL, NULL);
+    }
+    return s->file;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -1510,6 +1585,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
 
 bool qemu_savevm_state_blocked(Monitor *mon)
 {
@@ -1580,6 +1656,10 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
  */
+/*
+ * Unlike the other stages, this is called without the global lock held;
+ * live handlers take it themselves for the parts that need it.
+ */
 int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1605,20 +1685,14 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
     if (ret != 0) {
         return ret;
     }
-    ret = qemu_file_get_error(f);
-    if (ret != 0) {
-        qemu_savevm_state_cancel(mon, f);
-    }
-    return ret;
+    return qemu_file_get_error(f);
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+static int qemu_savevm_state_complete_live(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->save_live_state == NULL)
             continue;
@@ -1633,6 +1707,13 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         }
     }
 
+    return 0;
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1655,6 +1736,53 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(mon, f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_savevm_state_complete_devices(f);
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Complete a migration whose RAM is going to be sent after the guest has
+ * started on the destination.  The device state is sent as a single
+ * package, so that the destination can start serving page requests from
+ * the rest of the stream before it loads the devices, which may touch
+ * guest memory.
+ */
+int qemu_savevm_state_complete_postcopy(Monitor *mon, QEMUFile *f)
+{
+    QEMUFileBuffer *pkg;
+    QEMUFile *pkg_file;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(mon, f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pkg_file = qemu_fopen_buffer(NULL, 0, 1);
+    qemu_savevm_state_complete_devices(pkg_file);
+    qemu_fflush(pkg_file);
+    pkg = pkg_file->opaque;
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, pkg->len);
+    qemu_put_buffer(f, pkg->data, pkg->len);
+    qemu_fclose(pkg_file);
 
     return qemu_file_get_error(f);
 }
@@ -1683,11 +1811,16 @@ static int qemu_savevm_state(Monitor *mon, QEMUFile *f)
     if (ret < 0)
         goto out;
 
+    qemu_mutex_unlock_iothread();
     do {
         ret = qemu_savevm_state_iterate(mon, f);
-        if (ret < 0)
-            goto out;
     } while (ret == 0);
+    qemu_mutex_lock_iothread();
+
+    if (ret < 0) {
+        qemu_savevm_state_cancel(mon, f);
+        goto out;
+    }
 
     ret = qemu_savevm_state_complete(mon, f);
 
@@ -1799,30 +1932,46 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateEntryList *handlers);
+
+static int loadvm_postcopy_package(QEMUFile *f, LoadStateEntryList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+    QEMUFile *pkg_file;
+    uint8_t *data;
+    uint32_t len;
     int ret;
 
-    if (qemu_savevm_state_blocked(default_mon)) {
+    len = qemu_get_be32(f);
+    data = g_malloc(len);
+    if (qemu_get_buffer(f, data, len) != len) {
+        g_free(data);
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    /* From now on the rest of the stream belongs to post-copy */
+    ret = ram_postcopy_incoming_start(f);
+    if (ret < 0) {
+        g_free(data);
+        return ret;
+    }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    pkg_file = qemu_fopen_buffer(data, len, 0);
+    ret = qemu_loadvm_state_main(pkg_file, handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(pkg_file);
     }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+    qemu_fclose(pkg_file);
+
+    return ret < 0 ? ret : 1;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateEntryList *handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1845,16 +1994,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1863,49 +2010,81 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            /* the package holds the end of the device state */
+            return loadvm_postcopy_package(f, handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+/*
+ * Returns 1 if the stream switched to post-copy, in which case @f is owned
+ * by the post-copy receive thread and must not be touched any more.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntryList loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(default_mon)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret >= 0) {
+        cpu_synchronize_all_post_init();
+    }
 
-out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         g_free(le);
@@ -2127,7 +2306,7 @@ int load_vmstate(const char *name)
     }
 
     /* Flush all IO requests so they don't interfere with the new state.  */
-    qemu_aio_flush();
+    bdrv_drain_all();
 
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
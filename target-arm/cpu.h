@@ -33,6 +33,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* store-exclusive runs with the other vCPU threads stopped */
+#define TARGET_HAS_PARALLEL_TCG
+
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
 #define EXCP_PREFETCH_ABORT  3
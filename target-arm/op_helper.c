@@ -241,6 +241,16 @@ void HELPER(wfi)(void)
     cpu_loop_exit(env);
 }
 
+void HELPER(exclusive_lock)(void)
+{
+    cpu_atomic_lock();
+}
+
+void HELPER(exclusive_unlock)(void)
+{
+    cpu_atomic_unlock();
+}
+
 void HELPER(exception)(uint32_t excp)
 {
     env->exception_index = excp;
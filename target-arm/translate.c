@@ -6567,7 +6567,14 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
          {Rd} = 0;
        } else {
          {Rd} = 1;
-       } */
+       }
+       With multi-threaded TCG the lock helper leaves the TB, and the
+       instruction is executed again with the other vCPUs stopped.  */
+    if (parallel_cpus) {
+        gen_set_condexec(s);
+        gen_set_pc_im(s->pc - 4);
+        gen_helper_exclusive_lock();
+    }
     fail_label = gen_new_label();
     done_label = gen_new_label();
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
@@ -6621,6 +6628,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
     tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+    if (parallel_cpus) {
+        gen_helper_exclusive_unlock();
+    }
 }
 #endif
 
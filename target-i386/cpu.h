@@ -36,6 +36,12 @@
 
 #define TARGET_HAS_ICE 1
 
+/* LOCK-prefixed instructions run with the other vCPU threads stopped */
+#define TARGET_HAS_PARALLEL_TCG
+
+/* the translator can follow hot traces across branches */
+#define TARGET_HAS_TRACES
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -204,18 +204,16 @@ static const uint8_t rclb_table[32] = {
 #define floatx80_l2e make_floatx80( 0x3fff, 0xb8aa3b295c17f0bcLL )
 #define floatx80_l2t make_floatx80( 0x4000, 0xd49a784bcd1b8afeLL )
 
-/* broken thread support */
-
-static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
+/* LOCK prefix, see cpu_atomic_lock() */
 
 void helper_lock(void)
 {
-    spin_lock(&global_cpu_lock);
+    cpu_atomic_lock();
 }
 
 void helper_unlock(void)
 {
-    spin_unlock(&global_cpu_lock);
+    cpu_atomic_unlock();
 }
 
 void helper_write_eflags(target_ulong t0, uint32_t update_mask)
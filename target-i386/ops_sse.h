@@ -35,6 +35,31 @@
 #define SUFFIX _xmm
 #endif
 
+#if SHIFT == 1 && defined(__SSE2__)
+/* x86 hosts lay out the lanes like the guest and implement the same
+   operations, so apply them to the whole register at once */
+#include <emmintrin.h>
+#define SSE_HOST_VECTOR
+
+#define SSE_HELPER_HOST(name, V)\
+void glue(name, SUFFIX) (Reg *d, Reg *s)\
+{\
+    __m128i a = _mm_loadu_si128((__m128i *)d);\
+    __m128i b = _mm_loadu_si128((__m128i *)s);\
+    _mm_storeu_si128((__m128i *)d, V(a, b));\
+}
+#endif
+
+#ifdef SSE_HOST_VECTOR
+SSE_HELPER_HOST(helper_psrlw, _mm_srl_epi16)
+SSE_HELPER_HOST(helper_psraw, _mm_sra_epi16)
+SSE_HELPER_HOST(helper_psllw, _mm_sll_epi16)
+SSE_HELPER_HOST(helper_psrld, _mm_srl_epi32)
+SSE_HELPER_HOST(helper_psrad, _mm_sra_epi32)
+SSE_HELPER_HOST(helper_pslld, _mm_sll_epi32)
+SSE_HELPER_HOST(helper_psrlq, _mm_srl_epi64)
+SSE_HELPER_HOST(helper_psllq, _mm_sll_epi64)
+#else
 void glue(helper_psrlw, SUFFIX)(Reg *d, Reg *s)
 {
     int shift;
@@ -196,6 +221,7 @@ void glue(helper_psllq, SUFFIX)(Reg *d, Reg *s)
 #endif
     }
 }
+#endif
 
 #if SHIFT == 1
 void glue(helper_psrldq, SUFFIX)(Reg *d, Reg *s)
@@ -283,6 +309,19 @@ void glue(name, SUFFIX) (Reg *d, Reg *s)\
     )\
 }
 
+/* same with V, the host vector operation, if there is one */
+#ifdef SSE_HOST_VECTOR
+#define SSE_HELPER_BV(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE_HELPER_WV(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE_HELPER_LV(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE_HELPER_QV(name, F, V) SSE_HELPER_HOST(name, V)
+#else
+#define SSE_HELPER_BV(name, F, V) SSE_HELPER_B(name, F)
+#define SSE_HELPER_WV(name, F, V) SSE_HELPER_W(name, F)
+#define SSE_HELPER_LV(name, F, V) SSE_HELPER_L(name, F)
+#define SSE_HELPER_QV(name, F, V) SSE_HELPER_Q(name, F)
+#endif
+
 #if SHIFT == 0
 static inline int satub(int x)
 {
@@ -358,55 +397,60 @@ static inline int satsw(int x)
 #define FAVG(a, b) ((a) + (b) + 1) >> 1
 #endif
 
-SSE_HELPER_B(helper_paddb, FADD)
-SSE_HELPER_W(helper_paddw, FADD)
-SSE_HELPER_L(helper_paddl, FADD)
-SSE_HELPER_Q(helper_paddq, FADD)
+SSE_HELPER_BV(helper_paddb, FADD, _mm_add_epi8)
+SSE_HELPER_WV(helper_paddw, FADD, _mm_add_epi16)
+SSE_HELPER_LV(helper_paddl, FADD, _mm_add_epi32)
+SSE_HELPER_QV(helper_paddq, FADD, _mm_add_epi64)
 
-SSE_HELPER_B(helper_psubb, FSUB)
-SSE_HELPER_W(helper_psubw, FSUB)
-SSE_HELPER_L(helper_psubl, FSUB)
-SSE_HELPER_Q(helper_psubq, FSUB)
+SSE_HELPER_BV(helper_psubb, FSUB, _mm_sub_epi8)
+SSE_HELPER_WV(helper_psubw, FSUB, _mm_sub_epi16)
+SSE_HELPER_LV(helper_psubl, FSUB, _mm_sub_epi32)
+SSE_HELPER_QV(helper_psubq, FSUB, _mm_sub_epi64)
 
-SSE_HELPER_B(helper_paddusb, FADDUB)
-SSE_HELPER_B(helper_paddsb, FADDSB)
-SSE_HELPER_B(helper_psubusb, FSUBUB)
-SSE_HELPER_B(helper_psubsb, FSUBSB)
+SSE_HELPER_BV(helper_paddusb, FADDUB, _mm_adds_epu8)
+SSE_HELPER_BV(helper_paddsb, FADDSB, _mm_adds_epi8)
+SSE_HELPER_BV(helper_psubusb, FSUBUB, _mm_subs_epu8)
+SSE_HELPER_BV(helper_psubsb, FSUBSB, _mm_subs_epi8)
 
-SSE_HELPER_W(helper_paddusw, FADDUW)
-SSE_HELPER_W(helper_paddsw, FADDSW)
-SSE_HELPER_W(helper_psubusw, FSUBUW)
-SSE_HELPER_W(helper_psubsw, FSUBSW)
+SSE_HELPER_WV(helper_paddusw, FADDUW, _mm_adds_epu16)
+SSE_HELPER_WV(helper_paddsw, FADDSW, _mm_adds_epi16)
+SSE_HELPER_WV(helper_psubusw, FSUBUW, _mm_subs_epu16)
+SSE_HELPER_WV(helper_psubsw, FSUBSW, _mm_subs_epi16)
 
-SSE_HELPER_B(helper_pminub, FMINUB)
-SSE_HELPER_B(helper_pmaxub, FMAXUB)
+SSE_HELPER_BV(helper_pminub, FMINUB, _mm_min_epu8)
+SSE_HELPER_BV(helper_pmaxub, FMAXUB, _mm_max_epu8)
 
-SSE_HELPER_W(helper_pminsw, FMINSW)
-SSE_HELPER_W(helper_pmaxsw, FMAXSW)
+SSE_HELPER_WV(helper_pminsw, FMINSW, _mm_min_epi16)
+SSE_HELPER_WV(helper_pmaxsw, FMAXSW, _mm_max_epi16)
 
-SSE_HELPER_Q(helper_pand, FAND)
-SSE_HELPER_Q(helper_pandn, FANDN)
-SSE_HELPER_Q(helper_por, FOR)
-SSE_HELPER_Q(helper_pxor, FXOR)
+SSE_HELPER_QV(helper_pand, FAND, _mm_and_si128)
+SSE_HELPER_QV(helper_pandn, FANDN, _mm_andnot_si128)
+SSE_HELPER_QV(helper_por, FOR, _mm_or_si128)
+SSE_HELPER_QV(helper_pxor, FXOR, _mm_xor_si128)
 
-SSE_HELPER_B(helper_pcmpgtb, FCMPGTB)
-SSE_HELPER_W(helper_pcmpgtw, FCMPGTW)
-SSE_HELPER_L(helper_pcmpgtl, FCMPGTL)
+SSE_HELPER_BV(helper_pcmpgtb, FCMPGTB, _mm_cmpgt_epi8)
+SSE_HELPER_WV(helper_pcmpgtw, FCMPGTW, _mm_cmpgt_epi16)
+SSE_HELPER_LV(helper_pcmpgtl, FCMPGTL, _mm_cmpgt_epi32)
 
-SSE_HELPER_B(helper_pcmpeqb, FCMPEQ)
-SSE_HELPER_W(helper_pcmpeqw, FCMPEQ)
-SSE_HELPER_L(helper_pcmpeql, FCMPEQ)
+SSE_HELPER_BV(helper_pcmpeqb, FCMPEQ, _mm_cmpeq_epi8)
+SSE_HELPER_WV(helper_pcmpeqw, FCMPEQ, _mm_cmpeq_epi16)
+SSE_HELPER_LV(helper_pcmpeql, FCMPEQ, _mm_cmpeq_epi32)
 
-SSE_HELPER_W(helper_pmullw, FMULLW)
+SSE_HELPER_WV(helper_pmullw, FMULLW, _mm_mullo_epi16)
 #if SHIFT == 0
 SSE_HELPER_W(helper_pmulhrw, FMULHRW)
 #endif
-SSE_HELPER_W(helper_pmulhuw, FMULHUW)
-SSE_HELPER_W(helper_pmulhw, FMULHW)
+SSE_HELPER_WV(helper_pmulhuw, FMULHUW, _mm_mulhi_epu16)
+SSE_HELPER_WV(helper_pmulhw, FMULHW, _mm_mulhi_epi16)
 
-SSE_HELPER_B(helper_pavgb, FAVG)
-SSE_HELPER_W(helper_pavgw, FAVG)
+SSE_HELPER_BV(helper_pavgb, FAVG, _mm_avg_epu8)
+SSE_HELPER_WV(helper_pavgw, FAVG, _mm_avg_epu16)
 
+#ifdef SSE_HOST_VECTOR
+SSE_HELPER_HOST(helper_pmuludq, _mm_mul_epu32)
+SSE_HELPER_HOST(helper_pmaddwd, _mm_madd_epi16)
+SSE_HELPER_HOST(helper_psadbw, _mm_sad_epu8)
+#else
 void glue(helper_pmuludq, SUFFIX) (Reg *d, Reg *s)
 {
     d->Q(0) = (uint64_t)s->L(0) * (uint64_t)d->L(0);
@@ -461,6 +505,7 @@ void glue(helper_psadbw, SUFFIX) (Reg *d, Reg *s)
     d->Q(1) = val;
 #endif
 }
+#endif
 
 void glue(helper_maskmov, SUFFIX) (Reg *d, Reg *s, target_ulong a0)
 {
@@ -519,6 +564,34 @@ void helper_shufpd(Reg *d, Reg *s, int order)
     *d = r;
 }
 
+#ifdef SSE_HOST_VECTOR
+/* pshufd only takes an immediate order, so dispatch on all 256 of them */
+#define PSHUFD_CASE(n) case (n): v = _mm_shuffle_epi32(v, (n)); break;
+#define PSHUFD_CASE4(n) PSHUFD_CASE(n) PSHUFD_CASE((n) + 1) \
+                        PSHUFD_CASE((n) + 2) PSHUFD_CASE((n) + 3)
+#define PSHUFD_CASE16(n) PSHUFD_CASE4(n) PSHUFD_CASE4((n) + 4) \
+                         PSHUFD_CASE4((n) + 8) PSHUFD_CASE4((n) + 12)
+#define PSHUFD_CASE64(n) PSHUFD_CASE16(n) PSHUFD_CASE16((n) + 16) \
+                         PSHUFD_CASE16((n) + 32) PSHUFD_CASE16((n) + 48)
+
+void glue(helper_pshufd, SUFFIX) (Reg *d, Reg *s, int order)
+{
+    __m128i v = _mm_loadu_si128((__m128i *)s);
+
+    switch (order & 0xff) {
+    PSHUFD_CASE64(0)
+    PSHUFD_CASE64(64)
+    PSHUFD_CASE64(128)
+    PSHUFD_CASE64(192)
+    }
+    _mm_storeu_si128((__m128i *)d, v);
+}
+
+#undef PSHUFD_CASE
+#undef PSHUFD_CASE4
+#undef PSHUFD_CASE16
+#undef PSHUFD_CASE64
+#else
 void glue(helper_pshufd, SUFFIX) (Reg *d, Reg *s, int order)
 {
     Reg r;
@@ -528,6 +601,7 @@ void glue(helper_pshufd, SUFFIX) (Reg *d, Reg *s, int order)
     r.L(3) = s->L((order >> 6) & 3);
     *d = r;
 }
+#endif
 
 void glue(helper_pshuflw, SUFFIX) (Reg *d, Reg *s, int order)
 {
@@ -588,10 +662,44 @@ void helper_ ## name ## sd (Reg *d, Reg *s)\
 #define FPU_MAX(size, a, b) (a) > (b) ? (a) : (b)
 #define FPU_SQRT(size, a, b) float ## size ## _sqrt(b, &env->sse_status)
 
+#ifdef SSE_HOST_VECTOR
+/* The guest MXCSR is not emulated, so sse_status always rounds to
+   nearest and its flags are never read: the host instructions, with
+   the default MXCSR, give the same results.  */
+#define SSE_HELPER_S_V(name)\
+void helper_ ## name ## ps (Reg *d, Reg *s)\
+{\
+    _mm_storeu_ps((float *)d, _mm_ ## name ## _ps(_mm_loadu_ps((float *)d),\
+                                                  _mm_loadu_ps((float *)s)));\
+}\
+\
+void helper_ ## name ## ss (Reg *d, Reg *s)\
+{\
+    _mm_storeu_ps((float *)d, _mm_ ## name ## _ss(_mm_loadu_ps((float *)d),\
+                                                  _mm_loadu_ps((float *)s)));\
+}\
+void helper_ ## name ## pd (Reg *d, Reg *s)\
+{\
+    _mm_storeu_pd((double *)d, _mm_ ## name ## _pd(_mm_loadu_pd((double *)d),\
+                                                   _mm_loadu_pd((double *)s)));\
+}\
+\
+void helper_ ## name ## sd (Reg *d, Reg *s)\
+{\
+    _mm_storeu_pd((double *)d, _mm_ ## name ## _sd(_mm_loadu_pd((double *)d),\
+                                                   _mm_loadu_pd((double *)s)));\
+}
+
+SSE_HELPER_S_V(add)
+SSE_HELPER_S_V(sub)
+SSE_HELPER_S_V(mul)
+SSE_HELPER_S_V(div)
+#else
 SSE_HELPER_S(add, FPU_ADD)
 SSE_HELPER_S(sub, FPU_SUB)
 SSE_HELPER_S(mul, FPU_MUL)
 SSE_HELPER_S(div, FPU_DIV)
+#endif
 SSE_HELPER_S(min, FPU_MIN)
 SSE_HELPER_S(max, FPU_MAX)
 SSE_HELPER_S(sqrt, FPU_SQRT)
@@ -2078,6 +2186,12 @@ target_ulong helper_popcnt(target_ulong n, uint32_t type)
 #endif
 
 #undef SHIFT
+#undef SSE_HOST_VECTOR
+#undef SSE_HELPER_HOST
+#undef SSE_HELPER_BV
+#undef SSE_HELPER_WV
+#undef SSE_HELPER_LV
+#undef SSE_HELPER_QV
 #undef XMM_ONLY
 #undef Reg
 #undef B
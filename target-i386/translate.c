@@ -115,6 +115,15 @@ typedef struct DisasContext {
     int cpuid_ext_features;
     int cpuid_ext2_features;
     int cpuid_ext3_features;
+    int tb_jmp_used; /* goto_tb slots already used */
+    /* trace translation, see tb_gen_trace() */
+    int trace_idx; /* blocks of the trace translated so far */
+    int trace_branch_idx; /* trace_idx at the conditional branch */
+    target_ulong trace_end; /* end of the code translated so far */
+    int nb_trace_exits;
+    int trace_exit_label[TB_TRACE_MAX_EXITS];
+    int trace_exit_slot[TB_TRACE_MAX_EXITS];
+    target_ulong trace_exit_eip[TB_TRACE_MAX_EXITS];
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2281,11 +2290,24 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
+    /* a side exit of a trace may have taken the slot */
+    if (s->tb_jmp_used & (1 << tb_num)) {
+        tb_num ^= 1;
+    }
     /* NOTE: we handle the case where the TB spans two pages here */
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
+        if (s->tb_jmp_used & (1 << tb_num)) {
+            /* the trace has one exit too many: stop it before its
+               conditional branch, tb_gen_code() translates it again */
+            tb->trace_len = s->trace_branch_idx;
+            gen_jmp_im(eip);
+            gen_eob(s);
+            return;
+        }
         /* jump to same page: we can use a direct jump */
         tcg_gen_goto_tb(tb_num);
+        s->tb_jmp_used |= 1 << tb_num;
         gen_jmp_im(eip);
         tcg_gen_exit_tb((tcg_target_long)tb + tb_num);
     } else {
@@ -2295,6 +2317,78 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     }
 }
 
+/* If the trace being translated continues at 'eip', go on translating
+   there and return true.  */
+static bool gen_trace_follow(DisasContext *s, target_ulong eip)
+{
+    if (!s->jmp_opt ||
+        !tb_trace_continues(s->tb, s->trace_idx, s->cs_base + eip)) {
+        return false;
+    }
+    s->trace_idx++;
+    if (s->pc > s->trace_end) {
+        s->trace_end = s->pc;
+    }
+    s->pc = s->cs_base + eip;
+    return true;
+}
+
+/* Return true if a conditional branch can be followed: its other
+   direction becomes a side exit.  */
+static inline bool trace_can_branch(DisasContext *s, target_ulong eip)
+{
+    return s->nb_trace_exits < TB_TRACE_MAX_EXITS &&
+        tb_trace_continues(s->tb, s->trace_idx, s->cs_base + eip);
+}
+
+/* Return a label that leaves the trace for 'eip'.  The exits are
+   generated after the last instruction by gen_trace_exits(), but they
+   get a direct jump slot first: the blocks that follow them in the
+   trace will run less often.  */
+static int gen_trace_exit_label(DisasContext *s, target_ulong eip)
+{
+    int l = gen_new_label();
+    int n = -1;
+
+    if (((s->cs_base + eip) & TARGET_PAGE_MASK) ==
+        (s->tb->pc & TARGET_PAGE_MASK)) {
+        if (!(s->tb_jmp_used & 1)) {
+            n = 0;
+        } else if (!(s->tb_jmp_used & 2)) {
+            n = 1;
+        }
+    }
+    if (n >= 0) {
+        s->tb_jmp_used |= 1 << n;
+    }
+    s->trace_exit_label[s->nb_trace_exits] = l;
+    s->trace_exit_slot[s->nb_trace_exits] = n;
+    s->trace_exit_eip[s->nb_trace_exits++] = eip;
+    return l;
+}
+
+/* cc_op was stored before the branch to a side exit, so unlike gen_eob()
+   this must not store dc->cc_op here */
+static void gen_trace_exits(DisasContext *s)
+{
+    target_ulong eip;
+    int i, n;
+
+    for (i = 0; i < s->nb_trace_exits; i++) {
+        eip = s->trace_exit_eip[i];
+        n = s->trace_exit_slot[i];
+        gen_set_label(s->trace_exit_label[i]);
+        if (n >= 0) {
+            tcg_gen_goto_tb(n);
+            gen_jmp_im(eip);
+            tcg_gen_exit_tb((tcg_target_long)s->tb + n);
+        } else {
+            gen_jmp_im(eip);
+            tcg_gen_exit_tb(0);
+        }
+    }
+}
+
 static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
@@ -2302,7 +2396,18 @@ static inline void gen_jcc(DisasContext *s, int b,
 
     cc_op = s->cc_op;
     gen_update_cc_op(s);
-    if (s->jmp_opt) {
+    if (s->jmp_opt && trace_can_branch(s, val)) {
+        /* leave the trace if the branch is not taken */
+        s->trace_branch_idx = s->trace_idx;
+        gen_jcc1(s, cc_op, b ^ 1, gen_trace_exit_label(s, next_eip));
+        gen_trace_follow(s, val);
+        s->cc_op = cc_op;
+    } else if (s->jmp_opt && trace_can_branch(s, next_eip)) {
+        s->trace_branch_idx = s->trace_idx;
+        gen_jcc1(s, cc_op, b, gen_trace_exit_label(s, val));
+        gen_trace_follow(s, next_eip);
+        s->cc_op = cc_op;
+    } else if (s->jmp_opt) {
         l1 = gen_new_label();
         gen_jcc1(s, cc_op, b, l1);
         
@@ -2654,6 +2759,19 @@ static void gen_enter(DisasContext *s, int esp_addend, int level)
     }
 }
 
+/* Start a locked instruction.  With multi-threaded TCG the lock helper
+   leaves the TB, and the instruction is executed again from cur_eip with
+   the other vCPUs stopped.  */
+static void gen_lock(DisasContext *s, target_ulong cur_eip)
+{
+    if (parallel_cpus) {
+        if (s->cc_op != CC_OP_DYNAMIC)
+            gen_op_set_cc_op(s->cc_op);
+        gen_jmp_im(cur_eip);
+    }
+    gen_helper_lock();
+}
+
 static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
@@ -2786,6 +2904,47 @@ static inline void gen_op_movq_env_0(int d_offset)
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, d_offset);
 }
 
+#define SSE_LOGIC_AND  0
+#define SSE_LOGIC_ANDN 1
+#define SSE_LOGIC_OR   2
+#define SSE_LOGIC_XOR  3
+
+/* pand, pandn, por or pxor on the nb_q 64 bit words of an MMX or SSE
+   register, inline instead of through a helper */
+static void gen_op_logic_q(int op, int d_offset, int s_offset, int nb_q)
+{
+    TCGv_i64 t0;
+    int i;
+
+    t0 = tcg_temp_new_i64();
+    for (i = 0; i < nb_q; i++) {
+        if (d_offset == s_offset &&
+            (op == SSE_LOGIC_ANDN || op == SSE_LOGIC_XOR)) {
+            /* pandn or pxor of a register with itself */
+            tcg_gen_movi_i64(cpu_tmp1_i64, 0);
+        } else {
+            tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, d_offset + i * 8);
+            tcg_gen_ld_i64(t0, cpu_env, s_offset + i * 8);
+            switch (op) {
+            case SSE_LOGIC_AND:
+                tcg_gen_and_i64(cpu_tmp1_i64, cpu_tmp1_i64, t0);
+                break;
+            case SSE_LOGIC_ANDN:
+                tcg_gen_andc_i64(cpu_tmp1_i64, t0, cpu_tmp1_i64);
+                break;
+            case SSE_LOGIC_OR:
+                tcg_gen_or_i64(cpu_tmp1_i64, cpu_tmp1_i64, t0);
+                break;
+            case SSE_LOGIC_XOR:
+                tcg_gen_xor_i64(cpu_tmp1_i64, cpu_tmp1_i64, t0);
+                break;
+            }
+        }
+        tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, d_offset + i * 8);
+    }
+    tcg_temp_free_i64(t0);
+}
+
 #define SSE_SPECIAL ((void *)1)
 #define SSE_DUMMY ((void *)2)
 
@@ -4059,6 +4218,26 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv))sse_op2)(cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+        case 0x54: /* andps, andpd */
+        case 0xdb: /* pand */
+            gen_op_logic_q(SSE_LOGIC_AND, op1_offset, op2_offset,
+                           is_xmm ? 2 : 1);
+            break;
+        case 0x55: /* andnps, andnpd */
+        case 0xdf: /* pandn */
+            gen_op_logic_q(SSE_LOGIC_ANDN, op1_offset, op2_offset,
+                           is_xmm ? 2 : 1);
+            break;
+        case 0x56: /* orps, orpd */
+        case 0xeb: /* por */
+            gen_op_logic_q(SSE_LOGIC_OR, op1_offset, op2_offset,
+                           is_xmm ? 2 : 1);
+            break;
+        case 0x57: /* xorps, xorpd */
+        case 0xef: /* pxor */
+            gen_op_logic_q(SSE_LOGIC_XOR, op1_offset, op2_offset,
+                           is_xmm ? 2 : 1);
+            break;
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -4204,7 +4383,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
 
     /* lock generation */
     if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
+        gen_lock(s, pc_start - s->cs_base);
 
     /* now check op code */
  reswitch:
@@ -5313,7 +5492,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_op_mov_TN_reg(ot, 0, reg);
             /* for xchg, lock is implicit */
             if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
+                gen_lock(s, pc_start - s->cs_base);
             gen_op_ld_T1_A0(ot + s->mem_index);
             gen_op_st_T0_A0(ot + s->mem_index);
             if (!(prefixes & PREFIX_LOCK))
@@ -6256,7 +6435,9 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            if (!gen_trace_follow(s, tval)) {
+                gen_jmp(s, tval);
+            }
         }
         break;
     case 0x9a: /* lcall im */
@@ -6283,7 +6464,9 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        if (!gen_trace_follow(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0xea: /* ljmp im */
         {
@@ -6304,7 +6487,9 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        if (!gen_trace_follow(s, tval)) {
+            gen_jmp(s, tval);
+        }
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(s, OT_BYTE);
@@ -7789,6 +7974,11 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     gen_opc_end = gen_opc_buf + OPC_MAX_SIZE;
 
     dc->is_jmp = DISAS_NEXT;
+    dc->tb_jmp_used = 0;
+    dc->trace_idx = 0;
+    dc->trace_branch_idx = 0;
+    dc->trace_end = pc_start;
+    dc->nb_trace_exits = 0;
     pc_ptr = pc_start;
     lj = -1;
     num_insns = 0;
@@ -7852,6 +8042,10 @@ static inline void gen_intermediate_code_internal(CPUState *env,
             break;
         }
     }
+    gen_trace_exits(dc);
+    if (pc_ptr > dc->trace_end) {
+        dc->trace_end = pc_ptr;
+    }
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
     gen_icount_end(tb, num_insns);
@@ -7875,13 +8069,13 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         else
 #endif
             disas_flags = !dc->code32;
-        log_target_disas(pc_start, pc_ptr - pc_start, disas_flags);
+        log_target_disas(pc_start, dc->trace_end - pc_start, disas_flags);
         qemu_log("\n");
     }
 #endif
 
     if (!search_pc) {
-        tb->size = pc_ptr - pc_start;
+        tb->size = dc->trace_end - pc_start;
         tb->icount = num_insns;
     }
 }
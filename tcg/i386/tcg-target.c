@@ -944,8 +944,10 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        tcg_code_reloc(s, TCG_CODE_RELOC_PC32, dest);
         tcg_out32(s, disp);
     } else {
+        tcg_code_reloc(s, TCG_CODE_RELOC_ABS, dest);
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
@@ -962,6 +964,48 @@ static void tcg_out_jmp(TCGContext *s, tcg_target_long dest)
     tcg_out_branch(s, 0, dest);
 }
 
+/* Number of code bytes that tcg_apply_code_reloc() accesses at the
+   relocation offset, or -1 for an unknown relocation type.  */
+int tcg_code_reloc_size(const TCGCodeReloc *r)
+{
+    switch (r->type) {
+    case TCG_CODE_RELOC_PC32:
+        return 4;
+    case TCG_CODE_RELOC_ABS:
+        return 0;
+    case TCG_CODE_RELOC_TB:
+        return sizeof(tcg_target_long);
+    }
+    return -1;
+}
+
+/* Patch a code relocation in a copy of a TB placed at 'code'.  Return
+   false if tcg_out_branch() would have picked the other encoding at the
+   new address, as regenerating the code must give the same layout.  */
+bool tcg_apply_code_reloc(const TCGCodeReloc *r, uint8_t *code,
+                          tcg_target_long tb)
+{
+    uint8_t *p = code + r->offset;
+    tcg_target_long disp;
+
+    switch (r->type) {
+    case TCG_CODE_RELOC_PC32:
+        disp = r->value - (tcg_target_long)p - 4;
+        if (disp != (int32_t)disp) {
+            return false;
+        }
+        *(uint32_t *)p = disp;
+        return true;
+    case TCG_CODE_RELOC_ABS:
+        disp = r->value - (tcg_target_long)p - 5;
+        return disp != (int32_t)disp;
+    case TCG_CODE_RELOC_TB:
+        *(tcg_target_long *)p = tb + r->value;
+        return true;
+    }
+    return false;
+}
+
 #if defined(CONFIG_SOFTMMU)
 
 #include "../../softmmu_defs.h"
@@ -1026,8 +1070,9 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     tgen_arithi(s, ARITH_AND + rexw, r0,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + rexw, r1,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    /* the TLB size changes at run time */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + rexw, r1,
+                         TCG_AREG0, offsetof(CPUState, tlb_mask));
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, r1, TCG_AREG0, r1, 0,
                              offsetof(CPUState, tlb_table[mem_index][0])
@@ -1450,12 +1495,30 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        if (s->code_relocs_enabled && args[0] != 0) {
+            /* use the same encoding for any TB address, so that the
+               value can be patched when the code is moved */
+            tcg_out_opc(s, OPC_MOVL_Iv + P_REXW, 0, TCG_REG_EAX, 0);
+            tcg_code_reloc(s, TCG_CODE_RELOC_TB, args[0]);
+            tcg_out32(s, args[0]);
+#if TCG_TARGET_REG_BITS == 64
+            tcg_out32(s, args[0] >> 31 >> 1);
+#endif
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
-            /* direct jump method */
+            /* direct jump method; with multi-threaded TCG keep the
+               displacement 4-byte aligned so that it can be patched
+               while another vCPU thread runs this code */
+            if (parallel_cpus) {
+                while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                    tcg_out8(s, 0x90); /* nop */
+                }
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
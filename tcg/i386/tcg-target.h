@@ -121,6 +121,9 @@ enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+/* the backend records code relocations (see TCGCodeReloc) */
+#define TCG_TARGET_HAS_CODE_RELOCS
+
 /* Note: must be synced with dyngen-exec.h */
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
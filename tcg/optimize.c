@@ -48,10 +48,40 @@ struct tcg_temp_info {
     uint16_t prev_copy;
     uint16_t next_copy;
     tcg_target_ulong val;
+    tcg_target_ulong mask;
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* State saved at a branch whose target label has no other predecessor,
+   so that it can be restored when the label is reached.  */
+static struct tcg_temp_info label_temps[TCG_MAX_TEMPS];
+static int label_temps_label;
+static int label_refs[TCG_MAX_LABELS];
+
+/* Stores to CPUState fields that have not been read yet.  */
+#define MAX_PENDING_STORES 16
+
+struct tcg_pending_store {
+    TCGArg base;
+    tcg_target_long ofs;
+    int size;
+    int op_index;
+};
+
+static struct tcg_pending_store pending_stores[MAX_PENDING_STORES];
+static int nb_pending_stores;
+
+static void reset_all_temps(int nb_temps)
+{
+    int i;
+
+    for (i = 0; i < nb_temps; i++) {
+        temps[i].state = TCG_TEMP_UNDEF;
+        temps[i].mask = -1;
+    }
+}
+
 /* Reset TEMP's state to TCG_TEMP_ANY.  If TEMP was a representative of some
    class of equivalent temp's, a new representative should be chosen in this
    class. */
@@ -85,6 +115,16 @@ static void reset_temp(TCGArg temp, int nb_temps, int nb_globals)
     if (new_base != (TCGArg)-1 && temps[new_base].next_copy == new_base) {
         temps[new_base].state = TCG_TEMP_ANY;
     }
+    temps[temp].mask = -1;
+}
+
+/* Return the bits of TEMP that may be nonzero.  */
+static tcg_target_ulong temp_mask(TCGArg temp)
+{
+    if (temps[temp].state == TCG_TEMP_CONST) {
+        return temps[temp].val;
+    }
+    return temps[temp].mask;
 }
 
 static int op_bits(TCGOpcode op)
@@ -111,6 +151,7 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args, TCGArg dst,
                             TCGArg src, int nb_temps, int nb_globals)
 {
         reset_temp(dst, nb_temps, nb_globals);
+        temps[dst].mask = temps[src].mask;
         assert(temps[src].state != TCG_TEMP_COPY);
         /* Don't try to copy if one of temps is a global or either one
            is local and another is register */
@@ -267,15 +308,228 @@ static TCGArg do_constant_folding(TCGOpcode op, TCGArg x, TCGArg y)
     return res;
 }
 
+/* Return the bits of the result of OP that may be nonzero, given the
+   known bits of its inputs.  Must be called before the output is reset.
+   The high half of a 32-bit result is undefined on 64-bit hosts.  */
+static tcg_target_ulong result_mask(TCGOpcode op, const TCGArg *args)
+{
+    tcg_target_ulong mask;
+
+    switch (op) {
+    CASE_OP_32_64(and):
+        mask = temp_mask(args[1]) & temp_mask(args[2]);
+        break;
+    CASE_OP_32_64(andc):
+        mask = temp_mask(args[1]);
+        break;
+    CASE_OP_32_64(or):
+    CASE_OP_32_64(xor):
+        mask = temp_mask(args[1]) | temp_mask(args[2]);
+        break;
+    CASE_OP_32_64(ext8u):
+        mask = temp_mask(args[1]) & 0xff;
+        break;
+    CASE_OP_32_64(ext16u):
+        mask = temp_mask(args[1]) & 0xffff;
+        break;
+    case INDEX_op_ext32u_i64:
+        mask = temp_mask(args[1]) & 0xffffffffu;
+        break;
+    case INDEX_op_shr_i32:
+        if (temps[args[2]].state != TCG_TEMP_CONST) {
+            return -1;
+        }
+        mask = (uint32_t)temp_mask(args[1]) >> (temps[args[2]].val & 31);
+        break;
+    case INDEX_op_shr_i64:
+        if (temps[args[2]].state != TCG_TEMP_CONST) {
+            return -1;
+        }
+        mask = (uint64_t)temp_mask(args[1]) >> (temps[args[2]].val & 63);
+        break;
+    CASE_OP_32_64(setcond):
+        mask = 1;
+        break;
+    CASE_OP_32_64(ld8u):
+        mask = 0xff;
+        break;
+    CASE_OP_32_64(ld16u):
+        mask = 0xffff;
+        break;
+    case INDEX_op_ld32u_i64:
+        mask = 0xffffffffu;
+        break;
+    default:
+        return -1;
+    }
+    if (op_bits(op) == 32) {
+        mask = (uint32_t)mask | ~(tcg_target_ulong)0xffffffffu;
+    }
+    return mask;
+}
+
+/* Return true if the bits of TEMP outside of KEEP are known to be zero,
+   so that masking TEMP with KEEP is a no-op.  */
+static bool mask_is_noop(TCGOpcode op, TCGArg temp, tcg_target_ulong keep)
+{
+    tcg_target_ulong extra = temp_mask(temp) & ~keep;
+
+    if (op_bits(op) == 32) {
+        extra &= 0xffffffffu;
+    }
+    return extra == 0;
+}
+
+/* Return the label targeted by a branch, or -1 for other ops.  */
+static int op_label(TCGOpcode op, const TCGArg *args)
+{
+    switch (op) {
+    case INDEX_op_br:
+        return args[0];
+    CASE_OP_32_64(brcond):
+        return args[3];
+    case INDEX_op_brcond2_i32:
+        return args[5];
+    default:
+        return -1;
+    }
+}
+
+/* Return the number of arguments of the op at ARGS.  */
+static int op_nb_args(TCGOpcode op, const TCGArg *args, const TCGOpDef *def)
+{
+    switch (op) {
+    case INDEX_op_call:
+        return (args[0] >> 16) + (args[0] & 0xffff) + 3;
+    case INDEX_op_nopn:
+        return args[0];
+    default:
+        return def->nb_args;
+    }
+}
+
+/* Count the branches to each label.  */
+static void count_label_refs(TCGContext *s, int nb_ops, const TCGArg *args,
+                             const TCGOpDef *tcg_op_defs)
+{
+    int op_index, label;
+    TCGOpcode op;
+
+    memset(label_refs, 0, s->nb_labels * sizeof(int));
+    for (op_index = 0; op_index < nb_ops; op_index++) {
+        op = gen_opc_buf[op_index];
+        label = op_label(op, args);
+        if (label >= 0) {
+            label_refs[label]++;
+        }
+        args += op_nb_args(op, args, &tcg_op_defs[op]);
+    }
+}
+
+/* Return the size in bytes of the CPUState access done by a ld/st op,
+   or 0 if OP is not one.  */
+static int ldst_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* Dead store elimination: a store to a CPUState field is removed if the
+   same bytes are stored again before anything can observe them, that is
+   before a load from the field, a helper call, a guest memory access
+   (which may fault) or the end of the basic block.  Only stores relative
+   to fixed registers (the env pointer) are considered, so that two
+   accesses with the same offset are known to hit the same address.  */
+static void eliminate_dead_stores(TCGContext *s, TCGOpcode op,
+                                  const TCGArg *args, int op_index)
+{
+    const TCGOpDef *def = &tcg_op_defs[op];
+    struct tcg_pending_store *ps;
+    tcg_target_long ofs;
+    int i, size;
+
+    size = ldst_size(op);
+    if (size == 0) {
+        /* debug_insn_start and ops without side effects only touch
+           temporaries.  */
+        if (op == INDEX_op_debug_insn_start || op == INDEX_op_discard ||
+            (!(def->flags & (TCG_OPF_SIDE_EFFECTS | TCG_OPF_BB_END |
+                             TCG_OPF_CALL_CLOBBER)) &&
+             op != INDEX_op_set_label)) {
+            return;
+        }
+        nb_pending_stores = 0;
+        return;
+    }
+    if (!s->temps[args[1]].fixed_reg) {
+        if (!(def->flags & TCG_OPF_SIDE_EFFECTS)) {
+            /* a load through another pointer may read CPUState */
+            nb_pending_stores = 0;
+        }
+        return;
+    }
+
+    ofs = args[2];
+    for (i = 0; i < nb_pending_stores; ) {
+        ps = &pending_stores[i];
+        if (ps->base != args[1] ||
+            ps->ofs + ps->size <= ofs || ofs + size <= ps->ofs) {
+            i++;
+            continue;
+        }
+        if ((def->flags & TCG_OPF_SIDE_EFFECTS) &&
+            ofs <= ps->ofs && ps->ofs + ps->size <= ofs + size) {
+            /* overwritten: the op keeps its arguments, which a nop3
+               op skips */
+            gen_opc_buf[ps->op_index] = INDEX_op_nop3;
+#ifdef CONFIG_PROFILER
+            s->opt_del_st_count++;
+#endif
+        }
+        /* overwritten, read or partially overwritten */
+        *ps = pending_stores[--nb_pending_stores];
+    }
+
+    if ((def->flags & TCG_OPF_SIDE_EFFECTS) &&
+        nb_pending_stores < MAX_PENDING_STORES) {
+        ps = &pending_stores[nb_pending_stores++];
+        ps->base = args[1];
+        ps->ofs = ofs;
+        ps->size = size;
+        ps->op_index = op_index;
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
-    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
+    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args, label;
     TCGOpcode op;
     const TCGOpDef *def;
     TCGArg *gen_args;
     TCGArg tmp;
+    tcg_target_ulong mask;
+    bool fallthrough;
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
        If this temp is a copy of other ones then this equivalence class'
@@ -285,13 +539,18 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
 
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
-    memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+    reset_all_temps(nb_temps);
 
     nb_ops = tcg_opc_ptr - gen_opc_buf;
+    count_label_refs(s, nb_ops, args, tcg_op_defs);
+    label_temps_label = -1;
+    nb_pending_stores = 0;
+
     gen_args = args;
     for (op_index = 0; op_index < nb_ops; op_index++) {
         op = gen_opc_buf[op_index];
         def = &tcg_op_defs[op];
+        eliminate_dead_stores(s, op, args, op_index);
         /* Do copy propagation */
         if (!(def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS))) {
             assert(op != INDEX_op_call);
@@ -362,8 +621,74 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 continue;
             }
             break;
+        CASE_OP_32_64(ext8u):
+        CASE_OP_32_64(ext16u):
+        case INDEX_op_ext32u_i64:
+        CASE_OP_32_64(ext8s):
+        CASE_OP_32_64(ext16s):
+        case INDEX_op_ext32s_i64:
+            /* Extensions of a value whose high bits are known to be
+               zero are copies. */
+            if (temps[args[1]].state == TCG_TEMP_CONST) {
+                break;
+            }
+            switch (op) {
+            CASE_OP_32_64(ext8u):
+                mask = 0xff;
+                break;
+            CASE_OP_32_64(ext16u):
+                mask = 0xffff;
+                break;
+            case INDEX_op_ext32u_i64:
+                mask = 0xffffffffu;
+                break;
+            CASE_OP_32_64(ext8s):
+                mask = 0x7f;
+                break;
+            CASE_OP_32_64(ext16s):
+                mask = 0x7fff;
+                break;
+            default:
+                mask = 0x7fffffff;
+                break;
+            }
+            if (!mask_is_noop(op, args[1], mask)) {
+                break;
+            }
+            if ((temps[args[0]].state == TCG_TEMP_COPY
+                && temps[args[0]].val == args[1])
+                || args[0] == args[1]) {
+                args += 2;
+                gen_opc_buf[op_index] = INDEX_op_nop;
+            } else {
+                gen_opc_buf[op_index] = op_to_mov(op);
+                tcg_opt_gen_mov(s, gen_args, args[0], args[1], nb_temps,
+                                nb_globals);
+                gen_args += 2;
+                args += 2;
+            }
+            continue;
         CASE_OP_32_64(or):
         CASE_OP_32_64(and):
+            if (op == INDEX_op_and_i32 || op == INDEX_op_and_i64) {
+                /* Masking with a constant that keeps every bit which
+                   may be set is a copy, masking all of them off gives
+                   zero. */
+                if (temps[args[1]].state != TCG_TEMP_CONST
+                    && temps[args[2]].state == TCG_TEMP_CONST) {
+                    if (mask_is_noop(op, args[1], ~temps[args[2]].val)) {
+                        gen_opc_buf[op_index] = op_to_movi(op);
+                        tcg_opt_gen_movi(gen_args, args[0], 0, nb_temps,
+                                         nb_globals);
+                        args += 3;
+                        gen_args += 2;
+                        continue;
+                    }
+                    if (mask_is_noop(op, args[1], temps[args[2]].val)) {
+                        args[2] = args[1];
+                    }
+                }
+            }
             if (args[1] == args[2]) {
                 if (args[1] == args[0]) {
                     args += 3;
@@ -428,7 +753,9 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args += 2;
                 break;
             } else {
+                mask = result_mask(op, args);
                 reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].mask = mask;
                 gen_args[0] = args[0];
                 gen_args[1] = args[1];
                 gen_args += 2;
@@ -461,7 +788,9 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args += 3;
                 break;
             } else {
+                mask = result_mask(op, args);
                 reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].mask = mask;
                 gen_args[0] = args[0];
                 gen_args[1] = args[1];
                 gen_args[2] = args[2];
@@ -488,10 +817,38 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
             break;
         case INDEX_op_set_label:
+            /* Keep the state of the only predecessor of the label: the
+               previous op when no branch targets it, or the single
+               branch to it when it cannot be reached by falling
+               through.  */
+            label = args[0];
+            fallthrough = op_index == 0
+                || (gen_opc_buf[op_index - 1] != INDEX_op_br
+                    && gen_opc_buf[op_index - 1] != INDEX_op_jmp
+                    && gen_opc_buf[op_index - 1] != INDEX_op_exit_tb);
+            if (label_refs[label] == 0 && fallthrough) {
+                /* nothing to do */
+            } else if (label_refs[label] == 1 && !fallthrough
+                       && label_temps_label == label) {
+                memcpy(temps, label_temps,
+                       nb_temps * sizeof(struct tcg_temp_info));
+            } else {
+                reset_all_temps(nb_temps);
+            }
+            *gen_args++ = *args++;
+            break;
         case INDEX_op_jmp:
         case INDEX_op_br:
         CASE_OP_32_64(brcond):
-            memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+        case INDEX_op_brcond2_i32:
+            /* The not-taken path of a conditional branch is the only
+               successor of the branch, so the state stays valid.  */
+            label = op_label(op, args);
+            if (label >= 0 && label_refs[label] == 1) {
+                memcpy(label_temps, temps,
+                       nb_temps * sizeof(struct tcg_temp_info));
+                label_temps_label = label;
+            }
             for (i = 0; i < def->nb_args; i++) {
                 *gen_args = *args;
                 args++;
@@ -501,9 +858,13 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         default:
             /* Default case: we do know nothing about operation so no
                propagation is done.  We only trash output args.  */
+            mask = result_mask(op, args);
             for (i = 0; i < def->nb_oargs; i++) {
                 reset_temp(args[i], nb_temps, nb_globals);
             }
+            if (def->nb_oargs == 1) {
+                temps[args[0]].mask = mask;
+            }
             for (i = 0; i < def->nb_args; i++) {
                 gen_args[i] = args[i];
             }
@@ -289,6 +289,32 @@ void tcg_func_start(TCGContext *s)
 
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
+
+    s->nb_code_relocs = 0;
+    s->code_relocs_failed = false;
+}
+
+/* Record that the code about to be emitted at s->code_ptr depends on
+   the position of the TB code.  */
+void tcg_code_reloc_add(TCGContext *s, int type, tcg_target_long value)
+{
+    TCGCodeReloc *r;
+
+    if (type == TCG_CODE_RELOC_TB) {
+        value -= s->code_reloc_tb;
+        if ((tcg_target_ulong)value > 3) {
+            s->code_relocs_failed = true;
+            return;
+        }
+    }
+    if (s->nb_code_relocs == TCG_MAX_CODE_RELOCS) {
+        s->code_relocs_failed = true;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->type = type;
+    r->offset = s->code_ptr - s->code_buf;
+    r->value = value;
 }
 
 static inline void tcg_temp_alloc(TCGContext *s, int n)
@@ -1588,6 +1614,50 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* store a temporary to memory if its register copy was modified, but
+   keep it in the register. */
+static void temp_sync(TCGContext *s, int temp, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+
+    ts = &s->temps[temp];
+    if (!ts->fixed_reg && ts->val_type == TEMP_VAL_REG) {
+        if (!ts->mem_coherent) {
+            if (!ts->mem_allocated)
+                temp_allocate_frame(s, temp);
+            tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+            ts->mem_coherent = 1;
+        }
+    } else {
+        temp_save(s, temp, allocated_regs);
+    }
+}
+
+/* at a conditional branch, the code at the label expects the same state
+   as at the end of a basic block, but the code that follows the branch
+   can still use the registers holding globals and local temps. */
+static void tcg_reg_alloc_cond_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+        if (ts->temp_local) {
+            temp_sync(s, i, allocated_regs);
+        } else {
+            if (ts->val_type == TEMP_VAL_REG) {
+                s->reg_to_temp[ts->reg] = -1;
+            }
+            ts->val_type = TEMP_VAL_DEAD;
+        }
+    }
+
+    for(i = 0; i < s->nb_globals; i++) {
+        temp_sync(s, i, allocated_regs);
+    }
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 
 static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args)
@@ -1753,7 +1823,10 @@ static void tcg_reg_alloc_op(TCGContext *s,
     iarg_end: ;
     }
     
-    if (def->flags & TCG_OPF_BB_END) {
+    if (opc == INDEX_op_brcond_i32 || opc == INDEX_op_brcond2_i32 ||
+        opc == INDEX_op_brcond_i64) {
+        tcg_reg_alloc_cond_bb_end(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         /* mark dead temporaries and free the associated registers */
@@ -2219,6 +2292,9 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
+    cpu_fprintf(f, "dead stores/TB      %0.2f\n",
+                s->tb_count ?
+                (double)s->opt_del_st_count / s->tb_count : 0);
     cpu_fprintf(f, "avg temps/TB        %0.2f max=%d\n",
                 s->tb_count ? 
                 (double)s->temp_count / s->tb_count : 0,
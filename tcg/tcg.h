@@ -335,6 +335,24 @@ typedef struct TCGHelperInfo {
 
 typedef struct TCGContext TCGContext;
 
+/* Places in the code of a TB that depend on where the code sits in the
+   buffer.  They are recorded by backends that define
+   TCG_TARGET_HAS_CODE_RELOCS, so that the user mode emulators can save
+   translated code to disk and patch it when it is reloaded.  */
+enum {
+    TCG_CODE_RELOC_PC32, /* 32-bit displacement to the absolute 'value' */
+    TCG_CODE_RELOC_ABS,  /* 'value' was too far away for a PC32 reloc */
+    TCG_CODE_RELOC_TB,   /* TB pointer plus the addend 'value' */
+};
+
+typedef struct TCGCodeReloc {
+    uint32_t type;
+    uint32_t offset; /* from the start of the TB code */
+    tcg_target_long value;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 256
+
 struct TCGContext {
     uint8_t *pool_cur, *pool_end;
     TCGPool *pool_first, *pool_current;
@@ -352,6 +370,13 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* code relocations of the current TB */
+    bool code_relocs_enabled;
+    bool code_relocs_failed; /* the TB cannot be relocated */
+    tcg_target_long code_reloc_tb;
+    int nb_code_relocs;
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
@@ -382,6 +407,7 @@ struct TCGContext {
     int64_t temp_count;
     int temp_count_max;
     int64_t del_op_count;
+    int64_t opt_del_st_count; /* stores removed by the optimizer */
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t interm_time;
@@ -402,6 +428,22 @@ extern TCGArg *gen_opparam_ptr;
 extern uint16_t gen_opc_buf[];
 extern TCGArg gen_opparam_buf[];
 
+void tcg_code_reloc_add(TCGContext *s, int type, tcg_target_long value);
+
+static inline void tcg_code_reloc(TCGContext *s, int type,
+                                  tcg_target_long value)
+{
+    if (s->code_relocs_enabled) {
+        tcg_code_reloc_add(s, type, value);
+    }
+}
+
+#ifdef TCG_TARGET_HAS_CODE_RELOCS
+bool tcg_apply_code_reloc(const TCGCodeReloc *r, uint8_t *code,
+                          tcg_target_long tb);
+int tcg_code_reloc_size(const TCGCodeReloc *r);
+#endif
+
 /* pool based memory allocation */
 
 void *tcg_malloc_internal(TCGContext *s, int size);
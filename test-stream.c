@@ -0,0 +1,141 @@
+/*
+ * Image streaming tests
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "block_int.h"
+
+#define IMG_SIZE (4 * 1024 * 1024)
+#define CLUSTER_SECTORS (65536 / BDRV_SECTOR_SIZE)
+
+/*
+ * The tools have no timers, so the stream job would never wake up from
+ * co_sleep_ns().  Park it instead and let stream_wait() resume it.
+ */
+
+static Coroutine *sleeping_co;
+
+void coroutine_fn co_sleep_ns(QEMUClock *clock, int64_t ns)
+{
+    g_assert(!sleeping_co);
+    sleeping_co = qemu_coroutine_self();
+    qemu_coroutine_yield();
+}
+
+typedef struct {
+    bool done;
+    int ret;
+} StreamResult;
+
+static void stream_cb(void *opaque, int ret)
+{
+    StreamResult *res = opaque;
+
+    res->done = true;
+    res->ret = ret;
+}
+
+static void stream_wait(StreamResult *res)
+{
+    Coroutine *co;
+
+    while (!res->done) {
+        if (sleeping_co) {
+            co = sleeping_co;
+            sleeping_co = NULL;
+            qemu_coroutine_enter(co, NULL);
+        } else {
+            qemu_aio_wait();
+        }
+    }
+}
+
+static void fill_sectors(BlockDriverState *bs, int64_t sector_num,
+                         int nb_sectors, int pattern)
+{
+    uint8_t *buf = g_malloc(nb_sectors * BDRV_SECTOR_SIZE);
+
+    memset(buf, pattern, nb_sectors * BDRV_SECTOR_SIZE);
+    g_assert(bdrv_write(bs, sector_num, buf, nb_sectors) == 0);
+    g_free(buf);
+}
+
+static void check_sectors(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, int pattern)
+{
+    uint8_t *buf = g_malloc(nb_sectors * BDRV_SECTOR_SIZE);
+    int i;
+
+    g_assert(bdrv_read(bs, sector_num, buf, nb_sectors) == 0);
+    for (i = 0; i < nb_sectors * BDRV_SECTOR_SIZE; i++) {
+        g_assert(buf[i] == pattern);
+    }
+    g_free(buf);
+}
+
+/*
+ * Stream an image whose last cluster is already allocated in the top
+ * image, and check that the backing file is dropped all the same.
+ */
+static void test_stream_last_allocated(void)
+{
+    char base[] = "/tmp/test-stream-base.XXXXXX";
+    char top[] = "/tmp/test-stream-top.XXXXXX";
+    int64_t end = IMG_SIZE / BDRV_SECTOR_SIZE;
+    StreamResult res = { false, 0 };
+    BlockDriverState *bs;
+    int fd;
+
+    fd = mkstemp(base);
+    g_assert(fd >= 0);
+    close(fd);
+    fd = mkstemp(top);
+    g_assert(fd >= 0);
+    close(fd);
+
+    g_assert(bdrv_img_create(base, "raw", NULL, NULL, NULL,
+                             IMG_SIZE, 0) == 0);
+    bs = bdrv_new("");
+    g_assert(bdrv_open(bs, base, BDRV_O_RDWR, NULL) == 0);
+    fill_sectors(bs, 0, end, 0x11);
+    bdrv_delete(bs);
+
+    g_assert(bdrv_img_create(top, "qcow2", base, "raw", NULL,
+                             IMG_SIZE, 0) == 0);
+    bs = bdrv_new("");
+    g_assert(bdrv_open(bs, top, BDRV_O_RDWR, NULL) == 0);
+    fill_sectors(bs, end - CLUSTER_SECTORS, CLUSTER_SECTORS, 0x22);
+
+    g_assert(stream_start(bs, stream_cb, &res) == 0);
+    stream_wait(&res);
+
+    g_assert(res.ret == 0);
+    g_assert(bs->backing_hd == NULL);
+    g_assert(bs->backing_file[0] == '\0');
+    check_sectors(bs, 0, end - CLUSTER_SECTORS, 0x11);
+    check_sectors(bs, end - CLUSTER_SECTORS, CLUSTER_SECTORS, 0x22);
+    bdrv_delete(bs);
+
+    /* the backing file is not needed anymore */
+    unlink(base);
+    bs = bdrv_new("");
+    g_assert(bdrv_open(bs, top, 0, NULL) == 0);
+    g_assert(bs->backing_hd == NULL);
+    check_sectors(bs, 0, 1, 0x11);
+    bdrv_delete(bs);
+    unlink(top);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    bdrv_init();
+    g_test_add_func("/stream/last-allocated", test_stream_last_allocated);
+    return g_test_run();
+}
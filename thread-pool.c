@@ -0,0 +1,625 @@
+/*
+ * QEMU worker thread pool
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-aio.h"
+#include "osdep.h"
+#include "trace.h"
+#include "block_int.h"
+#include "thread-pool.h"
+
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/* Workers above min_threads exit after being idle for this many seconds */
+#define THREAD_POOL_IDLE_TIMEOUT 10
+
+enum ThreadState {
+    THREAD_BATCHED,     /* in submit_list, not yet visible to workers */
+    THREAD_QUEUED,      /* in request_list */
+    THREAD_ACTIVE,      /* running in a worker */
+    THREAD_DONE,        /* in completed_list */
+    THREAD_COMPLETING,  /* in completion_list, waiting for its callback */
+};
+
+typedef struct ThreadPoolElement {
+    BlockDriverAIOCB common;
+    ThreadPool *pool;
+    ThreadPoolFunc *func;
+    void *arg;
+    ThreadPoolFreeFunc *free_arg;
+    enum ThreadState state;
+    int ret;
+
+    /* Linked by whichever list matches the current state */
+    QTAILQ_ENTRY(ThreadPoolElement) reqs;
+
+    /* All requests that have not completed yet */
+    QLIST_ENTRY(ThreadPoolElement) all;
+} ThreadPoolElement;
+
+struct ThreadPool {
+    const char *name;
+    QLIST_ENTRY(ThreadPool) next;
+    int rfd, wfd;
+    QEMUBH *submit_bh;
+    pthread_attr_t attr;
+
+    /* The following variables are only accessed from the I/O thread */
+    QLIST_HEAD(, ThreadPoolElement) head;
+    QTAILQ_HEAD(, ThreadPoolElement) submit_list;
+    QTAILQ_HEAD(, ThreadPoolElement) completion_list;
+
+    /* The following variables are protected by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t request_cond;
+    pthread_cond_t done_cond;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QTAILQ_HEAD(, ThreadPoolElement) completed_list;
+    int min_threads;
+    int max_threads;
+    int cur_threads;
+    int idle_threads;
+    int new_threads;     /* backlog of threads we need to create */
+    int pending_threads; /* threads created but not running yet */
+    int cancel_waiters;
+};
+
+/* Limits set with thread_pool_configure() */
+typedef struct ThreadPoolConfig {
+    char *name;
+    int min_threads;
+    int max_threads;
+    QLIST_ENTRY(ThreadPoolConfig) next;
+} ThreadPoolConfig;
+
+static QLIST_HEAD(, ThreadPool) pools = QLIST_HEAD_INITIALIZER(pools);
+static QLIST_HEAD(, ThreadPoolConfig) pool_configs =
+    QLIST_HEAD_INITIALIZER(pool_configs);
+
+static void die2(int err, const char *what)
+{
+    fprintf(stderr, "%s failed: %s\n", what, strerror(err));
+    abort();
+}
+
+static void die(const char *what)
+{
+    die2(errno, what);
+}
+
+static void mutex_lock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_lock(mutex);
+    if (ret) {
+        die2(ret, "pthread_mutex_lock");
+    }
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_unlock(mutex);
+    if (ret) {
+        die2(ret, "pthread_mutex_unlock");
+    }
+}
+
+static void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret) {
+        die2(ret, "pthread_cond_wait");
+    }
+}
+
+static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          struct timespec *ts)
+{
+    int ret = pthread_cond_timedwait(cond, mutex, ts);
+    if (ret && ret != ETIMEDOUT) {
+        die2(ret, "pthread_cond_timedwait");
+    }
+    return ret;
+}
+
+static void cond_signal(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_signal(cond);
+    if (ret) {
+        die2(ret, "pthread_cond_signal");
+    }
+}
+
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) {
+        die2(ret, "pthread_cond_broadcast");
+    }
+}
+
+static void thread_pool_notify(ThreadPool *pool)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(pool->wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EAGAIN) {
+        die("write()");
+    }
+}
+
+static void do_spawn_thread(ThreadPool *pool);
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    mutex_lock(&pool->lock);
+    pool->pending_threads--;
+    mutex_unlock(&pool->lock);
+    do_spawn_thread(pool);
+
+    mutex_lock(&pool->lock);
+    for (;;) {
+        ThreadPoolElement *req;
+        qemu_timeval tv;
+        struct timespec ts;
+        bool notify;
+        int ret = 0;
+
+        qemu_gettimeofday(&tv);
+        ts.tv_sec = tv.tv_sec + THREAD_POOL_IDLE_TIMEOUT;
+        ts.tv_nsec = 0;
+
+        pool->idle_threads++;
+        while (QTAILQ_EMPTY(&pool->request_list) && ret != ETIMEDOUT &&
+               pool->cur_threads <= pool->max_threads) {
+            if (pool->cur_threads <= pool->min_threads) {
+                cond_wait(&pool->request_cond, &pool->lock);
+            } else {
+                ret = cond_timedwait(&pool->request_cond, &pool->lock, &ts);
+            }
+        }
+        pool->idle_threads--;
+
+        if (QTAILQ_EMPTY(&pool->request_list)) {
+            if (pool->cur_threads > pool->min_threads) {
+                break;
+            }
+            continue;
+        }
+
+        req = QTAILQ_FIRST(&pool->request_list);
+        QTAILQ_REMOVE(&pool->request_list, req, reqs);
+        req->state = THREAD_ACTIVE;
+        mutex_unlock(&pool->lock);
+
+        ret = req->func(req->arg);
+
+        mutex_lock(&pool->lock);
+        req->ret = ret;
+        req->state = THREAD_DONE;
+
+        /* Only the first completion of a batch needs to kick the I/O
+         * thread, which picks up the whole completed_list at once.
+         */
+        notify = QTAILQ_EMPTY(&pool->completed_list);
+        QTAILQ_INSERT_TAIL(&pool->completed_list, req, reqs);
+        if (pool->cancel_waiters) {
+            cond_broadcast(&pool->done_cond);
+        }
+        mutex_unlock(&pool->lock);
+
+        if (notify) {
+            thread_pool_notify(pool);
+        }
+        mutex_lock(&pool->lock);
+    }
+
+    pool->cur_threads--;
+    mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void do_spawn_thread(ThreadPool *pool)
+{
+    sigset_t set, oldset;
+    pthread_t thread_id;
+    int ret;
+
+    mutex_lock(&pool->lock);
+    if (!pool->new_threads) {
+        mutex_unlock(&pool->lock);
+        return;
+    }
+
+    pool->new_threads--;
+    pool->pending_threads++;
+
+    mutex_unlock(&pool->lock);
+
+    /* block all signals */
+    if (sigfillset(&set)) {
+        die("sigfillset");
+    }
+    if (pthread_sigmask(SIG_SETMASK, &set, &oldset)) {
+        die("pthread_sigmask");
+    }
+
+    ret = pthread_create(&thread_id, &pool->attr, worker_thread, pool);
+    if (ret) {
+        die2(ret, "pthread_create");
+    }
+
+    if (pthread_sigmask(SIG_SETMASK, &oldset, NULL)) {
+        die("pthread_sigmask restore");
+    }
+}
+
+/* Called with pool->lock held */
+static void spawn_thread(ThreadPool *pool)
+{
+    pool->cur_threads++;
+    pool->new_threads++;
+}
+
+/*
+ * Hand all requests submitted since the last run over to the workers
+ *
+ * This takes the pool lock once per batch rather than once per request, and
+ * wakes no more workers than there are requests.  Missing workers are created
+ * here in the I/O thread, so that they inherit its affinity instead of the
+ * affinity of a vcpu thread.  Each new worker spawns the next one, so we do
+ * not spend time creating many threads in a loop.
+ */
+static void thread_pool_submit_bh(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ThreadPoolElement *req;
+    bool spawn_now;
+    int n = 0;
+    int spawn;
+
+    if (QTAILQ_EMPTY(&pool->submit_list)) {
+        return;
+    }
+
+    mutex_lock(&pool->lock);
+    while ((req = QTAILQ_FIRST(&pool->submit_list)) != NULL) {
+        QTAILQ_REMOVE(&pool->submit_list, req, reqs);
+        req->state = THREAD_QUEUED;
+        QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+        n++;
+    }
+
+    spawn = MIN(n - pool->idle_threads,
+                pool->max_threads - pool->cur_threads);
+    for (; spawn > 0; spawn--) {
+        spawn_thread(pool);
+    }
+    spawn_now = pool->new_threads && !pool->pending_threads;
+
+    if (n == 1) {
+        cond_signal(&pool->request_cond);
+    } else {
+        cond_broadcast(&pool->request_cond);
+    }
+    mutex_unlock(&pool->lock);
+
+    trace_thread_pool_submit_batch(pool, n);
+
+    if (spawn_now) {
+        do_spawn_thread(pool);
+    }
+}
+
+static void thread_pool_release(ThreadPoolElement *req)
+{
+    if (req->free_arg) {
+        req->free_arg(req->arg);
+    }
+    qemu_aio_release(req);
+}
+
+static int thread_pool_process_queue(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ThreadPoolElement *req;
+    int result = 0;
+
+    /* Pick up the whole batch with one lock round trip */
+    mutex_lock(&pool->lock);
+    while ((req = QTAILQ_FIRST(&pool->completed_list)) != NULL) {
+        QTAILQ_REMOVE(&pool->completed_list, req, reqs);
+        req->state = THREAD_COMPLETING;
+        QTAILQ_INSERT_TAIL(&pool->completion_list, req, reqs);
+    }
+    mutex_unlock(&pool->lock);
+
+    /* Callbacks may submit or cancel requests, or run a nested
+     * qemu_aio_wait(), so fetch the list head each time.
+     */
+    while ((req = QTAILQ_FIRST(&pool->completion_list)) != NULL) {
+        QTAILQ_REMOVE(&pool->completion_list, req, reqs);
+        QLIST_REMOVE(req, all);
+        if (req->common.bs) {
+            req->common.bs->thread_pool_reqs--;
+        }
+
+        trace_thread_pool_complete(pool, req, req->common.opaque, req->ret);
+        req->common.cb(req->common.opaque, req->ret);
+        thread_pool_release(req);
+        result = 1;
+    }
+
+    return result;
+}
+
+static void thread_pool_completion_read(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ssize_t len;
+
+    /* clear the notifier before looking at completed_list */
+    for (;;) {
+        char bytes[16];
+
+        len = read(pool->rfd, bytes, sizeof(bytes));
+        if (len == -1 && errno == EINTR) {
+            continue; /* try again */
+        }
+        if (len == sizeof(bytes)) {
+            continue; /* more to read */
+        }
+        break;
+    }
+
+    thread_pool_process_queue(pool);
+}
+
+static int thread_pool_flush(void *opaque)
+{
+    ThreadPool *pool = opaque;
+
+    return !QLIST_EMPTY(&pool->head);
+}
+
+static void thread_pool_cancel(BlockDriverAIOCB *acb)
+{
+    ThreadPoolElement *elem = (ThreadPoolElement *)acb;
+    ThreadPool *pool = elem->pool;
+
+    trace_thread_pool_cancel(pool, elem, elem->common.opaque);
+
+    switch (elem->state) {
+    case THREAD_BATCHED:
+        QTAILQ_REMOVE(&pool->submit_list, elem, reqs);
+        break;
+    case THREAD_COMPLETING:
+        QTAILQ_REMOVE(&pool->completion_list, elem, reqs);
+        break;
+    default:
+        mutex_lock(&pool->lock);
+        if (elem->state == THREAD_QUEUED) {
+            QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        } else {
+            /* fail safe: if the request is already running, wait for it */
+            pool->cancel_waiters++;
+            while (elem->state != THREAD_DONE) {
+                cond_wait(&pool->done_cond, &pool->lock);
+            }
+            pool->cancel_waiters--;
+            QTAILQ_REMOVE(&pool->completed_list, elem, reqs);
+        }
+        mutex_unlock(&pool->lock);
+        break;
+    }
+
+    QLIST_REMOVE(elem, all);
+    if (elem->common.bs) {
+        elem->common.bs->thread_pool_reqs--;
+    }
+    thread_pool_release(elem);
+}
+
+static AIOPool thread_pool_aio_pool = {
+    .aiocb_size         = sizeof(ThreadPoolElement),
+    .cancel             = thread_pool_cancel,
+};
+
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+                                         BlockDriverState *bs,
+                                         ThreadPoolFunc *func, void *arg,
+                                         ThreadPoolFreeFunc *free_arg,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque)
+{
+    ThreadPoolElement *req;
+
+    req = qemu_aio_get(&thread_pool_aio_pool, bs, cb, opaque);
+    req->pool = pool;
+    req->func = func;
+    req->arg = arg;
+    req->free_arg = free_arg;
+    req->ret = -EINPROGRESS;
+    req->state = THREAD_BATCHED;
+
+    QLIST_INSERT_HEAD(&pool->head, req, all);
+    QTAILQ_INSERT_TAIL(&pool->submit_list, req, reqs);
+    if (bs) {
+        bs->thread_pool_reqs++;
+    }
+
+    trace_thread_pool_submit(pool, req, arg);
+
+    qemu_bh_schedule(pool->submit_bh);
+    return &req->common;
+}
+
+typedef struct ThreadPoolCo {
+    Coroutine *co;
+    int ret;
+} ThreadPoolCo;
+
+static void thread_pool_co_cb(void *opaque, int ret)
+{
+    ThreadPoolCo *co = opaque;
+
+    co->ret = ret;
+    qemu_coroutine_enter(co->co, NULL);
+}
+
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
+                                       ThreadPoolFunc *func, void *arg)
+{
+    ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
+
+    assert(qemu_in_coroutine());
+    thread_pool_submit_aio(pool, NULL, func, arg, NULL,
+                           thread_pool_co_cb, &tpc);
+    qemu_coroutine_yield();
+    return tpc.ret;
+}
+
+void thread_pool_set_size(ThreadPool *pool, int min_threads, int max_threads)
+{
+    assert(min_threads >= 0 && max_threads >= 1 && min_threads <= max_threads);
+
+    mutex_lock(&pool->lock);
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+
+    /* let idle workers re-check whether they are still needed */
+    cond_broadcast(&pool->request_cond);
+    mutex_unlock(&pool->lock);
+}
+
+static ThreadPoolConfig *thread_pool_find_config(const char *name)
+{
+    ThreadPoolConfig *config;
+
+    QLIST_FOREACH(config, &pool_configs, next) {
+        if (!strcmp(config->name, name)) {
+            return config;
+        }
+    }
+    return NULL;
+}
+
+void thread_pool_configure(const char *name, int min_threads,
+                           int max_threads)
+{
+    ThreadPoolConfig *config = thread_pool_find_config(name);
+    ThreadPool *pool;
+
+    if (!config) {
+        config = g_malloc0(sizeof(*config));
+        config->name = g_strdup(name);
+        QLIST_INSERT_HEAD(&pool_configs, config, next);
+    }
+    config->min_threads = min_threads;
+    config->max_threads = max_threads;
+
+    QLIST_FOREACH(pool, &pools, next) {
+        if (!strcmp(pool->name, name)) {
+            thread_pool_set_size(pool, min_threads, max_threads);
+        }
+    }
+}
+
+static int thread_pool_init_notifier(ThreadPool *pool)
+{
+    int fds[2];
+
+#ifdef CONFIG_EVENTFD
+    fds[0] = eventfd(0, 0);
+    if (fds[0] >= 0) {
+        qemu_set_cloexec(fds[0]);
+        pool->rfd = pool->wfd = fds[0];
+        goto out;
+    }
+    if (errno != ENOSYS && errno != EINVAL) {
+        return -1;
+    }
+#endif
+
+    if (qemu_pipe(fds) == -1) {
+        return -1;
+    }
+    pool->rfd = fds[0];
+    pool->wfd = fds[1];
+
+#ifdef CONFIG_EVENTFD
+out:
+#endif
+    fcntl(pool->rfd, F_SETFL, O_NONBLOCK);
+    fcntl(pool->wfd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+ThreadPool *thread_pool_new(const char *name, int min_threads,
+                            int max_threads)
+{
+    ThreadPoolConfig *config = thread_pool_find_config(name);
+    ThreadPool *pool;
+    int ret;
+
+    if (config) {
+        min_threads = config->min_threads;
+        max_threads = config->max_threads;
+    }
+
+    pool = g_malloc0(sizeof(*pool));
+    pool->name = name;
+
+    if (thread_pool_init_notifier(pool) < 0) {
+        fprintf(stderr, "failed to create thread pool notifier\n");
+        g_free(pool);
+        return NULL;
+    }
+
+    ret = pthread_attr_init(&pool->attr);
+    if (ret) {
+        die2(ret, "pthread_attr_init");
+    }
+
+    ret = pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
+    if (ret) {
+        die2(ret, "pthread_attr_setdetachstate");
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->request_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    QLIST_INIT(&pool->head);
+    QTAILQ_INIT(&pool->submit_list);
+    QTAILQ_INIT(&pool->completion_list);
+    QTAILQ_INIT(&pool->request_list);
+    QTAILQ_INIT(&pool->completed_list);
+    pool->submit_bh = qemu_bh_new(thread_pool_submit_bh, pool);
+
+    thread_pool_set_size(pool, min_threads, max_threads);
+
+    qemu_aio_set_fd_handler(pool->rfd, thread_pool_completion_read, NULL,
+                            thread_pool_flush, thread_pool_process_queue,
+                            pool);
+
+    QLIST_INSERT_HEAD(&pools, pool, next);
+    trace_thread_pool_new(pool, name, min_threads, max_threads);
+    return pool;
+}
@@ -0,0 +1,98 @@
+/*
+ * QEMU worker thread pool
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_THREAD_POOL_H
+#define QEMU_THREAD_POOL_H 1
+
+#include "qemu-common.h"
+#include "qemu-coroutine.h"
+#include "block.h"
+
+typedef int ThreadPoolFunc(void *opaque);
+typedef void ThreadPoolFreeFunc(void *opaque);
+
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * thread_pool_new:
+ * @name: Name used in trace events.
+ * @min_threads: Number of workers that are kept alive while idle.
+ * @max_threads: Upper bound on the number of workers.
+ *
+ * Create a pool of worker threads.  Workers are spawned lazily, the first
+ * @min_threads of them never exit, and any further ones exit after being
+ * idle for a while.
+ *
+ * Requests submitted from the I/O thread are handed to the workers in
+ * batches, and completions are reported back through a single file
+ * descriptor notification per batch.  Completion callbacks run in the I/O
+ * thread from qemu_aio_wait() or the main loop.
+ */
+ThreadPool *thread_pool_new(const char *name, int min_threads,
+                            int max_threads);
+
+/**
+ * thread_pool_configure:
+ * @name: Name of the pool, as passed to thread_pool_new().
+ * @min_threads: Number of workers that are kept alive while idle.
+ * @max_threads: Upper bound on the number of workers.
+ *
+ * Override the worker limits of the pool called @name.  Pools that already
+ * exist are resized, pools created later ignore the limits they ask for.
+ */
+void thread_pool_configure(const char *name, int min_threads,
+                           int max_threads);
+
+/**
+ * thread_pool_set_size:
+ * @pool: The pool to resize.
+ * @min_threads: New number of workers that are kept alive while idle.
+ * @max_threads: New upper bound on the number of workers.
+ *
+ * Change the worker limits of @pool.  Excess workers exit once they become
+ * idle.
+ */
+void thread_pool_set_size(ThreadPool *pool, int min_threads, int max_threads);
+
+/**
+ * thread_pool_submit_aio:
+ * @pool: The pool that runs the request.
+ * @bs: Block device the request is accounted to, or %NULL.
+ * @func: Function that is run in a worker thread.
+ * @arg: Opaque argument for @func.
+ * @free_arg: Function that releases @arg, or %NULL.
+ * @cb: Completion function, called in the I/O thread with the return
+ * value of @func.
+ * @opaque: Opaque argument for @cb.
+ *
+ * Run @func(@arg) in a worker thread.  While the request is in flight it
+ * is counted in @bs->thread_pool_reqs.  Cancelling the returned AIOCB
+ * waits for @func if it is already running, and @cb is not called.
+ * Either way @free_arg(@arg) is called in the I/O thread once the request
+ * is gone, whether or not @func ever ran.
+ */
+BlockDriverAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+                                         BlockDriverState *bs,
+                                         ThreadPoolFunc *func, void *arg,
+                                         ThreadPoolFreeFunc *free_arg,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque);
+
+/**
+ * thread_pool_submit_co:
+ * @pool: The pool that runs the request.
+ * @func: Function that is run in a worker thread.
+ * @arg: Opaque argument for @func.
+ *
+ * Run @func(@arg) in a worker thread and yield until it has finished.
+ * Returns the return value of @func.
+ */
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
+                                       ThreadPoolFunc *func, void *arg);
+
+#endif
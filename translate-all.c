@@ -27,7 +27,7 @@
 #define NO_CPU_IO_DEFS
 #include "cpu.h"
 #include "disas.h"
-#include "tcg.h"
+#include "tcg-op.h"
 #include "qemu-timer.h"
 
 /* code generation context */
@@ -45,6 +45,20 @@ void cpu_gen_init(void)
     tcg_context_init(&tcg_ctx); 
 }
 
+/* Count the executions of TB.  Emitted before the guest code in both
+   cpu_gen_code() and cpu_restore_state(), so that the ops match.  */
+static void gen_tb_exec_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    TCGv_i64 count = tcg_temp_new_i64();
+
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -66,7 +80,11 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->code_reloc_tb = (tcg_target_long)tb;
 
+    if (tb->count_exec) {
+        gen_tb_exec_count(tb);
+    }
     gen_intermediate_code(env, tb);
 
     /* generate machine code */
@@ -108,8 +126,8 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 
 /* The cpu state corresponding to 'searched_pc' is restored.
  */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUState *env, unsigned long searched_pc)
+static int cpu_restore_state_locked(TranslationBlock *tb,
+                                    CPUState *env, unsigned long searched_pc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -122,7 +140,11 @@ int cpu_restore_state(TranslationBlock *tb,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->code_reloc_tb = (tcg_target_long)tb;
 
+    if (tb->count_exec) {
+        gen_tb_exec_count(tb);
+    }
     gen_intermediate_code_pc(env, tb);
 
     if (use_icount) {
@@ -161,3 +183,15 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* The translator state is shared between vCPUs, hence tb_lock.  */
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUState *env, unsigned long searched_pc)
+{
+    int ret;
+
+    tb_lock_acquire();
+    ret = cpu_restore_state_locked(tb, env, searched_pc);
+    tb_lock_release();
+    return ret;
+}
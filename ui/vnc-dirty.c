@@ -0,0 +1,137 @@
+/*
+ * QEMU VNC display driver: dirty region detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "bitops.h"
+#include "bitmap.h"
+#include "host-utils.h"
+#include "vnc-dirty.h"
+
+#if HOST_LONG_BITS == 64
+#define ctzl ctz64
+#else
+#define ctzl ctz32
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Copy @len bytes from @src to @dst unless they are already equal.
+ * Returns 1 if @dst was modified.
+ */
+static inline int vnc_copy_if_changed(uint8_t *dst, const uint8_t *src,
+                                      int len)
+{
+    int i;
+
+#if defined(__AVX2__)
+    if (!(len & 31)) {
+        __m256i acc = _mm256_setzero_si256();
+
+        for (i = 0; i < len; i += 32) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+            acc = _mm256_or_si256(acc, _mm256_xor_si256(s, d));
+        }
+        if (_mm256_testz_si256(acc, acc)) {
+            return 0;
+        }
+        for (i = 0; i < len; i += 32) {
+            _mm256_storeu_si256((__m256i *)(dst + i),
+                                _mm256_loadu_si256((const __m256i *)(src + i)));
+        }
+        return 1;
+    }
+#endif
+#if defined(__SSE2__)
+    if (!(len & 15)) {
+        __m128i acc = _mm_setzero_si128();
+
+        for (i = 0; i < len; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+            acc = _mm_or_si128(acc, _mm_xor_si128(s, d));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128()))
+            == 0xffff) {
+            return 0;
+        }
+        for (i = 0; i < len; i += 16) {
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_loadu_si128((const __m128i *)(src + i)));
+        }
+        return 1;
+    }
+#endif
+    if (!(len % sizeof(unsigned long))) {
+        const unsigned long *s = (const unsigned long *)src;
+        unsigned long *d = (unsigned long *)dst;
+        unsigned long acc = 0;
+        int n = len / sizeof(unsigned long);
+
+        for (i = 0; i < n; i++) {
+            acc |= s[i] ^ d[i];
+        }
+        if (!acc) {
+            return 0;
+        }
+        memcpy(dst, src, len);
+        return 1;
+    }
+
+    if (memcmp(dst, src, len) == 0) {
+        return 0;
+    }
+    memcpy(dst, src, len);
+    return 1;
+}
+
+/*
+ * Bring one scanline of the server surface up to date with the guest.
+ *
+ * Only the 16-pixel chunks flagged in @dirty are looked at; their bits
+ * are cleared.  Chunks whose content really changed are copied and
+ * flagged in @changed.  Returns the number of chunks copied.
+ */
+int vnc_refresh_row(uint8_t *server_row, const uint8_t *guest_row,
+                    unsigned long *dirty, unsigned long *changed,
+                    int width, int bpp)
+{
+    int nr = DIV_ROUND_UP(width, 16);
+    int chunk_bytes = 16 * bpp;
+    int row_bytes = width * bpp;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < BITS_TO_LONGS(nr); i++) {
+        unsigned long bits = dirty[i];
+
+        if (!bits) {
+            continue;
+        }
+        if ((i + 1) * BITS_PER_LONG > nr) {
+            bits &= BITMAP_LAST_WORD_MASK(nr);
+        }
+        dirty[i] &= ~bits;
+        while (bits) {
+            int x = i * BITS_PER_LONG + ctzl(bits);
+            int offset = x * chunk_bytes;
+
+            bits &= bits - 1;
+            if (vnc_copy_if_changed(server_row + offset, guest_row + offset,
+                                    MIN(chunk_bytes, row_bytes - offset))) {
+                changed[i] |= BIT_MASK(x);
+                count++;
+            }
+        }
+    }
+    return count;
+}
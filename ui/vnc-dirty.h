@@ -0,0 +1,17 @@
+/*
+ * QEMU VNC display driver: dirty region detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef VNC_DIRTY_H
+#define VNC_DIRTY_H
+
+#include <stdint.h>
+
+int vnc_refresh_row(uint8_t *server_row, const uint8_t *guest_row,
+                    unsigned long *dirty, unsigned long *changed,
+                    int width, int bpp);
+
+#endif /* VNC_DIRTY_H */
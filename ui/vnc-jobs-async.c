@@ -28,40 +28,72 @@
 
 #include "vnc.h"
 #include "vnc-jobs.h"
+#include "qemu-timer.h"
 
 /*
  * Locking:
  *
  * There is three levels of locking:
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
- * - VncDisplay global lock: mainly used for framebuffer updates to avoid
- *                      screen corruption if the framebuffer is updated
- *			while the worker is doing something.
+ * - VncDisplay global lock: protects the server surface, which
+ *                      vnc_refresh() updates from the guest framebuffer.
+ *                      Workers take it for reading, so the workers of
+ *                      different clients encode at the same time.
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  * 		   	 if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is hold
- * to avoid screen corruptions (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not hold because the thread work on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds the VncDisplay global lock
+ * for reading to avoid screen corruptions (this does not block vnc_refresh()
+ * because it uses trylock()) but the output lock is not hold because the
+ * thread work on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
-*/
+ *
+ * There can be several worker threads, each with its own list of jobs.
+ * The jobs of a client all go to the same worker while any of them is
+ * pending, so that its updates are sent in order; when it has none, the
+ * next one goes to the worker with the fewest jobs.  Encoders without
+ * state across rectangles (raw and hextile) also split large updates in
+ * tiles, which idle workers encode in parallel with the job's worker.
+ */
+
+#define VNC_MAX_WORKERS 16
+/* height of the tiles encoded in parallel */
+#define VNC_TILE_HEIGHT 64
+
+typedef struct VncTileBatch {
+    VncState *orig;    /* client of the job */
+    VncState *vs;      /* local copy of orig */
+    VncRect *tiles;
+    Buffer *outputs;
+    int *n_rectangles;
+    int nb_tiles;
+    int next_tile;     /* first tile that nobody encodes yet */
+    int nb_running;    /* tiles being encoded by other workers */
+} VncTileBatch;
+
+typedef struct VncWorker {
+    QemuThread thread;
+    Buffer buffer;
+    int nb_jobs;
+    VncJob *current;   /* the job being encoded, still in jobs */
+    QTAILQ_HEAD(, VncJob) jobs;
+} VncWorker;
 
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
     bool exit;
-    QTAILQ_HEAD(, VncJob) jobs;
+    int nb_workers;
+    int nb_threads;    /* workers that have not exited yet */
+    VncWorker workers[VNC_MAX_WORKERS];
+    VncTileBatch *batch; /* tiles to encode, or NULL */
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reetrant, so we can easilly add more than one encoding thread
+ * We use a single global queue, shared by all the encoding threads.
  */
 static VncJobQueue *queue;
 
@@ -80,6 +112,7 @@ VncJob *vnc_job_new(VncState *vs)
     VncJob *job = g_malloc0(sizeof(VncJob));
 
     job->vs = vs;
+    job->start = qemu_get_clock_ns(rt_clock);
     vnc_lock_queue(queue);
     QLIST_INIT(&job->rectangles);
     vnc_unlock_queue(queue);
@@ -101,13 +134,39 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+static void vnc_job_free(VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    g_free(job);
+}
+
 void vnc_job_push(VncJob *job)
 {
+    VncState *vs = job->vs;
+    VncWorker *worker;
+    int i;
+
     vnc_lock_queue(queue);
     if (queue->exit || QLIST_EMPTY(&job->rectangles)) {
-        g_free(job);
+        vnc_job_free(job);
     } else {
-        QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        if (vs->jobs_queued == 0) {
+            vs->worker = 0;
+            for (i = 1; i < queue->nb_workers; i++) {
+                if (queue->workers[i].nb_jobs <
+                    queue->workers[vs->worker].nb_jobs) {
+                    vs->worker = i;
+                }
+            }
+        }
+        worker = &queue->workers[vs->worker];
+        QTAILQ_INSERT_TAIL(&worker->jobs, job, next);
+        worker->nb_jobs++;
+        vs->jobs_queued++;
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
@@ -115,10 +174,13 @@ void vnc_job_push(VncJob *job)
 
 static bool vnc_has_job_locked(VncState *vs)
 {
-    VncJob *job;
+    int i;
 
-    QTAILQ_FOREACH(job, &queue->jobs, next) {
-        if (job->vs == vs || !vs) {
+    if (vs) {
+        return vs->jobs_queued > 0;
+    }
+    for (i = 0; i < queue->nb_workers; i++) {
+        if (!QTAILQ_EMPTY(&queue->workers[i].jobs)) {
             return true;
         }
     }
@@ -137,15 +199,24 @@ bool vnc_has_job(VncState *vs)
 
 void vnc_jobs_clear(VncState *vs)
 {
+    VncWorker *worker;
     VncJob *job, *tmp;
+    int i;
 
     vnc_lock_queue(queue);
-    QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
-            QTAILQ_REMOVE(&queue->jobs, job, next);
+    for (i = 0; i < queue->nb_workers; i++) {
+        worker = &queue->workers[i];
+        QTAILQ_FOREACH_SAFE(job, &worker->jobs, next, tmp) {
+            if ((job->vs == vs || !vs) && job != worker->current) {
+                QTAILQ_REMOVE(&worker->jobs, job, next);
+                worker->nb_jobs--;
+                job->vs->jobs_queued--;
+                vnc_job_free(job);
+            }
         }
     }
     vnc_unlock_queue(queue);
+    qemu_cond_broadcast(&queue->cond);
 }
 
 void vnc_jobs_join(VncState *vs)
@@ -160,7 +231,8 @@ void vnc_jobs_join(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *output)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -168,18 +240,20 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->vd = orig->vd;
     local->lossy_rect = orig->lossy_rect;
     local->write_pixels = orig->write_pixels;
+    local->converter = orig->converter;
     local->clientds = orig->clientds;
     local->tight = orig->tight;
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *output;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *output)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -187,29 +261,150 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    *output = local->output;
+}
+
+/* Encode the tiles of 'batch' that are left.  Called with the queue
+   lock held, which is released while encoding.  */
+static void vnc_encode_tiles_locked(VncTileBatch *batch)
+{
+    VncState vs;
+    VncRect *rect;
+    int i;
+
+    while (batch->next_tile < batch->nb_tiles) {
+        if (batch->orig->csock == -1) {
+            /* the client is gone, drop the tiles that are left */
+            batch->next_tile = batch->nb_tiles;
+            break;
+        }
+        i = batch->next_tile++;
+        batch->nb_running++;
+        vnc_unlock_queue(queue);
+
+        rect = &batch->tiles[i];
+        vnc_async_encoding_start(batch->vs, &vs, &batch->outputs[i]);
+        batch->n_rectangles[i] =
+            vnc_send_framebuffer_update(&vs, rect->x, rect->y,
+                                        rect->w, rect->h);
+        batch->outputs[i] = vs.output;
+
+        vnc_lock_queue(queue);
+        if (--batch->nb_running == 0 &&
+            batch->next_tile == batch->nb_tiles) {
+            qemu_cond_broadcast(&queue->cond);
+        }
+    }
+}
+
+/* Split the rectangles of 'job' in tiles and encode them in parallel
+   into vs->output.  Return the number of rectangles sent, or -1 if the
+   job must be encoded by this thread alone.  */
+static int vnc_encode_job_tiles(VncJob *job, VncState *vs)
+{
+    VncTileBatch batch;
+    VncRectEntry *entry;
+    int i, y, n_rectangles, nb_tiles = 0;
+
+    if (queue->nb_workers < 2 ||
+        (vs->vnc_encoding != VNC_ENCODING_RAW &&
+         vs->vnc_encoding != VNC_ENCODING_HEXTILE)) {
+        return -1;
+    }
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        nb_tiles += DIV_ROUND_UP(entry->rect.h, VNC_TILE_HEIGHT);
+    }
+    if (nb_tiles < 2) {
+        return -1;
+    }
+
+    batch.orig = job->vs;
+    batch.vs = vs;
+    batch.tiles = g_malloc(nb_tiles * sizeof(VncRect));
+    batch.outputs = g_malloc0(nb_tiles * sizeof(Buffer));
+    batch.n_rectangles = g_malloc(nb_tiles * sizeof(int));
+    batch.nb_tiles = 0;
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        for (y = 0; y < entry->rect.h; y += VNC_TILE_HEIGHT) {
+            batch.tiles[batch.nb_tiles].x = entry->rect.x;
+            batch.tiles[batch.nb_tiles].y = entry->rect.y + y;
+            batch.tiles[batch.nb_tiles].w = entry->rect.w;
+            batch.tiles[batch.nb_tiles].h = MIN(VNC_TILE_HEIGHT,
+                                                entry->rect.h - y);
+            batch.nb_tiles++;
+        }
+    }
+    batch.next_tile = 0;
+    batch.nb_running = 0;
+
+    vnc_lock_queue(queue);
+    if (queue->batch) {
+        /* another job is being split already */
+        vnc_unlock_queue(queue);
+        n_rectangles = -1;
+        goto out;
+    }
+    queue->batch = &batch;
+    qemu_cond_broadcast(&queue->cond);
+    vnc_encode_tiles_locked(&batch);
+    while (batch.nb_running) {
+        qemu_cond_wait(&queue->cond, &queue->mutex);
+    }
+    queue->batch = NULL;
+    vnc_unlock_queue(queue);
+
+    n_rectangles = 0;
+    for (i = 0; i < batch.nb_tiles; i++) {
+        if (batch.n_rectangles[i] >= 0) {
+            n_rectangles += batch.n_rectangles[i];
+        }
+        buffer_reserve(&vs->output, batch.outputs[i].offset);
+        buffer_append(&vs->output, batch.outputs[i].buffer,
+                      batch.outputs[i].offset);
+    }
+
+out:
+    for (i = 0; i < nb_tiles; i++) {
+        buffer_free(&batch.outputs[i]);
+    }
+    g_free(batch.tiles);
+    g_free(batch.outputs);
+    g_free(batch.n_rectangles);
+    return n_rectangles;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static int vnc_worker_thread_loop(VncWorker *worker)
 {
     VncJob *job;
-    VncRectEntry *entry, *tmp;
+    VncRectEntry *entry;
     VncState vs;
     int n_rectangles;
     int saved_offset;
+    int64_t latency;
     bool flush;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (QTAILQ_EMPTY(&worker->jobs) && !queue->exit &&
+           !(queue->batch &&
+             queue->batch->next_tile < queue->batch->nb_tiles)) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    if (QTAILQ_EMPTY(&worker->jobs)) {
+        /* help the worker that split its job */
+        vnc_encode_tiles_locked(queue->batch);
+        vnc_unlock_queue(queue);
+        return 0;
+    }
+    job = QTAILQ_FIRST(&worker->jobs);
+    worker->current = job;
+    vnc_unlock_queue(queue);
+
+    /* Make a local copy of vs and switch output buffers */
+    vnc_async_encoding_start(job->vs, &vs, &worker->buffer);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -217,9 +412,6 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     }
     vnc_unlock_output(job->vs);
 
-    /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
-
     /* Start sending rectangles */
     n_rectangles = 0;
     vnc_write_u8(&vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
@@ -227,28 +419,32 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
-    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
-        int n;
-
-        if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
-            /* output mutex must be locked before going to
-             * disconnected:
-             */
-            vnc_lock_output(job->vs);
-            goto disconnected;
-        }
-
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
-                                        entry->rect.w, entry->rect.h);
-
-        if (n >= 0) {
-            n_rectangles += n;
+    vnc_lock_display_read(job->vs->vd);
+    n_rectangles = vnc_encode_job_tiles(job, &vs);
+    if (n_rectangles < 0) {
+        n_rectangles = 0;
+        QLIST_FOREACH(entry, &job->rectangles, next) {
+            int n;
+
+            if (job->vs->csock == -1) {
+                vnc_unlock_display_read(job->vs->vd);
+                /* output mutex must be locked before going to
+                 * disconnected:
+                 */
+                vnc_lock_output(job->vs);
+                goto disconnected;
+            }
+
+            n = vnc_send_framebuffer_update(&vs, entry->rect.x,
+                                            entry->rect.y,
+                                            entry->rect.w, entry->rect.h);
+
+            if (n >= 0) {
+                n_rectangles += n;
+            }
         }
-        g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_read(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -261,10 +457,11 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     }
 
     vnc_write(job->vs, vs.output.buffer, vs.output.offset);
+    vnc_update_sent(job->vs, vs.output.offset);
 
 disconnected:
     /* Copy persistent encoding data */
-    vnc_async_encoding_end(job->vs, &vs);
+    vnc_async_encoding_end(job->vs, &vs, &worker->buffer);
     flush = (job->vs->csock != -1 && job->vs->abort != true);
     vnc_unlock_output(job->vs);
 
@@ -272,44 +469,74 @@ disconnected:
         vnc_flush(job->vs);
     }
 
+    latency = qemu_get_clock_ns(rt_clock) - job->start;
     vnc_lock_queue(queue);
-    QTAILQ_REMOVE(&queue->jobs, job, next);
+    QTAILQ_REMOVE(&worker->jobs, job, next);
+    worker->nb_jobs--;
+    worker->current = NULL;
+    job->vs->jobs_queued--;
+    job->vs->jobs_done++;
+    job->vs->job_latency_total += latency;
+    job->vs->job_latency_max = MAX(job->vs->job_latency_max, latency);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
-    g_free(job);
+    vnc_job_free(job);
     return 0;
 }
 
 static VncJobQueue *vnc_queue_init(void)
 {
     VncJobQueue *queue = g_malloc0(sizeof(VncJobQueue));
+    int i;
 
     qemu_cond_init(&queue->cond);
     qemu_mutex_init(&queue->mutex);
-    QTAILQ_INIT(&queue->jobs);
+    for (i = 0; i < VNC_MAX_WORKERS; i++) {
+        QTAILQ_INIT(&queue->workers[i].jobs);
+    }
     return queue;
 }
 
 static void vnc_queue_clear(VncJobQueue *q)
 {
+    int i;
+
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
+    for (i = 0; i < queue->nb_workers; i++) {
+        buffer_free(&queue->workers[i].buffer);
+    }
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    bool last;
+
+    qemu_thread_get_self(&worker->thread);
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(worker)) ;
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    vnc_lock_queue(queue);
+    last = --queue->nb_threads == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+/* Called with the queue lock held, or before the queue is published.  */
+static void vnc_add_worker_thread(VncJobQueue *q)
+{
+    VncWorker *worker = &q->workers[q->nb_workers++];
+
+    q->nb_threads++;
+    qemu_thread_create(&worker->thread, vnc_worker_thread, worker);
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
@@ -318,8 +545,20 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q);
     queue = q; /* Set global queue */
+    vnc_add_worker_thread(q);
+}
+
+void vnc_set_worker_threads(int n)
+{
+    if (!vnc_worker_thread_running())
+        return ;
+
+    vnc_lock_queue(queue);
+    while (queue->nb_workers < MIN(n, VNC_MAX_WORKERS) && !queue->exit) {
+        vnc_add_worker_thread(queue);
+    }
+    vnc_unlock_queue(queue);
 }
 
 bool vnc_worker_thread_running(void)
@@ -332,7 +571,7 @@ void vnc_stop_worker_thread(void)
     if (!vnc_worker_thread_running())
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the threads */
     vnc_lock_queue(queue);
     queue->exit = true;
     vnc_unlock_queue(queue);
@@ -27,6 +27,7 @@
 
 #include "vnc.h"
 #include "vnc-jobs.h"
+#include "qemu-timer.h"
 
 void vnc_jobs_clear(VncState *vs)
 {
@@ -39,6 +40,7 @@ void vnc_jobs_join(VncState *vs)
 VncJob *vnc_job_new(VncState *vs)
 {
     vs->job.vs = vs;
+    vs->job.start = qemu_get_clock_ns(rt_clock);
     vs->job.rectangles = 0;
 
     vnc_write_u8(vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
@@ -51,10 +53,17 @@ VncJob *vnc_job_new(VncState *vs)
 void vnc_job_push(VncJob *job)
 {
     VncState *vs = job->vs;
+    int64_t latency;
 
     vs->output.buffer[job->saved_offset] = (job->rectangles >> 8) & 0xFF;
     vs->output.buffer[job->saved_offset + 1] = job->rectangles & 0xFF;
+    vnc_update_sent(vs, vs->output.offset - job->saved_offset + 2);
     vnc_flush(job->vs);
+
+    latency = qemu_get_clock_ns(rt_clock) - job->start;
+    vs->jobs_done++;
+    vs->job_latency_total += latency;
+    vs->job_latency_max = MAX(vs->job_latency_max, latency);
 }
 
 int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
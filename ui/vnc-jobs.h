@@ -41,31 +41,53 @@ void vnc_jobs_join(VncState *vs);
 #ifdef CONFIG_VNC_THREAD
 
 void vnc_start_worker_thread(void);
+void vnc_set_worker_threads(int n);
 bool vnc_worker_thread_running(void);
 void vnc_stop_worker_thread(void);
 
 #endif /* CONFIG_VNC_THREAD */
 
 /* Locks */
+
+/* Take the server surface for writing.  Fails while a worker thread
+   encodes from it.  */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
-    return qemu_mutex_trylock(&vd->mutex);
-#else
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -1;
+    }
+    if (vd->nb_readers) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -1;
+    }
+#endif
     return 0;
+}
+
+static inline void vnc_unlock_display(VncDisplay *vd)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_unlock(&vd->mutex);
 #endif
 }
 
-static inline void vnc_lock_display(VncDisplay *vd)
+/* Take the server surface for reading.  Several workers can hold it
+   at the same time.  */
+static inline void vnc_lock_display_read(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
     qemu_mutex_lock(&vd->mutex);
+    vd->nb_readers++;
+    qemu_mutex_unlock(&vd->mutex);
 #endif
 }
 
-static inline void vnc_unlock_display(VncDisplay *vd)
+static inline void vnc_unlock_display_read(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
+    qemu_mutex_lock(&vd->mutex);
+    vd->nb_readers--;
     qemu_mutex_unlock(&vd->mutex);
 #endif
 }
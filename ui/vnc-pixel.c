@@ -0,0 +1,241 @@
+/*
+ * QEMU VNC display driver: pixel format conversion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "bswap.h"
+#include "vnc-pixel.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef HOST_WORDS_BIGENDIAN
+#define HOST_BIG_ENDIAN true
+#else
+#define HOST_BIG_ENDIAN false
+#endif
+
+static inline uint32_t vnc_convert_one(const VncPixelConverter *conv,
+                                       uint32_t v)
+{
+    return (((v >> conv->rshift[0]) & conv->mask[0]) << conv->lshift[0]) |
+           (((v >> conv->rshift[1]) & conv->mask[1]) << conv->lshift[1]) |
+           (((v >> conv->rshift[2]) & conv->mask[2]) << conv->lshift[2]);
+}
+
+#if defined(__SSE2__)
+typedef struct VncConvertSSE2 {
+    __m128i mask[3];
+    __m128i rshift[3];
+    __m128i lshift[3];
+} VncConvertSSE2;
+
+static inline void vnc_convert_sse2_init(VncConvertSSE2 *c,
+                                         const VncPixelConverter *conv)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        c->mask[i] = _mm_set1_epi32(conv->mask[i]);
+        c->rshift[i] = _mm_cvtsi32_si128(conv->rshift[i]);
+        c->lshift[i] = _mm_cvtsi32_si128(conv->lshift[i]);
+    }
+}
+
+static inline __m128i vnc_convert_sse2(const VncConvertSSE2 *c, __m128i v)
+{
+    __m128i r, g, b;
+
+    r = _mm_and_si128(_mm_srl_epi32(v, c->rshift[0]), c->mask[0]);
+    g = _mm_and_si128(_mm_srl_epi32(v, c->rshift[1]), c->mask[1]);
+    b = _mm_and_si128(_mm_srl_epi32(v, c->rshift[2]), c->mask[2]);
+    return _mm_or_si128(_mm_sll_epi32(r, c->lshift[0]),
+                        _mm_or_si128(_mm_sll_epi32(g, c->lshift[1]),
+                                     _mm_sll_epi32(b, c->lshift[2])));
+}
+
+static inline __m128i vnc_bswap32_sse2(__m128i v)
+{
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    return _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+}
+
+static inline __m128i vnc_bswap16_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/* Pack the low 16 bits of each 32-bit lane; packs_epi32 saturates, so
+   sign extend first to keep the values in range.  */
+static inline __m128i vnc_pack32to16_sse2(__m128i a, __m128i b)
+{
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    return _mm_packs_epi32(a, b);
+}
+#endif
+
+/*
+ * Convert @n pixels of @src_bpp bytes in host order into @dst_bpp byte
+ * client pixels.  Only ever called with constant sizes, so that each
+ * wrapper below gets its own specialized loop.
+ */
+static inline void vnc_convert_pixels(const VncPixelConverter *conv,
+                                      uint8_t *dst, const uint8_t *src,
+                                      int n, int src_bpp, int dst_bpp)
+{
+    bool big_endian = conv->big_endian;
+    int i = 0;
+
+#if defined(__SSE2__)
+    VncConvertSSE2 c;
+    bool bswap = big_endian != HOST_BIG_ENDIAN;
+    __m128i v[4];
+    int j;
+
+    vnc_convert_sse2_init(&c, conv);
+    for (; i + 16 <= n; i += 16) {
+        if (src_bpp == 4) {
+            for (j = 0; j < 4; j++) {
+                v[j] = _mm_loadu_si128((const __m128i *)(src + 16 * j));
+            }
+        } else {
+            __m128i zero = _mm_setzero_si128();
+            __m128i lo = _mm_loadu_si128((const __m128i *)src);
+            __m128i hi = _mm_loadu_si128((const __m128i *)(src + 16));
+
+            v[0] = _mm_unpacklo_epi16(lo, zero);
+            v[1] = _mm_unpackhi_epi16(lo, zero);
+            v[2] = _mm_unpacklo_epi16(hi, zero);
+            v[3] = _mm_unpackhi_epi16(hi, zero);
+        }
+        for (j = 0; j < 4; j++) {
+            v[j] = vnc_convert_sse2(&c, v[j]);
+        }
+        if (dst_bpp == 4) {
+            for (j = 0; j < 4; j++) {
+                if (bswap) {
+                    v[j] = vnc_bswap32_sse2(v[j]);
+                }
+                _mm_storeu_si128((__m128i *)(dst + 16 * j), v[j]);
+            }
+        } else if (dst_bpp == 2) {
+            for (j = 0; j < 2; j++) {
+                __m128i p = vnc_pack32to16_sse2(v[2 * j], v[2 * j + 1]);
+
+                if (bswap) {
+                    p = vnc_bswap16_sse2(p);
+                }
+                _mm_storeu_si128((__m128i *)(dst + 16 * j), p);
+            }
+        } else {
+            __m128i lo = vnc_pack32to16_sse2(v[0], v[1]);
+            __m128i hi = vnc_pack32to16_sse2(v[2], v[3]);
+            __m128i ff = _mm_set1_epi16(0xff);
+
+            _mm_storeu_si128((__m128i *)dst,
+                             _mm_packus_epi16(_mm_and_si128(lo, ff),
+                                              _mm_and_si128(hi, ff)));
+        }
+        src += 16 * src_bpp;
+        dst += 16 * dst_bpp;
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint32_t p;
+
+        if (src_bpp == 4) {
+            p = vnc_convert_one(conv, *(const uint32_t *)src);
+        } else {
+            p = vnc_convert_one(conv, *(const uint16_t *)src);
+        }
+        if (dst_bpp == 4) {
+            if (big_endian) {
+                stl_be_p(dst, p);
+            } else {
+                stl_le_p(dst, p);
+            }
+        } else if (dst_bpp == 2) {
+            if (big_endian) {
+                stw_be_p(dst, p);
+            } else {
+                stw_le_p(dst, p);
+            }
+        } else {
+            dst[0] = p;
+        }
+        src += src_bpp;
+        dst += dst_bpp;
+    }
+}
+
+#define VNC_CONVERT_FUNC(sbpp, dbpp)                                        \
+static void vnc_convert_##sbpp##_##dbpp(const VncPixelConverter *conv,      \
+                                        uint8_t *dst, const uint8_t *src,   \
+                                        int n)                              \
+{                                                                           \
+    vnc_convert_pixels(conv, dst, src, n, sbpp, dbpp);                      \
+}
+
+VNC_CONVERT_FUNC(4, 4)
+VNC_CONVERT_FUNC(4, 2)
+VNC_CONVERT_FUNC(4, 1)
+VNC_CONVERT_FUNC(2, 4)
+VNC_CONVERT_FUNC(2, 2)
+VNC_CONVERT_FUNC(2, 1)
+
+/* indexed by bytes per pixel / 2, source first */
+static VncConvertPixels * const vnc_converters[3][3] = {
+    { NULL, NULL, NULL },
+    { vnc_convert_2_1, vnc_convert_2_2, vnc_convert_2_4 },
+    { vnc_convert_4_1, vnc_convert_4_2, vnc_convert_4_4 },
+};
+
+/*
+ * Set up @conv to turn @src pixels into @dst pixels exactly like
+ * vnc_convert_pixel() does.  Returns false if no specialized converter
+ * handles this pair of formats.
+ */
+bool vnc_pixel_converter_init(VncPixelConverter *conv,
+                              const PixelFormat *src, const PixelFormat *dst,
+                              bool dst_big_endian)
+{
+    int sbits[3] = { src->rbits, src->gbits, src->bbits };
+    int sshift[3] = { src->rshift, src->gshift, src->bshift };
+    int dbits[3] = { dst->rbits, dst->gbits, dst->bbits };
+    int dshift[3] = { dst->rshift, dst->gshift, dst->bshift };
+    int i;
+
+    if ((src->bytes_per_pixel != 2 && src->bytes_per_pixel != 4) ||
+        (dst->bytes_per_pixel != 1 && dst->bytes_per_pixel != 2 &&
+         dst->bytes_per_pixel != 4)) {
+        return false;
+    }
+
+    for (i = 0; i < 3; i++) {
+        /* vnc_convert_pixel() works on 8-bit channels */
+        if (!sbits[i] || !dbits[i] || sbits[i] > 8 || dbits[i] > 8 ||
+            sshift[i] + sbits[i] > 32 || dshift[i] + dbits[i] > 32) {
+            return false;
+        }
+        if (dbits[i] <= sbits[i]) {
+            conv->rshift[i] = sshift[i] + sbits[i] - dbits[i];
+            conv->mask[i] = (1U << dbits[i]) - 1;
+            conv->lshift[i] = dshift[i];
+        } else {
+            conv->rshift[i] = sshift[i];
+            conv->mask[i] = (1U << sbits[i]) - 1;
+            conv->lshift[i] = dshift[i] + dbits[i] - sbits[i];
+        }
+    }
+
+    conv->big_endian = dst_big_endian;
+    conv->convert = vnc_converters[src->bytes_per_pixel / 2]
+                                  [dst->bytes_per_pixel / 2];
+    return true;
+}
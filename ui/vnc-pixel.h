@@ -0,0 +1,31 @@
+/*
+ * QEMU VNC display driver: pixel format conversion
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef VNC_PIXEL_H
+#define VNC_PIXEL_H
+
+#include "console.h"
+
+typedef struct VncPixelConverter VncPixelConverter;
+
+typedef void VncConvertPixels(const VncPixelConverter *conv, uint8_t *dst,
+                              const uint8_t *src, int n);
+
+struct VncPixelConverter {
+    VncConvertPixels *convert;
+    /* red, green and blue end up at ((v >> rshift) & mask) << lshift */
+    uint32_t mask[3];
+    int rshift[3];
+    int lshift[3];
+    bool big_endian;
+};
+
+bool vnc_pixel_converter_init(VncPixelConverter *conv,
+                              const PixelFormat *src, const PixelFormat *dst,
+                              bool dst_big_endian);
+
+#endif /* VNC_PIXEL_H */
@@ -38,6 +38,16 @@
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
+/* Stop waiting for a fence reply after two seconds (rt_clock ns) */
+#define VNC_PING_TIMEOUT (2000 * SCALE_MS)
+/* Above this (bytes/s), the link is not what limits updates */
+#define VNC_BANDWIDTH_MAX (128 << 20)
+
+/* Bandwidth, in KB/s, needed for each tight JPEG quality level */
+static const int vnc_quality_bandwidth[10] = {
+    0, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384
+};
+
 #include "vnc_keysym.h"
 #include "d3des.h"
 
@@ -295,6 +305,42 @@ static void info_vnc_iter(QObject *obj, void *opaque)
         qdict_haskey(client, "sasl_username") ?
         qdict_get_str(client, "sasl_username") : "none");
 #endif
+    monitor_printf(mon, "     updates: %" PRId64 " sent, %" PRId64 " queued\n",
+                   qdict_get_int(client, "updates"),
+                   qdict_get_int(client, "queued_updates"));
+    monitor_printf(mon, "     latency: %" PRId64 " us avg, %" PRId64
+                   " us max\n",
+                   qdict_get_int(client, "latency_avg"),
+                   qdict_get_int(client, "latency_max"));
+    monitor_printf(mon, "     network: %" PRId64 " us rtt, %" PRId64
+                   " KB/s\n",
+                   qdict_get_int(client, "rtt"),
+                   qdict_get_int(client, "bandwidth"));
+}
+
+static void vnc_client_info_copy(const char *key, QObject *obj, void *opaque)
+{
+    qobject_incref(obj);
+    qdict_put_obj(opaque, key, obj);
+}
+
+/* client->info and the encoding statistics of the client */
+static QObject *vnc_client_info(VncState *client)
+{
+    QDict *qdict = qdict_new();
+
+    qdict_iter(qobject_to_qdict(client->info), vnc_client_info_copy, qdict);
+    qdict_put(qdict, "updates", qint_from_int(client->jobs_done));
+    qdict_put(qdict, "queued_updates", qint_from_int(client->jobs_queued));
+    qdict_put(qdict, "latency_avg",
+              qint_from_int(client->jobs_done ?
+                            client->job_latency_total / client->jobs_done /
+                            1000 : 0));
+    qdict_put(qdict, "latency_max",
+              qint_from_int(client->job_latency_max / 1000));
+    qdict_put(qdict, "rtt", qint_from_int(client->rtt / 1000));
+    qdict_put(qdict, "bandwidth", qint_from_int(client->bandwidth / 1024));
+    return QOBJECT(qdict);
 }
 
 void do_info_vnc_print(Monitor *mon, const QObject *data)
@@ -333,9 +379,7 @@ void do_info_vnc(Monitor *mon, QObject **ret_data)
         clist = qlist_new();
         QTAILQ_FOREACH(client, &vnc_display->clients, next) {
             if (client->info) {
-                /* incref so that it's not freed by upper layers */
-                qobject_incref(client->info);
-                qlist_append_obj(clist, client->info);
+                qlist_append_obj(clist, vnc_client_info(client));
             }
         }
 
@@ -582,6 +626,19 @@ void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
     }
 }
 
+/* specialized conversion straight into the output buffer */
+static void vnc_write_pixels_convert(VncState *vs, struct PixelFormat *pf,
+                                     void *pixels, int size)
+{
+    int n = size / pf->bytes_per_pixel;
+    int len = n * vs->clientds.pf.bytes_per_pixel;
+
+    buffer_reserve(&vs->output, len);
+    vs->converter.convert(&vs->converter, buffer_end(&vs->output),
+                          pixels, n);
+    vs->output.offset += len;
+}
+
 static void vnc_write_pixels_generic(VncState *vs, struct PixelFormat *pf,
                                      void *pixels1, int size)
 {
@@ -812,6 +869,144 @@ static int find_and_clear_dirty_height(struct VncState *vs,
     return h;
 }
 
+/* Fold 'bytes' reaching the client in 'elapsed' ns into the bandwidth
+ * estimate.
+ */
+static void vnc_bandwidth_sample(VncState *vs, uint64_t bytes, int64_t elapsed)
+{
+    int64_t bandwidth;
+
+    if (elapsed < SCALE_MS) {
+        return;
+    }
+    bandwidth = muldiv64(bytes, 1000000, elapsed / SCALE_US);
+    vs->bandwidth = vs->bandwidth ? (3 * vs->bandwidth + bandwidth) / 4 :
+                                    bandwidth;
+    if (vs->bandwidth > VNC_BANDWIDTH_MAX) {
+        vs->bandwidth = 0;
+    }
+}
+
+static void vnc_write_fence(VncState *vs, uint32_t flags,
+                            uint8_t len, const uint8_t *data)
+{
+    vnc_write_u8(vs, VNC_MSG_SERVER_FENCE);
+    vnc_write_u8(vs, 0);
+    vnc_write_u8(vs, 0);
+    vnc_write_u8(vs, 0);
+    vnc_write_u32(vs, flags);
+    vnc_write_u8(vs, len);
+    if (len) {
+        vnc_write(vs, data, len);
+    }
+}
+
+/* Ask the client to reply once it has processed everything sent so far.
+ * Must be called with the output lock held.
+ */
+static void vnc_ping(VncState *vs, int64_t now)
+{
+    uint8_t seq[4];
+
+    vs->ping_seq++;
+    seq[0] = (vs->ping_seq >> 24) & 0xFF;
+    seq[1] = (vs->ping_seq >> 16) & 0xFF;
+    seq[2] = (vs->ping_seq >> 8) & 0xFF;
+    seq[3] = vs->ping_seq & 0xFF;
+    vnc_write_fence(vs, VNC_FENCE_REQUEST | VNC_FENCE_BLOCK_BEFORE,
+                    sizeof(seq), seq);
+    vs->ping_time = now;
+    vs->ping_size = vs->unacked_size;
+    vs->unacked_size = 0;
+}
+
+/* The client answered vnc_ping().  The lowest round trip seen is the
+ * latency of the network, anything above it is the time the updates
+ * sent ahead of the ping took to get through.
+ */
+static void vnc_pong(VncState *vs, int64_t now)
+{
+    int64_t rtt = now - vs->ping_time;
+
+    if (!vs->rtt || rtt < vs->rtt) {
+        vs->rtt = rtt;
+    }
+    if (rtt - vs->rtt >= SCALE_MS) {
+        vnc_bandwidth_sample(vs, vs->ping_size, rtt - vs->rtt);
+    } else if (vs->bandwidth && vs->ping_size * 100 >= vs->bandwidth) {
+        /* A sizable update went through without delay, the link may be
+         * faster than estimated.
+         */
+        vs->bandwidth += vs->bandwidth / 8;
+        if (vs->bandwidth > VNC_BANDWIDTH_MAX) {
+            vs->bandwidth = 0;
+        }
+    }
+    vs->ping_time = 0;
+}
+
+/*
+ * Called with the output lock held once a framebuffer update of 'size'
+ * bytes has been queued in vs->output.  Holds the next update back for
+ * the time the link needs to carry this one, and starts a round trip
+ * measurement if the client supports fences.
+ */
+void vnc_update_sent(VncState *vs, size_t size)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    vs->unacked_size += size;
+    if (vs->bandwidth) {
+        vs->next_update = now + MIN(muldiv64(size, 1000, vs->bandwidth),
+                                    VNC_REFRESH_INTERVAL_MAX) * SCALE_MS;
+    }
+    if (vnc_has_feature(vs, VNC_FEATURE_FENCE) && !vs->ping_time) {
+        vnc_ping(vs, now);
+    }
+}
+
+/* Whether the rate estimates let the client take another update */
+static bool vnc_update_allowed(VncState *vs)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    if (now < vs->next_update) {
+        return false;
+    }
+    if (vs->ping_time && vs->rtt) {
+        int64_t expected = vs->rtt;
+
+        if (vs->bandwidth) {
+            expected += muldiv64(vs->ping_size, 1000, vs->bandwidth) *
+                        SCALE_MS;
+        }
+        if (now - vs->ping_time > VNC_PING_TIMEOUT) {
+            vs->ping_time = 0;
+        } else if (now - vs->ping_time > 2 * expected) {
+            /* The client is falling behind, let it catch up */
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The JPEG quality the client asked for, lowered to what the estimated
+ * bandwidth can carry.
+ */
+static uint8_t vnc_jpeg_quality(VncState *vs)
+{
+    int quality = vs->client_quality;
+
+    if (quality == (uint8_t)-1 || vs->vd->non_adaptive || !vs->bandwidth) {
+        return quality;
+    }
+    while (quality > 0 &&
+           vs->bandwidth < vnc_quality_bandwidth[quality] * 1024) {
+        quality--;
+    }
+    return quality;
+}
+
 #ifdef CONFIG_VNC_THREAD
 static int vnc_update_client_sync(VncState *vs, int has_dirty)
 {
@@ -836,12 +1031,27 @@ static int vnc_update_client(VncState *vs, int has_dirty)
         int n = 0;
 
 
-        if (vs->output.offset && !vs->audio_cap && !vs->force_update)
+        if (vs->output.offset && !vs->audio_cap && !vs->force_update) {
             /* kernel send buffers are full -> drop frames to throttle */
+            if (has_dirty) {
+                vs->update_deferred = true;
+            }
+            return 0;
+        }
+
+        if (!has_dirty && !vs->update_deferred && !vs->audio_cap &&
+            !vs->force_update)
             return 0;
 
-        if (!has_dirty && !vs->audio_cap && !vs->force_update)
+        vnc_lock_output(vs);
+        if (!vs->force_update && !vnc_update_allowed(vs)) {
+            vnc_unlock_output(vs);
+            vs->update_deferred = true;
             return 0;
+        }
+        vs->tight.quality = vnc_jpeg_quality(vs);
+        vnc_unlock_output(vs);
+        vs->update_deferred = false;
 
         /*
          * Send screen updates to the vnc client using the server
@@ -1098,6 +1308,30 @@ long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen)
  * the buffered output data if the socket would block. Returns
  * -1 on error, and disconnects the client socket.
  */
+static void vnc_update_bandwidth(VncState *vs, long written)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    if (vs->output.offset) {
+        /* The first short write only filled the kernel buffers, time
+         * how fast the following ones drain them.
+         */
+        if (!vs->congested_since) {
+            vs->congested_since = now;
+            vs->congested_bytes = 0;
+        } else {
+            vs->congested_bytes += written;
+        }
+        return;
+    }
+
+    if (vs->congested_since) {
+        vnc_bandwidth_sample(vs, vs->congested_bytes + written,
+                             now - vs->congested_since);
+        vs->congested_since = 0;
+    }
+}
+
 static long vnc_client_write_plain(VncState *vs)
 {
     long ret;
@@ -1121,6 +1355,7 @@ static long vnc_client_write_plain(VncState *vs)
 
     memmove(vs->output.buffer, vs->output.buffer + ret, (vs->output.offset - ret));
     vs->output.offset -= ret;
+    vnc_update_bandwidth(vs, ret);
 
     if (vs->output.offset == 0) {
         qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
@@ -1688,15 +1923,66 @@ static void send_ext_audio_ack(VncState *vs)
     vnc_flush(vs);
 }
 
+static void send_end_of_continuous_updates(VncState *vs)
+{
+    vnc_lock_output(vs);
+    vnc_write_u8(vs, VNC_MSG_SERVER_END_CONTINUOUS_UPDATES);
+    vnc_unlock_output(vs);
+    vnc_flush(vs);
+}
+
+static void enable_continuous_updates(VncState *vs, int enable,
+                                      int x, int y, int w, int h)
+{
+    /* Once a client has asked for an update, the server keeps sending
+     * the changes as they happen, so continuous updates are only a
+     * standing incremental request.
+     */
+    if (enable) {
+        framebuffer_update_request(vs, 1, x, y, w, h);
+        return;
+    }
+    vnc_jobs_join(vs);
+    send_end_of_continuous_updates(vs);
+}
+
+static void client_fence(VncState *vs, uint32_t flags,
+                         uint8_t len, uint8_t *data)
+{
+    if (flags & VNC_FENCE_REQUEST) {
+        /* Messages are handled in order, so only the updates still being
+         * encoded have to go out before the reply.
+         */
+        if (flags & VNC_FENCE_BLOCK_BEFORE) {
+            vnc_jobs_join(vs);
+        }
+        vnc_lock_output(vs);
+        vnc_write_fence(vs,
+                        flags & (VNC_FENCE_BLOCK_BEFORE | VNC_FENCE_BLOCK_AFTER),
+                        len, data);
+        vnc_unlock_output(vs);
+        vnc_flush(vs);
+        return;
+    }
+
+    vnc_lock_output(vs);
+    if (vs->ping_time && len == 4 && read_u32(data, 0) == vs->ping_seq) {
+        vnc_pong(vs, qemu_get_clock_ns(rt_clock));
+    }
+    vnc_unlock_output(vs);
+}
+
 static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
 {
     int i;
     unsigned int enc = 0;
+    uint32_t old_features = vs->features;
 
     vs->features = 0;
     vs->vnc_encoding = 0;
     vs->tight.compression = 9;
     vs->tight.quality = -1; /* Lossless by default */
+    vs->client_quality = -1;
     vs->absolute = -1;
 
     /*
@@ -1755,12 +2041,19 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
         case VNC_ENCODING_WMVi:
             vs->features |= VNC_FEATURE_WMVI_MASK;
             break;
+        case VNC_ENCODING_FENCE:
+            vs->features |= VNC_FEATURE_FENCE_MASK;
+            break;
+        case VNC_ENCODING_CONTINUOUS_UPDATES:
+            vs->features |= VNC_FEATURE_CONTINUOUS_UPDATES_MASK;
+            break;
         case VNC_ENCODING_COMPRESSLEVEL0 ... VNC_ENCODING_COMPRESSLEVEL0 + 9:
             vs->tight.compression = (enc & 0x0F);
             break;
         case VNC_ENCODING_QUALITYLEVEL0 ... VNC_ENCODING_QUALITYLEVEL0 + 9:
             if (vs->vd->lossy) {
                 vs->tight.quality = (enc & 0x0F);
+                vs->client_quality = vs->tight.quality;
             }
             break;
         default:
@@ -1770,6 +2063,19 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
     }
     vnc_desktop_resize(vs);
     check_pointer_type_change(&vs->mouse_mode_notifier, NULL);
+
+    /* Tell the client that the server supports the new extensions */
+    if (vs->features & ~old_features & VNC_FEATURE_CONTINUOUS_UPDATES_MASK) {
+        send_end_of_continuous_updates(vs);
+    }
+    if (vs->features & ~old_features & VNC_FEATURE_FENCE_MASK) {
+        vnc_lock_output(vs);
+        if (!vs->ping_time) {
+            vnc_ping(vs, qemu_get_clock_ns(rt_clock));
+        }
+        vnc_unlock_output(vs);
+        vnc_flush(vs);
+    }
 }
 
 static void set_pixel_conversion(VncState *vs)
@@ -1779,6 +2085,12 @@ static void set_pixel_conversion(VncState *vs)
         !memcmp(&(vs->clientds.pf), &(vs->ds->surface->pf), sizeof(PixelFormat))) {
         vs->write_pixels = vnc_write_pixels_copy;
         vnc_hextile_set_pixel_conversion(vs, 0);
+    } else if (vnc_pixel_converter_init(&vs->converter, &vs->vd->server->pf,
+                                        &vs->clientds.pf,
+                                        vs->clientds.flags &
+                                        QEMU_BIG_ENDIAN_FLAG)) {
+        vs->write_pixels = vnc_write_pixels_convert;
+        vnc_hextile_set_pixel_conversion(vs, 1);
     } else {
         vs->write_pixels = vnc_write_pixels_generic;
         vnc_hextile_set_pixel_conversion(vs, 1);
@@ -1877,7 +2189,8 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
     uint16_t limit;
     VncDisplay *vd = vs->vd;
 
-    if (data[0] > 3) {
+    if (data[0] > 3 && data[0] != VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES &&
+        data[0] != VNC_MSG_CLIENT_FENCE) {
         vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
         if (!qemu_timer_expired(vd->timer, qemu_get_clock_ms(rt_clock) + vd->timer_interval))
             qemu_mod_timer(vd->timer, qemu_get_clock_ms(rt_clock) + vd->timer_interval);
@@ -1944,6 +2257,31 @@ static int protocol_client_msg(VncState *vs, uint8_t *data, size_t len)
 
         client_cut_text(vs, read_u32(data, 4), data + 8);
         break;
+    case VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES:
+        if (len == 1)
+            return 10;
+
+        enable_continuous_updates(vs, read_u8(data, 1),
+                                  read_u16(data, 2), read_u16(data, 4),
+                                  read_u16(data, 6), read_u16(data, 8));
+        break;
+    case VNC_MSG_CLIENT_FENCE:
+        if (len == 1)
+            return 9;
+
+        if (len == 9) {
+            uint8_t dlen = read_u8(data, 8);
+            if (dlen > 64) {
+                printf("Invalid fence length %d\n", dlen);
+                vnc_client_error(vs);
+                break;
+            }
+            if (dlen > 0)
+                return 9 + dlen;
+        }
+
+        client_fence(vs, read_u32(data, 4), read_u8(data, 8), data + 9);
+        break;
     case VNC_MSG_CLIENT_QEMU:
         if (len == 1)
             return 2;
@@ -2386,9 +2724,10 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int y;
     uint8_t *guest_row;
     uint8_t *server_row;
-    int cmp_bytes;
+    int width, bpp;
     VncState *vs;
     int has_dirty = 0;
+    DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
 
     struct timeval tv = { 0, 0 };
 
@@ -2402,31 +2741,32 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
      * Check and copy modified bits from guest to server surface.
      * Update server dirty map.
      */
-    cmp_bytes = 16 * ds_get_bytes_per_pixel(vd->ds);
+    width = vd->guest.ds->width;
+    bpp = ds_get_bytes_per_pixel(vd->ds);
     guest_row  = vd->guest.ds->data;
     server_row = vd->server->data;
     for (y = 0; y < vd->guest.ds->height; y++) {
         if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
-            uint8_t *guest_ptr;
-            uint8_t *server_ptr;
-
-            guest_ptr  = guest_row;
-            server_ptr = server_row;
-
-            for (x = 0; x < vd->guest.ds->width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
+            int n;
+
+            bitmap_zero(changed, VNC_DIRTY_BITS);
+            n = vnc_refresh_row(server_row, guest_row, vd->guest.dirty[y],
+                                changed, width, bpp);
+            if (n) {
+                if (!vd->non_adaptive) {
+                    unsigned long x;
+
+                    for (x = find_first_bit(changed, VNC_DIRTY_BITS);
+                         x < VNC_DIRTY_BITS;
+                         x = find_next_bit(changed, VNC_DIRTY_BITS, x + 1)) {
+                        vnc_rect_updated(vd, x * 16, y, &tv);
+                    }
+                }
                 QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
+                    bitmap_or(vs->dirty[y], vs->dirty[y], changed,
+                              VNC_DIRTY_BITS);
                 }
-                has_dirty++;
+                has_dirty += n;
             }
         }
         guest_row  += ds_get_linesize(vd->ds);
@@ -2440,6 +2780,7 @@ static void vnc_refresh(void *opaque)
     VncDisplay *vd = opaque;
     VncState *vs, *vn;
     int has_dirty, rects = 0;
+    bool deferred = false;
 
     vga_hw_update();
 
@@ -2457,13 +2798,16 @@ static void vnc_refresh(void *opaque)
         rects += vnc_update_client(vs, has_dirty);
         /* vs might be free()ed here */
     }
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        deferred |= vs->update_deferred;
+    }
 
     /* vd->timer could be NULL now if the last client disconnected,
      * in this case don't update the timer */
     if (vd->timer == NULL)
         return;
 
-    if (has_dirty && rects) {
+    if ((has_dirty && rects) || deferred) {
         vd->timer_interval /= 2;
         if (vd->timer_interval < VNC_REFRESH_INTERVAL_BASE)
             vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
@@ -2779,6 +3123,10 @@ int vnc_display_open(DisplayState *ds, const char *display)
             vs->lossy = true;
         } else if (strncmp(options, "non-adapative", 13) == 0) {
             vs->non_adaptive = true;
+#ifdef CONFIG_VNC_THREAD
+        } else if (strncmp(options, "threads=", 8) == 0) {
+            vnc_set_worker_threads(atoi(options + 8));
+#endif
         }
     }
 
@@ -41,6 +41,8 @@
 
 #include "keymaps.h"
 #include "vnc-palette.h"
+#include "vnc-dirty.h"
+#include "vnc-pixel.h"
 #include "vnc-enc-zrle.h"
 
 // #define _VNC_DEBUG 1
@@ -133,6 +135,7 @@ struct VncDisplay
     int lock_key_sync;
 #ifdef CONFIG_VNC_THREAD
     QemuMutex mutex;
+    int nb_readers;     /* worker threads encoding from the server surface */
 #endif
 
     QEMUCursor *cursor;
@@ -219,6 +222,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    int64_t start; /* rt_clock ns at vnc_job_new() */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -227,6 +231,7 @@ struct VncJob
 struct VncJob
 {
     VncState *vs;
+    int64_t start; /* rt_clock ns at vnc_job_new() */
     int rectangles;
     size_t saved_offset;
 };
@@ -272,6 +277,7 @@ struct VncState
     Buffer input;
     /* current output mode information */
     VncWritePixels *write_pixels;
+    VncPixelConverter converter;
     DisplaySurface clientds;
 
     CaptureVoiceOut *audio_cap;
@@ -288,7 +294,31 @@ struct VncState
     VncJob job;
 #else
     QemuMutex output_mutex;
+    int worker; /* encoding thread of the pending jobs */
 #endif
+    /* Framebuffer updates being encoded, and statistics of those done.
+     * Written with the jobs queue lock held.  The latency goes from
+     * vnc_job_new() to the update being queued in output.
+     */
+    int jobs_queued;
+    uint64_t jobs_done;
+    int64_t job_latency_total;
+    int64_t job_latency_max;
+
+    /* Rate control.  Written with the output lock held, times are
+     * rt_clock ns.  bandwidth (bytes/s) and rtt are 0 until measured.
+     */
+    uint8_t client_quality;  /* JPEG quality asked for by the client */
+    bool update_deferred;    /* dirty rectangles were held back */
+    int64_t next_update;     /* paces updates to the bandwidth */
+    int64_t bandwidth;
+    int64_t congested_since; /* the socket stopped taking all our data */
+    size_t congested_bytes;
+    size_t unacked_size;     /* updates queued since the last ping */
+    uint32_t ping_seq;
+    int64_t ping_time;       /* a fence request is outstanding */
+    size_t ping_size;        /* updates queued ahead of it */
+    int64_t rtt;             /* lowest round trip seen */
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -365,6 +395,8 @@ enum {
 #define VNC_ENCODING_EXT_KEY_EVENT        0XFFFFFEFE /* -258 */
 #define VNC_ENCODING_AUDIO                0XFFFFFEFD /* -259 */
 #define VNC_ENCODING_TIGHT_PNG            0xFFFFFEFC /* -260 */
+#define VNC_ENCODING_FENCE                0xFFFFFEC8 /* -312 */
+#define VNC_ENCODING_CONTINUOUS_UPDATES   0xFFFFFEC7 /* -313 */
 #define VNC_ENCODING_WMVi                 0x574D5669
 
 /*****************************************************************************
@@ -403,6 +435,8 @@ enum {
 #define VNC_FEATURE_TIGHT_PNG                8
 #define VNC_FEATURE_ZRLE                     9
 #define VNC_FEATURE_ZYWRLE                  10
+#define VNC_FEATURE_FENCE                   11
+#define VNC_FEATURE_CONTINUOUS_UPDATES      12
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -415,6 +449,8 @@ enum {
 #define VNC_FEATURE_TIGHT_PNG_MASK           (1 << VNC_FEATURE_TIGHT_PNG)
 #define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 #define VNC_FEATURE_ZYWRLE_MASK              (1 << VNC_FEATURE_ZYWRLE)
+#define VNC_FEATURE_FENCE_MASK               (1 << VNC_FEATURE_FENCE)
+#define VNC_FEATURE_CONTINUOUS_UPDATES_MASK  (1 << VNC_FEATURE_CONTINUOUS_UPDATES)
 
 
 /* Client -> Server message IDs */
@@ -425,6 +461,8 @@ enum {
 #define VNC_MSG_CLIENT_POINTER_EVENT              5
 #define VNC_MSG_CLIENT_CUT_TEXT                   6
 #define VNC_MSG_CLIENT_VMWARE_0                   127
+#define VNC_MSG_CLIENT_ENABLE_CONTINUOUS_UPDATES  150
+#define VNC_MSG_CLIENT_FENCE                      248
 #define VNC_MSG_CLIENT_CALL_CONTROL               249
 #define VNC_MSG_CLIENT_XVP                        250
 #define VNC_MSG_CLIENT_SET_DESKTOP_SIZE           251
@@ -439,6 +477,8 @@ enum {
 #define VNC_MSG_SERVER_BELL                       2
 #define VNC_MSG_SERVER_CUT_TEXT                   3
 #define VNC_MSG_SERVER_VMWARE_0                   127
+#define VNC_MSG_SERVER_END_CONTINUOUS_UPDATES     150
+#define VNC_MSG_SERVER_FENCE                      248
 #define VNC_MSG_SERVER_CALL_CONTROL               249
 #define VNC_MSG_SERVER_XVP                        250
 #define VNC_MSG_SERVER_TIGHT                      252
@@ -467,6 +507,12 @@ enum {
 #define VNC_MSG_SERVER_QEMU_AUDIO_BEGIN           1
 #define VNC_MSG_SERVER_QEMU_AUDIO_DATA            2
 
+/* Fence message flags */
+#define VNC_FENCE_BLOCK_BEFORE                    (1 << 0)
+#define VNC_FENCE_BLOCK_AFTER                     (1 << 1)
+#define VNC_FENCE_SYNC_NEXT                       (1 << 2)
+#define VNC_FENCE_REQUEST                         (1U << 31)
+
 
 /*****************************************************************************
  *
@@ -477,6 +523,7 @@ enum {
 /* Event loop functions */
 void vnc_client_read(void *opaque);
 void vnc_client_write(void *opaque);
+void vnc_update_sent(VncState *vs, size_t size);
 
 long vnc_client_read_buf(VncState *vs, uint8_t *data, size_t datalen);
 long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen);
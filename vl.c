@@ -3203,6 +3203,14 @@ int main(int argc, char **argv, char **envp)
     }
     configure_icount(icount_option);
 
+    olist = qemu_find_opts("machine");
+    if (!QTAILQ_EMPTY(&olist->head)) {
+        configure_tcg_threads(qemu_opt_get(QTAILQ_FIRST(&olist->head),
+                                           "tcg_threads"));
+        configure_tcg_traces(qemu_opt_get_bool(QTAILQ_FIRST(&olist->head),
+                                               "tcg_traces", false));
+    }
+
     if (net_init_clients() < 0) {
         exit(1);
     }
@@ -0,0 +1,134 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+static int uleb128_encode_small(uint8_t *out, uint32_t n)
+{
+    int i = 0;
+
+    do {
+        uint8_t byte = n & 0x7f;
+
+        n >>= 7;
+        if (n) {
+            byte |= 0x80;
+        }
+        out[i++] = byte;
+    } while (n);
+
+    return i;
+}
+
+static int uleb128_decode_small(const uint8_t *in, int len, uint32_t *n)
+{
+    uint32_t val = 0;
+    int i;
+
+    for (i = 0; i < len && i < 5; i++) {
+        val |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *n = val;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+/* Worst case encoding of a length, in bytes */
+#define ULEB128_MAX_LEN 5
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+
+    while (i < slen) {
+        int zrun_start = i, nzrun_start;
+
+        /* zero run: compare a word at a time where possible */
+        while (i < slen && ((uintptr_t)(old_buf + i) & (sizeof(long) - 1))) {
+            if (old_buf[i] != new_buf[i]) {
+                break;
+            }
+            i++;
+        }
+        if (i < slen && old_buf[i] == new_buf[i]) {
+            while (i + (int)sizeof(long) <= slen &&
+                   *(const long *)(old_buf + i) ==
+                   *(const long *)(new_buf + i)) {
+                i += sizeof(long);
+            }
+            while (i < slen && old_buf[i] == new_buf[i]) {
+                i++;
+            }
+        }
+
+        /* a trailing zero run is implied */
+        if (i == slen) {
+            break;
+        }
+
+        if (d + ULEB128_MAX_LEN > dlen) {
+            return -1;
+        }
+        d += uleb128_encode_small(dst + d, i - zrun_start);
+
+        /* non-zero run; isolated equal bytes are cheaper to copy than to
+         * start a new zero run for, so only stop at two equal bytes */
+        nzrun_start = i;
+        while (i < slen) {
+            if (old_buf[i] == new_buf[i] &&
+                (i + 1 == slen || old_buf[i + 1] == new_buf[i + 1])) {
+                break;
+            }
+            i++;
+        }
+
+        if (d + ULEB128_MAX_LEN + (i - nzrun_start) > dlen) {
+            return -1;
+        }
+        d += uleb128_encode_small(dst + d, i - nzrun_start);
+        memcpy(dst + d, new_buf + nzrun_start, i - nzrun_start);
+        d += i - nzrun_start;
+    }
+
+    return d;
+}
+
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count;
+
+    while (i < slen) {
+        /* zero run */
+        ret = uleb128_decode_small(src + i, slen - i, &count);
+        if (ret < 0 || count > dlen - d) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* non-zero run */
+        ret = uleb128_decode_small(src + i, slen - i, &count);
+        if (ret < 0 || count == 0 || count > dlen - d ||
+            count > slen - i - ret) {
+            return -1;
+        }
+        i += ret;
+        memcpy(dst + d, src + i, count);
+        d += count;
+        i += count;
+    }
+
+    return d;
+}
@@ -0,0 +1,38 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef XBZRLE_H
+#define XBZRLE_H
+
+#include "qemu-common.h"
+
+/*
+ * The encoded stream is a sequence of (zrun, nzrun, data) tuples.  zrun
+ * and nzrun are ULEB128 encoded lengths of a run of bytes that did not
+ * change (xor is zero) and of a run of bytes that did; data holds the new
+ * contents of the changed run.  A trailing zero run is not encoded.
+ */
+
+/**
+ * xbzrle_encode_buffer: encode the difference between two pages
+ *
+ * Returns the length of the encoded data, 0 if the pages are identical,
+ * or -1 if the encoding would not fit in @dlen bytes.
+ */
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+
+/**
+ * xbzrle_decode_buffer: apply an encoded difference to @dst in place
+ *
+ * Returns the number of bytes of @dst covered by the encoding, or -1 if
+ * @src is malformed.
+ */
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+#endif